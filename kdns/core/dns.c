@@ -17,6 +17,11 @@
 #include <netdb.h>
 #include <string.h>
 #include <rte_per_lcore.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "dns.h"
 #include "zone.h"
 
@@ -184,6 +189,120 @@ domain_name_make_no_malloc( const uint8_t *name, int normalize,domain_name_st *r
 	return result;
 }
 
+/*
+ * Copy LEN bytes lowercased.  The length bytes of a wire format name
+ * are below 'A', so a whole name can be folded without looking at the
+ * label boundaries.
+ */
+static inline void
+name_copy_tolower(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i a32 = _mm256_set1_epi8('A' - 1);
+	const __m256i z32 = _mm256_set1_epi8('Z' + 1);
+	const __m256i case32 = _mm256_set1_epi8(0x20);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+		/* signed compares, bytes >= 0x80 are never upper case */
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, a32),
+			_mm256_cmpgt_epi8(z32, v));
+		_mm256_storeu_si256((__m256i *) (dst + i),
+			_mm256_or_si256(v, _mm256_and_si256(upper, case32)));
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i a16 = _mm_set1_epi8('A' - 1);
+	const __m128i z16 = _mm_set1_epi8('Z' + 1);
+	const __m128i case16 = _mm_set1_epi8(0x20);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, a16),
+			_mm_cmpgt_epi8(z16, v));
+		_mm_storeu_si128((__m128i *) (dst + i),
+			_mm_or_si128(v, _mm_and_si128(upper, case16)));
+	}
+#endif
+	for (; i < len; i++) {
+		uint8_t c = src[i];
+		dst[i] = (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+	}
+}
+
+/*
+ * Copy LEN lowercased label bytes as radname bytes: bytes below 'A'
+ * are moved up by one to make room for the 00 label separator, the
+ * same as char_d2r in radtree.c.
+ */
+static inline void
+name_copy_radname(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i a16 = _mm_set1_epi8('A');
+	const __m128i one16 = _mm_set1_epi8(1);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		/* unsigned v >= 'A' */
+		__m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, a16), v);
+		_mm_storeu_si128((__m128i *) (dst + i),
+			_mm_add_epi8(v, _mm_andnot_si128(ge, one16)));
+	}
+#endif
+	for (; i < len; i++) {
+		uint8_t c = src[i];
+		dst[i] = c < 'A' ? c + 1 : c;
+	}
+}
+
+size_t
+domain_name_make_query(const uint8_t *name, size_t max,
+	domain_name_st *result, uint8_t *key, uint16_t *key_len)
+{
+	uint8_t label_offsets[MAXDOMAINLEN / 2 + 1];
+	uint8_t label_count = 0;
+	uint8_t *offsets;
+	uint8_t *dst;
+	size_t pos = 0;
+	uint16_t kpos = 0;
+	int i;
+
+	if (max < 1)
+		return 0;
+
+	/* walk the length bytes, the label and the next length byte must fit */
+	while (name[pos] != 0) {
+		if ((name[pos] & 0xc0) ||
+		    pos + name[pos] + 2 > max ||
+		    pos + name[pos] + 2 > MAXDOMAINLEN)
+			return 0;
+		label_offsets[label_count++] = (uint8_t) pos;
+		pos += name[pos] + 1;
+	}
+	label_offsets[label_count++] = (uint8_t) pos;
+
+	/* offsets are stored from the root label down */
+	result->name_size = pos + 1;
+	result->label_count = label_count;
+	offsets = (uint8_t *) domain_name_label_offsets(result);
+	for (i = 0; i < label_count; i++)
+		offsets[i] = label_offsets[label_count - i - 1];
+
+	dst = (uint8_t *) domain_name_get(result);
+	name_copy_tolower(dst, name, result->name_size);
+
+	/* radname: top label first, 00 between labels, no root label */
+	for (i = 1; i < label_count; i++) {
+		const uint8_t *label = dst + offsets[i];
+		if (i > 1)
+			key[kpos++] = 0;
+		name_copy_radname(key + kpos, label + 1, label[0]);
+		kpos += label[0];
+	}
+	*key_len = kpos;
+	return result->name_size;
+}
+
 
 const domain_name_st *
 domain_name_parse( const char *name)
@@ -64,6 +64,8 @@ typedef enum rr_section {
 
 #define TYPE_SUPPORT_MAX  6
 
+#define TYPE_OPT	41	/* EDNS0 pseudo RR, RFC6891, never in a zone */
+
 
 #define MAXLABELLEN	63
 #define MAXDOMAINLEN	255
@@ -130,6 +132,16 @@ struct domain_name
 const domain_name_st *
 domain_name_make_no_malloc( const uint8_t *name, int normalize,domain_name_st *result);
 
+/*
+ * Parse the query name NAME, at most MAX bytes long, into RESULT in one
+ * pass: check it, lowercase it, fill the label offsets and write the
+ * radname key used by the name tree into KEY (MAXDOMAINLEN in size).
+ *
+ * Returns the wire length of the name, or 0 on a format error.
+ */
+size_t domain_name_make_query(const uint8_t *name, size_t max,
+	domain_name_st *result, uint8_t *key, uint16_t *key_len);
+
 /*
  * Construct a new domain name based on NAME in wire format.  NAME
  * cannot contain compression pointers.
@@ -12,14 +12,159 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <rte_hash_crc.h>
 
 #include "view.h"
 #include "domain_store.h"
 
+#define DOMAIN_HASH_INIT_BUCKETS	1024
+
+static domain_hash_bucket_type *
+domain_hash_buckets_alloc(size_t num)
+{
+	void *buckets;
+	if (posix_memalign(&buckets, sizeof(domain_hash_bucket_type),
+		num * sizeof(domain_hash_bucket_type)) != 0) {
+		log_msg(LOG_ERR, "posix_memalign failed: %s", strerror(errno));
+		exit(1);
+	}
+	memset(buckets, 0, num * sizeof(domain_hash_bucket_type));
+	return (domain_hash_bucket_type *) buckets;
+}
+
+uint32_t
+domain_name_hash(const domain_name_st* dname)
+{
+	return rte_hash_crc(domain_name_get(dname), dname->name_size, 0);
+}
+
+/* put the domain in a free slot of the bucket chain for hash */
+static void
+domain_hash_slot_add(domain_hash_type* hash, domain_type* domain, uint32_t h)
+{
+	domain_hash_bucket_type* b = &hash->buckets[h & hash->mask];
+	int i;
+
+	while (1) {
+		for (i = 0; i < DOMAIN_HASH_SLOTS; i++) {
+			if (b->domains[i] == NULL) {
+				b->hashes[i] = h;
+				b->domains[i] = domain;
+				return;
+			}
+		}
+		if (b->next == NULL)
+			b->next = domain_hash_buckets_alloc(1);
+		b = b->next;
+	}
+}
+
+static void
+domain_hash_grow(domain_hash_type* hash)
+{
+	domain_hash_bucket_type* old = hash->buckets;
+	uint32_t old_num = hash->mask + 1;
+	domain_hash_bucket_type *b, *next;
+	uint32_t n;
+	int i;
+
+	hash->buckets = domain_hash_buckets_alloc((size_t)old_num * 2);
+	hash->mask = old_num * 2 - 1;
+	for (n = 0; n < old_num; n++) {
+		for (b = &old[n]; b; b = b->next) {
+			for (i = 0; i < DOMAIN_HASH_SLOTS; i++) {
+				if (b->domains[i])
+					domain_hash_slot_add(hash, b->domains[i], b->hashes[i]);
+			}
+		}
+		for (b = old[n].next; b; b = next) {
+			next = b->next;
+			free(b);
+		}
+	}
+	free(old);
+}
+
+static void
+domain_hash_insert(domain_table_type* table, domain_type* domain)
+{
+	domain_hash_type* hash = table->hash;
+
+	if (hash == NULL)
+		return;
+	/* keep the average chain within one bucket */
+	if (hash->count >= (size_t)(hash->mask + 1) * DOMAIN_HASH_SLOTS * 3 / 4)
+		domain_hash_grow(hash);
+	domain_hash_slot_add(hash, domain, domain_name_hash(domain_dname(domain)));
+	hash->count++;
+}
+
+static void
+domain_hash_remove(domain_table_type* table, domain_type* domain)
+{
+	domain_hash_type* hash = table->hash;
+	domain_hash_bucket_type* b;
+	uint32_t h;
+	int i;
+
+	if (hash == NULL)
+		return;
+	h = domain_name_hash(domain_dname(domain));
+	for (b = &hash->buckets[h & hash->mask]; b; b = b->next) {
+		for (i = 0; i < DOMAIN_HASH_SLOTS; i++) {
+			if (b->domains[i] == domain) {
+				b->domains[i] = NULL;
+				hash->count--;
+				return;
+			}
+		}
+	}
+}
+
+domain_type*
+domain_table_hash_find(domain_table_type* table,
+		const domain_name_st* dname, uint32_t h)
+{
+	domain_hash_type* hash = table->hash;
+	domain_hash_bucket_type* b;
+	const domain_name_st* found;
+	int i;
+
+	if (hash == NULL)
+		return NULL;
+	for (b = &hash->buckets[h & hash->mask]; b; b = b->next) {
+		for (i = 0; i < DOMAIN_HASH_SLOTS; i++) {
+			if (b->hashes[i] != h || b->domains[i] == NULL)
+				continue;
+			found = domain_dname(b->domains[i]);
+			if (found->name_size == dname->name_size &&
+			    memcmp(domain_name_get(found), domain_name_get(dname),
+				dname->name_size) == 0)
+				return b->domains[i];
+		}
+	}
+	return NULL;
+}
+
+void
+domain_table_hash_enable(domain_table_type* table)
+{
+	struct radnode* n;
+
+	if (table->hash)
+		return;
+	table->hash = (domain_hash_type *) xalloc_zero(sizeof(domain_hash_type));
+	table->hash->buckets = domain_hash_buckets_alloc(DOMAIN_HASH_INIT_BUCKETS);
+	table->hash->mask = DOMAIN_HASH_INIT_BUCKETS - 1;
+	for (n = radix_first(table->nametree); n; n = radix_next(n))
+		domain_hash_insert(table, (domain_type *) n->elem);
+}
+
 static domain_type *
 allocate_domain_info(domain_table_type* table,
 		     const domain_name_st* dname,
@@ -34,9 +179,11 @@ allocate_domain_info(domain_table_type* table,
 	d->wildcard_child_closest_match = d;
 	d->rrsets = NULL;
 	d->usage = 0;
+	d->cname_slot = 0;
+	d->cname_chains = NULL;
+	d->cname_users = NULL;
 	d->is_existing = 0;
 	d->is_apex = 0;
-    d->compressed_offset =0;
     table->number_total++;
 	return d;
 }
@@ -57,6 +204,272 @@ domain_can_be_deleted(domain_type* domain)
 }
 
 
+static inline domain_type*
+cname_ref_domain(cname_chain_type* chain, uint16_t pos)
+{
+	return pos == CNAME_CHAIN_MAX ? chain->target : chain->domains[pos];
+}
+
+/** note that chain passes through domain at pos */
+static void
+cname_ref_add(domain_type* domain, cname_chain_type* chain, uint16_t pos)
+{
+	cname_users_type* users = domain->cname_users;
+
+	if (!users || users->count == users->size) {
+		uint32_t size = users ? users->size * 2 : 4;
+		users = (cname_users_type *) xrealloc(users,
+			sizeof(cname_users_type) + size * sizeof(cname_ref_type));
+		if (!domain->cname_users)
+			users->count = 0;
+		users->size = size;
+		domain->cname_users = users;
+	}
+	users->refs[users->count].chain = chain;
+	users->refs[users->count].pos = pos;
+	chain->ref_slots[pos] = users->count++;
+}
+
+/** forget the ref of chain at pos, the last ref moves into its slot */
+static void
+cname_ref_remove(cname_chain_type* chain, uint16_t pos)
+{
+	domain_type* domain = cname_ref_domain(chain, pos);
+	cname_users_type* users = domain->cname_users;
+	uint32_t slot = chain->ref_slots[pos];
+	cname_ref_type* moved;
+
+	chain->ref_slots[pos] = CNAME_REF_NONE;
+	if (--users->count == 0) {
+		free(users);
+		domain->cname_users = NULL;
+		return;
+	}
+	if (slot != users->count) {
+		moved = &users->refs[slot];
+		*moved = users->refs[users->count];
+		moved->chain->ref_slots[moved->pos] = slot;
+	}
+}
+
+/** a deleted domain is gone from the chains, their owners are rebuilt later */
+static void
+cname_users_detach(domain_type* domain)
+{
+	cname_users_type* users = domain->cname_users;
+	uint32_t i;
+
+	for (i = 0; i < users->count; i++)
+		users->refs[i].chain->ref_slots[users->refs[i].pos] = CNAME_REF_NONE;
+	free(users);
+	domain->cname_users = NULL;
+}
+
+static void
+cname_chain_refs_add(cname_chain_type* chain)
+{
+	uint16_t i;
+
+	for (i = 1; i < chain->count; i++)
+		cname_ref_add(chain->domains[i], chain, i);
+	if (chain->target)
+		cname_ref_add(chain->target, chain, CNAME_CHAIN_MAX);
+}
+
+static void
+cname_chains_free(domain_type* domain)
+{
+	cname_chain_type* chain = domain->cname_chains, *next;
+	uint16_t i;
+
+	while (chain) {
+		next = chain->next;
+		for (i = 0; i <= CNAME_CHAIN_MAX; i++) {
+			if (chain->ref_slots[i] != CNAME_REF_NONE)
+				cname_ref_remove(chain, i);
+		}
+		free(chain);
+		chain = next;
+	}
+	domain->cname_chains = NULL;
+}
+
+/** free the chains of domain and forget it as an owner */
+static void
+cname_chains_drop(domain_store_type* db, domain_type* domain)
+{
+	domain_type* last;
+
+	cname_chains_free(domain);
+	last = db->cname_owners[--db->cname_owner_count];
+	db->cname_owners[domain->cname_slot] = last;
+	last->cname_slot = domain->cname_slot;
+}
+
+/** the CNAME rrset of domain if it can be a hop of a chain, else NULL */
+static rrset_type*
+cname_chain_hop(domain_store_type* db, domain_type* domain, zone_type** zone)
+{
+	rrset_type* rrset;
+	*zone = domain_find_zone(db, domain);
+	if (!*zone || !(*zone)->apex || !(*zone)->soa_rrset)
+		return NULL;
+	rrset = domain_find_rrset(domain, *zone, TYPE_CNAME);
+	if (!rrset || domain->rrsets != rrset || rrset->next)
+		return NULL;
+	return rrset;
+}
+
+/** the CNAME target for view_name, as answer_domain picks it */
+static domain_type*
+cname_chain_pick(rrset_type* rrset, const char* view_name)
+{
+	int i, def = -1;
+	for (i = 0; i < rrset->rr_count; ++i) {
+		if (strcmp(rrset->rrs[i].view_name, view_name) == 0)
+			return rdata_atom_domain(rrset->rrs[i].rdatas[0]);
+		if (strcmp(rrset->rrs[i].view_name, DEFAULT_VIEW_NAME) == 0)
+			def = i;
+	}
+	return def == -1 ? NULL : rdata_atom_domain(rrset->rrs[def].rdatas[0]);
+}
+
+static cname_chain_type*
+cname_chain_build(domain_store_type* db, domain_type* owner, const char* view_name)
+{
+	cname_chain_type* chain;
+	domain_type* d = owner;
+	rrset_type* rrset;
+	zone_type* zone;
+	uint16_t i;
+
+	chain = (cname_chain_type *) xalloc_zero(sizeof(cname_chain_type));
+	snprintf(chain->view_name, MAX_VIEW_NAME_LEN, "%s", view_name);
+	for (i = 0; i <= CNAME_CHAIN_MAX; i++)
+		chain->ref_slots[i] = CNAME_REF_NONE;
+	while (d) {
+		/* not a plain hop, a loop or too long: the lookup goes on at d */
+		if (chain->count == CNAME_CHAIN_MAX || !(rrset = cname_chain_hop(db, d, &zone)))
+			break;
+		for (i = 0; i < chain->count && chain->domains[i] != d; i++)
+			;
+		if (i < chain->count)
+			break;
+		chain->domains[chain->count] = d;
+		chain->rrsets[chain->count] = rrset;
+		chain->zones[chain->count] = zone;
+		chain->count++;
+		d = cname_chain_pick(rrset, view_name);
+	}
+	chain->target = d;
+	cname_chain_refs_add(chain);
+	return chain;
+}
+
+/** rebuild the chains of domain, the default one and one per view on its hops */
+static void
+cname_chains_build(domain_store_type* db, domain_type* domain)
+{
+	cname_chain_type* chain, *c;
+	zone_type* zone;
+	uint16_t i, j;
+
+	if (domain->cname_chains)
+		cname_chains_drop(db, domain);
+	if (!cname_chain_hop(db, domain, &zone))
+		return;
+
+	chain = cname_chain_build(db, domain, "");
+	domain->cname_chains = chain;
+	/* a view can only take another path where it has a record on
+	 * the default path */
+	for (i = 0; i < chain->count; i++) {
+		rrset_type* rrset = chain->rrsets[i];
+		for (j = 0; j < rrset->rr_count; j++) {
+			const char* view_name = rrset->rrs[j].view_name;
+			if (strcmp(view_name, DEFAULT_VIEW_NAME) == 0)
+				continue;
+			for (c = domain->cname_chains; c && strcmp(c->view_name, view_name); c = c->next)
+				;
+			if (c)
+				continue;
+			c = cname_chain_build(db, domain, view_name);
+			c->next = chain->next;
+			chain->next = c;
+		}
+	}
+
+	if (db->cname_owner_count == db->cname_owner_size) {
+		db->cname_owner_size = db->cname_owner_size ? db->cname_owner_size * 2 : 64;
+		db->cname_owners = (domain_type **) xrealloc(db->cname_owners,
+			db->cname_owner_size * sizeof(domain_type*));
+	}
+	domain->cname_slot = db->cname_owner_count;
+	db->cname_owners[db->cname_owner_count++] = domain;
+}
+
+static int
+domain_ptr_cmp(const void* a, const void* b)
+{
+	const domain_type* x = *(domain_type* const *) a;
+	const domain_type* y = *(domain_type* const *) b;
+	return x < y ? -1 : x > y;
+}
+
+void
+domain_store_cname_refresh(domain_store_type* db, domain_type* domain,
+	uint16_t type)
+{
+	cname_users_type* users;
+	domain_type** owners;
+	uint32_t i, n;
+	rrset_type* rrset;
+
+	if (!domain)
+		return;
+	/* other records only matter on a domain that has a CNAME */
+	if (type != TYPE_CNAME) {
+		for (rrset = domain->rrsets; rrset; rrset = rrset->next) {
+			if (rrset_rrtype(rrset) == TYPE_CNAME)
+				break;
+		}
+		if (!rrset)
+			return;
+	}
+
+	cname_chains_build(db, domain);
+	if (!domain->cname_users)
+		return;
+
+	/* the owners of the chains through domain, once each, taken before
+	 * their rebuilds change the refs */
+	users = domain->cname_users;
+	owners = (domain_type **) xalloc(users->count * sizeof(domain_type*));
+	for (i = 0, n = 0; i < users->count; i++) {
+		if (users->refs[i].chain->domains[0] != domain)
+			owners[n++] = users->refs[i].chain->domains[0];
+	}
+	qsort(owners, n, sizeof(domain_type*), domain_ptr_cmp);
+	for (i = 0; i < n; i++) {
+		if (i == 0 || owners[i] != owners[i - 1])
+			cname_chains_build(db, owners[i]);
+	}
+	free(owners);
+}
+
+void
+domain_store_cname_rebuild(domain_store_type* db)
+{
+	domain_type* domain;
+
+	while (db->cname_owner_count)
+		cname_chains_drop(db, db->cname_owners[0]);
+	for (domain = db->domains->root; domain; domain = domain_next(domain)) {
+		if (domain->rrsets)
+			cname_chains_build(db, domain);
+	}
+}
+
 /** perform domain name deletion */
 static void
 do_deldomain(domain_store_type* db, domain_type* domain)
@@ -70,6 +483,11 @@ do_deldomain(domain_store_type* db, domain_type* domain)
 		domain->parent->wildcard_child_closest_match =
 			domain_previous_existing_child(domain);
 
+    if (domain->cname_chains)
+        cname_chains_drop(db, domain);
+    if (domain->cname_users)
+        cname_users_detach(domain);
+    domain_hash_remove(db->domains, domain);
     radix_delete(db->domains->nametree, domain->rnode);
     db->domains->number_total--;
     free(domain_dname(domain));
@@ -101,6 +519,8 @@ add_rdata_to_recyclebin(rr_type* rr)
             free(rr->rdatas[i].data);
 	}
 	free(rr->rdatas);
+	free(rr->wire);
+	rr->wire = NULL;
 }
 
 /* this routine determines if below a domain there exist names with
@@ -121,6 +541,178 @@ hasdata_below(domain_type* top)
 	return 0;
 }
 
+/* Maglev table sizes, the smallest one with 20 slots per RR is used */
+static const uint16_t rrset_lb_hash_sizes[] = { 251, 509, 1021, 2039, 4093 };
+
+void
+rrset_lb_free(rrset_type* rrset)
+{
+	rrset_lb_type* lb = rrset->lb, *next;
+	while (lb) {
+		next = lb->next;
+		free(lb);
+		lb = next;
+	}
+	rrset->lb = NULL;
+}
+
+static uint32_t
+rr_rdata_hash(rr_type* rr, uint32_t seed)
+{
+	uint16_t j;
+	for (j = 0; j < rr->rdata_count; ++j) {
+		if (rdata_atom_is_domain(rr->type, j)) {
+			const domain_name_st* name = domain_dname(rdata_atom_domain(rr->rdatas[j]));
+			seed = rte_hash_crc(domain_name_get(name), name->name_size, seed);
+		} else {
+			seed = rte_hash_crc(rdata_atomdata(rr->rdatas[j]),
+				rdata_atom_size(rr->rdatas[j]), seed);
+		}
+	}
+	return seed;
+}
+
+static uint32_t
+gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/** smooth weighted round robin: every step the RR furthest ahead of its
+ * share is picked, so heavy RRs are spread out instead of run in a row */
+static void
+rrset_lb_wrr(rrset_lb_type* lb, const uint32_t* weights, uint32_t total)
+{
+	int32_t current[VIEW_MATCH_MAX_NUM];
+	uint32_t s;
+	uint16_t k, best;
+
+	memset(current, 0, lb->count * sizeof(int32_t));
+	for (s = 0; s < total; s++) {
+		best = 0;
+		for (k = 0; k < lb->count; k++) {
+			current[k] += weights[k];
+			if (current[k] > current[best])
+				best = k;
+		}
+		current[best] -= total;
+		lb->sched[s] = best;
+	}
+}
+
+/** Maglev: every RR fills the table along its own permutation of the
+ * slots, so a new or removed RR only moves the clients of its share */
+static void
+rrset_lb_hash(rrset_type* rrset, rrset_lb_type* lb)
+{
+	uint32_t offset[VIEW_MATCH_MAX_NUM], skip[VIEW_MATCH_MAX_NUM], next[VIEW_MATCH_MAX_NUM];
+	uint32_t filled = 0, c;
+	uint16_t k;
+
+	for (k = 0; k < lb->count; k++) {
+		rr_type* rr = &rrset->rrs[lb->rrs[k]];
+		offset[k] = rr_rdata_hash(rr, 0x2b7e1516) % lb->size;
+		skip[k] = rr_rdata_hash(rr, 0x28aed2a6) % (lb->size - 1) + 1;
+		next[k] = 0;
+	}
+	memset(lb->sched, 0xff, lb->size * sizeof(uint16_t));
+	while (1) {
+		for (k = 0; k < lb->count; k++) {
+			do {
+				c = (offset[k] + next[k] * skip[k]) % lb->size;
+				next[k]++;
+			} while (lb->sched[c] != 0xffff);
+			lb->sched[c] = k;
+			if (++filled == lb->size)
+				return;
+		}
+	}
+}
+
+static rrset_lb_type*
+rrset_lb_build(rrset_type* rrset, uint16_t first)
+{
+	rrset_lb_type* lb;
+	uint32_t weights[VIEW_MATCH_MAX_NUM];
+	int16_t rrs[VIEW_MATCH_MAX_NUM];
+	uint32_t total = 0, g = 0, size;
+	uint16_t i, k, count = 0;
+	uint16_t lb_mode = rrset->rrs[first].lb_mode;
+	const char* view_name = rrset->rrs[first].view_name;
+
+	for (i = first; i < rrset->rr_count && count < VIEW_MATCH_MAX_NUM; ++i) {
+		if (strcmp(rrset->rrs[i].view_name, view_name) == 0)
+			rrs[count++] = i;
+	}
+
+	if (lb_mode == DOMAIN_LB_WRR) {
+		for (k = 0; k < count; k++) {
+			weights[k] = rrset->rrs[rrs[k]].lb_weight ? rrset->rrs[rrs[k]].lb_weight : 1;
+			g = gcd(weights[k], g);
+		}
+		for (k = 0; k < count; k++) {
+			weights[k] /= g;
+			total += weights[k];
+		}
+		if (total > RRSET_LB_WRR_MAX) {
+			uint32_t scaled = 0;
+			for (k = 0; k < count; k++) {
+				weights[k] = weights[k] * RRSET_LB_WRR_MAX / total;
+				if (weights[k] == 0)
+					weights[k] = 1;
+				scaled += weights[k];
+			}
+			total = scaled;
+		}
+		size = total;
+	} else {
+		for (k = 0; (size_t)k + 1 < sizeof(rrset_lb_hash_sizes) / sizeof(rrset_lb_hash_sizes[0])
+			&& rrset_lb_hash_sizes[k] < count * 20u; k++)
+			;
+		size = rrset_lb_hash_sizes[k];
+	}
+
+	lb = (rrset_lb_type *) xalloc_zero(sizeof(rrset_lb_type)
+		+ count * sizeof(int16_t) + size * sizeof(uint16_t));
+	lb->rrs = (int16_t *) (lb + 1);
+	lb->sched = (uint16_t *) (lb->rrs + count);
+	memcpy(lb->rrs, rrs, count * sizeof(int16_t));
+	snprintf(lb->view_name, MAX_VIEW_NAME_LEN, "%s", view_name);
+	lb->lb_mode = lb_mode;
+	lb->count = count;
+	lb->size = (uint16_t)size;
+	if (lb_mode == DOMAIN_LB_WRR)
+		rrset_lb_wrr(lb, weights, total);
+	else
+		rrset_lb_hash(rrset, lb);
+	return lb;
+}
+
+void
+rrset_lb_prepare(rrset_type* rrset)
+{
+	rrset_lb_type* lb;
+	uint16_t i;
+
+	rrset_lb_free(rrset);
+	for (i = 0; i < rrset->rr_count; ++i) {
+		rr_type* rr = &rrset->rrs[i];
+		if (rr->lb_mode != DOMAIN_LB_WRR && rr->lb_mode != DOMAIN_LB_HASH)
+			continue;
+		/* one schedule per view, built from its first RR */
+		if (rrset_lb_find(rrset, rr->view_name))
+			continue;
+		lb = rrset_lb_build(rrset, i);
+		lb->next = rrset->lb;
+		rrset->lb = lb;
+	}
+}
+
 void
 apex_rrset_checks( rrset_type* rrset, domain_type* domain)
 {
@@ -137,6 +729,7 @@ apex_rrset_checks( rrset_type* rrset, domain_type* domain)
 			zone->soa_nx_rrset->rr_count = 1;
 			zone->soa_nx_rrset->next = 0;
 			zone->soa_nx_rrset->zone = zone;
+			zone->soa_nx_rrset->lb = NULL;
 			zone->soa_nx_rrset->rrs = xalloc(sizeof(rr_type));
 		}
 		memcpy(zone->soa_nx_rrset->rrs, rrset->rrs, sizeof(rr_type));
@@ -204,6 +797,7 @@ rrset_delete(domain_store_type* db, domain_type* domain, rrset_type* rrset)
 	/* recycle the memory space of the rrset */
 	for (i = 0; i < rrset->rr_count; ++i)
 		add_rdata_to_recyclebin( &rrset->rrs[i]);
+	rrset_lb_free(rrset);
     free(rrset->rrs);
     free(rrset);
 }
@@ -262,30 +856,22 @@ domain_table_create(void)
 
 
     result->number_total = 1;
+	result->hash = NULL;
 
 	result->root = root;
 
 	return result;
 }
 
-int
-domain_table_search(domain_table_type *table,
-		   const domain_name_st   *dname,
+/* move the closest match of a lookup up to the closest encloser */
+static int
+domain_table_search_done(const domain_name_st *dname, int exact,
 		   domain_type       **closest_match,
 		   domain_type       **closest_encloser)
 {
-	int exact;
 	uint8_t label_match_count;
 
-	assert(table);
-	assert(dname);
-	assert(closest_match);
-	assert(closest_encloser);
-
-
-    exact = radomain_name_find_less_equal(table->nametree, domain_name_get(dname),
-            dname->name_size, (struct radnode**)closest_match);
-        *closest_match = (domain_type*)((*(struct radnode**)closest_match)->elem);
+	*closest_match = (domain_type*)((*(struct radnode**)closest_match)->elem);
 	assert(*closest_match);
 
 	*closest_encloser = *closest_match;
@@ -304,6 +890,51 @@ domain_table_search(domain_table_type *table,
 	return exact;
 }
 
+int
+domain_table_search(domain_table_type *table,
+		   const domain_name_st   *dname,
+		   domain_type       **closest_match,
+		   domain_type       **closest_encloser)
+{
+	int exact;
+
+	assert(table);
+	assert(dname);
+	assert(closest_match);
+	assert(closest_encloser);
+
+	if (table->hash) {
+		*closest_match = domain_table_hash_find(table, dname, domain_name_hash(dname));
+		if (*closest_match) {
+			*closest_encloser = *closest_match;
+			return 1;
+		}
+	}
+
+    exact = radomain_name_find_less_equal(table->nametree, domain_name_get(dname),
+            dname->name_size, (struct radnode**)closest_match);
+	return domain_table_search_done(dname, exact, closest_match, closest_encloser);
+}
+
+int
+domain_table_search_key(domain_table_type *table,
+		   const domain_name_st   *dname,
+		   uint8_t *key, uint16_t key_len,
+		   domain_type       **closest_match,
+		   domain_type       **closest_encloser)
+{
+	int exact;
+
+	assert(table);
+	assert(dname);
+	assert(closest_match);
+	assert(closest_encloser);
+
+	exact = radix_find_less_equal(table->nametree, key, key_len,
+		(struct radnode**)closest_match);
+	return domain_table_search_done(dname, exact, closest_match, closest_encloser);
+}
+
 domain_type *
 domain_table_find(domain_table_type* table,
 		  const domain_name_st* dname)
@@ -347,6 +978,7 @@ domain_table_insert(domain_table_type* table,
 			result->rnode = radomain_name_insert(table->nametree,
 				domain_name_get(result->dname),
 				result->dname->name_size, result);
+			domain_hash_insert(table, result);
 
 			/*
 			 * If the newly added domain name is larger
@@ -510,3 +1142,14 @@ domain_store_lookup(struct  domain_store* db,
 	return domain_table_search(
 		db->domains, dname, closest_match, closest_encloser);
 }
+
+int
+domain_store_lookup_key(struct  domain_store* db,
+	      const domain_name_st* dname,
+	      uint8_t *key, uint16_t key_len,
+	      domain_type     **closest_match,
+	      domain_type     **closest_encloser)
+{
+	return domain_table_search_key(
+		db->domains, dname, key, key_len, closest_match, closest_encloser);
+}
@@ -10,6 +10,7 @@
 #define	_DOMAIN_STORE_H_
 
 #include <stdio.h>
+#include <string.h>
 #include "dns.h"
 #include "kdns.h"
 
@@ -26,12 +27,59 @@ typedef struct domain
 	struct domain* wildcard_child_closest_match;
 	struct rrset * rrsets;
 	size_t     usage;     
-    uint16_t    compressed_offset;
     uint32_t maxAnswer;
+	uint32_t cname_slot;			/* index in cname_owners, if an owner */
+	struct cname_chain* cname_chains;	/* NULL if not a flattened CNAME owner */
+	struct cname_users* cname_users;	/* NULL if no chain of another owner passes here */
 	unsigned     is_existing : 1;
 	unsigned     is_apex : 1;
 }domain_type;
 
+/* maximum number of CNAME hops kept in a flattened chain */
+#define CNAME_CHAIN_MAX	8
+
+/*
+ * A CNAME chain inside our zones, followed when the records change so
+ * a query does not look up every hop. domains[0] is the owner and every
+ * hop holds only its CNAME rrset. The lookup continues at target after
+ * the last hop; target is NULL if the view has no CNAME record there.
+ * The first chain of a domain is for the views without own records,
+ * then there is one chain per view that has records on a hop.
+ */
+typedef struct cname_chain
+{
+	struct cname_chain* next;
+	char view_name[MAX_VIEW_NAME_LEN];
+	uint16_t count;
+	struct domain* target;
+	struct domain* domains[CNAME_CHAIN_MAX];
+	struct rrset* rrsets[CNAME_CHAIN_MAX];
+	struct zone* zones[CNAME_CHAIN_MAX];
+	/* slot of the chain in the cname_users of domains[i], i > 0, and
+	 * of the target at [CNAME_CHAIN_MAX] */
+	uint32_t ref_slots[CNAME_CHAIN_MAX + 1];
+}cname_chain_type;
+
+#define CNAME_REF_NONE	UINT32_MAX
+
+/*
+ * The reverse index of the chains: the chains that pass through a
+ * domain as a later hop or end at it, so a change there rebuilds only
+ * their owners.
+ */
+typedef struct cname_ref
+{
+	struct cname_chain* chain;
+	uint16_t pos;		/* in chain->domains, CNAME_CHAIN_MAX for the target */
+}cname_ref_type;
+
+typedef struct cname_users
+{
+	uint32_t count;
+	uint32_t size;
+	cname_ref_type refs[];
+}cname_users_type;
+
 typedef struct zone
 {
 	struct radnode *node; 
@@ -57,9 +105,42 @@ typedef struct rr {
 	
 	uint16_t         lb_mode;
 	uint16_t         lb_weight;
-	uint16_t         lb_weight_cur;
+
+	/* precomputed type, class, ttl, rdlength and rdata, NULL if the
+	 * rdata has a compressed name other than the last atom */
+	uint8_t*         wire;
+	uint16_t         wire_len;
+	/* the last atom is a compressed name, appended at encode time */
+	uint8_t          wire_dname;
 }rr_type;
 
+/* rr lb_mode */
+#define DOMAIN_LB_RR    1
+#define DOMAIN_LB_WRR   2
+#define DOMAIN_LB_HASH  3
+
+/* longest weighted round robin sequence, weights are scaled down to it */
+#define RRSET_LB_WRR_MAX	1024
+
+/*
+ * Load balancing schedule of the RRs of one view in an rrset, built when
+ * the rrset changes. rrs are the indexes of the view's RRs in the rrset
+ * and sched holds positions in rrs: the smooth weighted round robin
+ * sequence for DOMAIN_LB_WRR, the Maglev lookup table for DOMAIN_LB_HASH.
+ * Every lcore has its own store, so cursor is per lcore.
+ */
+typedef struct rrset_lb
+{
+	struct rrset_lb* next;
+	char view_name[MAX_VIEW_NAME_LEN];
+	uint16_t lb_mode;
+	uint16_t count;
+	uint16_t size;
+	uint16_t cursor;
+	int16_t* rrs;
+	uint16_t* sched;
+}rrset_lb_type;
+
 /*
  * An RRset consists of at least one RR.  All RRs are from the same
  * zone.
@@ -69,6 +150,7 @@ typedef struct rrset
 	struct rrset* next;
 	struct zone*  zone;
 	struct rr*    rrs;
+	struct rrset_lb* lb;	/* NULL without weighted or hashed RRs */
 	uint16_t    rr_count;
 }rrset_type;
 
@@ -80,11 +162,30 @@ typedef union rdata_atom
 	uint16_t*    data;
 }rdata_atom_type;
 
+#define DOMAIN_HASH_SLOTS	4
+
+/* one cache line of the exact match index */
+typedef struct domain_hash_bucket
+{
+	uint32_t hashes[DOMAIN_HASH_SLOTS];
+	struct domain* domains[DOMAIN_HASH_SLOTS];
+	struct domain_hash_bucket* next;	/* overflow chain */
+} __attribute__((aligned(64))) domain_hash_bucket_type;
+
+/* exact match index of the name tree, lowercase wire name -> domain */
+typedef struct domain_hash
+{
+	domain_hash_bucket_type* buckets;
+	uint32_t mask;
+	size_t count;
+}domain_hash_type;
+
 typedef struct domain_table
 {
     struct radtree *nametree;
 	struct domain* root;
     size_t     number_total; 
+	domain_hash_type* hash;	/* NULL if the index is not enabled */
 }domain_table_type;
 
 
@@ -93,6 +194,10 @@ typedef struct  domain_store
 	struct domain_table* domains;
 	struct radtree*    zonetree;
 	struct view_tree* viewtree;
+	/* domains with flattened CNAME chains */
+	struct domain** cname_owners;
+	size_t cname_owner_count;
+	size_t cname_owner_size;
 }domain_store_type;
 
 
@@ -109,6 +214,40 @@ int domain_table_search(domain_table_type* table,
 			domain_type      **closest_match,
 			domain_type      **closest_encloser);
 
+/*
+ * Same as domain_table_search, with the radname KEY of DNAME already made.
+ */
+int domain_table_search_key(domain_table_type* table,
+			const domain_name_st* dname,
+			uint8_t *key, uint16_t key_len,
+			domain_type      **closest_match,
+			domain_type      **closest_encloser);
+
+/*
+ * Build the exact match hash index for the names in the table and keep
+ * it up to date from then on.  Exact hits are found in the index, the
+ * name tree is then only needed for the closest encloser.
+ */
+void domain_table_hash_enable(domain_table_type* table);
+
+/* hash of a lowercase domain name, the key of the index */
+uint32_t domain_name_hash(const domain_name_st* dname);
+
+/* prefetch the bucket a lookup of HASH reads first */
+static inline void
+domain_table_hash_prefetch(domain_table_type* table, uint32_t hash)
+{
+	if (table->hash)
+		__builtin_prefetch(&table->hash->buckets[hash & table->hash->mask]);
+}
+
+/*
+ * Find the exact match of DNAME in the hash index.  NULL if not found
+ * or the index is not enabled.
+ */
+domain_type* domain_table_hash_find(domain_table_type* table,
+			const domain_name_st* dname, uint32_t hash);
+
 /*
  * The number of domains stored in the table (minimum is one for the
  * root domain).
@@ -119,6 +258,53 @@ domain_table_count(domain_table_type* table)
 	return table->nametree->count;
 }
 
+/*
+ * Refresh the flattened CNAME chains after an RR of TYPE was added to
+ * or deleted from DOMAIN (NULL if the domain was deleted with it).
+ */
+void domain_store_cname_refresh(domain_store_type* db, domain_type* domain,
+			uint16_t type);
+
+/*
+ * Rebuild all flattened CNAME chains, after zones were added or deleted.
+ */
+void domain_store_cname_rebuild(domain_store_type* db);
+
+/*
+ * The flattened chain of DOMAIN for a query in VIEW_NAME.
+ */
+static inline cname_chain_type*
+domain_cname_chain(domain_type* domain, const char* view_name)
+{
+	cname_chain_type* chain;
+	for (chain = domain->cname_chains->next; chain; chain = chain->next) {
+		if (strcmp(chain->view_name, view_name) == 0)
+			return chain;
+	}
+	return domain->cname_chains;
+}
+
+/*
+ * (Re)build the load balancing schedules of RRSET after its RRs changed.
+ */
+void rrset_lb_prepare(rrset_type* rrset);
+void rrset_lb_free(rrset_type* rrset);
+
+/*
+ * The load balancing schedule for the RRs of VIEW_NAME in RRSET, NULL if
+ * there is none.
+ */
+static inline rrset_lb_type*
+rrset_lb_find(rrset_type* rrset, const char* view_name)
+{
+	rrset_lb_type* lb;
+	for (lb = rrset->lb; lb; lb = lb->next) {
+		if (strcmp(lb->view_name, view_name) == 0)
+			return lb;
+	}
+	return NULL;
+}
+
 void rrset_lower_usage(domain_store_type* db, rrset_type* rrset);
 void rrset_delete(domain_store_type* db, domain_type* domain, rrset_type* rrset);
 void rr_lower_usage(domain_store_type* db, rr_type* rr);
@@ -230,6 +416,11 @@ int domain_store_lookup (struct  domain_store* db,
 		   const domain_name_st* dname,
 		   domain_type     **closest_match,
 		   domain_type     **closest_encloser);
+int domain_store_lookup_key (struct  domain_store* db,
+		   const domain_name_st* dname,
+		   uint8_t *key, uint16_t key_len,
+		   domain_type     **closest_match,
+		   domain_type     **closest_encloser);
 /* pass number of children (to alloc in dirty array */
 struct  domain_store *domain_store_open(void);
 void domain_store_close(struct  domain_store* db);
@@ -0,0 +1,91 @@
+/*
+ * edns.c -- EDNS definitions (RFC 6891).
+ *
+ * Copyright (c) 2001-2006, NLnet Labs.
+ *
+ * Modified Work Copyright (c) 2018 The TIGLabs Authors.
+ *
+ */
+
+#include "dns.h"
+#include "edns.h"
+
+void
+edns_init_record(edns_record_type *edns)
+{
+	edns->status = EDNS_NOT_PRESENT;
+	edns->maxlen = 0;
+	edns->version = 0;
+	edns->dnssec_ok = 0;
+}
+
+int
+edns_parse_record(edns_record_type *edns, buffer_st *packet)
+{
+	uint8_t  opt_owner;
+	uint16_t opt_type;
+	uint16_t opt_class;
+	uint8_t  opt_version;
+	uint16_t opt_flags;
+	uint16_t opt_rdlen;
+	uint16_t opt_len;
+	size_t   pos;
+
+	if (!buffer_available(packet, OPT_LEN))
+		return 0;
+
+	/* only the root owner and the OPT type make it an OPT RR */
+	opt_owner = buffer_read_u8_at(packet, buffer_get_position(packet));
+	opt_type = buffer_read_u16_at(packet, buffer_get_position(packet) + 1);
+	if (opt_owner != 0 || opt_type != TYPE_OPT)
+		return 0;
+
+	buffer_skip(packet, 3);
+	opt_class = buffer_read_u16(packet);
+	(void)buffer_read_u8(packet);	/* extended RCODE, 0 in queries */
+	opt_version = buffer_read_u8(packet);
+	opt_flags = buffer_read_u16(packet);
+	opt_rdlen = buffer_read_u16(packet);
+
+	if (!buffer_available(packet, opt_rdlen)) {
+		edns->status = EDNS_ERROR;
+		return 1;
+	}
+
+	/* the options are not used, but they must fill the rdata exactly */
+	pos = buffer_get_position(packet);
+	while (opt_rdlen > 0) {
+		if (opt_rdlen < 4) {
+			edns->status = EDNS_ERROR;
+			return 1;
+		}
+		opt_len = buffer_read_u16_at(packet, pos + 2);
+		if (opt_len > opt_rdlen - 4) {
+			edns->status = EDNS_ERROR;
+			return 1;
+		}
+		pos += 4 + opt_len;
+		opt_rdlen -= 4 + opt_len;
+	}
+	buffer_set_position(packet, pos);
+
+	edns->status = EDNS_OK;
+	edns->version = opt_version;
+	edns->dnssec_ok = (opt_flags & EDNS_DO_BIT) != 0;
+	/* smaller values are to be treated as 512, RFC 6891 6.2.5 */
+	edns->maxlen = opt_class < 512 ? 512 : opt_class;
+	return 1;
+}
+
+void
+edns_write_record(buffer_st *packet, const edns_record_type *edns,
+	uint16_t udp_size, int rcode)
+{
+	buffer_write_u8(packet, 0);		/* root owner */
+	buffer_write_u16(packet, TYPE_OPT);
+	buffer_write_u16(packet, udp_size);
+	buffer_write_u8(packet, (uint8_t)(rcode >> 4));
+	buffer_write_u8(packet, 0);		/* version */
+	buffer_write_u16(packet, edns->dnssec_ok ? EDNS_DO_BIT : 0);
+	buffer_write_u16(packet, 0);	/* no options */
+}
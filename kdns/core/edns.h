@@ -0,0 +1,59 @@
+/*
+ * edns.h -- EDNS definitions (RFC 6891).
+ *
+ * Copyright (c) 2001-2006, NLnet Labs.
+ *
+ * Modified Work Copyright (c) 2018 The TIGLabs Authors.
+ *
+ */
+
+#ifndef _EDNS_H_
+#define _EDNS_H_
+
+#include "buffer.h"
+
+/* Size of the OPT RR we write: root owner, type, class, ttl, rdlen */
+#define OPT_LEN		11U
+
+/* Extended RCODE, the upper 8 bits go in the TTL of the OPT RR */
+#define EDNS_RCODE_BADVERS	16
+
+#define EDNS_DO_BIT	0x8000U
+
+enum edns_status
+{
+	EDNS_NOT_PRESENT,
+	EDNS_OK,
+	EDNS_ERROR
+};
+typedef enum edns_status edns_status_type;
+
+struct edns_record
+{
+	edns_status_type status;
+	uint16_t maxlen;	/* UDP payload size advertised by the client */
+	uint8_t version;
+	int dnssec_ok;
+};
+typedef struct edns_record edns_record_type;
+
+void edns_init_record(edns_record_type *edns);
+
+/*
+ * Parse the OPT RR at the current position of the packet. Returns 0 if
+ * the record is not an OPT RR, the position is left unchanged then.
+ * Otherwise the record is consumed and the status is EDNS_OK, or
+ * EDNS_ERROR if it is malformed.
+ */
+int edns_parse_record(edns_record_type *edns, buffer_st *packet);
+
+/*
+ * Write an OPT RR at the current position of the packet, advertising
+ * udp_size as our payload size and carrying the upper bits of the
+ * extended rcode. The DO bit of the query is echoed. The caller has
+ * reserved OPT_LEN bytes for it and updates the ARCOUNT.
+ */
+void edns_write_record(buffer_st *packet, const edns_record_type *edns,
+	uint16_t udp_size, int rcode);
+
+#endif /* _EDNS_H_ */
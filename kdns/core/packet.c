@@ -7,15 +7,13 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <rte_hash_crc.h>
 #include "packet.h"
 #include "query.h"
 #include "zone.h"
 
-#define DOMAIN_LB_RR    1
-#define DOMAIN_LB_WRR   2
-#define DOMAIN_LB_HASH  3
-
 int round_robin = 1;
 
 
@@ -23,17 +21,16 @@ int round_robin = 1;
 static void
 do_dname_data_encode(kdns_query_st *q, domain_type *domain)
 {
-	while (domain->parent && domain->compressed_offset == 0) {
-		domain->compressed_offset =  buffer_get_position(q->packet);
-        q->compressed_dnames[q->compressed_count] = domain;
-        q->compressed_count++;
-        
+	uint16_t offset = 0;
+
+	while (domain->parent && (offset = query_compress_find(q, domain)) == 0) {
+		query_compress_add(q, domain, buffer_get_position(q->packet));
 		buffer_write(q->packet, domain_name_get(domain_dname(domain)),
 			     label_length(domain_name_get(domain_dname(domain))) + 1U);
 		domain = domain->parent;
 	}
 	if (domain->parent) {
-		buffer_write_u16(q->packet,0xc000 | domain->compressed_offset);
+		buffer_write_u16(q->packet,0xc000 | offset);
 	} else {
 		buffer_write_u8(q->packet, 0);
 	}
@@ -41,10 +38,64 @@ do_dname_data_encode(kdns_query_st *q, domain_type *domain)
 
 
 
+int
+packet_rr_wire_prepare(rr_type *rr)
+{
+	size_t len = 10;
+	uint16_t j, count = rr->rdata_count;
+	uint8_t dname = 0;
+	uint8_t *wire;
+
+	for (j = 0; j < rr->rdata_count; ++j) {
+		switch (rdata_atom_wireformat_type(rr->type, j)) {
+		case RDATA_WF_COMPRESSED_DNAME:
+			if (j != rr->rdata_count - 1)
+				return 0;
+			dname = 1;
+			count = j;
+			break;
+		case RDATA_WF_UNCOMPRESSED_DNAME:
+			len += domain_dname(rdata_atom_domain(rr->rdatas[j]))->name_size;
+			break;
+		default:
+			len += rdata_atom_size(rr->rdatas[j]);
+			break;
+		}
+	}
+	if (len > 10 + MAX_RDLENGTH)
+		return 0;
+
+	wire = (uint8_t *) xalloc(len);
+	do_write_uint16(wire, rr->type);
+	do_write_uint16(wire + 2, rr->klass);
+	do_write_uint32(wire + 4, rr->ttl);
+	do_write_uint16(wire + 8, (uint16_t)(len - 10));
+	len = 10;
+	for (j = 0; j < count; ++j) {
+		if (rdata_atom_wireformat_type(rr->type, j) == RDATA_WF_UNCOMPRESSED_DNAME) {
+			const domain_name_st *name = domain_dname(
+				rdata_atom_domain(rr->rdatas[j]));
+			memcpy(wire + len, domain_name_get(name), name->name_size);
+			len += name->name_size;
+		} else {
+			memcpy(wire + len, rdata_atomdata(rr->rdatas[j]),
+			       rdata_atom_size(rr->rdatas[j]));
+			len += rdata_atom_size(rr->rdatas[j]);
+		}
+	}
+
+	free(rr->wire);
+	rr->wire = wire;
+	rr->wire_len = (uint16_t)len;
+	rr->wire_dname = dname;
+	return 1;
+}
+
 int
 packet_encode_rr(kdns_query_st *q, domain_type *owner, rr_type *rr, uint32_t ttl)
 {
 	size_t truncation_mark;
+	uint16_t compress_mark;
 	uint16_t rdlength = 0;
 	size_t rdlength_pos;
 	uint16_t j;
@@ -53,9 +104,29 @@ packet_encode_rr(kdns_query_st *q, domain_type *owner, rr_type *rr, uint32_t ttl
 	 * will be restored to the mark.
 	 */
 	truncation_mark = buffer_get_position(q->packet);
+	compress_mark = q->compress.count;
 
     do_dname_data_encode(q,owner);
 
+	if (rr->wire) {
+		/* bulk copy, only the target name (and rdlength) is patched */
+		rdlength_pos = buffer_get_position(q->packet) + 8;
+		buffer_write(q->packet, rr->wire, rr->wire_len);
+		if (ttl != rr->ttl)
+			buffer_write_u32_at(q->packet, rdlength_pos - 4, ttl);
+		if (rr->wire_dname) {
+			do_dname_data_encode(q, rdata_atom_domain(rr->rdatas[rr->rdata_count - 1]));
+			rdlength = (buffer_get_position(q->packet) - rdlength_pos
+				    - sizeof(rdlength));
+			buffer_write_u16_at(q->packet, rdlength_pos, rdlength);
+		}
+		if (buffer_get_position(q->packet) <= q->maxMsgLen)
+			return 1;
+		buffer_set_position(q->packet, truncation_mark);
+		query_compress_rewind(q, compress_mark);
+		return 0;
+	}
+
     
 	buffer_write_u16(q->packet, rr->type);
 	buffer_write_u16(q->packet, rr->klass);
@@ -93,47 +164,34 @@ packet_encode_rr(kdns_query_st *q, domain_type *owner, rr_type *rr, uint32_t ttl
 		return 1;
 	} else {
 		buffer_set_position(q->packet, truncation_mark);
-       // query_clear_dname_offsets(q, truncation_mark);
+		query_compress_rewind(q, compress_mark);
 		return 0;
 	}
 }
 
 static int lb_filter(kdns_query_st *query,domain_type *owner,int16_t lb_mode, rrset_type *rrset,
-                    int16_t *idx_array, int16_t size,uint16_t round_robin_off){
+                    int16_t *idx_array, int16_t size,uint16_t round_robin_off, const char *view_name){
 
     rr_type *rr_to_encode = NULL;
     int16_t fit_rr_idx =0;
+    rrset_lb_type *lb;
 
     if (lb_mode == DOMAIN_LB_RR){
         fit_rr_idx = idx_array[round_robin_off %size];       
-    }else if (lb_mode == DOMAIN_LB_HASH){
-        fit_rr_idx = idx_array[query->sip %size];       
-    }else if (lb_mode == DOMAIN_LB_WRR){
-        int16_t i;
-        int16_t find =0;
-        rr_type *rr;
-wrr_retry:
-
-        for( i =0; i<size; i++){
-            rr = &rrset->rrs[idx_array[i]];  
-            if (rr->lb_weight_cur >0){   
-                fit_rr_idx =  idx_array[i];
-                rr->lb_weight_cur--;
-                find =1;
-                break;
-            }  
-        }
-        //no find rebuild lb_weight_cur
-        if (!find){     
-            for( i =0; i<size; i++){
-              rr = &rrset->rrs[idx_array[i]];  
-              rr->lb_weight_cur = rr->lb_weight;      
-            }  
-            goto wrr_retry;
+    }else if (lb_mode == DOMAIN_LB_WRR || lb_mode == DOMAIN_LB_HASH){
+        lb = rrset_lb_find(rrset, view_name);
+        if (lb == NULL || lb->count != size) {
+            fit_rr_idx = idx_array[round_robin_off %size];
+        } else if (lb->lb_mode == DOMAIN_LB_WRR) {
+            fit_rr_idx = lb->rrs[lb->sched[lb->cursor]];
+            if (++lb->cursor == lb->size) {
+                lb->cursor = 0;
+            }
+        } else {
+            fit_rr_idx = lb->rrs[lb->sched[rte_hash_crc_4byte(query->sip, 0) % lb->size]];
         }
-            
     }else{
-        log_msg(LOG_ERR,"lb_filter() lb_mode = %d \n",lb_mode);
+        log_msg_ratelimit(LOG_ERR,"lb_filter() lb_mode = %d \n",lb_mode);
         return 0;
     }
 
@@ -153,7 +211,7 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 {
 	uint16_t i;
 	uint16_t added = 0;  
-	static uint16_t round_robin_off = 0;
+	static __thread uint16_t round_robin_off = 0;
 	int do_robin = (round_robin && section == ANSWER_SECTION);
 	uint16_t start;
     uint32_t maxAnswer = 65535;
@@ -174,6 +232,7 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 
 	assert(rrset->rr_count > 0);
     size_t truncation_mark = buffer_get_position(query->packet);
+    uint16_t compress_mark = query->compress.count;
 
     round_robin_off++;
 
@@ -210,7 +269,8 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 
     // lb enable
     if (lb_mode != 0){
-        return lb_filter(query, owner, lb_mode, rrset, rrs_idx, match_num, round_robin_off);
+        return lb_filter(query, owner, lb_mode, rrset, rrs_idx, match_num, round_robin_off,
+                         view_match_num ? query->view_name : DEFAULT_VIEW_NAME);
     }
     
     // lb_mode ==0 
@@ -241,7 +301,7 @@ packet_encode_rrset(kdns_query_st *query, domain_type *owner,
 	if (!all_added && truncate_rrset) {
 		/* Truncate entire RRset and set truncate flag. */
 		buffer_set_position(query->packet, truncation_mark);
-	//	query_clear_dname_offsets(query, truncation_mark);
+		query_compress_rewind(query, compress_mark);
 		SET_FLAG_TC(query->packet);
 		added = 0;
     }
@@ -134,6 +134,13 @@ struct query;
 #define IPV4_MINIMAL_RESPONSE_SIZE 1480	 /* Recommended minimal edns size for IPv4 */
  
  
+/*
+ * Precompute the wire format of RR after the owner name, see rr->wire.
+ * Returns 0 if the rdata layout does not allow it, RR is then encoded
+ * atom by atom.
+ */
+int packet_rr_wire_prepare(rr_type *rr);
+
 /*
  * Encode RR with OWNER as owner name into QUERY.  Returns the number
  * of RRs successfully encoded.
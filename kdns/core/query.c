@@ -80,6 +80,7 @@ query_create(void)
     if (query) {
         query->packet = buffer_create(QIOBUFSZ);
         query->qname = (domain_name_st *)xalloc_zero(sizeof(domain_name_st) + MAXDOMAINLEN * 2);
+        query->ednsMaxLen = UDP_MAX_MESSAGE_LEN;
         if (query->packet == NULL || query->qname == NULL) {
             free(query);
             return NULL;
@@ -91,10 +92,8 @@ query_create(void)
 void
 query_reset(kdns_query_st *q )
 {
-    if (q->wildcard_match != NULL) {
-        free(q->wildcard_match);
-        q->wildcard_match = NULL;
-    }
+    q->scratch_used = 0;
+    query_compress_rewind(q, 0);
     q->qname->name_size = 0;
     q->qname->label_count = 0;
     buffer_clear(q->packet);
@@ -107,26 +106,32 @@ query_reset(kdns_query_st *q )
     q->sip = 0 ;
     q->cname_count = 0;
     q->maxMsgLen= UDP_MAX_MESSAGE_LEN;
+    edns_init_record(&q->edns);
     memset(q->view_name,0,MAX_VIEW_NAME_LEN);
     q->answer.rrset_count = 0;
 }
 
 /*
  * Parse the question section of a query.  The normalized query name
- * is stored in QUERY->name, the class in QUERY->klass, and the type
- * in QUERY->type.
+ * is stored in QUERY->name and its radname key in QUERY->qkey, the
+ * class in QUERY->klass, and the type in QUERY->type.
  */
 int
 process_query_section(kdns_query_st *query)
 {
-	uint8_t qnamebuf[MAXDOMAINLEN];
+	size_t len;
 
 	buffer_set_position(query->packet, DNS_HEAD_SIZE);
 	/* Lets parse the query name and convert it to lower case.  */
-	if(!packet_read_query_section(query->packet, qnamebuf,
-		&query->qtype, &query->qclass))
+	len = domain_name_make_query(buffer_current(query->packet),
+		buffer_remaining(query->packet), query->qname,
+		query->qkey, &query->qkey_len);
+	if (len == 0 || !buffer_available(query->packet, len + 2*sizeof(uint16_t)))
 		return 0;
-	domain_name_make_no_malloc( qnamebuf, 1,(domain_name_st *)query->qname);
+	buffer_skip(query->packet, len);
+	query->qhash = domain_name_hash(query->qname);
+	query->qtype = buffer_read_u16(query->packet);
+	query->qclass = buffer_read_u16(query->packet);
 	return 1;
 }
 
@@ -186,15 +191,19 @@ add_additional_rrsets(struct query *query, kdns_answer_st *answer,
 		}
 		if (additional != match && domain_wildcard_child(match)) {
 			domain_type *wildcard_child = domain_wildcard_child(match);
-			query->wildcard_match = (domain_type *) xalloc(sizeof(domain_type));
-			domain_type *temp = query->wildcard_match;
-			temp->rnode = NULL;
+			domain_type *temp = (domain_type *) query_scratch_alloc(query, sizeof(domain_type));
+			if (!temp) {
+				/* scratch used up, leave out the rest of the additionals */
+				return;
+			}
+			memset(temp, 0, sizeof(domain_type));
+			/* named like the target, through the target's parents */
 			temp->dname = additional->dname;
-			temp->parent = match;
+			temp->parent = additional->parent;
 			temp->wildcard_child_closest_match = temp;
 			temp->rrsets = wildcard_child->rrsets;
-			temp->compressed_offset = DNS_HEAD_SIZE;
 			temp->is_existing = wildcard_child->is_existing;
+			temp->maxAnswer = wildcard_child->maxAnswer;
 			additional = temp;
 		}
 
@@ -258,6 +267,42 @@ answer_nxdomain(kdns_query_st *query, kdns_answer_st *answer)
 }
 
 
+/*
+ * Answer the hops after DOMAIN from its flattened CNAME chain, and the
+ * name the chain ends at. Returns 0 if the chain does not start with
+ * RRSET.
+ */
+static int
+answer_cname_chain(struct kdns *kdns, struct query *q, kdns_answer_st *answer,
+	      domain_type *domain, rrset_type *rrset)
+{
+	cname_chain_type *chain = domain_cname_chain(domain, q->view_name);
+	zone_type *origzone = q->zone;
+	uint16_t i;
+
+	if (chain->rrsets[0] != rrset)
+		return 0;
+	for (i = 1; i < chain->count; ++i) {
+		++q->cname_count;
+		q->zone = chain->zones[i];
+		if (q->qclass == CLASS_ANY) {
+			RESET_FLAG_AA(q->packet);
+		} else {
+			SET_FLAG_AA(q->packet);
+		}
+		if (!add_rrset(q, answer, ANSWER_SECTION, chain->domains[i], chain->rrsets[i])) {
+			q->zone = origzone;
+			return 1;
+		}
+	}
+	if (chain->target) {
+		++q->cname_count;
+		answer_lookup_zone( kdns, q, answer, 1, chain->target, chain->target);
+	}
+	q->zone = origzone;
+	return 1;
+}
+
 /*
  * Answer domain information (or SOA if we do not have an RRset for
  * the type specified by the query).
@@ -275,6 +320,10 @@ answer_domain(struct kdns*  kdns, struct query *q, kdns_answer_st *answer,
 		int added;
 		added = add_rrset(q, answer, ANSWER_SECTION, domain, rrset);
 		assert(rrset->rr_count > 0);
+		if (added && domain->cname_chains &&
+			answer_cname_chain(kdns, q, answer, domain, rrset)) {
+			return;
+		}
 		if (added) {
 			/* only process first CNAME record */
 			int i, ret;
@@ -334,15 +383,27 @@ answer_authoritative(struct kdns   * kdns,
 	} else if (domain_wildcard_child(closest_encloser)) {
 		/* Generate the domain from the wildcard.  */
 		domain_type *wildcard_child = domain_wildcard_child(closest_encloser);
-		q->wildcard_match = (domain_type *) xalloc(sizeof(domain_type));
-		match = q->wildcard_match;
-		match->rnode = NULL;
+		match = (domain_type *) query_scratch_alloc(q, sizeof(domain_type));
+		if (!match) {
+			if (q->cname_count == 0)
+				SET_RCODE(q->packet, RCODE_SERVFAIL);
+			return;
+		}
+		memset(match, 0, sizeof(domain_type));
 		match->dname = wildcard_child->dname;
 		match->parent = closest_encloser;
 		match->wildcard_child_closest_match = match;
 		match->rrsets = wildcard_child->rrsets;
-		match->compressed_offset = DNS_HEAD_SIZE;
 		match->is_existing = wildcard_child->is_existing;
+		match->maxAnswer = wildcard_child->maxAnswer;
+		if (q->cname_count == 0) {
+			/* the owner is the qname */
+			query_compress_add(q, match, DNS_HEAD_SIZE);
+		} else {
+			/* the owner is the CNAME target */
+			match->dname = closest_match->dname;
+			match->parent = closest_match->parent;
+		}
 
 		/*
 		 * Remember the original domain in case a Wildcard No
@@ -401,44 +462,76 @@ answer_lookup_zone(struct kdns * kdns, struct query *q, kdns_answer_st *answer,
 	
 }
 
-static void query_compressed_table_clear(struct query *q){
-    int i =0;
-    for(;i < q->compressed_count; i++){
-        if (q->compressed_dnames[i] != NULL) {
-            q->compressed_dnames[i]->compressed_offset = 0;
-        }      
-    }
-    q->compressed_count = 0;    
-}
-
 static void
 query_compressed_table_add(struct query *q, domain_type *domain, uint16_t offset)
 {
 	while (domain->parent) {
-		domain->compressed_offset = offset;
-		q->compressed_dnames[q->compressed_count] = domain;
-		q->compressed_count++;
+		query_compress_add(q, domain, offset);
 
 		offset += label_length(domain_name_get(domain_dname(domain))) + 1;
 		domain = domain->parent;
 	}
 }
 
+int
+query_lookup_hash(struct kdns * kdns, struct query *q)
+{
+	domain_type *domain = domain_table_hash_find(kdns->db->domains, q->qname, q->qhash);
+	if (!domain)
+		return 0;
+	q->exact = 1;
+	q->closest_match = domain;
+	q->closest_encloser = domain;
+	return 1;
+}
+
+void
+query_lookup_tree(struct kdns * kdns, struct query *q)
+{
+	q->exact = domain_store_lookup_key( kdns->db, q->qname, q->qkey, q->qkey_len,
+		&q->closest_match, &q->closest_encloser);
+}
+
+void
+query_lookup(struct kdns * kdns, struct query *q)
+{
+	if (!query_lookup_hash(kdns, q))
+		query_lookup_tree(kdns, q);
+}
+
+/*
+ * Append our OPT RR to the response if the query had one, in the space
+ * reserved by query_process_edns.
+ */
 static void
-query_response(struct kdns * kdns, struct query *q)
+query_add_optional_rcode(struct query *q, int rcode)
+{
+	if (q->edns.status != EDNS_OK)
+		return;
+	edns_write_record(q->packet, &q->edns, q->ednsMaxLen, rcode);
+	SET_AR_COUNT(q->packet, GET_AR_COUNT(q->packet) + 1);
+}
+
+static void
+query_add_optional(struct query *q)
+{
+	if (q->edns.status == EDNS_OK)
+		q->maxMsgLen += OPT_LEN;
+	query_add_optional_rcode(q, GET_RCODE(q->packet));
+}
+
+void
+query_answer(struct kdns * kdns, struct query *q)
 {
-	domain_type *closest_match;
-	domain_type *closest_encloser;
-	int exact;
 	uint16_t offset;
 
-	exact = domain_store_lookup( kdns->db, q->qname, &closest_match, &closest_encloser);
-	answer_lookup_zone( kdns, q, &q->answer, exact, closest_match,closest_encloser);
+	answer_lookup_zone( kdns, q, &q->answer, q->exact, q->closest_match, q->closest_encloser);
 	if (GET_RCODE(q->packet) != RCODE_REFUSE) {
-		offset = domain_name_label_offsets(q->qname)[domain_dname(closest_encloser)->label_count - 1] + DNS_HEAD_SIZE;
-		query_compressed_table_add(q, closest_encloser, offset);
+		offset = domain_name_label_offsets(q->qname)[domain_dname(q->closest_encloser)->label_count - 1] + DNS_HEAD_SIZE;
+		query_compressed_table_add(q, q->closest_encloser, offset);
 		encode_answer(q, &q->answer);
-		query_compressed_table_clear(q);
+		query_compress_rewind(q, 0);
+		query_add_optional(q);
 	}
 }
 
@@ -458,11 +551,116 @@ query_prepare_response_data(kdns_query_st *q)
 }
 
 /*
- * process one query.
+ * Skip one RR of the additional section, its owner may be compressed.
+ * Returns 0 if the RR runs past the end of the packet.
+ */
+static int
+query_skip_rr(buffer_st *packet)
+{
+	uint8_t label_len;
+	uint16_t rdlen;
+
+	for (;;) {
+		if (!buffer_available(packet, 1))
+			return 0;
+		label_len = buffer_read_u8(packet);
+		if ((label_len & 0xc0) == 0xc0) {
+			if (!buffer_available(packet, 1))
+				return 0;
+			buffer_skip(packet, 1);
+			break;
+		}
+		if (label_len & 0xc0)
+			return 0;
+		if (label_len == 0)
+			break;
+		if (!buffer_available(packet, label_len))
+			return 0;
+		buffer_skip(packet, label_len);
+	}
+	/* type, class, ttl, rdlength */
+	if (!buffer_available(packet, 10))
+		return 0;
+	buffer_skip(packet, 8);
+	rdlen = buffer_read_u16(packet);
+	if (!buffer_available(packet, rdlen))
+		return 0;
+	buffer_skip(packet, rdlen);
+	return 1;
+}
+
+/*
+ * Parse the OPT RR in the additional section, if any, and size the
+ * response after it. The other additional RRs (a TSIG) are skipped,
+ * more than one OPT RR is a format error (RFC 6891 6.1.1). Space for
+ * our OPT RR is taken off the limit here and given back by
+ * query_add_optional.
+ */
+static query_state_type
+query_process_edns(kdns_query_st *q)
+{
+	size_t question_end = buffer_get_position(q->packet);
+	size_t rr_pos, opt_pos = 0;
+	uint16_t i, arcount = GET_AR_COUNT(q->packet);
+	int opt_count = 0;
+	uint32_t maxlen;
+
+	for (i = 0; i < arcount; i++) {
+		rr_pos = buffer_get_position(q->packet);
+		if (buffer_available(q->packet, 3)
+		    && buffer_read_u8_at(q->packet, rr_pos) == 0
+		    && buffer_read_u16_at(q->packet, rr_pos + 1) == TYPE_OPT) {
+			opt_pos = rr_pos;
+			opt_count++;
+		}
+		if (!query_skip_rr(q->packet))
+			break;
+	}
+	if (opt_count > 1) {
+		buffer_set_position(q->packet, question_end);
+		return query_format_error(q);
+	}
+	if (opt_count == 1)
+		buffer_set_position(q->packet, opt_pos);
+	if (opt_count == 0 || !edns_parse_record(&q->edns, q->packet)) {
+		/* no OPT, the additional RRs are ignored as before */
+		buffer_set_position(q->packet, question_end);
+		return QUERY_LOOKUP;
+	}
+	buffer_set_position(q->packet, question_end);
+
+	if (q->edns.status == EDNS_ERROR) {
+		edns_init_record(&q->edns);
+		return query_format_error(q);
+	}
+
+	if (q->edns.version != 0) {
+		buffer_setlimit(q->packet, question_end);
+		query_prepare_response_data(q);
+		SET_RCODE(q->packet, EDNS_RCODE_BADVERS & 0x0f);
+		SET_AN_COUNT(q->packet, 0);
+		SET_NS_COUNT(q->packet, 0);
+		SET_AR_COUNT(q->packet, 0);
+		query_add_optional_rcode(q, EDNS_RCODE_BADVERS);
+		return QUERY_SUCCESS;
+	}
+
+	/* never less than without EDNS, as much as both sides can take */
+	maxlen = q->edns.maxlen < q->ednsMaxLen ? q->edns.maxlen : q->ednsMaxLen;
+	if (maxlen > q->maxMsgLen)
+		q->maxMsgLen = maxlen;
+	q->maxMsgLen -= OPT_LEN;
+	return QUERY_LOOKUP;
+}
+
+/*
+ * check the header and parse the question of one query.
  *
  */
-query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
+query_state_type query_parse(kdns_query_st *q)
 {
+	query_state_type state;
+
 	if ((buffer_getlimit(q->packet) < DNS_HEAD_SIZE) ||(GET_FLAG_QR(q->packet)) ){
 		return QUERY_FAIL;
 	}
@@ -481,10 +679,15 @@ query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
 		return query_format_error(q);
 	}
 	/* Ignore settings of flags */
- 	if (GET_AN_COUNT(q->packet) != 0 || GET_NS_COUNT(q->packet) != 0 ||  GET_AR_COUNT(q->packet) >= 2) {
+ 	if (GET_AN_COUNT(q->packet) != 0 || GET_NS_COUNT(q->packet) != 0) {
 		return query_format_error(q);
 	}
 
+	state = query_process_edns(q);
+	if (state != QUERY_LOOKUP) {
+		return state;
+	}
+
  	buffer_setlimit(q->packet, buffer_get_position(q->packet));
 
 	query_prepare_response_data(q);
@@ -492,8 +695,22 @@ query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
 	if (q->qclass != CLASS_IN ) {
 		return query_error(q, RCODE_REFUSE);
 	}
-    
-	query_response(kdns, q);
+	return QUERY_LOOKUP;
+}
+
+/*
+ * process one query.
+ *
+ */
+query_state_type query_process(kdns_query_st *q, kdns_type * kdns)
+{
+	query_state_type state = query_parse(q);
+	if (state != QUERY_LOOKUP) {
+		return state;
+	}
+
+	query_lookup(kdns, q);
+	query_answer(kdns, q);
 	return QUERY_SUCCESS;
 }
 
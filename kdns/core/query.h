@@ -14,6 +14,7 @@
 #include <string.h>
 #include <netinet/in.h>
 #include "domain_store.h"
+#include "edns.h"
 #include "kdns.h"
 #include "packet.h"
 
@@ -22,6 +23,7 @@
 typedef enum query_state {
 	QUERY_SUCCESS,
 	QUERY_FAIL,
+	QUERY_LOOKUP,	/* parsed, the answer still needs the lookup */
 }query_state_type;
 
 typedef struct answer {
@@ -31,12 +33,38 @@ typedef struct answer {
     rr_section_type section[MAXRRSPP];
 }kdns_answer_st;
 
+/*
+ * Per-query scratch arena for the transient objects of the lookup, such
+ * as domains synthesized from a wildcard. It is reset with the query, so
+ * nothing on the answer path touches the heap.
+ */
+#define QUERY_SCRATCH_SIZE	(64 * sizeof(domain_type))
+
+/*
+ * Name compression dictionary of the response, open addressed on the
+ * domain pointer. Entries are kept in insertion order in used[] so the
+ * table can be cleared, or rewound to a truncation mark, by undoing the
+ * newest ones. The domains themselves are never written to.
+ */
+#define QUERY_COMPRESS_SLOTS	512
+#define QUERY_COMPRESS_MAX	(QUERY_COMPRESS_SLOTS * 3 / 4)
+
+typedef struct query_compress {
+    const domain_type *domains[QUERY_COMPRESS_SLOTS];
+    uint16_t offsets[QUERY_COMPRESS_SLOTS];
+    uint16_t used[QUERY_COMPRESS_MAX];
+    uint16_t count;
+}query_compress_st;
+
 /* Query as we pass it around */
 
 typedef struct query {
-	domain_type *wildcard_match;
 	buffer_st *packet;
 	domain_name_st *qname;
+	/* qname as a radname key of the name tree */
+	uint8_t qkey[MAXDOMAINLEN];
+	uint16_t qkey_len;
+	uint32_t qhash;
 	uint16_t qtype;
 	uint16_t qclass;
     uint8_t opcode;
@@ -45,16 +73,29 @@ typedef struct query {
     char view_name[MAX_VIEW_NAME_LEN];
     
 	zone_type *zone;
+
+    /* result of the name lookup, kept for the answer stage */
+    domain_type *closest_match;
+    domain_type *closest_encloser;
+    int exact;
     
 	int cname_count;
     uint16_t offset;
     uint32_t maxAnswer;
     uint32_t maxMsgLen;
 
-    domain_type *compressed_dnames[MAXRRSPP];
-    uint16_t    compressed_count;
+    /* EDNS record of the query, and the largest UDP payload we offer
+     * EDNS clients on this transport. The latter is set by the owner of
+     * the query once and is kept across resets. */
+    edns_record_type edns;
+    uint32_t ednsMaxLen;
+
+    query_compress_st compress;
 
     kdns_answer_st answer;
+
+    size_t scratch_used;
+    uint8_t scratch[QUERY_SCRATCH_SIZE] __attribute__((aligned(8)));
     /*
 	uint16_t     compressed_domain_name_count;
 	domain_type *compressed_dnames[MAXRRSPP];
@@ -75,6 +116,70 @@ static inline int check_view_info(kdns_query_st *query, rr_type *rr)
     return VIEW_MATCH_NONE;
 }
 
+/*
+ * Allocate from the query scratch arena, NULL when it is used up.
+ */
+static inline void *query_scratch_alloc(kdns_query_st *query, size_t size)
+{
+    void *p;
+    size = (size + 7) & ~(size_t)7;
+    if (size > QUERY_SCRATCH_SIZE - query->scratch_used) {
+        return NULL;
+    }
+    p = query->scratch + query->scratch_used;
+    query->scratch_used += size;
+    return p;
+}
+
+static inline uint32_t query_compress_slot(const domain_type *domain)
+{
+    return (uint32_t)(((uintptr_t)domain >> 3) * 0x9e3779b1u) & (QUERY_COMPRESS_SLOTS - 1);
+}
+
+/*
+ * Offset of the name of domain in the response, 0 if not written yet.
+ */
+static inline uint16_t query_compress_find(const kdns_query_st *query, const domain_type *domain)
+{
+    uint32_t slot = query_compress_slot(domain);
+    while (query->compress.domains[slot] != NULL) {
+        if (query->compress.domains[slot] == domain) {
+            return query->compress.offsets[slot];
+        }
+        slot = (slot + 1) & (QUERY_COMPRESS_SLOTS - 1);
+    }
+    return 0;
+}
+
+/*
+ * Remember the offset of the name of domain. When the table is full the
+ * name is not remembered and later copies are written uncompressed.
+ */
+static inline void query_compress_add(kdns_query_st *query, const domain_type *domain, uint16_t offset)
+{
+    uint32_t slot;
+    if (query->compress.count >= QUERY_COMPRESS_MAX || offset > 0x3fff) {
+        return;
+    }
+    slot = query_compress_slot(domain);
+    while (query->compress.domains[slot] != NULL) {
+        slot = (slot + 1) & (QUERY_COMPRESS_SLOTS - 1);
+    }
+    query->compress.domains[slot] = domain;
+    query->compress.offsets[slot] = offset;
+    query->compress.used[query->compress.count++] = (uint16_t)slot;
+}
+
+/*
+ * Forget the entries added after the table held count entries.
+ */
+static inline void query_compress_rewind(kdns_query_st *query, uint16_t count)
+{
+    while (query->compress.count > count) {
+        query->compress.domains[query->compress.used[--query->compress.count]] = NULL;
+    }
+}
+
 void encode_answer(kdns_query_st *q, const kdns_answer_st *answer);
 
 /*
@@ -104,6 +209,21 @@ int process_query_section(kdns_query_st *query);
  */
 query_state_type query_process(kdns_query_st *q,  kdns_type * kdns);
 
+/*
+ * The stages of query_process, for running them over a burst of
+ * queries. query_parse checks the header and question and returns
+ * QUERY_LOOKUP if an answer must be looked up, otherwise the response
+ * (if any) is already written. query_lookup finds the name in the
+ * domain store, first in the exact match index (query_lookup_hash,
+ * true on a hit) and then in the name tree (query_lookup_tree).
+ * query_answer writes the response.
+ */
+query_state_type query_parse(kdns_query_st *q);
+int query_lookup_hash(kdns_type *kdns, kdns_query_st *q);
+void query_lookup_tree(kdns_type *kdns, kdns_query_st *q);
+void query_lookup(kdns_type *kdns, kdns_query_st *q);
+void query_answer(kdns_type *kdns, kdns_query_st *q);
+
 /*
  * Prepare the query structure for writing the response. The packet
  * data up-to the current packet limit is preserved. This usually
@@ -117,7 +237,6 @@ void query_prepare_response_data(kdns_query_st *q);
  * RCODE.
  */
 query_state_type query_error(kdns_query_st *q,  int rcode);
-void query_clear_dname_offsets(struct query *q, size_t max_offset);
 
  
 #endif /* _QUERY_H_ */
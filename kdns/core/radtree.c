@@ -14,6 +14,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <rte_prefetch.h>
 #include "radtree.h"
 #include "util.h"
 
@@ -882,6 +883,8 @@ int radix_find_less_equal(struct radtree* rt, uint8_t* k, uint16_t len,
 			/* this entry or something before it */
 			return ret_self_or_prev(n, result);
 		}
+		/* fetch the child while the edge string is compared */
+		rte_prefetch0(n->array[byte].node);
 		if(n->array[byte].len != 0) {
 			/* must match additional string */
 			if(pos+n->array[byte].len > len) {
@@ -1259,6 +1262,55 @@ struct radnode* radomain_name_search(struct radtree* rt, const uint8_t* d,
 	return NULL;
 }
 
+void radix_walk_init(struct radtree* rt, struct radwalk* w,
+	const uint8_t* k, uint16_t len)
+{
+	w->n = rt->root;
+	w->sel = NULL;
+	w->pos = 0;
+	w->len = len;
+	w->k = k;
+	if(w->n)
+		rte_prefetch0(w->n);
+}
+
+int radix_walk_step(struct radwalk* w)
+{
+	struct radnode* n = w->n;
+	struct radsel* sel = w->sel;
+	uint8_t byte;
+
+	if(sel) {
+		/* the selector is in cache now, move on to its node */
+		w->sel = NULL;
+		w->pos += 1 + sel->len;
+		if(sel->len != 0)
+			rte_prefetch0(sel->str);
+		w->n = sel->node;
+		if(!w->n)
+			return 0;
+		rte_prefetch0(w->n);
+		return 1;
+	}
+	if(!n)
+		return 0;
+	if(w->pos >= w->len) {
+		/* end of the key, the lookup reads the element next */
+		if(n->elem)
+			rte_prefetch0(n->elem);
+		w->n = NULL;
+		return 0;
+	}
+	byte = w->k[w->pos];
+	if(byte < n->offset || byte - n->offset >= n->len) {
+		w->n = NULL;
+		return 0;
+	}
+	w->sel = &n->array[byte - n->offset];
+	rte_prefetch0(w->sel);
+	return 1;
+}
+
 /* find domain name or smaller or equal domain name in radix tree */
 int radomain_name_find_less_equal(struct radtree* rt, const uint8_t* d, size_t max,
         struct radnode** result)
@@ -1362,6 +1414,8 @@ int radomain_name_find_less_equal(struct radtree* rt, const uint8_t* d, size_t m
 			/* this entry or something before it */
 			return ret_self_or_prev(n, result);
 		}
+		/* fetch the child while the edge string is compared */
+		rte_prefetch0(n->array[byte].node);
 		if(n->array[byte].len != 0) {
 			/* must match additional string */
 			/* see how many bytes we need and start matching them*/
@@ -229,6 +229,42 @@ struct radnode* radomain_name_insert(struct radtree* rt, const uint8_t* d,
  */
 void radomain_name_delete(struct radtree* rt, const uint8_t* d, size_t max);
 
+/**
+ * Cursor that steps down the tree one memory access at a time.
+ * Walks for several keys are stepped in turn, so the cache misses of
+ * one lookup overlap with the others, and the real lookup that follows
+ * finds its path in the cache.
+ */
+struct radwalk {
+	/** node to step from, NULL when the walk is done */
+	struct radnode* n;
+	/** selector to move through, set between the two halves of a step */
+	struct radsel* sel;
+	/** position in the key */
+	uint16_t pos;
+	/** length of the key */
+	uint16_t len;
+	/** the key, must stay valid during the walk */
+	const uint8_t* k;
+};
+
+/**
+ * Start a walk for the key.
+ * @param rt: the radix tree.
+ * @param w: the walk to init.
+ * @param k: the key.
+ * @param len: length of the key.
+ */
+void radix_walk_init(struct radtree* rt, struct radwalk* w,
+	const uint8_t* k, uint16_t len);
+
+/**
+ * Do one step of the walk, prefetching the memory the next step reads.
+ * @param w: the walk.
+ * @return false when the walk is done.
+ */
+int radix_walk_step(struct radwalk* w);
+
 /** number of bytes in common in strings */
 uint16_t bstr_common_ext(uint8_t* x, uint16_t xlen, uint8_t* y,
 	uint16_t ylen);
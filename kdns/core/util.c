@@ -6,6 +6,7 @@
  * Modified Work Copyright (c) 2018 The TIGLabs Authors.
  *
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -14,6 +15,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+
+#include <rte_lcore.h>
+#include <rte_atomic.h>
 
 #include "util.h"
 #include "domain_store.h"
@@ -27,11 +32,44 @@ struct log_leval_info {
 static struct log_leval_info log_leval_infos[] = {
 	{ LOG_ERR, "error" },
 	{ LOG_INFO, "info" },
+	{ 0, NULL },
+};
+
+/*
+ * Messages of one EAL lcore waiting for the writer thread. Single
+ * producer, single consumer: the lcore only moves head, the writer
+ * only moves tail.
+ */
+struct log_entry {
+	struct timespec ts;
+	int level;
+	char message[LOG_ENTRY_LEN];
+};
+
+struct log_ring {
+	volatile uint32_t head;
+	uint64_t dropped;	/* ring full */
+	uint64_t suppressed;	/* over the callsite rate */
+	char pad0[RTE_CACHE_LINE_SIZE - sizeof(uint32_t) - 2 * sizeof(uint64_t)];
+	volatile uint32_t tail;
+	uint64_t dropped_reported;
+	char pad1[RTE_CACHE_LINE_SIZE - sizeof(uint32_t) - sizeof(uint64_t)];
+	struct log_entry entries[LOG_RING_SIZE];
 };
 
 static FILE *current_log_file = NULL;
 static int current_pid = 0;
 
+/* serializes the writers of current_log_file */
+static pthread_mutex_t log_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings[RTE_MAX_LCORE];
+static volatile int log_async = 0;
+static uint64_t log_suppressed_other = 0;
+
+/* last second formatted by log_msg_to_file, under log_file_lock */
+static time_t log_time_sec = -1;
+static char log_time_mbuf[32];
+
 
 static const char * getinfo_by_levelId( int level)
 {
@@ -45,29 +83,87 @@ static const char * getinfo_by_levelId( int level)
 	return "unknown";
 }
 
+static inline void log_coarse_time(struct timespec *ts)
+{
+	if (clock_gettime(CLOCK_REALTIME_COARSE, ts) != 0) {
+		ts->tv_sec = time(NULL);
+		ts->tv_nsec = 0;
+	}
+}
 
-
-static void log_msg_to_file(int log_level, const char *message)
+/* called with log_file_lock held */
+static void log_msg_to_file(const struct timespec *ts, int log_level, const char *message)
 {
 	size_t length;    
 	const char *level_text = getinfo_by_levelId(log_level);
 
-	struct timeval tv;
-	char time_mbuf[32]={0};
-	tv.tv_usec = 0;
-	if(gettimeofday(&tv, NULL) == 0) {
+	if (ts->tv_sec != log_time_sec) {
 		struct tm tm;
-		time_t now = (time_t)tv.tv_sec;
-		strftime(time_mbuf, sizeof(time_mbuf), "%Y-%m-%d %H:%M:%S",localtime_r(&now, &tm));
+		time_t now = ts->tv_sec;
+		strftime(log_time_mbuf, sizeof(log_time_mbuf), "%Y-%m-%d %H:%M:%S",localtime_r(&now, &tm));
+		log_time_sec = ts->tv_sec;
 	}
 	fprintf(current_log_file, "[%s.%3.3d] [%d] [%s] : %s",
-		time_mbuf, (int)tv.tv_usec/1000, current_pid, level_text, message);
+		log_time_mbuf, (int)(ts->tv_nsec / 1000000), current_pid, level_text, message);
         
 	length = strlen(message);
 	if (length == 0 || message[length - 1] != '\n') {
 		fprintf(current_log_file, "\n");
 	}
-	fflush(current_log_file);
+}
+
+static int log_ring_drain(unsigned lcore_id, struct log_ring *ring)
+{
+	uint32_t head, tail, n;
+	uint64_t dropped;
+	struct timespec ts;
+	char message[128];
+
+	tail = ring->tail;
+	head = ring->head;
+	rte_smp_rmb();
+	for (n = 0; tail != head; tail++, n++) {
+		struct log_entry *entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+		log_msg_to_file(&entry->ts, entry->level, entry->message);
+	}
+	rte_smp_mb();
+	ring->tail = tail;
+
+	dropped = ring->dropped;
+	if (dropped != ring->dropped_reported) {
+		log_coarse_time(&ts);
+		snprintf(message, sizeof(message), "log ring of lcore %u full, %lu messages dropped\n",
+			lcore_id, (unsigned long)(dropped - ring->dropped_reported));
+		log_msg_to_file(&ts, LOG_ERR, message);
+		ring->dropped_reported = dropped;
+		n++;
+	}
+	return n;
+}
+
+static int log_rings_drain(void)
+{
+	unsigned lcore_id;
+	int n = 0;
+
+	pthread_mutex_lock(&log_file_lock);
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (log_rings[lcore_id])
+			n += log_ring_drain(lcore_id, log_rings[lcore_id]);
+	}
+	if (n)
+		fflush(current_log_file);
+	pthread_mutex_unlock(&log_file_lock);
+	return n;
+}
+
+static void *log_writer(__attribute__((unused)) void *arg)
+{
+	while (1) {
+		if (log_rings_drain() == 0)
+			usleep(LOG_WRITER_IDLE_US);
+	}
+	return NULL;
 }
 
 
@@ -97,23 +193,133 @@ int log_file_reload(char *filename)
 				filename, strerror(errno));
 			return -1;
 		} else {
+			pthread_mutex_lock(&log_file_lock);
+			fflush(current_log_file);
 			if (current_log_file != stderr)
 				fclose(current_log_file);
 			current_log_file = file;
+			pthread_mutex_unlock(&log_file_lock);
+		}
+	}
+
+	return 0;
+}
+
+int
+log_async_start(void)
+{
+	pthread_t thread;
+	unsigned lcore_id;
+
+	if (log_async)
+		return 0;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (rte_lcore_is_enabled(lcore_id))
+			log_rings[lcore_id] = xalloc_zero(sizeof(struct log_ring));
+	}
+	if (pthread_create(&thread, NULL, log_writer, NULL) != 0) {
+		log_msg(LOG_ERR, "Cannot create the log writer thread (%s), logging synchronously",
+			strerror(errno));
+		return -1;
+	}
+	pthread_setname_np(thread, "kdns_log");
+	atexit(log_flush);
+	rte_smp_wmb();
+	log_async = 1;
+	return 0;
+}
+
+void
+log_flush(void)
+{
+	if (log_async)
+		log_rings_drain();
+}
+
+void
+log_stats_get(uint64_t *dropped, uint64_t *suppressed)
+{
+	unsigned lcore_id;
+
+	*dropped = 0;
+	*suppressed = log_suppressed_other;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (log_rings[lcore_id]) {
+			*dropped += log_rings[lcore_id]->dropped;
+			*suppressed += log_rings[lcore_id]->suppressed;
 		}
 	}
+}
+
+int
+log_ratelimit_check(struct log_ratelimit *rl, uint32_t *suppressed)
+{
+	struct timespec ts;
+	unsigned lcore_id;
+
+	/* racy across lcores on purpose, the counts are approximate */
+	log_coarse_time(&ts);
+	*suppressed = 0;
+	if (rl->sec != (uint32_t)ts.tv_sec) {
+		*suppressed = rl->suppressed;
+		rl->suppressed = 0;
+		rl->cnt = 0;
+		rl->sec = (uint32_t)ts.tv_sec;
+	}
+	if (rl->cnt < LOG_RATELIMIT_BURST) {
+		rl->cnt++;
+		return 1;
+	}
 
+	rl->suppressed++;
+	lcore_id = rte_lcore_id();
+	if (lcore_id < RTE_MAX_LCORE && log_rings[lcore_id])
+		log_rings[lcore_id]->suppressed++;
+	else
+		__sync_fetch_and_add(&log_suppressed_other, 1);
 	return 0;
 }
 
+static void
+log_vmsg(int priority, const char *format, va_list args)
+{
+	struct log_ring *ring;
+	struct log_entry *entry;
+	struct timespec ts;
+	uint32_t head;
+	unsigned lcore_id = rte_lcore_id();
+
+	/* EAL lcores only queue, the writer thread does the stdio */
+	if (log_async && lcore_id < RTE_MAX_LCORE && (ring = log_rings[lcore_id]) != NULL) {
+		head = ring->head;
+		if (head - ring->tail >= LOG_RING_SIZE) {
+			ring->dropped++;
+			return;
+		}
+		entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+		log_coarse_time(&entry->ts);
+		entry->level = priority;
+		vsnprintf(entry->message, sizeof(entry->message), format, args);
+		rte_smp_wmb();
+		ring->head = head + 1;
+		return;
+	}
+
+	char message[1024];
+	vsnprintf(message, sizeof(message), format, args);
+	log_coarse_time(&ts);
+	pthread_mutex_lock(&log_file_lock);
+	log_msg_to_file(&ts, priority, message);
+	fflush(current_log_file);
+	pthread_mutex_unlock(&log_file_lock);
+}
+
 void
 log_msg(int priority, const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-    char message[1024];
-	vsnprintf(message, sizeof(message), format, args);
-	log_msg_to_file(priority, message);
+	log_vmsg(priority, format, args);
 	va_end(args);
 }
 
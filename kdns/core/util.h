@@ -37,6 +37,20 @@ struct buffer;
         __attribute__ ((format (archetype, string_index, first_to_check)))
 
 
+/* messages queued per EAL lcore, and their length, longer ones are cut */
+#define LOG_RING_SIZE		1024
+#define LOG_ENTRY_LEN		256
+#define LOG_WRITER_IDLE_US	1000
+
+/* messages logged per second by one log_msg_ratelimit() callsite */
+#define LOG_RATELIMIT_BURST	10
+
+struct log_ratelimit {
+	uint32_t sec;
+	uint32_t cnt;
+	uint32_t suppressed;
+};
+
 void log_open( char *ident);
 
 void log_msg(int priority, const char *format, ...)
@@ -44,6 +58,36 @@ void log_msg(int priority, const char *format, ...)
 
 int log_file_reload(char *filename);
 
+/*
+ * Start the writer thread. From then on the EAL lcores only queue their
+ * messages in their own ring and the writer does the stdio, a full ring
+ * drops the message and counts it. Other threads keep writing directly.
+ */
+int log_async_start(void);
+
+/* Write out the queued messages, done at exit too */
+void log_flush(void);
+
+void log_stats_get(uint64_t *dropped, uint64_t *suppressed);
+
+/*
+ * Returns 1 if the callsite may log in the current second, with the
+ * number of messages it suppressed in the last one in *suppressed.
+ */
+int log_ratelimit_check(struct log_ratelimit *rl, uint32_t *suppressed);
+
+/* log_msg() for the packet paths, at most LOG_RATELIMIT_BURST per second per callsite */
+#define log_msg_ratelimit(priority, format, ...) do {				\
+	static struct log_ratelimit _log_rl;					\
+	uint32_t _log_suppressed;						\
+	if (log_ratelimit_check(&_log_rl, &_log_suppressed)) {			\
+		if (_log_suppressed)						\
+			log_msg(priority, "%s:%d: %u messages suppressed\n",	\
+				__FILE__, __LINE__, _log_suppressed);		\
+		log_msg(priority, format, ##__VA_ARGS__);			\
+	}									\
+} while (0)
+
 void *xalloc(size_t size);
 void *xalloc_zero(size_t size);
 void *xalloc_array_zero(size_t num, size_t size);
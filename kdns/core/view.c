@@ -7,6 +7,7 @@
 #include <jansson.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <rte_prefetch.h>
 #include "view.h"
 #include "kdns.h"
 
@@ -113,6 +114,37 @@ view_value_t* view_find(view_tree_t *tree, uint8_t *key, size_t nbits)
     return node ? node->view_data : VIEW_NO_NODE;
 }
 
+/* walk the 32 bits of an ipv4 key, prefetching the next node */
+void view_walk_init(view_tree_t *tree, view_walk_t *walk, uint8_t *key)
+{
+    walk->node = tree->root;
+    walk->key = ntohl(*(uint32_t *)key);
+    walk->bit = 0x80000000;
+    if (walk->node) {
+        rte_prefetch0(walk->node);
+    }
+}
+
+int view_walk_step(view_walk_t *walk)
+{
+    view_node_t *cur = walk->node;
+
+    if (cur == NULL || walk->bit == 0) {
+        return 0;
+    }
+    if (cur->view_data != VIEW_NULL_VALUE) {
+        rte_prefetch0(cur->view_data);
+    }
+    cur = (walk->key & walk->bit) ? cur->right : cur->left;
+    walk->bit >>= 1;
+    walk->node = cur;
+    if (cur == NULL) {
+        return 0;
+    }
+    rte_prefetch0(cur);
+    return 1;
+}
+
 static int do_view_tree_delete(view_tree_t *tree, uint8_t *key, size_t nbits, char *pcidr, char *view_name)
 {
     view_node_t *node = do_view_tree_get(tree, key, nbits, 0);
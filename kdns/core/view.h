@@ -39,9 +39,18 @@ typedef struct view_tree {
     int size;
 } view_tree_t;
 
+/* cursor that steps down the tree one node at a time, see radix_walk_step */
+typedef struct view_walk {
+    view_node_t *node;
+    uint32_t key;
+    uint32_t bit;
+} view_walk_t;
+
 int view_operate(view_tree_t *tree, char *pcidr, char *view_name, enum view_action action);
 view_tree_t *view_tree_create(void);
 view_value_t* view_find(view_tree_t *tree, uint8_t *key, size_t nbits);
+void view_walk_init(view_tree_t *tree, view_walk_t *walk, uint8_t *key);
+int view_walk_step(view_walk_t *walk);
 void view_tree_dump(view_node_t *node,  void* arg1,void (*callback)(void*,view_value_t *));
 
 #endif
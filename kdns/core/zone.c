@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <ctype.h>
+#include <rte_spinlock.h>
+#include <rte_atomic.h>
 #include "zone.h"
 #include "dns.h"
 #include "kdns.h"
@@ -19,6 +22,14 @@
 
 #define IP6ADDRLEN	(128/8)
 
+/* zone stats ids by name, appended only so the names can be read unlocked */
+static struct {
+	rte_spinlock_t lock;
+	volatile unsigned count;
+	uint8_t names[ZONE_STATS_MAX][MAXDOMAINLEN];
+	char strs[ZONE_STATS_MAX][MAXDOMAINLEN + 1];
+} zone_stats_ids = { RTE_SPINLOCK_INITIALIZER, 1, {{0}}, {"_other"} };
+
 
 uint16_t *
 alloc_rdata_init( const void *data, size_t size)
@@ -156,7 +167,7 @@ domain_store_zone_create(domain_store_type* db, const domain_name_st* dname)
 	zone->soa_rrset = NULL;
 	zone->soa_nx_rrset = NULL;
 	zone->ns_rrset = NULL;
-	zone->zonestatid = 0;
+	zone->zonestatid = zone_stats_id_get(dname);
 	zone->is_changed = 0;
 	zone->is_ok = 1;
 	return zone;
@@ -230,6 +241,74 @@ domain_store_zone_delete(domain_store_type* db, zone_type* zone)
 }
 
 
+static int
+zone_stats_name_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (tolower(a[i]) != tolower(b[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/* the text of a wire name, without escapes as it is only printed in stats */
+static void
+zone_stats_name_str(char *str, const uint8_t *name)
+{
+	char *p = str;
+	while (*name) {
+		if (p != str)
+			*p++ = '.';
+		memcpy(p, name + 1, *name);
+		p += *name;
+		name += *name + 1;
+	}
+	if (p == str)
+		*p++ = '.';
+	*p = 0;
+}
+
+unsigned
+zone_stats_id_get(const domain_name_st *dname)
+{
+	unsigned id;
+	const uint8_t *name = domain_name_get(dname);
+
+	rte_spinlock_lock(&zone_stats_ids.lock);
+	for (id = 1; id < zone_stats_ids.count; id++) {
+		if (zone_stats_name_equal(zone_stats_ids.names[id], name, dname->name_size))
+			goto out;
+	}
+	if (id == ZONE_STATS_MAX) {
+		log_msg(LOG_ERR, "no zone stats id left for %s, counted as %s\n",
+			domain_name_to_string(dname, NULL), zone_stats_ids.strs[0]);
+		id = 0;
+		goto out;
+	}
+	memcpy(zone_stats_ids.names[id], name, dname->name_size);
+	zone_stats_name_str(zone_stats_ids.strs[id], name);
+	rte_smp_wmb();
+	zone_stats_ids.count = id + 1;
+out:
+	rte_spinlock_unlock(&zone_stats_ids.lock);
+	return id;
+}
+
+unsigned
+zone_stats_id_count(void)
+{
+	unsigned count = zone_stats_ids.count;
+	rte_smp_rmb();
+	return count;
+}
+
+const char *
+zone_stats_name_get(unsigned id)
+{
+	return zone_stats_ids.strs[id];
+}
+
 void domain_store_zones_check_create(struct kdns*  kdns, char* zones)
 {
 	char zoneTmp[1024] = {0};
@@ -247,6 +326,7 @@ void domain_store_zones_check_create(struct kdns*  kdns, char* zones)
 		free((void *)dname);
 		name = strtok_r(0, ",", &tmp);
 	}
+	domain_store_cname_rebuild(kdns->db);
 	return;
 }
 
@@ -269,6 +349,7 @@ void domain_store_zones_check_delete(struct kdns* kdns, char* zones)
 		free((void *)dname);
 		name = strtok_r(0, ",", &tmp);
 	}
+	domain_store_cname_rebuild(kdns->db);
 	return;
 }
 
@@ -28,6 +28,9 @@
 #define LINEBUFSZ 1024
 #define ZONES_STR_LEN (1024)
 
+/* zone ids of the query counters, id 0 counts the queries out of any zone */
+#define ZONE_STATS_MAX 256
+
 struct lexdata {
     size_t   len;		/* holds the label length */
     char    *str;		/* holds the data */
@@ -52,4 +55,15 @@ uint16_t *alloc_rdata_init( const void *data, size_t size);
 
 void domain_store_zones_check_delete(struct kdns* kdns, char* zones);
 void domain_store_zones_check_create(struct kdns* kdns, char *zones);
+
+/*
+ * Get the stats id of a zone. The ids are kept by name and shared by the
+ * stores of all the lcores, so their counters can be summed up. Returns 0
+ * if all the ids are taken.
+ */
+unsigned zone_stats_id_get(const domain_name_st *dname);
+/* number of the zone stats ids handed out, including 0 */
+unsigned zone_stats_id_count(void);
+/* name of a zone stats id */
+const char *zone_stats_name_get(unsigned id);
 #endif /* _ZONEC_H_ */
@@ -33,7 +33,7 @@ static int ctrl_msg_ingress(struct rte_ring *ring, void **msg, uint16_t msg_cnt)
     nb_tx = rte_ring_enqueue_burst(ring, msg, msg_cnt);
     if (unlikely(nb_tx < msg_cnt)) {
         uint16_t s_cnt = nb_tx;
-        log_msg(LOG_ERR, "%s packet loss due to full ring, loss %d\n", ring->name, msg_cnt - nb_tx);
+        log_msg_ratelimit(LOG_ERR, "%s packet loss due to full ring, loss %d\n", ring->name, msg_cnt - nb_tx);
         do {
             free(msg[nb_tx]);
         } while (++nb_tx < msg_cnt);
@@ -68,14 +68,14 @@ uint16_t ctrl_msg_slave_process(unsigned slave_lcore) {
             view_msg_slave_process(msg[i], slave_lcore);
             break;
         case CTRL_MSG_TYPE_TO_KNI:
-            log_msg(LOG_ERR, "unexpected msg CTRL_MSG_TYPE_TO_KNI on slave_lcore %u\n", slave_lcore);
+            log_msg_ratelimit(LOG_ERR, "unexpected msg CTRL_MSG_TYPE_TO_KNI on slave_lcore %u\n", slave_lcore);
             free(msg[i]);
             break;
         case CTRL_MSG_TYPE_TO_TX:
             tx_msg_slave_process(msg[i], slave_lcore);
             break;
         default:
-            log_msg(LOG_ERR, "unknow msg type %d on slave_lcore %u\n", msg[i]->type, slave_lcore);
+            log_msg_ratelimit(LOG_ERR, "unknow msg type %d on slave_lcore %u\n", msg[i]->type, slave_lcore);
             free(msg[i]);
             break;
         }
@@ -121,11 +121,11 @@ uint16_t ctrl_msg_master_process(void) {
             kni_msg_master_process(msg[i]);
             break;
         case CTRL_MSG_TYPE_TO_TX:
-            log_msg(LOG_ERR, "unexpected msg CTRL_MSG_TYPE_TO_TX on master_lcore\n");
+            log_msg_ratelimit(LOG_ERR, "unexpected msg CTRL_MSG_TYPE_TO_TX on master_lcore\n");
             free(msg[i]);
             break;
         default:
-            log_msg(LOG_ERR, "unknow msg type %d on master_lcore\n", msg[i]->type);
+            log_msg_ratelimit(LOG_ERR, "unknow msg type %d on master_lcore\n", msg[i]->type);
             free(msg[i]);
             break;
         }
@@ -143,7 +143,7 @@ void ctrl_msg_init(void) {
         if (lcore_id == master_lcore) {
             ctrl_msg_ring[lcore_id] = rte_ring_create(ring_name, CTRL_RING_SZ, rte_socket_id(), RING_F_SC_DEQ);
         } else {
-            ctrl_msg_ring[lcore_id] = rte_ring_create(ring_name, CTRL_RING_SZ, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+            ctrl_msg_ring[lcore_id] = rte_ring_create(ring_name, CTRL_RING_SZ, rte_lcore_to_socket_id(lcore_id), RING_F_SP_ENQ | RING_F_SC_DEQ);
         }
         if (ctrl_msg_ring[lcore_id] == NULL) {
             log_msg(LOG_ERR, "Cannot create %s\n", ring_name);
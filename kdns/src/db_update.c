@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "db_update.h"
 #include "util.h"
+#include "packet.h"
 
 static rrset_type *do_domaindata_insert(struct domain_store *db, zone_type *zo, const domain_name_st *dname, rr_type *rr, uint32_t maxAnswer)
 {
@@ -13,6 +14,7 @@ static rrset_type *do_domaindata_insert(struct domain_store *db, zone_type *zo,
     //domain_name_st *dname = domain_name_make(db->domain, 1);
     domain_type *owner = domain_table_insert(db->domains, dname, maxAnswer);
     rr->owner          = owner;
+    packet_rr_wire_prepare(rr);
 
     /* Do we have this type of rrset already? */
     rrset = domain_find_rrset(rr->owner, zo, rr->type);
@@ -25,6 +27,7 @@ static rrset_type *do_domaindata_insert(struct domain_store *db, zone_type *zo,
 
         /* Add it */
         domain_add_rrset(rr->owner, rrset);
+        rrset_lb_prepare(rrset);
     } else {
         int i;
         rr_type *o;
@@ -56,6 +59,7 @@ static rrset_type *do_domaindata_insert(struct domain_store *db, zone_type *zo,
         free(o);
         rrset->rrs[rrset->rr_count] = *rr;
         ++rrset->rr_count;
+        rrset_lb_prepare(rrset);
     }
     return rrset;
 }
@@ -107,6 +111,7 @@ static int do_domaindata_delete(struct domain_store *db, zone_type *zo, const do
                 memcpy(rrset->rrs, rrs_orig, (rrset->rr_count - 1) * sizeof(rr_type));
                 free(rrs_orig);
                 rrset->rr_count--;
+                rrset_lb_prepare(rrset);
             }
         }
     }
@@ -246,7 +251,6 @@ int domaindata_update(struct domain_store *db, struct domin_info_update *update)
     rr.ttl           = update->ttl;
     rr.lb_mode       = update->lb_mode;
     rr.lb_weight     = update->lb_weight;
-    rr.lb_weight_cur = update->lb_weight;
     snprintf(rr.view_name, MAX_VIEW_NAME_LEN, "%s", update->view_name);
 
     rr.rdatas = xalloc_array_zero(MAXRDATALEN, sizeof(rdata_atom_type));
@@ -277,12 +281,16 @@ int domaindata_update(struct domain_store *db, struct domin_info_update *update)
             free((void *)dname);
             return -1;
         }
+        domain_store_cname_refresh(db, rr.owner, update->type);
         free((void *)dname);
         return 0;
     } else {
         int ret = do_domaindata_delete(db, zo, dname, &rr);
         rr_lower_usage(db, &rr);
         add_rdata_to_recyclebin(&rr);
+        if (ret == 0) {
+            domain_store_cname_refresh(db, domain_table_find(db->domains, dname), update->type);
+        }
         free((void *)dname);
         return ret;
     }
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <rte_cfgfile.h>
+#include <rte_eth_bond.h>
 #include "dns-conf.h"
 #include "util.h"
 #include "domain_update.h"
@@ -9,6 +10,11 @@
 #include "kdns-adap.h"
 #include "parser.h"
 #include "rate_limit.h"
+#include "rrl.h"
+#include "querylog.h"
+#include "topk.h"
+#include "tcp_process.h"
+#include "local_udp_process.h"
 
 #define DEF_CONFIG_LOG_FILE "/export/log/kdns/kdns.log"
 #define DEF_FWD_ADDRS "8.8.8.8:53,114.114.114.114:53"
@@ -21,6 +27,10 @@
 #define RELOAD_ALL_PER_SECOND       (0x1 << 5)
 #define RELOAD_FWD_PER_SECOND       (0x1 << 6)
 #define RELOAD_CLIENT_NUM           (0x1 << 7)
+#define RELOAD_CLIENT_PREFIX_LEN    (0x1 << 8)
+#define RELOAD_RRL                  (0x1 << 9)
+#define RELOAD_QUERY_LOG_SAMPLE     (0x1 << 10)
+#define RELOAD_TOPK_WINDOW          (0x1 << 11)
 
 static rte_atomic16_t g_reload_perflag[MAX_CORES] = {RTE_ATOMIC16_INIT(0)};
 static uint16_t g_reload_flag;
@@ -29,10 +39,6 @@ struct dns_config *g_dns_cfg;
 struct dns_config *g_reload_dns_cfg = NULL;
 struct zones_reload *g_reload_zone = NULL;
 extern struct kdns dpdk_dns[MAX_CORES];
-extern rte_rwlock_t tcp_lock;
-extern struct kdns tcp_kdns;
-extern rte_rwlock_t local_udp_lock;
-extern struct kdns local_udp_kdns;
 
 static void dpdk_config_init(struct rte_cfgfile *cfgfile, struct dpdk_config *cfg, const char *proc_name) {
     const char *entry;
@@ -83,6 +89,120 @@ static void dpdk_config_init(struct rte_cfgfile *cfgfile, struct dpdk_config *cf
 
 }
 
+/* response rate limiting, read the same way at start and on reload */
+static void rrl_config_init(struct rte_cfgfile *cfgfile, struct comm_config *cfg) {
+    const char *entry;
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-responses-per-second");
+    if (entry) {
+        if (parser_read_uint32(&cfg->rrl_responses_per_second, entry) < 0) {
+            printf("Cannot read COMMON/rrl-responses-per-second = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->rrl_responses_per_second = 0;  //disable rrl
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-nxdomains-per-second");
+    if (entry) {
+        if (parser_read_uint32(&cfg->rrl_nxdomains_per_second, entry) < 0) {
+            printf("Cannot read COMMON/rrl-nxdomains-per-second = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->rrl_nxdomains_per_second = cfg->rrl_responses_per_second;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-errors-per-second");
+    if (entry) {
+        if (parser_read_uint32(&cfg->rrl_errors_per_second, entry) < 0) {
+            printf("Cannot read COMMON/rrl-errors-per-second = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->rrl_errors_per_second = cfg->rrl_responses_per_second;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-slip");
+    if (entry) {
+        if (parser_read_uint32(&cfg->rrl_slip, entry) < 0) {
+            printf("Cannot read COMMON/rrl-slip = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->rrl_slip = 2;  //every second limited response is sent truncated
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-prefix-len");
+    if (entry) {
+        if (parser_read_uint32(&cfg->rrl_prefix_len, entry) < 0 || cfg->rrl_prefix_len < 8 || cfg->rrl_prefix_len > 32) {
+            printf("Cannot read COMMON/rrl-prefix-len = %s, 8 - 32.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->rrl_prefix_len = 24;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "rrl-table-size");
+    if (entry) {
+        if (parser_read_uint32(&cfg->rrl_table_size, entry) < 0 || cfg->rrl_table_size == 0) {
+            printf("Cannot read COMMON/rrl-table-size = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->rrl_table_size = 64 * 1024;    //buckets per lcore
+    }
+}
+
+/* sampled query log, the destination and the ring size are only read at start */
+static void query_log_config_init(struct rte_cfgfile *cfgfile, struct comm_config *cfg) {
+    const char *entry;
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "query-log");
+    if (entry && strlen(entry) > 0) {
+        cfg->query_log = strdup(entry);
+    } else {
+        cfg->query_log = NULL;  //disable query log
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "query-log-sample");
+    if (entry) {
+        if (parser_read_uint32(&cfg->query_log_sample, entry) < 0) {
+            printf("Cannot read COMMON/query-log-sample = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->query_log_sample = 1;  //log every response
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "query-log-ring-size");
+    if (entry) {
+        if (parser_read_uint32(&cfg->query_log_ring_size, entry) < 0 || cfg->query_log_ring_size == 0) {
+            printf("Cannot read COMMON/query-log-ring-size = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->query_log_ring_size = 4096;    //records per lcore
+    }
+}
+
+/* heavy hitters, topk-k is only read at start */
+static void topk_config_init(struct rte_cfgfile *cfgfile, struct comm_config *cfg) {
+    const char *entry;
+
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "topk-k");
+    if (entry) {
+        if (parser_read_uint32(&cfg->topk_k, entry) < 0 || cfg->topk_k > TOPK_K_MAX) {
+            printf("Cannot read COMMON/topk-k = %s, max %d.\n", entry, TOPK_K_MAX);
+            exit(-1);
+        }
+    } else {
+        cfg->topk_k = 0;    //off, about 600 cycles per query when on
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "topk-window");
+    if (entry) {
+        if (parser_read_uint32(&cfg->topk_window, entry) < 0 || cfg->topk_window == 0) {
+            printf("Cannot read COMMON/topk-window = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->topk_window = 60;  //seconds
+    }
+}
+
 static void common_config_init(struct rte_cfgfile *cfgfile, struct comm_config *cfg) {
     const char *entry;
 
@@ -117,6 +237,44 @@ static void common_config_init(struct rte_cfgfile *cfgfile, struct comm_config *
         cfg->fwd_threads = 1;
     }
 
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "tcp-thread-num");
+    if (entry) {
+        if (parser_read_uint16(&cfg->tcp_threads, entry) < 0 || cfg->tcp_threads == 0 || cfg->tcp_threads > TCP_WORKER_MAX) {
+            printf("Cannot read COMMON/tcp-thread-num = %s, 1 - %d.\n", entry, TCP_WORKER_MAX);
+            exit(-1);
+        }
+    } else {
+        cfg->tcp_threads = 2;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "local-udp-thread-num");
+    if (entry) {
+        if (parser_read_uint16(&cfg->local_udp_threads, entry) < 0 || cfg->local_udp_threads == 0 ||
+            cfg->local_udp_threads > LOCAL_UDP_WORKER_MAX) {
+            printf("Cannot read COMMON/local-udp-thread-num = %s, 1 - %d.\n", entry, LOCAL_UDP_WORKER_MAX);
+            exit(-1);
+        }
+    } else {
+        cfg->local_udp_threads = 2;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "tcp-max-conns");
+    if (entry) {
+        if (parser_read_uint32(&cfg->tcp_max_conns, entry) < 0) {
+            printf("Cannot read COMMON/tcp-max-conns = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->tcp_max_conns = 1024;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "tcp-idle-timeout");
+    if (entry) {
+        if (parser_read_uint32(&cfg->tcp_idle_timeout, entry) < 0) {
+            printf("Cannot read COMMON/tcp-idle-timeout = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->tcp_idle_timeout = 10;  //seconds
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "fwd-timeout");
     if (entry) {
         if (parser_read_uint16(&cfg->fwd_timeout, entry) < 0) {
@@ -180,6 +338,35 @@ static void common_config_init(struct rte_cfgfile *cfgfile, struct comm_config *
         printf("Cannot read COMMON/zones.\n");
         exit(-1);
     }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "name-hash");
+    if (entry) {
+        cfg->name_hash = parser_read_arg_bool(entry);
+        if (cfg->name_hash < 0) {
+            printf("Cannot read COMMON/name-hash = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->name_hash = 1;
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "latency-sample");
+    if (entry) {
+        if (parser_read_uint32(&cfg->latency_sample, entry) < 0) {
+            printf("Cannot read COMMON/latency-sample = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->latency_sample = 16;   //time 1 of every 16 rx bursts
+    }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "edns-udp-size");
+    if (entry) {
+        if (parser_read_uint16(&cfg->edns_udp_size, entry) < 0 || cfg->edns_udp_size < 512 ||
+            cfg->edns_udp_size > 4096) {
+            printf("Cannot read COMMON/edns-udp-size = %s, 512 - 4096.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->edns_udp_size = 1232;  //bytes, fits the common MTUs unfragmented
+    }
     entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "metrics-host");
     if (entry) {
         cfg->metrics_host = strdup(entry);
@@ -215,6 +402,19 @@ static void common_config_init(struct rte_cfgfile *cfgfile, struct comm_config *
     } else {
         cfg->client_num = 16*1024;
     }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "client-prefix-len");
+    if (entry) {
+        if (parser_read_uint32(&cfg->client_prefix_len, entry) < 0 || cfg->client_prefix_len < 8 ||
+            cfg->client_prefix_len > 32) {
+            printf("Cannot read COMMON/client-prefix-len = %s, 8 - 32.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->client_prefix_len = 32;    //limit every source address on its own
+    }
+    rrl_config_init(cfgfile, cfg);
+    query_log_config_init(cfgfile, cfg);
+    topk_config_init(cfgfile, cfg);
 }
 
 static void netdev_config_init(struct rte_cfgfile *cfgfile, struct netdev_config *cfg) {
@@ -265,6 +465,31 @@ static void netdev_config_init(struct rte_cfgfile *cfgfile, struct netdev_config
         exit(-1);
     }
 
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "bond-mode");
+    if (entry && strcmp(entry, "none") != 0) {
+        uint8_t mode;
+        if (strcmp(entry, "lacp") == 0) {
+            cfg->bond_mode = BONDING_MODE_8023AD;
+        } else if (parser_read_uint8(&mode, entry) == 0 && mode <= BONDING_MODE_ALB) {
+            cfg->bond_mode = mode;
+        } else {
+            printf("Cannot read NETDEV/bond-mode = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->bond_mode = NETDEV_BOND_MODE_NONE;
+    }
+
+    entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "poll-idle-us");
+    if (entry) {
+        if (parser_read_uint32(&cfg->poll_idle_us, entry) < 0) {
+            printf("Cannot read NETDEV/poll-idle-us = %s.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->poll_idle_us = 0;      //always busy polling
+    }
+
     entry = rte_cfgfile_get_entry(cfgfile, "NETDEV", "kni-ipv4");
     if (entry) {
         if (parse_ipv4_addr(entry, (struct in_addr *)&cfg->kni_ip) < 0) {
@@ -384,6 +609,19 @@ static int common_config_reload_init(struct rte_cfgfile *cfgfile, struct comm_co
     } else {
         cfg->client_num = 16*1024;
     }
+    entry = rte_cfgfile_get_entry(cfgfile, "COMMON", "client-prefix-len");
+    if (entry) {
+        if (parser_read_uint32(&cfg->client_prefix_len, entry) < 0 || cfg->client_prefix_len < 8 ||
+            cfg->client_prefix_len > 32) {
+            printf("Cannot read COMMON/client-prefix-len = %s, 8 - 32.\n", entry);
+            exit(-1);
+        }
+    } else {
+        cfg->client_prefix_len = 32;    //limit every source address on its own
+    }
+    rrl_config_init(cfgfile, cfg);
+    query_log_config_init(cfgfile, cfg);
+    topk_config_init(cfgfile, cfg);
 
     return 0;
 }
@@ -616,23 +854,20 @@ static int zones_realod_del_proc(struct kdns *lcore_kdns) {
     return 0;
 }
 
+static int zones_realod_proc(struct kdns *lcore_kdns) {
+    zones_realod_del_proc(lcore_kdns);
+    zones_realod_add_proc(lcore_kdns);
+    return 0;
+}
+
 static int zones_reload_pre_core(unsigned lcore_id) {
     if (lcore_id == rte_get_master_lcore()) {
-        rte_rwlock_write_lock(&tcp_lock);
-        zones_realod_del_proc(&tcp_kdns);
-        zones_realod_add_proc(&tcp_kdns);
-        rte_rwlock_write_unlock(&tcp_lock);
-
-        rte_rwlock_write_lock(&local_udp_lock);
-        zones_realod_del_proc(&local_udp_kdns);
-        zones_realod_add_proc(&local_udp_kdns);
-        rte_rwlock_write_unlock(&local_udp_lock);
+        tcp_kdns_update(zones_realod_proc);
+        local_udp_kdns_update(zones_realod_proc);
 
         domain_list_del_zone(g_reload_zone->del_zone);
     } else {
-        struct kdns *lcore_kdns = &dpdk_dns[lcore_id];
-        zones_realod_del_proc(lcore_kdns);
-        zones_realod_add_proc(lcore_kdns);
+        zones_realod_proc(&dpdk_dns[lcore_id]);
     }
     return 0;
 }
@@ -650,9 +885,18 @@ int config_reload_pre_core(unsigned lcore_id) {
         if (reload_flag & (RELOAD_FWD_TIMEOUT | RELOAD_FWD_MODE | RELOAD_FWD_DEFAULT_ADDRS | RELOAD_FWD_ZONES_ADDRS)) {
             fwd_addrs_reload_proc(lcore_id);
         }
-        if (reload_flag & (RELOAD_ALL_PER_SECOND | RELOAD_FWD_PER_SECOND | RELOAD_CLIENT_NUM)) {
+        if (reload_flag & (RELOAD_ALL_PER_SECOND | RELOAD_FWD_PER_SECOND | RELOAD_CLIENT_NUM | RELOAD_CLIENT_PREFIX_LEN)) {
             rate_limit_reload(lcore_id);
         }
+        if (reload_flag & RELOAD_RRL) {
+            rrl_reload(lcore_id);
+        }
+        if (reload_flag & RELOAD_QUERY_LOG_SAMPLE) {
+            querylog_reload(lcore_id);
+        }
+        if (reload_flag & RELOAD_TOPK_WINDOW) {
+            topk_reload(lcore_id);
+        }
     }
 
     rte_atomic16_clear(&g_reload_perflag[lcore_id]);
@@ -708,10 +952,11 @@ static int config_zones_reload_proc(void) {
 }
 
 static int config_rate_limit_reload_proc(void) {
-    log_msg(LOG_INFO, "reload rate limit config, old: all_per_second=(%u), fwd_per_second=(%u), client_num=(%u).",
-            g_dns_cfg->comm.all_per_second, g_dns_cfg->comm.fwd_per_second, g_dns_cfg->comm.client_num);
-    log_msg(LOG_INFO, "reload rate limit config, new: all_per_second=(%u), fwd_per_second=(%u), client_num=(%u).",
-            g_reload_dns_cfg->comm.all_per_second, g_reload_dns_cfg->comm.fwd_per_second, g_reload_dns_cfg->comm.client_num);
+    log_msg(LOG_INFO, "reload rate limit config, old: all_per_second=(%u), fwd_per_second=(%u), client_num=(%u), client_prefix_len=(%u).",
+            g_dns_cfg->comm.all_per_second, g_dns_cfg->comm.fwd_per_second, g_dns_cfg->comm.client_num, g_dns_cfg->comm.client_prefix_len);
+    log_msg(LOG_INFO, "reload rate limit config, new: all_per_second=(%u), fwd_per_second=(%u), client_num=(%u), client_prefix_len=(%u).",
+            g_reload_dns_cfg->comm.all_per_second, g_reload_dns_cfg->comm.fwd_per_second, g_reload_dns_cfg->comm.client_num,
+            g_reload_dns_cfg->comm.client_prefix_len);
 
     if (g_reload_dns_cfg->comm.all_per_second != g_dns_cfg->comm.all_per_second) {
         g_dns_cfg->comm.all_per_second = g_reload_dns_cfg->comm.all_per_second;
@@ -725,9 +970,66 @@ static int config_rate_limit_reload_proc(void) {
         g_dns_cfg->comm.client_num = g_reload_dns_cfg->comm.client_num;
         g_reload_flag |= RELOAD_CLIENT_NUM;
     }
+    if (g_reload_dns_cfg->comm.client_prefix_len != g_dns_cfg->comm.client_prefix_len) {
+        g_dns_cfg->comm.client_prefix_len = g_reload_dns_cfg->comm.client_prefix_len;
+        g_reload_flag |= RELOAD_CLIENT_PREFIX_LEN;
+    }
+    return 0;
+}
+
+
+static int config_rrl_reload_proc(void) {
+    struct comm_config *cur = &g_dns_cfg->comm, *new = &g_reload_dns_cfg->comm;
+
+    if (cur->rrl_responses_per_second == new->rrl_responses_per_second && cur->rrl_nxdomains_per_second == new->rrl_nxdomains_per_second &&
+        cur->rrl_errors_per_second == new->rrl_errors_per_second && cur->rrl_slip == new->rrl_slip &&
+        cur->rrl_prefix_len == new->rrl_prefix_len && cur->rrl_table_size == new->rrl_table_size) {
+        return 0;
+    }
+    log_msg(LOG_INFO, "reload rrl config, new: responses_per_second=(%u), nxdomains_per_second=(%u), errors_per_second=(%u), "
+            "slip=(%u), prefix_len=(%u), table_size=(%u).", new->rrl_responses_per_second, new->rrl_nxdomains_per_second,
+            new->rrl_errors_per_second, new->rrl_slip, new->rrl_prefix_len, new->rrl_table_size);
+
+    cur->rrl_responses_per_second = new->rrl_responses_per_second;
+    cur->rrl_nxdomains_per_second = new->rrl_nxdomains_per_second;
+    cur->rrl_errors_per_second = new->rrl_errors_per_second;
+    cur->rrl_slip = new->rrl_slip;
+    cur->rrl_prefix_len = new->rrl_prefix_len;
+    cur->rrl_table_size = new->rrl_table_size;
+    g_reload_flag |= RELOAD_RRL;
+    return 0;
+}
+
+static int config_query_log_reload_proc(void) {
+    struct comm_config *cur = &g_dns_cfg->comm, *new = &g_reload_dns_cfg->comm;
+
+    if ((cur->query_log == NULL) != (new->query_log == NULL) || (cur->query_log && strcmp(cur->query_log, new->query_log)) ||
+        cur->query_log_ring_size != new->query_log_ring_size) {
+        log_msg(LOG_ERR, "query-log and query-log-ring-size take effect after restart.");
+    }
+    if (cur->query_log_sample == new->query_log_sample) {
+        return 0;
+    }
+    log_msg(LOG_INFO, "reload query log sample old=(%u), new=(%u).", cur->query_log_sample, new->query_log_sample);
+    cur->query_log_sample = new->query_log_sample;
+    g_reload_flag |= RELOAD_QUERY_LOG_SAMPLE;
     return 0;
 }
 
+static int config_topk_reload_proc(void) {
+    struct comm_config *cur = &g_dns_cfg->comm, *new = &g_reload_dns_cfg->comm;
+
+    if (cur->topk_k != new->topk_k) {
+        log_msg(LOG_ERR, "topk-k takes effect after restart.");
+    }
+    if (cur->topk_window == new->topk_window) {
+        return 0;
+    }
+    log_msg(LOG_INFO, "reload topk window old=(%u), new=(%u).", cur->topk_window, new->topk_window);
+    cur->topk_window = new->topk_window;
+    g_reload_flag |= RELOAD_TOPK_WINDOW;
+    return 0;
+}
 
 static void config_reload_free(void) {
     if (!g_reload_dns_cfg) {
@@ -739,6 +1041,11 @@ static void config_reload_free(void) {
         g_reload_dns_cfg->comm.log_file = NULL;
     }
 
+    if (g_reload_dns_cfg->comm.query_log) {
+        free(g_reload_dns_cfg->comm.query_log);
+        g_reload_dns_cfg->comm.query_log = NULL;
+    }
+
     if (g_reload_dns_cfg->comm.fwd_def_addrs) {
         free(g_reload_dns_cfg->comm.fwd_def_addrs);
         g_reload_dns_cfg->comm.fwd_def_addrs = NULL;
@@ -798,6 +1105,18 @@ int config_reload_proc(char *dns_cfgfile) {
     if (ret)
         goto _out;
 
+    ret = config_rrl_reload_proc();
+    if (ret)
+        goto _out;
+
+    ret = config_query_log_reload_proc();
+    if (ret)
+        goto _out;
+
+    ret = config_topk_reload_proc();
+    if (ret)
+        goto _out;
+
 _out:
     if (g_reload_flag) {
         for (i = 0; i < MAX_CORES; ++i) {
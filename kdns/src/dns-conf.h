@@ -6,6 +6,8 @@
 
 #define DPDK_ARG_MAX_NUM 32
 
+#define NETDEV_BOND_MODE_NONE (-1)
+
 #ifndef MIN
 #define MIN(v1, v2) ((v1) < (v2) ? (v1) : (v2))
 #endif
@@ -27,6 +29,10 @@ struct comm_config {
     char *fwd_def_addrs;
     char *fwd_mode;
     uint16_t fwd_threads;
+    uint16_t tcp_threads;
+    uint16_t local_udp_threads;
+    uint32_t tcp_max_conns;
+    uint32_t tcp_idle_timeout;
     uint16_t fwd_timeout;
     uint32_t fwd_mbuf_num;
     int ssl_enable;
@@ -34,10 +40,28 @@ struct comm_config {
     char *cert_pem_file;
     uint16_t web_port;
     char *metrics_host;
+    int name_hash;
+    uint32_t latency_sample;
+    uint16_t edns_udp_size;
 
     uint32_t all_per_second;
     uint32_t fwd_per_second;
     uint32_t client_num;
+    uint32_t client_prefix_len;
+
+    uint32_t rrl_responses_per_second;
+    uint32_t rrl_nxdomains_per_second;
+    uint32_t rrl_errors_per_second;
+    uint32_t rrl_slip;
+    uint32_t rrl_prefix_len;
+    uint32_t rrl_table_size;
+
+    char *query_log;
+    uint32_t query_log_sample;
+    uint32_t query_log_ring_size;
+
+    uint32_t topk_k;
+    uint32_t topk_window;
 };
 
 struct netdev_config {
@@ -48,6 +72,8 @@ struct netdev_config {
     uint16_t txq_desc_num;
     uint16_t rxq_num;
     uint16_t txq_num;
+    int bond_mode;
+    uint32_t poll_idle_us;
 
     uint32_t kni_mbuf_num;
     uint32_t kni_ip;
@@ -7,6 +7,7 @@
 #include <rte_ring.h>
 #include <rte_rwlock.h>
 #include <rte_ethdev.h>
+#include <rte_malloc.h>
 
 #include "webserver.h"
 #include "db_update.h"
@@ -19,6 +20,14 @@
 #include "forward.h"
 #include "hashMap.h"
 #include "metrics.h"
+#include "query_stats.h"
+#include "latency_stats.h"
+#include "rate_limit.h"
+#include "rrl.h"
+#include "querylog.h"
+#include "topk.h"
+#include "prometheus.h"
+#include "dns-conf.h"
 
 #define DOMAIN_HASH_SIZE    (0x3FFFF)
 
@@ -590,16 +599,19 @@ static void *statistics_percore_get(__attribute__((unused)) struct connection_in
     }
 
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
-        struct netif_queue_conf *conf = netif_queue_conf_get(lcore_id);
-        struct netif_queue_stats *sta_lcore = &conf->stats;
+        struct netif_queue_stats lcore_sta;
+        struct netif_queue_stats *sta_lcore = &lcore_sta;
+        netif_statsdata_lcore_get(lcore_id, sta_lcore);
 
         json_t *value = json_pack("{s:i, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f,\
                                     s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f,\
-                                    s:f, s:f, s:f, s:f, s:f}",
+                                    s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f}",
                                   "slave_lcore", lcore_id, "pkts_rcv", (double)sta_lcore->pkts_rcv,
                                   "dns_pkts_rcv", (double)sta_lcore->dns_pkts_rcv, "dns_pkts_snd", (double)sta_lcore->dns_pkts_snd,
                                   "pkt_dropped", (double)sta_lcore->pkt_dropped, "pkts_2kni", (double)sta_lcore->pkts_2kni,
                                   "pkts_icmp", (double)sta_lcore->pkts_icmp, "pkt_len_err", (double)sta_lcore->pkt_len_err,
+                                  "drop_rate_limit", (double)sta_lcore->drop_rate_limit, "drop_rrl", (double)sta_lcore->drop_rrl, "drop_tx_full", (double)sta_lcore->drop_tx_full,
+                                  "drop_ring_full", (double)sta_lcore->drop_ring_full, "drop_answer_err", (double)sta_lcore->drop_answer_err,
                                   "dns_lens_rcv", (double)sta_lcore->dns_lens_rcv, "dns_lens_snd", (double)sta_lcore->dns_lens_snd,
                                   "tcp_pkts_rcv", (double)sta_lcore->dns_pkts_rcv_tcp, "tcp_pkts_snd", (double)sta_lcore->dns_pkts_snd_tcp,
                                   "tcp_fwd_rcv", (double)sta_lcore->dns_fwd_rcv_tcp, "tcp_fwd_snd", (double)sta_lcore->dns_fwd_snd_tcp,
@@ -608,7 +620,9 @@ static void *statistics_percore_get(__attribute__((unused)) struct connection_in
                                   "metrics-maxtime", (double)sta_lcore->metrics.maxTime, "metrics-mintime", (double)sta_lcore->metrics.minTime,
                                   "metrics-sumtime", (double)sta_lcore->metrics.timeSum, "metrics1", (double)sta_lcore->metrics.metrics[0],
                                   "metrics2", (double)sta_lcore->metrics.metrics[1], "metrics3", (double)sta_lcore->metrics.metrics[2],
-                                  "metrics4", (double)sta_lcore->metrics.metrics[3]);
+                                  "metrics4", (double)sta_lcore->metrics.metrics[3],
+                                  "cycles_busy", (double)sta_lcore->cycles_busy, "cycles_idle", (double)sta_lcore->cycles_idle,
+                                  "rx_intr_sleeps", (double)sta_lcore->rx_intr_sleeps);
 
         if (!value) {
             log_msg(LOG_ERR, "json_pack err for slave core %u\n", lcore_id);
@@ -628,14 +642,18 @@ static void *statistics_get(__attribute__((unused)) struct connection_info_struc
     netif_statsdata_get(&sta);
     tcp_statsdata_get(&sta);
     fwd_statsdata_get(&sta);
+    uint64_t log_dropped, log_suppressed;
+    log_stats_get(&log_dropped, &log_suppressed);
 
     json_t *value = json_pack("{s:i, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f,\
                                 s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f,\
-                                s:f, s:f, s:f, s:f, s:f}",
+                                s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f}",
                               "domain_num", domain_num_get(), "pkts_rcv", (double)sta.pkts_rcv,
                               "dns_pkts_rcv", (double)sta.dns_pkts_rcv, "dns_pkts_snd", (double)sta.dns_pkts_snd,
                               "pkt_dropped", (double)sta.pkt_dropped, "pkts_2kni", (double)sta.pkts_2kni,
                               "pkts_icmp", (double)sta.pkts_icmp, "pkt_len_err", (double)sta.pkt_len_err,
+                              "drop_rate_limit", (double)sta.drop_rate_limit, "drop_rrl", (double)sta.drop_rrl, "drop_tx_full", (double)sta.drop_tx_full,
+                              "drop_ring_full", (double)sta.drop_ring_full, "drop_answer_err", (double)sta.drop_answer_err,
                               "dns_lens_rcv", (double)sta.dns_lens_rcv, "dns_lens_snd", (double)sta.dns_lens_snd,
                               "tcp_pkts_rcv", (double)sta.dns_pkts_rcv_tcp, "tcp_pkts_snd", (double)sta.dns_pkts_snd_tcp,
                               "tcp_fwd_rcv", (double)sta.dns_fwd_rcv_tcp, "tcp_fwd_snd", (double)sta.dns_fwd_snd_tcp,
@@ -644,7 +662,8 @@ static void *statistics_get(__attribute__((unused)) struct connection_info_struc
                               "metrics-maxtime", (double)sta.metrics.maxTime, "metrics-mintime", (double)sta.metrics.minTime,
                               "metrics-sumtime", (double)sta.metrics.timeSum, "metrics1", (double)sta.metrics.metrics[0],
                               "metrics2", (double)sta.metrics.metrics[1], "metrics3", (double)sta.metrics.metrics[2],
-                              "metrics4", (double)sta.metrics.metrics[3]);
+                              "metrics4", (double)sta.metrics.metrics[3], "log_dropped", (double)log_dropped,
+                              "log_suppressed", (double)log_suppressed);
 
     if (!value) {
         char *err = strdup("json_pack err");
@@ -662,25 +681,180 @@ static void *statistics_reset(__attribute__((unused)) struct connection_info_str
     netif_statsdata_reset();
     tcp_statsdata_reset();
     fwd_statsdata_reset();
+    query_stats_reset();
 
     char *post_ok = strdup("OK\n");
     *len_response = strlen(post_ok);
     return (void *)post_ok;
 }
 
-static void *statistics_port_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
-    uint8_t port_id = 0;
-    unsigned lcore_id;
-    struct rte_eth_stats eth_stats;
+static json_t *query_stats_rcodes_pack(uint64_t *rcodes) {
+    int i;
+    uint64_t queries = 0;
+
+    json_t *value = json_object();
+    if (!value) {
+        return NULL;
+    }
+    for (i = 0; i < QUERY_STATS_RCODE_MAX; i++) {
+        json_object_set_new(value, query_stats_rcode_name(i), json_real((double)rcodes[i]));
+        queries += rcodes[i];
+    }
+    json_object_set_new(value, "queries", json_real((double)queries));
+    return value;
+}
+
+/* queries answered by all the lcores and threads, by zone, rcode and qtype */
+static void *statistics_query_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    unsigned i, j;
+    char type_str[16];
+    uint64_t rcodes[QUERY_STATS_RCODE_MAX] = {0};
+
+    struct query_stats *sta = rte_zmalloc(NULL, sizeof(struct query_stats), RTE_CACHE_LINE_SIZE);
+    if (!sta) {
+        char *err = strdup("unable to alloc query stats");
+        *len_response = strlen(err);
+        log_msg(LOG_ERR, "%s\n", err);
+        return (void *)err;
+    }
+    query_stats_get(sta);
+
+    json_t *value = json_object();
+    json_t *zones = json_array();
+    json_t *qtypes = json_object();
+    if (!value || !zones || !qtypes) {
+        json_decref(value);
+        json_decref(zones);
+        json_decref(qtypes);
+        rte_free(sta);
+        char *err = strdup("unable to create json");
+        *len_response = strlen(err);
+        log_msg(LOG_ERR, "%s\n", err);
+        return (void *)err;
+    }
+
+    unsigned zone_count = zone_stats_id_count();
+    for (i = 0; i < zone_count; i++) {
+        json_t *zone = query_stats_rcodes_pack(sta->zones[i].rcodes);
+        if (!zone) {
+            log_msg(LOG_ERR, "json pack err for zone %s\n", zone_stats_name_get(i));
+            continue;
+        }
+        json_object_set_new(zone, "zone", json_string(zone_stats_name_get(i)));
+        json_array_append_new(zones, zone);
+        for (j = 0; j < QUERY_STATS_RCODE_MAX; j++) {
+            rcodes[j] += sta->zones[i].rcodes[j];
+        }
+    }
+
+    for (i = 0; i < QUERY_STATS_QTYPE_MAX; i++) {
+        if (sta->qtypes[i] == 0) {
+            continue;
+        }
+        rrtype_descriptor_st *descriptor = rrtype_descriptor_by_type(i);
+        if (descriptor) {
+            json_object_set_new(qtypes, descriptor->name, json_real((double)sta->qtypes[i]));
+        } else {
+            snprintf(type_str, sizeof(type_str), "TYPE%u", i);
+            json_object_set_new(qtypes, type_str, json_real((double)sta->qtypes[i]));
+        }
+    }
+    rte_free(sta);
+
+    json_object_set_new(value, "rcodes", query_stats_rcodes_pack(rcodes));
+    json_object_set_new(value, "qtypes", qtypes);
+    json_object_set_new(value, "zones", zones);
+
+    char *str_ret = json_dumps(value, JSON_COMPACT);
+    json_decref(value);
+    *len_response = strlen(str_ret);
+    return (void *)str_ret;
+}
+
+/* stage latencies of the sampled rx bursts of all the slave lcores, in ns */
+static void *statistics_latency_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    int i;
+    double ns_per_cycle = 1E9 / rte_get_tsc_hz();
+
+    json_t *array = json_array();
+    struct latency_hist *hists = calloc(LATENCY_STAGE_MAX, sizeof(struct latency_hist));
+    if (!array || !hists) {
+        json_decref(array);
+        free(hists);
+        char *err = strdup("unable to create array");
+        *len_response = strlen(err);
+        log_msg(LOG_ERR, "%s\n", err);
+        return (void *)err;
+    }
+    latency_stats_get(hists);
+
+    for (i = 0; i < LATENCY_STAGE_MAX; i++) {
+        struct latency_hist *hist = &hists[i];
+        json_t *value = json_pack("{s:s, s:f, s:f, s:f, s:f, s:f, s:f, s:f}",
+                                  "stage", latency_stage_name(i), "samples", (double)hist->count,
+                                  "mean_ns", hist->count ? hist->sum * ns_per_cycle / hist->count : 0.0,
+                                  "p50_ns", latency_hist_quantile(hist, 0.5) * ns_per_cycle,
+                                  "p90_ns", latency_hist_quantile(hist, 0.9) * ns_per_cycle,
+                                  "p99_ns", latency_hist_quantile(hist, 0.99) * ns_per_cycle,
+                                  "p999_ns", latency_hist_quantile(hist, 0.999) * ns_per_cycle,
+                                  "max_ns", hist->max * ns_per_cycle);
+        if (!value) {
+            log_msg(LOG_ERR, "json_pack err for stage %s\n", latency_stage_name(i));
+            continue;
+        }
+        json_array_append_new(array, value);
+    }
+    free(hists);
 
-    int ret = rte_eth_stats_get(port_id, &eth_stats);
-    if (ret != 0) {
-        char *err = strdup("unable to get eth stats");
+    char *str_ret = json_dumps(array, JSON_COMPACT);
+    json_decref(array);
+    *len_response = strlen(str_ret);
+    return (void *)str_ret;
+}
+
+#define RATE_LIMIT_HITTERS_MAX  (100)
+
+static void *statistics_ratelimit_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    int i, num;
+    char client[INET_ADDRSTRLEN + 4];
+
+    json_t *array = json_array();
+    rate_limit_hitter *hitters = calloc(RATE_LIMIT_HITTERS_MAX, sizeof(rate_limit_hitter));
+    num = hitters ? rate_limit_heavy_hitters_get(hitters, RATE_LIMIT_HITTERS_MAX) : -1;
+    if (!array || num < 0) {
+        json_decref(array);
+        free(hitters);
+        char *err = strdup("unable to create array");
         *len_response = strlen(err);
-        log_msg(LOG_ERR, "%s, ret %d\n", err, ret);
+        log_msg(LOG_ERR, "%s\n", err);
         return (void *)err;
     }
 
+    for (i = 0; i < num; i++) {
+        snprintf(client, sizeof(client), "%s/%u", inet_ntoa(*(struct in_addr *)&hitters[i].client), hitters[i].prefix_len);
+        json_t *value = json_pack("{s:s, s:s, s:i}", "client", client, "type", rate_limit_type_str(hitters[i].type),
+                                  "queries", hitters[i].queries);
+        if (!value) {
+            log_msg(LOG_ERR, "json_pack err for client %s\n", client);
+            continue;
+        }
+        json_array_append_new(array, value);
+    }
+    free(hitters);
+
+    char *str_ret = json_dumps(array, JSON_COMPACT);
+    json_decref(array);
+    *len_response = strlen(str_ret);
+    return (void *)str_ret;
+}
+
+/* response rate limiting counters of every slave lcore, by response class */
+static void *statistics_rrl_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    int i;
+    unsigned lcore_id;
+    uint32_t size, limited;
+    struct rrl_stats stats;
+
     json_t *array = json_array();
     if (!array) {
         char *err = strdup("unable to create array");
@@ -689,52 +863,151 @@ static void *statistics_port_get(__attribute__((unused)) struct connection_info_
         return (void *)err;
     }
 
-    json_t *value = json_pack("{s:i, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f}",
-                              "port", port_id, "ipackets", (double)eth_stats.ipackets,
-                              "opackets", (double)eth_stats.opackets, "ibytes", (double)eth_stats.ibytes,
-                              "obytes", (double)eth_stats.obytes, "imissed", (double)eth_stats.imissed,
-                              "ierrors", (double)eth_stats.ierrors, "oerrors", (double)eth_stats.oerrors,
-                              "rx_nombuf", (double)eth_stats.rx_nombuf);
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        size = rrl_lcore_stats_get(lcore_id, &stats, &limited);
+        json_t *classes = json_array();
+        for (i = 0; classes && i < RRL_CLASS_MAX; i++) {
+            json_t *cls = json_pack("{s:s, s:f, s:f, s:f}", "class", rrl_class_name(i),
+                                    "responses", (double)stats.responses[i], "dropped", (double)stats.dropped[i],
+                                    "slipped", (double)stats.slipped[i]);
+            if (cls) {
+                json_array_append_new(classes, cls);
+            }
+        }
+        json_t *value = json_pack("{s:i, s:i, s:i, s:o}", "lcore", lcore_id, "table_size", size,
+                                  "limited", limited, "classes", classes);
+        if (!value) {
+            log_msg(LOG_ERR, "json_pack err for lcore %u\n", lcore_id);
+            continue;
+        }
+        json_array_append_new(array, value);
+    }
 
+    char *str_ret = json_dumps(array, JSON_COMPACT);
+    json_decref(array);
+    *len_response = strlen(str_ret);
+    return (void *)str_ret;
+}
+
+static void *statistics_querylog_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    struct querylog_stats stats;
+    querylog_stats_get(&stats);
+
+    json_t *value = json_pack("{s:s, s:i, s:b, s:f, s:f, s:f, s:f, s:f}",
+                              "query_log", g_dns_cfg->comm.query_log ? g_dns_cfg->comm.query_log : "",
+                              "sample", g_dns_cfg->comm.query_log_sample, "connected", stats.connected,
+                              "records", (double)stats.records, "dropped", (double)stats.dropped,
+                              "written", (double)stats.written, "bytes", (double)stats.bytes,
+                              "write_errors", (double)stats.write_errors);
     if (!value) {
-        log_msg(LOG_ERR, "json_pack err for port %u\n", port_id);
-    } else {
-        json_array_append_new(array, value);
+        char *err = strdup("json_pack err");
+        *len_response = strlen(err);
+        return (void *)err;
     }
 
+    char *str_ret = json_dumps(value, JSON_COMPACT);
+    json_decref(value);
+    *len_response = strlen(str_ret);
+    return (void *)str_ret;
+}
+
+static json_t *port_stats_pack(uint8_t port_id, struct rte_eth_stats *eth_stats) {
+    return json_pack("{s:i, s:f, s:f, s:f, s:f, s:f, s:f, s:f, s:f}",
+                     "port", port_id, "ipackets", (double)eth_stats->ipackets,
+                     "opackets", (double)eth_stats->opackets, "ibytes", (double)eth_stats->ibytes,
+                     "obytes", (double)eth_stats->obytes, "imissed", (double)eth_stats->imissed,
+                     "ierrors", (double)eth_stats->ierrors, "oerrors", (double)eth_stats->oerrors,
+                     "rx_nombuf", (double)eth_stats->rx_nombuf);
+}
+
+static void port_queue_stats_append(json_t *array, uint16_t port_idx, struct rte_eth_stats *eth_stats) {
+    unsigned lcore_id;
+
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
         json_t *value = NULL;
         struct netif_queue_conf *conf = netif_queue_conf_get(lcore_id);
-        if (conf->rx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS && conf->tx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
-            value = json_pack("{s:i, s:i, s:i, s:f, s:f, s:f, s:f, s:f}",
-                              "slave_lcore", lcore_id, "rx_queue", conf->rx_queue_id, "tx_queue", conf->tx_queue_id,
-                              "q_ipackets", (double)eth_stats.q_ipackets[conf->rx_queue_id],
-                              "q_opackets", (double)eth_stats.q_opackets[conf->tx_queue_id],
-                              "q_ibytes", (double)eth_stats.q_ibytes[conf->rx_queue_id],
-                              "q_obytes", (double)eth_stats.q_obytes[conf->tx_queue_id],
-                              "q_errors", (double)eth_stats.q_errors[conf->rx_queue_id]);
-        } else if (conf->rx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
-            value = json_pack("{s:i, s:i, s:f, s:f, s:f}",
-                              "slave_lcore", lcore_id, "rx_queue", conf->rx_queue_id,
-                              "q_ipackets", (double)eth_stats.q_ipackets[conf->rx_queue_id],
-                              "q_ibytes", (double)eth_stats.q_ibytes[conf->rx_queue_id],
-                              "q_errors", (double)eth_stats.q_errors[conf->rx_queue_id]);
-        } else if (conf->tx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
-            value = json_pack("{s:i, s:i, s:f, s:f}",
-                              "slave_lcore", lcore_id, "tx_queue", conf->tx_queue_id,
-                              "q_opackets", (double)eth_stats.q_opackets[conf->tx_queue_id],
-                              "q_obytes", (double)eth_stats.q_obytes[conf->tx_queue_id]);
+        if (port_idx >= conf->nb_ports) {
+            continue;
+        }
+        struct netif_port_queue *pq = &conf->port_queues[port_idx];
+
+        if (pq->rx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS && pq->tx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
+            value = json_pack("{s:i, s:i, s:i, s:i, s:f, s:f, s:f, s:f, s:f}",
+                              "slave_lcore", lcore_id, "port", pq->port_id, "rx_queue", pq->rx_queue_id, "tx_queue", pq->tx_queue_id,
+                              "q_ipackets", (double)eth_stats->q_ipackets[pq->rx_queue_id],
+                              "q_opackets", (double)eth_stats->q_opackets[pq->tx_queue_id],
+                              "q_ibytes", (double)eth_stats->q_ibytes[pq->rx_queue_id],
+                              "q_obytes", (double)eth_stats->q_obytes[pq->tx_queue_id],
+                              "q_errors", (double)eth_stats->q_errors[pq->rx_queue_id]);
+        } else if (pq->rx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
+            value = json_pack("{s:i, s:i, s:i, s:f, s:f, s:f}",
+                              "slave_lcore", lcore_id, "port", pq->port_id, "rx_queue", pq->rx_queue_id,
+                              "q_ipackets", (double)eth_stats->q_ipackets[pq->rx_queue_id],
+                              "q_ibytes", (double)eth_stats->q_ibytes[pq->rx_queue_id],
+                              "q_errors", (double)eth_stats->q_errors[pq->rx_queue_id]);
+        } else if (pq->tx_queue_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
+            value = json_pack("{s:i, s:i, s:i, s:f, s:f}",
+                              "slave_lcore", lcore_id, "port", pq->port_id, "tx_queue", pq->tx_queue_id,
+                              "q_opackets", (double)eth_stats->q_opackets[pq->tx_queue_id],
+                              "q_obytes", (double)eth_stats->q_obytes[pq->tx_queue_id]);
         } else {
             continue;
         }
 
         if (!value) {
-            log_msg(LOG_ERR, "json_pack err for slave core %u, rx queue %u, tx queue %u\n",
-                    lcore_id, conf->rx_queue_id, conf->tx_queue_id);
+            log_msg(LOG_ERR, "json_pack err for slave core %u, port %u, rx queue %u, tx queue %u\n",
+                    lcore_id, pq->port_id, pq->rx_queue_id, pq->tx_queue_id);
             continue;
         }
         json_array_append_new(array, value);
     }
+}
+
+static void *statistics_port_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    uint16_t i, j;
+    json_t *value;
+    struct rte_eth_stats eth_stats;
+
+    json_t *array = json_array();
+    if (!array) {
+        char *err = strdup("unable to create array");
+        *len_response = strlen(err);
+        log_msg(LOG_ERR, "%s\n", err);
+        return (void *)err;
+    }
+
+    for (i = 0; i < kdns_net_device.nb_ports; i++) {
+        struct netif_port *port = &kdns_net_device.ports[i];
+
+        /* slave ports of the bonded port */
+        for (j = 0; j < port->nb_slaves; j++) {
+            if (rte_eth_stats_get(port->slaves[j], &eth_stats) != 0) {
+                log_msg(LOG_ERR, "unable to get eth stats for port %u\n", port->slaves[j]);
+                continue;
+            }
+            value = port_stats_pack(port->slaves[j], &eth_stats);
+            if (!value) {
+                log_msg(LOG_ERR, "json_pack err for port %u\n", port->slaves[j]);
+                continue;
+            }
+            json_object_set_new(value, "bonded_port", json_integer(port->port_id));
+            json_array_append_new(array, value);
+        }
+
+        int ret = rte_eth_stats_get(port->port_id, &eth_stats);
+        if (ret != 0) {
+            log_msg(LOG_ERR, "unable to get eth stats for port %u, ret %d\n", port->port_id, ret);
+            continue;
+        }
+        value = port_stats_pack(port->port_id, &eth_stats);
+        if (!value) {
+            log_msg(LOG_ERR, "json_pack err for port %u\n", port->port_id);
+        } else {
+            json_array_append_new(array, value);
+        }
+
+        port_queue_stats_append(array, i, &eth_stats);
+    }
 
     char *str_ret = json_dumps(array, JSON_COMPACT);
     json_decref(array);
@@ -743,9 +1016,15 @@ static void *statistics_port_get(__attribute__((unused)) struct connection_info_
 }
 
 static void *statistics_port_reset(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
-    uint8_t port_id = 0;
+    uint16_t i, j;
 
-    rte_eth_stats_reset(port_id);
+    for (i = 0; i < kdns_net_device.nb_ports; i++) {
+        struct netif_port *port = &kdns_net_device.ports[i];
+        for (j = 0; j < port->nb_slaves; j++) {
+            rte_eth_stats_reset(port->slaves[j]);
+        }
+        rte_eth_stats_reset(port->port_id);
+    }
 
     char *post_ok = strdup("OK\n");
     *len_response = strlen(post_ok);
@@ -754,12 +1033,94 @@ static void *statistics_port_reset(__attribute__((unused)) struct connection_inf
 
 static void *local_metrics_reset(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
     netif_statsdata_metrics_reset();
+    latency_stats_reset();
 
     char *post_ok = strdup("OK\n");
     *len_response = strlen(post_ok);
     return (void *)post_ok;
 }
 
+/* counters since the start in the prometheus text format, for the scrapers */
+static void *metrics_prometheus_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    char *text = prometheus_metrics_get(domain_num_get(), len_response);
+
+    if (!text) {
+        char *err = strdup("unable to render metrics");
+        *len_response = strlen(err);
+        log_msg(LOG_ERR, "%s\n", err);
+        return (void *)err;
+    }
+    return (void *)text;
+}
+
+/* wire format qname to dotted text, the copies of the lcores may be torn so the labels are bounded */
+static void topk_qname_str(const uint8_t *qname, uint8_t qname_len, char *str) {
+    uint8_t i = 0, len;
+    char *p = str;
+
+    while (i < qname_len && (len = qname[i]) != 0 && i + 1 + len <= qname_len) {
+        memcpy(p, qname + i + 1, len);
+        p += len;
+        *p++ = '.';
+        i += 1 + len;
+    }
+    if (p == str) {
+        *p++ = '.';
+    }
+    *p = '\0';
+}
+
+/* heavy hitters of the last topk window merged over the slave lcores */
+static void *metrics_topk_get(__attribute__((unused)) struct connection_info_struct *con_info, __attribute__((unused)) char *url, int *len_response) {
+    int i, type, num, partial = 0;
+    uint64_t window_start = 0;
+    char client[INET_ADDRSTRLEN];
+    char qname[MAXDOMAINLEN + 1];
+    uint32_t k = g_dns_cfg->comm.topk_k;
+
+    json_t *obj = json_pack("{s:i, s:i}", "k", k, "window", g_dns_cfg->comm.topk_window);
+    topk_hitter *hitters = calloc(RTE_MAX(k, 1u), sizeof(topk_hitter));
+    if (!obj || !hitters) {
+        json_decref(obj);
+        free(hitters);
+        char *err = strdup("unable to create object");
+        *len_response = strlen(err);
+        log_msg(LOG_ERR, "%s\n", err);
+        return (void *)err;
+    }
+
+    for (type = 0; type < TOPK_TYPE_MAX; type++) {
+        json_t *array = json_array();
+        num = topk_get(type, hitters, k, &window_start, &partial);
+        for (i = 0; array && i < num; i++) {
+            json_t *value;
+            inet_ntop(AF_INET, &hitters[i].client, client, sizeof(client));
+            topk_qname_str(hitters[i].qname, hitters[i].qname_len, qname);
+            if (type == TOPK_QNAME) {
+                value = json_pack("{s:s, s:i}", "qname", qname, "count", hitters[i].count);
+            } else if (type == TOPK_CLIENT) {
+                value = json_pack("{s:s, s:i}", "client", client, "count", hitters[i].count);
+            } else {
+                value = json_pack("{s:s, s:s, s:i}", "client", client, "qname", qname, "count", hitters[i].count);
+            }
+            if (!value) {
+                log_msg(LOG_ERR, "json_pack err for topk %s\n", topk_type_name(type));
+                continue;
+            }
+            json_array_append_new(array, value);
+        }
+        json_object_set_new(obj, topk_type_name(type), array);
+    }
+    free(hitters);
+    json_object_set_new(obj, "window_start", json_integer(window_start));
+    json_object_set_new(obj, "partial", json_boolean(partial));
+
+    char *str_ret = json_dumps(obj, JSON_COMPACT);
+    json_decref(obj);
+    *len_response = strlen(str_ret);
+    return (void *)str_ret;
+}
+
 void domian_info_exchange_run(int port) {
     dins = webserver_new(port);
     web_endpoint_add("POST", "/kdns/domain", dins, &domain_post);
@@ -776,6 +1137,11 @@ void domian_info_exchange_run(int port) {
     web_endpoint_add("POST", "/kdns/statistics/reset", dins, &statistics_reset);
 
     web_endpoint_add("GET", "/kdns/statistics/percore/get", dins, &statistics_percore_get);
+    web_endpoint_add("GET", "/kdns/statistics/query/get", dins, &statistics_query_get);
+    web_endpoint_add("GET", "/kdns/statistics/latency/get", dins, &statistics_latency_get);
+    web_endpoint_add("GET", "/kdns/statistics/ratelimit/get", dins, &statistics_ratelimit_get);
+    web_endpoint_add("GET", "/kdns/statistics/rrl/get", dins, &statistics_rrl_get);
+    web_endpoint_add("GET", "/kdns/statistics/querylog/get", dins, &statistics_querylog_get);
     web_endpoint_add("GET", "/kdns/statistics/port/get", dins, &statistics_port_get);
     web_endpoint_add("POST", "/kdns/statistics/port/reset", dins, &statistics_port_reset);
 
@@ -788,6 +1154,8 @@ void domian_info_exchange_run(int port) {
     web_endpoint_add("DELETE", "/kdns/allview", dins, &views_delete_all);
 
     web_endpoint_add("POST", "/kdns/metrics/resetlocal", dins, &local_metrics_reset);
+    web_endpoint_add("GET", "/kdns/metrics/topk", dins, &metrics_topk_get);
+    web_endpoint_add_typed("GET", "/metrics", dins, PROMETHEUS_CONTENT_TYPE, &metrics_prometheus_get);
 
 #ifdef ENABLE_KDNS_FWD_METRICS
     web_endpoint_add("GET", "/kdns/metrics/domains", dins, &metrics_domains_get);
@@ -84,6 +84,7 @@ typedef struct {
     int current_server;
     int servers_len;
     dns_addr_t server_addrs[FWD_MAX_ADDRS];
+    struct rte_ring *rsp_ring;  //response goes back to, g_fwd_response_ring if NULL
 } fwd_qnode;    //query/response node
 
 typedef struct {
@@ -135,24 +136,43 @@ static void fwd_cache_del(fwd_qnode *qnode) __attribute__((unused));
 
 static int fwd_cache_lookup(fwd_qnode *qnode, char *cache_data, int *cache_data_len);
 
-void fwd_statsdata_get(struct netif_queue_stats *sta) {
+/*
+ * Counters at the last reset, the atomics keep counting up. The lock
+ * orders the resets and the reads of the web threads.
+ */
+static int64_t dns_fwd_rcv_base;
+static int64_t dns_fwd_snd_base;
+static int64_t dns_fwd_lost_base;
+static pthread_mutex_t dns_fwd_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void fwd_statsdata_total_get(struct netif_queue_stats *sta) {
     sta->dns_fwd_rcv_udp = rte_atomic64_read(&dns_fwd_rcv);
     sta->dns_fwd_snd_udp = rte_atomic64_read(&dns_fwd_snd);
     sta->dns_fwd_lost_udp = rte_atomic64_read(&dns_fwd_lost);
 }
 
+void fwd_statsdata_get(struct netif_queue_stats *sta) {
+    pthread_mutex_lock(&dns_fwd_stats_lock);
+    sta->dns_fwd_rcv_udp = rte_atomic64_read(&dns_fwd_rcv) - dns_fwd_rcv_base;
+    sta->dns_fwd_snd_udp = rte_atomic64_read(&dns_fwd_snd) - dns_fwd_snd_base;
+    sta->dns_fwd_lost_udp = rte_atomic64_read(&dns_fwd_lost) - dns_fwd_lost_base;
+    pthread_mutex_unlock(&dns_fwd_stats_lock);
+}
+
 void fwd_statsdata_reset(void) {
-    rte_atomic64_clear(&dns_fwd_rcv);
-    rte_atomic64_clear(&dns_fwd_snd);
-    rte_atomic64_clear(&dns_fwd_lost);
+    pthread_mutex_lock(&dns_fwd_stats_lock);
+    dns_fwd_rcv_base = rte_atomic64_read(&dns_fwd_rcv);
+    dns_fwd_snd_base = rte_atomic64_read(&dns_fwd_snd);
+    dns_fwd_lost_base = rte_atomic64_read(&dns_fwd_lost);
+    pthread_mutex_unlock(&dns_fwd_stats_lock);
 }
 
-int fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint16_t qtype, char *domain_name) {
+static int __fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint16_t qtype, char *domain_name,
+                               domain_fwd_addrs_ctrl *ctrl, struct rte_ring *rsp_ring) {
     fwd_qnode *query;
-    unsigned cid = rte_lcore_id();
 
     rte_atomic64_inc(&dns_fwd_rcv);
-    if (fwd_addrs_ctrl[cid].mode == FWD_MODE_DISABLE) {
+    if (ctrl->mode == FWD_MODE_DISABLE) {
         rte_atomic64_inc(&dns_fwd_lost);
         rte_pktmbuf_free(pkt);
         return 0;
@@ -164,9 +184,9 @@ int fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint
     query->id = id;
     query->qtype = qtype;
     strcpy(query->domain_name, domain_name);
-    if (fwd_addrs_ctrl[cid].mode == FWD_MODE_DIRECT) {
+    if (ctrl->mode == FWD_MODE_DIRECT) {
         query->ctrl_flag |= FWD_CTRL_FLAG_DIRECT;
-    } else if (fwd_addrs_ctrl[cid].mode == FWD_MODE_CACHE) {
+    } else if (ctrl->mode == FWD_MODE_CACHE) {
         query->ctrl_flag |= FWD_CTRL_FLAG_CACHE;
     }
 
@@ -174,11 +194,12 @@ int fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint
     query->query_time = time_now_usec();
 #endif
 
-    query->timeout = fwd_addrs_ctrl[cid].timeout;
-    domain_fwd_addrs *fwd_addrs = fwd_addrs_find(query->domain_name, &fwd_addrs_ctrl[cid]);
+    query->timeout = ctrl->timeout;
+    domain_fwd_addrs *fwd_addrs = fwd_addrs_find(query->domain_name, ctrl);
     query->current_server = 0;
     query->servers_len = fwd_addrs->servers_len;
     memcpy(&query->server_addrs, &fwd_addrs->server_addrs, sizeof(fwd_addrs->server_addrs));
+    query->rsp_ring = rsp_ring;
 
     int ret = rte_ring_mp_enqueue(g_fwd_query_ring, (void *)query);
     if (unlikely(-EDQUOT == ret)) {
@@ -201,13 +222,25 @@ int fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint
     return ret;
 }
 
-unsigned fwd_response_dequeue(struct rte_mbuf **pkts, unsigned pkts_cnt) {
+int fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint16_t qtype, char *domain_name) {
+    return __fwd_query_enqueue(pkt, src_addr, id, qtype, domain_name, &fwd_addrs_ctrl[rte_lcore_id()], NULL);
+}
+
+int fwd_query_enqueue_ring(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint16_t qtype, char *domain_name,
+                           struct rte_ring *rsp_ring) {
+    pthread_rwlock_rdlock(&__fwd_lock);
+    int ret = __fwd_query_enqueue(pkt, src_addr, id, qtype, domain_name, &g_fwd_addrs_ctrl, rsp_ring);
+    pthread_rwlock_unlock(&__fwd_lock);
+    return ret;
+}
+
+unsigned fwd_response_dequeue_ring(struct rte_ring *rsp_ring, struct rte_mbuf **pkts, unsigned pkts_cnt) {
     unsigned i;
     fwd_qnode *response[NETIF_MAX_PKT_BURST];
 
-    pkts_cnt = RTE_MIN(rte_ring_count(g_fwd_response_ring), pkts_cnt);
-    while (pkts_cnt > 0 && unlikely(rte_ring_dequeue_bulk(g_fwd_response_ring, (void **)response, pkts_cnt) != 0)) {
-        pkts_cnt = (uint16_t)RTE_MIN(rte_ring_count(g_fwd_response_ring), pkts_cnt);
+    pkts_cnt = RTE_MIN(rte_ring_count(rsp_ring), RTE_MIN(pkts_cnt, (unsigned)NETIF_MAX_PKT_BURST));
+    while (pkts_cnt > 0 && unlikely(rte_ring_dequeue_bulk(rsp_ring, (void **)response, pkts_cnt) != 0)) {
+        pkts_cnt = (uint16_t)RTE_MIN(rte_ring_count(rsp_ring), pkts_cnt);
     }
     if (pkts_cnt > 0) {
         for (i = 0; i < pkts_cnt; ++i) {
@@ -224,6 +257,10 @@ unsigned fwd_response_dequeue(struct rte_mbuf **pkts, unsigned pkts_cnt) {
     return pkts_cnt;
 }
 
+unsigned fwd_response_dequeue(struct rte_mbuf **pkts, unsigned pkts_cnt) {
+    return fwd_response_dequeue_ring(g_fwd_response_ring, pkts, pkts_cnt);
+}
+
 static int fwd_query_response(fwd_manage *manage, fwd_qnode *query) {
     struct ether_hdr *eth_hdr;
     struct ipv4_hdr *ipv4_hdr;
@@ -256,7 +293,7 @@ static int fwd_query_response(fwd_manage *manage, fwd_qnode *query) {
     uint16_t orig_id = htons(query->id);
     memcpy(query_data, &orig_id, 2);
 
-    int ret = rte_ring_mp_enqueue(g_fwd_response_ring, (void *)query);
+    int ret = rte_ring_mp_enqueue(query->rsp_ring ? query->rsp_ring : g_fwd_response_ring, (void *)query);
     if (unlikely(-EDQUOT == ret)) {
         log_msg(LOG_ERR, "fwd response ring quota exceeded\n");
         ret = 0;
@@ -527,6 +564,7 @@ static int fwd_query_detect(fwd_manage *manage, fwd_qnode *query) {
     new_query->current_server = 0;
     new_query->servers_len = query->servers_len;
     memcpy(&new_query->server_addrs, &query->server_addrs, sizeof(query->server_addrs));
+    new_query->rsp_ring = query->rsp_ring;
 
     return fwd_query_forward(manage, new_query);
 }
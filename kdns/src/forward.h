@@ -50,14 +50,28 @@ int fwd_mode_reload(char *mode);
 
 int fwd_addrs_reload_proc(unsigned cid);
 
+/* Counts since the last reset */
 void fwd_statsdata_get(struct netif_queue_stats *sta);
 
+/* Counts since the start */
+void fwd_statsdata_total_get(struct netif_queue_stats *sta);
+
 void fwd_statsdata_reset(void);
 
 unsigned fwd_response_dequeue(struct rte_mbuf **pkts, unsigned pkts_cnt);
 
 int fwd_query_enqueue(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint16_t qtype, char *domain_name);
 
+/*
+ * For the threads out of the lcores: the query is forwarded with the
+ * global forward addresses, and its response is put to rsp_ring, which
+ * the caller drains with fwd_response_dequeue_ring.
+ */
+int fwd_query_enqueue_ring(struct rte_mbuf *pkt, uint32_t src_addr, uint16_t id, uint16_t qtype, char *domain_name,
+                           struct rte_ring *rsp_ring);
+
+unsigned fwd_response_dequeue_ring(struct rte_ring *rsp_ring, struct rte_mbuf **pkts, unsigned pkts_cnt);
+
 int fwd_server_init(void);
 
 void *fwd_caches_get(__attribute__((unused))struct connection_info_struct *con_info, __attribute__((unused))char *url, int *len_response);
@@ -1,5 +1,7 @@
 #include <rte_ethdev.h>
 #include <rte_mbuf.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
@@ -8,14 +10,28 @@
 #include "kdns.h"
 #include "util.h"
 #include "query.h"
+#include "radtree.h"
+#include "view.h"
 #include "dns-conf.h"
 #include "db_update.h"
 #include "view_update.h"
+#include "query_stats.h"
+#include "latency_stats.h"
+#include "topk.h"
 
 
 #define MAX_CORES 64
 
-static struct query *queries[MAX_CORES];
+/* the queries of one rx burst, run stage by stage */
+typedef struct dns_burst {
+    struct query *queries[DNS_QUERY_BURST_MAX];
+    query_state_type states[DNS_QUERY_BURST_MAX];
+    uint8_t hash_hits[DNS_QUERY_BURST_MAX];
+    view_walk_t view_walks[DNS_QUERY_BURST_MAX];
+    struct radwalk name_walks[DNS_QUERY_BURST_MAX];
+} dns_burst_t;
+
+static dns_burst_t *bursts[MAX_CORES];
 struct kdns dpdk_dns[MAX_CORES];
 
 int dnsdata_prepare(struct kdns * kdns) {
@@ -24,6 +40,9 @@ int dnsdata_prepare(struct kdns * kdns) {
         exit(-1);
     } 
 
+    if (g_dns_cfg->comm.name_hash) {
+        domain_table_hash_enable(kdns->db->domains);
+    }
     domain_store_zones_check_create( kdns,g_dns_cfg->comm.zones);
 
     kdns_zones_soa_create( kdns->db,g_dns_cfg->comm.zones);
@@ -105,24 +124,117 @@ int kdns_prepare_init(struct kdns *kdns, struct query **query) {
 }
 
 int kdns_init(unsigned lcore_id) {
-    return kdns_prepare_init(&dpdk_dns[lcore_id], &queries[lcore_id]);
+    int i;
+    dns_burst_t *burst = xalloc_zero(sizeof(dns_burst_t));
+    /* answers are built in the rx mbuf and sent unfragmented */
+    uint32_t edns_max_len = RTE_MIN((uint32_t)g_dns_cfg->comm.edns_udp_size,
+                                    ETHER_MTU - sizeof(struct ipv4_hdr) - sizeof(struct udp_hdr));
+
+    kdns_prepare_init(&dpdk_dns[lcore_id], &burst->queries[0]);
+    for (i = 1; i < DNS_QUERY_BURST_MAX; i++) {
+        burst->queries[i] = query_create();
+        if (burst->queries[i] == NULL) {
+            log_msg(LOG_ERR, "unable to create the burst queries on lcore %u\n", lcore_id);
+            exit(-1);
+        }
+    }
+    for (i = 0; i < DNS_QUERY_BURST_MAX; i++) {
+        burst->queries[i]->ednsMaxLen = edns_max_len;
+    }
+    bursts[lcore_id] = burst;
+    query_stats_init(lcore_id, rte_lcore_to_socket_id(lcore_id));
+    return 0;
 }
 
-kdns_query_st *dns_packet_proess(uint32_t sip, uint8_t *query_data, int query_len, unsigned lcore_id) {
-    kdns_query_st *query = queries[lcore_id];
+kdns_query_st *dns_packet_prepare(uint32_t sip, uint8_t *query_data, int query_len, uint16_t idx, unsigned lcore_id) {
+    kdns_query_st *query = bursts[lcore_id]->queries[idx];
 
     query_reset(query);
 
     query->packet->data = query_data;
     query->packet->position += query_len;
     query->sip = sip;
-    view_query_slave_process(query, lcore_id);
 
     buffer_flip(query->packet);
+    return query;
+}
 
-    if(query_process(query, &dpdk_dns[lcore_id]) != QUERY_FAIL) {
-        buffer_flip(query->packet);
+/*
+ * Answer the first nb_queries prepared queries. Every stage runs over the
+ * whole burst, and the view and name tree walks of all queries are stepped
+ * in turn, so their dependent cache misses overlap instead of adding up.
+ */
+void dns_packet_burst_process(uint16_t nb_queries, unsigned lcore_id) {
+    uint16_t i;
+    int walking;
+    dns_burst_t *burst = bursts[lcore_id];
+    struct kdns *kdns = &dpdk_dns[lcore_id];
+    struct query_stats *stats = g_query_stats[lcore_id];
+    struct latency_stats *latency = g_latency_stats[lcore_id];
+    struct topk_ctrl *topk = g_topk_ctrls[lcore_id];
+
+    for (i = 0; i < nb_queries; i++) {
+        burst->states[i] = query_parse(burst->queries[i]);
+        if (burst->states[i] == QUERY_LOOKUP) {
+            domain_table_hash_prefetch(kdns->db->domains, burst->queries[i]->qhash);
+        }
     }
+    latency_stage_mark(latency, LATENCY_STAGE_PARSE);
 
-    return query;
+    /* exact hits are done now, only the misses walk the name tree */
+    for (i = 0; i < nb_queries; i++) {
+        struct query *query = burst->queries[i];
+        if (burst->states[i] != QUERY_LOOKUP) {
+            continue;
+        }
+        view_walk_init(kdns->db->viewtree, &burst->view_walks[i], (uint8_t *)&query->sip);
+        burst->hash_hits[i] = query_lookup_hash(kdns, query);
+        if (burst->hash_hits[i]) {
+            burst->name_walks[i].n = NULL;
+            burst->name_walks[i].sel = NULL;
+        } else {
+            radix_walk_init(kdns->db->domains->nametree, &burst->name_walks[i], query->qkey, query->qkey_len);
+        }
+    }
+
+    do {
+        walking = 0;
+        for (i = 0; i < nb_queries; i++) {
+            if (burst->states[i] == QUERY_LOOKUP) {
+                walking |= view_walk_step(&burst->view_walks[i]);
+                walking |= radix_walk_step(&burst->name_walks[i]);
+            }
+        }
+    } while (walking);
+    latency_stage_mark(latency, LATENCY_STAGE_LOOKUP);
+
+    for (i = 0; i < nb_queries; i++) {
+        if (burst->states[i] == QUERY_LOOKUP) {
+            view_query_slave_process(burst->queries[i], lcore_id);
+        }
+    }
+    latency_stage_mark(latency, LATENCY_STAGE_VIEW);
+
+    for (i = 0; i < nb_queries; i++) {
+        if (burst->states[i] == QUERY_LOOKUP && !burst->hash_hits[i]) {
+            query_lookup_tree(kdns, burst->queries[i]);
+        }
+    }
+    latency_stage_mark(latency, LATENCY_STAGE_LOOKUP);
+
+    for (i = 0; i < nb_queries; i++) {
+        struct query *query = burst->queries[i];
+        if (burst->states[i] == QUERY_LOOKUP) {
+            query_answer(kdns, query);
+            burst->states[i] = QUERY_SUCCESS;
+        }
+        if (burst->states[i] != QUERY_FAIL) {
+            query_stats_update(stats, query);
+            if (topk) {
+                topk_update(topk, query);
+            }
+            buffer_flip(query->packet);
+        }
+    }
+    latency_stage_mark(latency, LATENCY_STAGE_ENCODE);
 }
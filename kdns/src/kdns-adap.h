@@ -5,11 +5,14 @@
 #include "kdns.h"
 #include "util.h"
 
+#define DNS_QUERY_BURST_MAX (32)
+
 int dnsdata_prepare(struct kdns * kdns);
 int kdns_init(unsigned lcore_id);
 int kdns_prepare_init(struct kdns *kdns, struct query **query);
 
-kdns_query_st *dns_packet_proess(uint32_t sip, uint8_t *query_data, int query_len, unsigned lcore_id);
+kdns_query_st *dns_packet_prepare(uint32_t sip, uint8_t *query_data, int query_len, uint16_t idx, unsigned lcore_id);
+void dns_packet_burst_process(uint16_t nb_queries, unsigned lcore_id);
 int check_pid(const char *pid_file);
 void write_pid(const char *pid_file);
 void kdns_zones_soa_create(struct  domain_store *db,char * zonesName);
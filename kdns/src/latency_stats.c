@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <rte_malloc.h>
+
+#include "util.h"
+#include "latency_stats.h"
+
+struct latency_stats *g_latency_stats[RTE_MAX_LCORE];
+
+/*
+ * Merged histograms at the last reset, the lcores keep counting up. The
+ * lock orders the resets and the reads of the web threads.
+ */
+static struct latency_hist latency_stats_base[LATENCY_STAGE_MAX];
+static pthread_mutex_t latency_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *latency_stage_names[LATENCY_STAGE_MAX] = {
+    [LATENCY_STAGE_PARSE] = "parse",
+    [LATENCY_STAGE_VIEW] = "view",
+    [LATENCY_STAGE_LOOKUP] = "lookup",
+    [LATENCY_STAGE_ENCODE] = "encode",
+    [LATENCY_STAGE_TX] = "tx",
+    [LATENCY_STAGE_TOTAL] = "total",
+};
+
+int latency_stats_init(unsigned lcore_id, uint32_t sample_rate) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "latency_stats_%u", lcore_id);
+    g_latency_stats[lcore_id] = rte_zmalloc_socket(name, sizeof(struct latency_stats), RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+    if (g_latency_stats[lcore_id] == NULL) {
+        log_msg(LOG_ERR, "unable to alloc the latency stats of lcore %u\n", lcore_id);
+        exit(-1);
+    }
+    g_latency_stats[lcore_id]->sample_rate = sample_rate;
+    g_latency_stats[lcore_id]->sample_countdown = sample_rate;
+    return 0;
+}
+
+void latency_burst_end(struct latency_stats *stats) {
+    int i;
+    uint64_t total;
+
+    if (!stats->sampling) {
+        return;
+    }
+    stats->sampling = 0;
+    total = rte_rdtsc() - stats->start_tsc;
+    if (unlikely(stats->max_reset)) {
+        stats->max_reset = 0;
+        for (i = 0; i < LATENCY_STAGE_MAX; i++) {
+            stats->hists[i].max = 0;
+        }
+    }
+    for (i = 0; i < LATENCY_STAGE_TOTAL; i++) {
+        latency_hist_add(&stats->hists[i], stats->stage_cycles[i]);
+        stats->stage_cycles[i] = 0;
+    }
+    latency_hist_add(&stats->hists[LATENCY_STAGE_TOTAL], total);
+}
+
+void latency_stats_total_get(struct latency_hist *hists) {
+    unsigned lcore_id, i, j;
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        struct latency_stats *stats = g_latency_stats[lcore_id];
+        if (stats == NULL) {
+            continue;
+        }
+        for (i = 0; i < LATENCY_STAGE_MAX; i++) {
+            hists[i].count += stats->hists[i].count;
+            hists[i].sum += stats->hists[i].sum;
+            if (stats->hists[i].max > hists[i].max) {
+                hists[i].max = stats->hists[i].max;
+            }
+            for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+                hists[i].buckets[j] += stats->hists[i].buckets[j];
+            }
+        }
+    }
+}
+
+void latency_stats_get(struct latency_hist *hists) {
+    unsigned i, j;
+
+    pthread_mutex_lock(&latency_stats_lock);
+    latency_stats_total_get(hists);
+    for (i = 0; i < LATENCY_STAGE_MAX; i++) {
+        hists[i].count -= latency_stats_base[i].count;
+        hists[i].sum -= latency_stats_base[i].sum;
+        for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+            hists[i].buckets[j] -= latency_stats_base[i].buckets[j];
+        }
+    }
+    pthread_mutex_unlock(&latency_stats_lock);
+}
+
+void latency_stats_reset(void) {
+    unsigned lcore_id;
+
+    pthread_mutex_lock(&latency_stats_lock);
+    memset(latency_stats_base, 0, sizeof(latency_stats_base));
+    latency_stats_total_get(latency_stats_base);
+
+    /* the max is not a sum, the lcores clear it on their next sample */
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        if (g_latency_stats[lcore_id]) {
+            g_latency_stats[lcore_id]->max_reset = 1;
+        }
+    }
+    pthread_mutex_unlock(&latency_stats_lock);
+}
+
+const char *latency_stage_name(latency_stage stage) {
+    return latency_stage_names[stage];
+}
+
+uint64_t latency_hist_bucket_cycles(unsigned index) {
+    unsigned shift;
+
+    if (index < LATENCY_HIST_SUB) {
+        return index;
+    }
+    shift = index / LATENCY_HIST_SUB - 1;
+    return (uint64_t)(index % LATENCY_HIST_SUB + LATENCY_HIST_SUB) << shift;
+}
+
+uint64_t latency_hist_quantile(struct latency_hist *hist, double quantile) {
+    unsigned i;
+    uint64_t seen = 0;
+    uint64_t rank = (uint64_t)(quantile * hist->count + 0.5);
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            /* the upper bound of the bucket, but never above the max seen */
+            uint64_t upper = (i + 1 < LATENCY_HIST_BUCKETS) ? latency_hist_bucket_cycles(i + 1) - 1 : hist->max;
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,116 @@
+#ifndef _LATENCY_STATS_H_
+#define _LATENCY_STATS_H_
+
+#include <stdint.h>
+#include <rte_lcore.h>
+#include <rte_cycles.h>
+#include <rte_memory.h>
+
+/*
+ * Log-linear histograms of TSC cycles: values below LATENCY_HIST_SUB are
+ * counted exactly, above it every power of two is split into
+ * LATENCY_HIST_SUB buckets, so a bucket is within 1/16 of its values.
+ */
+#define LATENCY_HIST_SUB_BITS   (4)
+#define LATENCY_HIST_SUB        (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_BITS   (40)    /* longer latencies go to the last bucket */
+#define LATENCY_HIST_BUCKETS    ((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB)
+
+/* stages of a rx burst, the interleaved view and name tree walks are counted in lookup */
+typedef enum {
+    LATENCY_STAGE_PARSE,
+    LATENCY_STAGE_VIEW,
+    LATENCY_STAGE_LOOKUP,
+    LATENCY_STAGE_ENCODE,
+    LATENCY_STAGE_TX,
+    LATENCY_STAGE_TOTAL,
+    LATENCY_STAGE_MAX,
+} latency_stage;
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+/* stage latencies of the sampled rx bursts of one lcore, written by the lcore only */
+struct latency_stats {
+    uint32_t sample_rate;                   /* sample 1 of every sample_rate bursts, 0 for none */
+    uint32_t sample_countdown;
+    uint8_t sampling;                       /* the current burst is sampled */
+    volatile uint8_t max_reset;             /* set by a reset, the max is cleared by the lcore */
+    uint64_t start_tsc;
+    uint64_t mark_tsc;
+    uint64_t stage_cycles[LATENCY_STAGE_MAX];
+
+    struct latency_hist hists[LATENCY_STAGE_MAX] __rte_cache_aligned;
+} __rte_cache_aligned;
+
+extern struct latency_stats *g_latency_stats[RTE_MAX_LCORE];
+
+int latency_stats_init(unsigned lcore_id, uint32_t sample_rate);
+
+static inline unsigned latency_hist_index(uint64_t cycles) {
+    unsigned msb;
+
+    if (cycles < LATENCY_HIST_SUB) {
+        return cycles;
+    }
+    msb = 63 - __builtin_clzll(cycles);
+    if (unlikely(msb >= LATENCY_HIST_MAX_BITS)) {
+        return LATENCY_HIST_BUCKETS - 1;
+    }
+    return (msb - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB + ((cycles >> (msb - LATENCY_HIST_SUB_BITS)) - LATENCY_HIST_SUB);
+}
+
+static inline void latency_hist_add(struct latency_hist *hist, uint64_t cycles) {
+    hist->count++;
+    hist->sum += cycles;
+    if (cycles > hist->max) {
+        hist->max = cycles;
+    }
+    hist->buckets[latency_hist_index(cycles)]++;
+}
+
+/* Decide if the burst is sampled and start its clock */
+static inline void latency_burst_begin(struct latency_stats *stats) {
+    if (stats->sample_rate == 0 || --stats->sample_countdown != 0) {
+        return;
+    }
+    stats->sample_countdown = stats->sample_rate;
+    stats->sampling = 1;
+    stats->start_tsc = rte_rdtsc();
+    stats->mark_tsc = stats->start_tsc;
+}
+
+/* Add the cycles since the last mark to the stage, a stage may be entered more than once a burst */
+static inline void latency_stage_mark(struct latency_stats *stats, latency_stage stage) {
+    if (stats->sampling) {
+        uint64_t now_tsc = rte_rdtsc();
+        stats->stage_cycles[stage] += now_tsc - stats->mark_tsc;
+        stats->mark_tsc = now_tsc;
+    }
+}
+
+/* Record the stages of the sampled burst */
+void latency_burst_end(struct latency_stats *stats);
+
+/* Merge the histograms of all the lcores into hists, since the last reset */
+void latency_stats_get(struct latency_hist *hists);
+
+/* The same since the start, the max is since the last reset */
+void latency_stats_total_get(struct latency_hist *hists);
+
+/* Snapshot the merged histograms, the live ones are never cleared */
+void latency_stats_reset(void);
+
+const char *latency_stage_name(latency_stage stage);
+
+/* Lower bound of the cycles counted in a bucket */
+uint64_t latency_hist_bucket_cycles(unsigned index);
+
+/* Cycles under which the given share of the histogram values are, for 0 < quantile <= 1 */
+uint64_t latency_hist_quantile(struct latency_hist *hist, double quantile);
+
+#endif  /* _LATENCY_STATS_H_ */
@@ -9,12 +9,19 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <rte_common.h>
+#include <rte_ring.h>
+#include <rte_mbuf.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
 
 #include "netdev.h"
 #include "util.h"
@@ -25,113 +32,240 @@
 #include "db_update.h"
 #include "query.h"
 #include "kdns-adap.h"
+#include "query_stats.h"
 #include "local_udp_process.h"
 
+#define LOCAL_UDP_BURST             (32)
+#define LOCAL_UDP_FWD_RING_SIZE     (4096)
+/* forwards past what the response ring takes would be dropped on their way back, plus the burst being sent */
+#define LOCAL_UDP_FWD_MBUF_NUM      (LOCAL_UDP_FWD_RING_SIZE - 1 + LOCAL_UDP_BURST)
+#define LOCAL_UDP_POLL_MS           (1)         /* while forwarded responses may come back */
+#define LOCAL_UDP_IDLE_POLL_MS      (100)
+
+#define LOCAL_UDP_HDR_LEN           (sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr))
+
+/*
+ * Minimum query size is:
+ *
+ *     Size of the header (12)
+ *   + Root domain name   (1)
+ *   + Query class        (2)
+ *   + Query type         (2)
+ */
+#define LOCAL_UDP_QUERY_LEN_MIN     (DNS_HEAD_SIZE + 1 + sizeof(uint16_t) + sizeof(uint16_t))
+
 extern domain_fwd_addrs_ctrl g_fwd_addrs_ctrl;
 
-rte_rwlock_t local_udp_lock;
-struct kdns local_udp_kdns;
-static struct query *local_udp_query;
+/*
+ * One local udp server thread. Every worker receives on its own
+ * SO_REUSEPORT socket and owns its store, the refused queries are handed
+ * to the forwarder threads and their responses come back on fwd_rsp_ring.
+ */
+typedef struct local_udp_worker {
+    unsigned id;
+    int sfd;
+    pthread_t thread;
+    uint32_t vip;
+
+    rte_rwlock_t lock;          /* held for write by the updates from the master */
+    struct kdns kdns;
+    struct query *query;
+
+    struct rte_mempool *pktmbuf_pool;
+    struct rte_ring *fwd_rsp_ring;
+    uint64_t fwd_wait_ms;       /* forwarded responses may come back until */
+
+    struct mmsghdr rmsgs[LOCAL_UDP_BURST];
+    struct iovec riovs[LOCAL_UDP_BURST];
+    struct sockaddr_in raddrs[LOCAL_UDP_BURST];
+    struct mmsghdr smsgs[LOCAL_UDP_BURST];
+    struct iovec siovs[LOCAL_UDP_BURST];
+    struct sockaddr_in saddrs[LOCAL_UDP_BURST];
+    char bufs[LOCAL_UDP_BURST][EDNS_MAX_MESSAGE_LEN];
+} local_udp_worker;
+
+static local_udp_worker *local_udp_workers[LOCAL_UDP_WORKER_MAX];
+static unsigned local_udp_worker_num;
+
+static uint64_t local_udp_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-static int local_udp_process_query(char *snd_buf, ssize_t snd_len, char *rvc_buf, ssize_t rcv_len, dns_addr_t *id_addr, int timeout) {
-    int sock_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock_fd == -1) {
-        log_msg(LOG_ERR, "local_udp_process_query sock errno=%d, errinfo=%s\n", errno, strerror(errno));
-        return -1;
-    }
+/* Send the first cnt prepared messages, a message failing is dropped and the rest are still sent */
+static void local_udp_send(local_udp_worker *worker, struct mmsghdr *msgs, unsigned cnt) {
+    unsigned sent = 0;
 
-    struct timeval tv = {timeout, 0};
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        log_msg(LOG_ERR, "local_udp_process_query socket option SO_RCVTIMEO errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
-    }
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-        log_msg(LOG_ERR, "local_udp_process_query socket option SO_SNDTIMEO errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
+    while (sent < cnt) {
+        int n = sendmmsg(worker->sfd, msgs + sent, cnt - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            struct sockaddr_in *caddr = (struct sockaddr_in *)msgs[sent].msg_hdr.msg_name;
+            log_msg(LOG_ERR, "response to %s, send error, errno=%d, errinfo=%s\n",
+                    inet_ntoa(caddr->sin_addr), errno, strerror(errno));
+            sent++;
+            continue;
+        }
+        sent += n;
     }
+}
 
-    int ret = sendto(sock_fd, snd_buf, snd_len, 0, &id_addr->addr, id_addr->addrlen);
-    if (ret <= 0) {
-        log_msg(LOG_ERR, "local_udp_process_query send errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
+/*
+ * Hand the refused query to the forwarder threads. It is wrapped in the
+ * udp packet the kni path would have received, so the forwarder and its
+ * cache treat both the same, and the response comes back with the client
+ * as destination.
+ */
+static void local_udp_forward(local_udp_worker *worker, struct sockaddr_in *caddr, char *buf, int len, struct query *query) {
+    struct rte_mbuf *pkt = rte_pktmbuf_alloc(worker->pktmbuf_pool);
+    if (pkt == NULL || rte_pktmbuf_tailroom(pkt) < LOCAL_UDP_HDR_LEN + len) {
+        log_msg(LOG_ERR, "Failed to forward local udp request: %s, type %d, from: %s, no mbuf\n",
+                domain_name_to_string(query->qname, NULL), query->qtype, inet_ntoa(caddr->sin_addr));
+        if (pkt) {
+            rte_pktmbuf_free(pkt);
+        }
+        return;
     }
 
-    struct sockaddr src_addr;
-    socklen_t src_len = sizeof(struct sockaddr);
-    ret = recvfrom(sock_fd, rvc_buf, rcv_len, 0, &src_addr, &src_len);
-    if (ret <= 0) {
-        log_msg(LOG_ERR, "local_udp_process_query recvfrom errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
-    }
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    struct ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, sizeof(struct ether_hdr));
+    struct udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+    memset(eth_hdr, 0, LOCAL_UDP_HDR_LEN);
+    eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+    ipv4_hdr->src_addr = caddr->sin_addr.s_addr;
+    ipv4_hdr->dst_addr = worker->vip;
+    udp_hdr->src_port = caddr->sin_port;
+    udp_hdr->dst_port = rte_cpu_to_be_16(53);
+    udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct udp_hdr) + len);
+    memcpy(rte_pktmbuf_mtod_offset(pkt, char *, LOCAL_UDP_HDR_LEN), buf, len);
+    pkt->data_len = pkt->pkt_len = LOCAL_UDP_HDR_LEN + len;
+
+    fwd_query_enqueue_ring(pkt, caddr->sin_addr.s_addr, GET_ID(query->packet), query->qtype,
+                           (char *)domain_name_to_string(query->qname, NULL), worker->fwd_rsp_ring);
+    worker->fwd_wait_ms = local_udp_now_ms() + (uint64_t)(g_fwd_addrs_ctrl.timeout + 1) * FWD_MAX_ADDRS * 1000;
+}
 
-    close(sock_fd);
-    return ret;
+/* Send the responses the forwarder has put back, returns how many */
+static unsigned local_udp_forward_responses(local_udp_worker *worker) {
+    unsigned i;
+    struct rte_mbuf *pkts[LOCAL_UDP_BURST];
+
+    unsigned cnt = fwd_response_dequeue_ring(worker->fwd_rsp_ring, pkts, LOCAL_UDP_BURST);
+    for (i = 0; i < cnt; i++) {
+        struct ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(pkts[i], struct ipv4_hdr *, sizeof(struct ether_hdr));
+        struct udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(pkts[i], struct udp_hdr *, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+
+        struct sockaddr_in *caddr = &worker->saddrs[i];
+        caddr->sin_family = AF_INET;
+        caddr->sin_addr.s_addr = ipv4_hdr->dst_addr;
+        caddr->sin_port = udp_hdr->dst_port;
+        worker->siovs[i].iov_base = rte_pktmbuf_mtod_offset(pkts[i], char *, LOCAL_UDP_HDR_LEN);
+        worker->siovs[i].iov_len = rte_be_to_cpu_16(udp_hdr->dgram_len) - sizeof(struct udp_hdr);
+    }
+    local_udp_send(worker, worker->smsgs, cnt);
+    for (i = 0; i < cnt; i++) {
+        rte_pktmbuf_free(pkts[i]);
+    }
+    return cnt;
 }
 
-static int local_udp_process_forward(int sfd, char *buf, int buf_len, struct sockaddr_in *caddr, uint16_t id, uint16_t qtype, char *domain) {
-    (void)id;
-    int i = 0;
-    int rlen = 0;
-    int fwd_mode;
-    int fwd_timeout;
-    int servers_len;
-    dns_addr_t server_addrs[FWD_MAX_ADDRS];
-    char recv_buf[EDNS_MAX_MESSAGE_LEN];
-
-    pthread_rwlock_rdlock(&__fwd_lock);
-    fwd_mode = g_fwd_addrs_ctrl.mode;
-    fwd_timeout = g_fwd_addrs_ctrl.timeout;
-    domain_fwd_addrs *fwd_addrs = fwd_addrs_find(domain, &g_fwd_addrs_ctrl);
-    servers_len = fwd_addrs->servers_len;
-    memcpy(&server_addrs, &fwd_addrs->server_addrs, sizeof(fwd_addrs->server_addrs));
-    pthread_rwlock_unlock(&__fwd_lock);
-
-    if (fwd_mode == FWD_MODE_DISABLE) {
+/* Answer a burst of received queries, returns how many were received */
+static unsigned local_udp_queries(local_udp_worker *worker) {
+    int i, cnt;
+    unsigned nb_snd = 0;
+    uint16_t flags_old;
+    struct query *query = worker->query;
+
+    for (i = 0; i < LOCAL_UDP_BURST; i++) {
+        worker->rmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    cnt = recvmmsg(worker->sfd, worker->rmsgs, LOCAL_UDP_BURST, MSG_DONTWAIT, NULL);
+    if (cnt <= 0) {
+        if (cnt == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_msg(LOG_ERR, "local udp worker %u recvmmsg errno=%d, errinfo=%s\n", worker->id, errno, strerror(errno));
+        }
         return 0;
     }
 
-    for (; i < servers_len; ++i) {
-        rlen = local_udp_process_query(buf, buf_len, recv_buf, sizeof(recv_buf), &server_addrs[i], fwd_timeout);
-        if (rlen > 0) {
-            break;
+    for (i = 0; i < cnt; i++) {
+        char *buf = worker->bufs[i];
+        int rlen = worker->rmsgs[i].msg_len;
+        struct sockaddr_in *caddr = &worker->raddrs[i];
+
+        if ((unsigned)rlen < LOCAL_UDP_QUERY_LEN_MIN) {
+            log_msg(LOG_ERR, "local query from %s packet size %d illegal, drop\n", inet_ntoa(caddr->sin_addr), rlen);
+            continue;
         }
 
-        char ip_src_str[INET_ADDRSTRLEN] = {0};
-        char ip_dst_str[INET_ADDRSTRLEN] = {0};
-        inet_ntop(AF_INET, &caddr->sin_addr, ip_src_str, sizeof(ip_src_str));
-        inet_ntop(AF_INET, &((struct sockaddr_in *)&server_addrs[i].addr)->sin_addr, ip_dst_str, sizeof(ip_dst_str));
-        log_msg(LOG_ERR, "Failed to send udp request: %s, type %d, to %s, from: %s, trycnt: %d\n",
-                domain, qtype, ip_dst_str, ip_src_str, i);
-    }
+        query_reset(query);
+        query->sip = caddr->sin_addr.s_addr;
+        query->packet->data = (uint8_t *)buf;
+        query->packet->position += rlen;
+        buffer_flip(query->packet);
+
+        memcpy(&flags_old, query->packet->data + 2, 2);
+
+        view_query_master_process(query);
+        rte_rwlock_read_lock(&worker->lock);
+        if (query_process(query, &worker->kdns) != QUERY_FAIL) {
+            query_stats_update(g_query_stats[QUERY_STATS_SLOT_LOCAL_UDP + worker->id], query);
+            buffer_flip(query->packet);
+        }
+        rte_rwlock_read_unlock(&worker->lock);
+
+        if (GET_RCODE(query->packet) == RCODE_REFUSE) {
+            memcpy(buf + 2, &flags_old, 2);
+            local_udp_forward(worker, caddr, buf, rlen, query);
+            continue;
+        }
 
-    if (rlen > 0) {
-        if (sendto(sfd, recv_buf, rlen, 0, (struct sockaddr *)caddr, sizeof(struct sockaddr)) == -1) {
-            log_msg(LOG_ERR, "Failed to send udp response: %s, type %d, to %s\n", domain, qtype, inet_ntoa(caddr->sin_addr));
-            return -1;
+        uint16_t slen = buffer_remaining(query->packet);
+        if (slen > 0) {
+            worker->saddrs[nb_snd] = *caddr;
+            worker->siovs[nb_snd].iov_base = buf;
+            worker->siovs[nb_snd].iov_len = slen;
+            nb_snd++;
         }
     }
-    return 0;
+    local_udp_send(worker, worker->smsgs, nb_snd);
+    return cnt;
 }
 
 static void *thread_local_udp_process(void *arg) {
-    char *ip = (char *)arg;
-    int sfd, rlen, slen;
-    socklen_t addr_len;
-    uint16_t flags_old;
-    struct sockaddr_in saddr, caddr;
-    char buf[EDNS_MAX_MESSAGE_LEN];
+    local_udp_worker *worker = (local_udp_worker *)arg;
+    struct pollfd pfd = {.fd = worker->sfd, .events = POLLIN};
 
-    sleep(30);
+    log_msg(LOG_INFO, "local udp worker %u accepting local udp querys\n", worker->id);
+    while (1) {
+        unsigned nb_rcv = local_udp_queries(worker);
+        unsigned nb_fwd = local_udp_forward_responses(worker);
 
-    sfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (nb_rcv == 0 && nb_fwd == 0) {
+            int wait_ms = local_udp_now_ms() < worker->fwd_wait_ms ? LOCAL_UDP_POLL_MS : LOCAL_UDP_IDLE_POLL_MS;
+            poll(&pfd, 1, wait_ms);
+        }
+    }
+    return NULL;
+}
+
+static int local_udp_socket(char *ip) {
+    int one = 1;
+    struct sockaddr_in saddr;
+
+    int sfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
     if (sfd < 0) {
         log_msg(LOG_ERR, "Failed to create udp socket, errno=%d, errinfo=%s\n", errno, strerror(errno));
         exit(1);
     }
+    /* the workers share the port, and the vip may not be up on the kni yet */
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+        setsockopt(sfd, IPPROTO_IP, IP_FREEBIND, &one, sizeof(one)) == -1) {
+        log_msg(LOG_ERR, "Failed to set udp socket options, errno=%d, errinfo=%s\n", errno, strerror(errno));
+        exit(1);
+    }
 
     bzero(&saddr, sizeof(saddr));
     saddr.sin_family = AF_INET;
@@ -141,72 +275,82 @@ static void *thread_local_udp_process(void *arg) {
         log_msg(LOG_ERR, "Failed to bind udp, ip %s, errno=%d, errinfo=%s\n", ip, errno, strerror(errno));
         exit(1);
     }
+    return sfd;
+}
 
-    log_msg(LOG_INFO, "Accepting local udp querys, form %s...\n", ip);
-    while (1) {
-        addr_len = sizeof(struct sockaddr);
-        rlen = recvfrom(sfd, (char *)buf, sizeof(buf), 0, (struct sockaddr *)&caddr, &addr_len);
-
-        /*
-        * Minimum query size is:
-        *
-        *     Size of the header (12)
-        *   + Root domain name   (1)
-        *   + Query class        (2)
-        *   + Query type         (2)
-        */
-        if (rlen <= 0 || (uint16_t)rlen < DNS_HEAD_SIZE + 1 + sizeof(uint16_t) + sizeof(uint16_t)) {
-            log_msg(LOG_ERR, "local query from %s packet size %d illegal, drop\n", inet_ntoa(caddr.sin_addr), rlen);
-            continue;
+int local_udp_process_init(char *ip) {
+    unsigned i, j;
+    char name[RTE_RING_NAMESIZE];
+    unsigned workers = RTE_MIN(RTE_MAX(g_dns_cfg->comm.local_udp_threads, 1), LOCAL_UDP_WORKER_MAX);
+
+    for (i = 0; i < workers; i++) {
+        local_udp_worker *worker = xalloc_zero(sizeof(local_udp_worker));
+        worker->id = i;
+        worker->vip = inet_addr(ip);
+
+        rte_rwlock_init(&worker->lock);
+        kdns_prepare_init(&worker->kdns, &worker->query);
+        worker->query->ednsMaxLen = g_dns_cfg->comm.edns_udp_size;
+        query_stats_init(QUERY_STATS_SLOT_LOCAL_UDP + i, SOCKET_ID_ANY);
+
+        snprintf(name, sizeof(name), "local_udp_pktmbuf_pool_%u", i);
+        worker->pktmbuf_pool = rte_pktmbuf_pool_create(name, RTE_MIN(g_dns_cfg->comm.fwd_mbuf_num, (uint32_t)LOCAL_UDP_FWD_MBUF_NUM),
+                                                       0, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+        if (worker->pktmbuf_pool == NULL) {
+            log_msg(LOG_ERR, "Failed to create local udp pktmbuf pool %u: %s\n", i, rte_strerror(rte_errno));
+            exit(-1);
         }
-
-        query_reset(local_udp_query);
-        local_udp_query->sip = *(uint32_t *)&caddr.sin_addr;
-        local_udp_query->maxMsgLen = sizeof(buf);
-        local_udp_query->packet->data = (uint8_t *)buf;
-        local_udp_query->packet->position += rlen;
-        buffer_flip(local_udp_query->packet);
-
-        memcpy(&flags_old, local_udp_query->packet->data + 2, 2);
-
-        view_query_master_process(local_udp_query);
-        rte_rwlock_read_lock(&local_udp_lock);
-        if (query_process(local_udp_query, &local_udp_kdns) != QUERY_FAIL) {
-            buffer_flip(local_udp_query->packet);
+        snprintf(name, sizeof(name), "local_udp_fwd_ring_%u", i);
+        worker->fwd_rsp_ring = rte_ring_create(name, LOCAL_UDP_FWD_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+        if (worker->fwd_rsp_ring == NULL) {
+            log_msg(LOG_ERR, "Failed to create local udp fwd ring %u: %s\n", i, rte_strerror(rte_errno));
+            exit(-1);
         }
-        rte_rwlock_read_unlock(&local_udp_lock);
 
-        if (GET_RCODE(local_udp_query->packet) == RCODE_REFUSE) {
-            memcpy(buf + 2, &flags_old, 2);
-            local_udp_process_forward(sfd, buf, rlen, &caddr, GET_ID(local_udp_query->packet), local_udp_query->qtype,
-                                      (char *)domain_name_to_string(local_udp_query->qname, NULL));
-            continue;
+        for (j = 0; j < LOCAL_UDP_BURST; j++) {
+            worker->riovs[j].iov_base = worker->bufs[j];
+            worker->riovs[j].iov_len = EDNS_MAX_MESSAGE_LEN;
+            worker->rmsgs[j].msg_hdr.msg_name = &worker->raddrs[j];
+            worker->rmsgs[j].msg_hdr.msg_iov = &worker->riovs[j];
+            worker->rmsgs[j].msg_hdr.msg_iovlen = 1;
+            worker->smsgs[j].msg_hdr.msg_name = &worker->saddrs[j];
+            worker->smsgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            worker->smsgs[j].msg_hdr.msg_iov = &worker->siovs[j];
+            worker->smsgs[j].msg_hdr.msg_iovlen = 1;
         }
 
-        slen = buffer_remaining(local_udp_query->packet);
-        if (slen > 0) {
-            if (sendto(sfd, buf, slen, 0, (struct sockaddr *)&caddr, sizeof(struct sockaddr)) == -1) {
-                log_msg(LOG_ERR, "response query %s to %s, send error, errno=%d, errinfo=%s\n",
-                        (char *)domain_name_to_string(local_udp_query->qname, NULL), inet_ntoa(caddr.sin_addr), errno, strerror(errno));
-            }
-        }
+        worker->sfd = local_udp_socket(ip);
+        local_udp_workers[i] = worker;
+        local_udp_worker_num = i + 1;
     }
-}
 
-int local_udp_process_init(char *ip) {
-    rte_rwlock_init(&local_udp_lock);
-    kdns_prepare_init(&local_udp_kdns, &local_udp_query);
-
-    pthread_t *thread_id = (pthread_t *)xalloc(sizeof(pthread_t));
-    pthread_create(thread_id, NULL, thread_local_udp_process, (void *)ip);
-    pthread_setname_np(*thread_id, "kdns_local_proc");
+    for (i = 0; i < local_udp_worker_num; i++) {
+        pthread_create(&local_udp_workers[i]->thread, NULL, thread_local_udp_process, (void *)local_udp_workers[i]);
+        snprintf(name, sizeof(name), "kdns_local_%u", i);
+        pthread_setname_np(local_udp_workers[i]->thread, name);
+    }
+    log_msg(LOG_INFO, "Accepting local udp querys, form %s on %u workers...\n", ip, local_udp_worker_num);
     return 0;
 }
 
 int local_udp_domian_databd_update(struct domin_info_update *update) {
-    rte_rwlock_write_lock(&local_udp_lock);
-    int ret = domaindata_update(local_udp_kdns.db, update);
-    rte_rwlock_write_unlock(&local_udp_lock);
+    unsigned i;
+    int ret = 0;
+
+    for (i = 0; i < local_udp_worker_num; i++) {
+        rte_rwlock_write_lock(&local_udp_workers[i]->lock);
+        ret |= domaindata_update(local_udp_workers[i]->kdns.db, update);
+        rte_rwlock_write_unlock(&local_udp_workers[i]->lock);
+    }
     return ret;
 }
 
+void local_udp_kdns_update(int (*update)(struct kdns *kdns)) {
+    unsigned i;
+
+    for (i = 0; i < local_udp_worker_num; i++) {
+        rte_rwlock_write_lock(&local_udp_workers[i]->lock);
+        update(&local_udp_workers[i]->kdns);
+        rte_rwlock_write_unlock(&local_udp_workers[i]->lock);
+    }
+}
@@ -4,9 +4,14 @@
 #include <arpa/inet.h>
 #include "db_update.h"
 
+#define LOCAL_UDP_WORKER_MAX    (16)
+
 int local_udp_process_init(char *ip);
 
 int local_udp_domian_databd_update(struct domin_info_update *update);
 
+/* Run update on the store of every local udp worker, with the worker's lock held */
+void local_udp_kdns_update(int (*update)(struct kdns *kdns));
+
 #endif  /* _LOCAL_UDP_PROCESS_H_ */
 
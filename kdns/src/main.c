@@ -22,6 +22,7 @@
 #include "forward.h"
 #include "tcp_process.h"
 #include "local_udp_process.h"
+#include "querylog.h"
 #include "domain_update.h"
 #include "ctrl_msg.h"
 
@@ -174,6 +175,7 @@ int main(int argc, char **argv) {
         log_msg(LOG_ERR, "EAL init failed.\n");
         exit(-1);
     }
+    log_async_start();
     kdns_netdev_init();
 
     if (set_thread_affinity() != 0) {
@@ -190,6 +192,7 @@ int main(int argc, char **argv) {
     fwd_server_init();
     tcp_process_init(g_dns_cfg->netdev.kni_vip);
     local_udp_process_init(g_dns_cfg->netdev.kni_vip);
+    querylog_init();
 
     unsigned lcore_id;
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include "rte_cycles.h"
 #include "rte_memory.h"
 #include "rte_memzone.h"
@@ -11,6 +12,8 @@
 #include "rte_mbuf.h"
 #include "rte_ethdev.h"
 #include "rte_kni.h"
+#include "rte_eth_bond.h"
+#include "rte_malloc.h"
 #include <rte_ip.h>
 #include <rte_udp.h>
 #include "netdev.h"
@@ -31,9 +34,7 @@
 
 #define MBUF_CACHE_DEF          (256)
 
-struct rte_kni *kdns_kni;
-
-struct rte_mempool *pkt_mbuf_pool;
+#define NETIF_BOND_NAME         "net_bonding0"
 
 struct rte_mempool *kni_mbuf_pool;
 
@@ -184,23 +185,138 @@ static void check_all_ports_link_status(uint8_t port_num, uint32_t port_mask) {
 }
 
 struct netif_queue_conf *netif_queue_conf_get(uint16_t lcore_id) {
-    return &kdns_net_device.l_netif_queue_conf[lcore_id];
+    return kdns_net_device.l_netif_queue_conf[lcore_id];
+}
+
+static int netif_socket_id(int socket_id) {
+    /* SOCKET_ID_ANY if the socket can not be determined */
+    if (socket_id < 0 || socket_id >= RTE_MAX_NUMA_NODES) {
+        return 0;
+    }
+    return socket_id;
+}
+
+static struct rte_mempool *netif_pktmbuf_pool_get(int socket_id) {
+    char name[RTE_MEMPOOL_NAMESIZE];
+
+    socket_id = netif_socket_id(socket_id);
+    if (kdns_net_device.pktmbuf_pools[socket_id] == NULL) {
+        snprintf(name, sizeof(name), "pkt_mbuf_pool_%d", socket_id);
+        kdns_net_device.pktmbuf_pools[socket_id] = rte_pktmbuf_pool_create(name, g_dns_cfg->netdev.mbuf_num,
+                                                                           MBUF_CACHE_DEF, 0, RTE_MBUF_DEFAULT_BUF_SIZE, socket_id);
+        if (kdns_net_device.pktmbuf_pools[socket_id] == NULL) {
+            log_msg(LOG_ERR, "Could not initialise %s: %s\n", name, rte_strerror(rte_errno));
+            exit(-1);
+        }
+        log_msg(LOG_INFO, "Created %s on socket %d\n", name, socket_id);
+    }
+    return kdns_net_device.pktmbuf_pools[socket_id];
+}
+
+static void netif_queue_conf_init(void) {
+    unsigned lcore_id;
+    char name[32];
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        snprintf(name, sizeof(name), "netif_queue_conf_%u", lcore_id);
+        kdns_net_device.l_netif_queue_conf[lcore_id] = rte_zmalloc_socket(name, sizeof(struct netif_queue_conf),
+                                                                          RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+        if (kdns_net_device.l_netif_queue_conf[lcore_id] == NULL) {
+            log_msg(LOG_ERR, "Could not alloc %s\n", name);
+            exit(-1);
+        }
+    }
+}
+
+struct netif_port_queue *netif_port_queue_get(struct netif_queue_conf *conf, uint8_t port_id) {
+    uint16_t i;
+    for (i = 0; i < conf->nb_ports; i++) {
+        if (conf->port_queues[i].port_id == port_id) {
+            return &conf->port_queues[i];
+        }
+    }
+    return NULL;
+}
+
+static struct netif_port *netif_port_get(uint8_t port_id) {
+    uint16_t i;
+    for (i = 0; i < kdns_net_device.nb_ports; i++) {
+        if (kdns_net_device.ports[i].port_id == port_id) {
+            return &kdns_net_device.ports[i];
+        }
+    }
+    return NULL;
 }
 
-static void netif_queue_core_bind(uint8_t port_id) {
+uint16_t netif_tx_burst_retry(struct netif_port_queue *pq, struct rte_mbuf **mbufs, uint16_t nb_mbufs) {
+    uint16_t i, retry, nb_tx;
+
+    nb_tx = rte_eth_tx_burst(pq->port_id, pq->tx_queue_id, mbufs, nb_mbufs);
+    for (retry = 0; nb_tx < nb_mbufs && retry < NETIF_TX_RETRY_MAX; retry++) {
+        rte_delay_us(NETIF_TX_RETRY_DELAY_US);
+        nb_tx += rte_eth_tx_burst(pq->port_id, pq->tx_queue_id, &mbufs[nb_tx], nb_mbufs - nb_tx);
+    }
+
+    if (unlikely(nb_tx < nb_mbufs)) {
+        pq->stats->drop_tx_full += nb_mbufs - nb_tx;
+        pq->stats->pkt_dropped += nb_mbufs - nb_tx;
+        for (i = nb_tx; i < nb_mbufs; i++) {
+            rte_pktmbuf_free(mbufs[i]);
+        }
+    }
+    return nb_tx;
+}
+
+/* tx_buffer error callback, the unsent answers are retried before being dropped */
+static void netif_tx_buffer_retry_cb(struct rte_mbuf **unsent, uint16_t count, void *userdata) {
+    struct netif_port_queue *pq = (struct netif_port_queue *)userdata;
+
+    pq->stats->dns_pkts_snd += netif_tx_burst_retry(pq, unsent, count);
+}
+
+static void netif_tx_buffer_init(struct netif_port_queue *pq, unsigned lcore_id) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "tx_buffer_%u_%u", pq->port_id, lcore_id);
+    pq->tx_buffer = rte_zmalloc_socket(name, RTE_ETH_TX_BUFFER_SIZE(NETIF_TX_BUFFER_SIZE), RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+    if (pq->tx_buffer == NULL) {
+        log_msg(LOG_ERR, "Could not alloc %s\n", name);
+        exit(-1);
+    }
+    rte_eth_tx_buffer_init(pq->tx_buffer, NETIF_TX_BUFFER_SIZE);
+    if (rte_eth_tx_buffer_set_err_callback(pq->tx_buffer, netif_tx_buffer_retry_cb, pq) != 0) {
+        log_msg(LOG_ERR, "Could not set err callback of %s\n", name);
+        exit(-1);
+    }
+}
+
+static void netif_queue_core_bind(uint16_t port_idx) {
     int rx_id = 0;
     int tx_id = 0;
+    uint8_t port_id = kdns_net_device.ports[port_idx].port_id;
     int port_socket_id = rte_eth_dev_socket_id(port_id);
     unsigned lcore_id;
 
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        if (rx_id >= g_dns_cfg->netdev.rxq_num || tx_id >= g_dns_cfg->netdev.txq_num) {
+            log_msg(LOG_ERR, "Not enough queues on port(%u) for core(%u): rx queues(%u), tx queues(%u)\n",
+                    port_id, lcore_id, g_dns_cfg->netdev.rxq_num, g_dns_cfg->netdev.txq_num);
+            exit(-1);
+        }
         log_msg(LOG_INFO, "core queue info: coreId(%d) coreSocketId(%u) portID(%d) portSocketId(%d) rxQueueId(%d) txQueueId(%d)\n",
                 lcore_id, lcore_config[lcore_id].socket_id, port_id, port_socket_id, rx_id, tx_id);
+        if (port_socket_id >= 0 && (unsigned)port_socket_id != lcore_config[lcore_id].socket_id) {
+            log_msg(LOG_ERR, "Warning: port(%u) on socket %d is polled by core(%u) on remote socket %u, "
+                    "rx/tx of this core will cross the numa nodes\n", port_id, port_socket_id, lcore_id, lcore_config[lcore_id].socket_id);
+        }
 
-        memset(&kdns_net_device.l_netif_queue_conf[lcore_id], 0, sizeof(struct netif_queue_conf));
-        kdns_net_device.l_netif_queue_conf[lcore_id].port_id = port_id;
-        kdns_net_device.l_netif_queue_conf[lcore_id].rx_queue_id = rx_id;
-        kdns_net_device.l_netif_queue_conf[lcore_id].tx_queue_id = tx_id;
+        struct netif_queue_conf *conf = kdns_net_device.l_netif_queue_conf[lcore_id];
+        conf->port_queues[port_idx].port_id = port_id;
+        conf->port_queues[port_idx].rx_queue_id = rx_id;
+        conf->port_queues[port_idx].tx_queue_id = tx_id;
+        conf->port_queues[port_idx].stats = &conf->stats;
+        netif_tx_buffer_init(&conf->port_queues[port_idx], lcore_id);
+        conf->nb_ports = port_idx + 1;
 
         if (rx_id < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
             rte_eth_dev_set_rx_queue_stats_mapping(port_id, rx_id, rx_id);
@@ -214,22 +330,31 @@ static void netif_queue_core_bind(uint8_t port_id) {
     }
 }
 
-static void kdns_port_init(uint8_t port_id) {
+/* rx queue polled by the lcore takes mbufs from the lcore's socket, other rx queues from the port's socket */
+static struct rte_mempool *kdns_rx_queue_pool_get(uint16_t port_idx, uint16_t rx_queue_id) {
+    unsigned lcore_id;
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        struct netif_queue_conf *conf = kdns_net_device.l_netif_queue_conf[lcore_id];
+        if (port_idx < conf->nb_ports && conf->port_queues[port_idx].rx_queue_id == rx_queue_id) {
+            return netif_pktmbuf_pool_get(rte_lcore_to_socket_id(lcore_id));
+        }
+    }
+    return netif_pktmbuf_pool_get(rte_eth_dev_socket_id(kdns_net_device.ports[port_idx].port_id));
+}
+
+static void kdns_port_init(uint16_t port_idx) {
     int ret;
     uint16_t q;
     struct rte_eth_conf conf;
+    struct netif_port *port = &kdns_net_device.ports[port_idx];
+    uint8_t port_id = port->port_id;
 
     uint16_t nb_rx_q = g_dns_cfg->netdev.rxq_num;
     uint16_t nb_tx_q = g_dns_cfg->netdev.txq_num;
     uint16_t nb_rx_desc = g_dns_cfg->netdev.rxq_desc_num;
     uint16_t nb_tx_desc = g_dns_cfg->netdev.txq_desc_num;
-    unsigned nb_mbuf = g_dns_cfg->netdev.mbuf_num;
 
-    pkt_mbuf_pool = rte_pktmbuf_pool_create("pkt_mbuf_pool", nb_mbuf, MBUF_CACHE_DEF, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_eth_dev_socket_id(port_id));
-    if (pkt_mbuf_pool == NULL) {
-        log_msg(LOG_ERR, "Could not initialise pkt_mbuf_pool\n");
-        exit(-1);
-    }
     log_msg(LOG_INFO, "Initialising port(%u), rx queues(%u) desc(%u), tx queues(%u) desc(%u) ...\n", port_id, nb_rx_q, nb_rx_desc, nb_tx_q, nb_tx_desc);
 
     if (strcmp(g_dns_cfg->netdev.mode, "rss") == 0) {
@@ -237,13 +362,28 @@ static void kdns_port_init(uint8_t port_id) {
     } else {
         memcpy(&conf, &port_conf, sizeof(conf));
     }
-    ret = rte_eth_dev_configure(port_id, nb_rx_q, nb_tx_q, &conf);
-    if (ret < 0) {
-        log_msg(LOG_ERR, "Could not configure port(%u) ret(%d)\n", port_id, ret);
-        exit(-1);
+    rte_spinlock_init(&port->intr_lock);
+    if (g_dns_cfg->netdev.poll_idle_us) {
+        conf.intr_conf.rxq = 1;
+        ret = rte_eth_dev_configure(port_id, nb_rx_q, nb_tx_q, &conf);
+        if (ret < 0) {
+            log_msg(LOG_ERR, "Could not configure port(%u) with rx interrupts ret(%d), just polling\n", port_id, ret);
+            conf.intr_conf.rxq = 0;
+        } else {
+            port->rx_intr = 1;
+        }
     }
+    if (!port->rx_intr) {
+        ret = rte_eth_dev_configure(port_id, nb_rx_q, nb_tx_q, &conf);
+        if (ret < 0) {
+            log_msg(LOG_ERR, "Could not configure port(%u) ret(%d)\n", port_id, ret);
+            exit(-1);
+        }
+    }
+    netif_queue_core_bind(port_idx);
+
     for (q = 0; q < nb_rx_q; ++q) {
-        ret = rte_eth_rx_queue_setup(port_id, q, nb_rx_desc, rte_eth_dev_socket_id(port_id), NULL, pkt_mbuf_pool);
+        ret = rte_eth_rx_queue_setup(port_id, q, nb_rx_desc, rte_eth_dev_socket_id(port_id), NULL, kdns_rx_queue_pool_get(port_idx, q));
         if (ret < 0) {
             log_msg(LOG_ERR, "Could not setup up RX queue for port(%u) queue(%u) ret(%d)\n", port_id, q, ret);
             exit(-1);
@@ -256,7 +396,6 @@ static void kdns_port_init(uint8_t port_id) {
             exit(-1);
         }
     }
-    netif_queue_core_bind(port_id);
 
     ret = rte_eth_dev_start(port_id);
     if (ret < 0) {
@@ -266,6 +405,34 @@ static void kdns_port_init(uint8_t port_id) {
     rte_eth_promiscuous_enable(port_id);
 }
 
+/* Bond all the probed ports into one port, the slave lcores just poll the bonded port */
+static void kdns_bond_port_create(uint8_t nb_sys_ports) {
+    int ret;
+    uint8_t port_id;
+    struct netif_port *port = &kdns_net_device.ports[0];
+
+    int socket_id = netif_socket_id(rte_eth_dev_socket_id(0));
+
+    ret = rte_eth_bond_create(NETIF_BOND_NAME, (uint8_t)g_dns_cfg->netdev.bond_mode, (uint8_t)socket_id);
+    if (ret < 0) {
+        log_msg(LOG_ERR, "Could not create bonded port %s mode(%d) ret(%d)\n", NETIF_BOND_NAME, g_dns_cfg->netdev.bond_mode, ret);
+        exit(-1);
+    }
+    port->port_id = (uint8_t)ret;
+
+    for (port_id = 0; port_id < nb_sys_ports; port_id++) {
+        ret = rte_eth_bond_slave_add(port->port_id, port_id);
+        if (ret < 0) {
+            log_msg(LOG_ERR, "Could not add slave port(%u) to bonded port(%u) ret(%d)\n", port_id, port->port_id, ret);
+            exit(-1);
+        }
+        port->slaves[port->nb_slaves++] = port_id;
+    }
+    kdns_net_device.nb_ports = 1;
+
+    log_msg(LOG_INFO, "Created bonded port(%u) mode(%d) with %u slaves\n", port->port_id, g_dns_cfg->netdev.bond_mode, port->nb_slaves);
+}
+
 static int kni_config_network_interface(uint8_t port_id, uint8_t if_up) {
     int ret = 0;
 
@@ -344,57 +511,69 @@ static int kni_change_mtu(uint8_t port_id, unsigned new_mtu) {
     return 0;
 }
 
-__attribute__((unused)) static int kdns_kni_deinit(uint8_t port_id) {
-    if (rte_kni_release(kdns_kni)) {
+__attribute__((unused)) static int kdns_kni_deinit(uint16_t port_idx) {
+    struct netif_port *port = &kdns_net_device.ports[port_idx];
+
+    if (rte_kni_release(port->kni)) {
         log_msg(LOG_ERR, "Fail to release kni\n");
     }
-    rte_eth_dev_stop(port_id);
+    rte_eth_dev_stop(port->port_id);
     return 0;
 }
 
-static int kdns_kni_init(uint8_t port_id) {
+static int kdns_kni_init(uint16_t port_idx) {
     struct rte_kni_ops ops;
     struct rte_kni_conf conf;
     struct rte_eth_dev_info dev_info;
+    struct netif_port *port = &kdns_net_device.ports[port_idx];
+    uint8_t port_id = port->port_id;
 
     unsigned nb_mbuf = g_dns_cfg->netdev.kni_mbuf_num;
     char *kni_name = g_dns_cfg->netdev.name_prefix;
 
-    kni_mbuf_pool = rte_pktmbuf_pool_create("kni_mbuf_pool", nb_mbuf, MBUF_CACHE_DEF, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_eth_dev_socket_id(port_id));
     if (kni_mbuf_pool == NULL) {
-        log_msg(LOG_ERR, "Could not initialise kni_mbuf_pool\n");
-        exit(-1);
+        kni_mbuf_pool = rte_pktmbuf_pool_create("kni_mbuf_pool", nb_mbuf, MBUF_CACHE_DEF, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_eth_dev_socket_id(port_id));
+        if (kni_mbuf_pool == NULL) {
+            log_msg(LOG_ERR, "Could not initialise kni_mbuf_pool\n");
+            exit(-1);
+        }
+        rte_kni_init(kdns_net_device.nb_ports);
     }
 
-    rte_kni_init(1);
-
     memset(&conf, 0, sizeof(conf));
     conf.core_id = 0;
     conf.force_bind = 1;
     conf.group_id = (uint16_t)port_id;
     conf.mbuf_size = RTE_MBUF_DEFAULT_DATAROOM;
-    snprintf(conf.name, sizeof(conf.name), "%s", kni_name);
+    if (kdns_net_device.nb_ports == 1) {
+        snprintf(conf.name, sizeof(conf.name), "%s", kni_name);
+    } else {
+        snprintf(conf.name, sizeof(conf.name), "%s%u", kni_name, port_idx);
+    }
 
+    /* the bonded port has no pci device, use the first slave's */
     memset(&dev_info, 0, sizeof(dev_info));
-    rte_eth_dev_info_get(port_id, &dev_info);
-    conf.addr = dev_info.pci_dev->addr;
-    conf.id = dev_info.pci_dev->id;
+    rte_eth_dev_info_get(port->nb_slaves ? port->slaves[0] : port_id, &dev_info);
+    if (dev_info.pci_dev) {
+        conf.addr = dev_info.pci_dev->addr;
+        conf.id = dev_info.pci_dev->id;
+    }
 
     memset(&ops, 0, sizeof(ops));
     ops.port_id = port_id;
     ops.change_mtu = kni_change_mtu;
     ops.config_network_if = kni_config_network_interface;
 
-    kdns_kni = rte_kni_alloc(kni_mbuf_pool, &conf, &ops);
-    if (!kdns_kni) {
+    port->kni = rte_kni_alloc(kni_mbuf_pool, &conf, &ops);
+    if (!port->kni) {
         log_msg(LOG_ERR, "Fail to create kni for port: %d\n", port_id);
         exit(-1);
     }
 
-    rte_eth_macaddr_get(port_id, &kdns_net_device.hwaddr);
-    if (linux_set_if_mac(conf.name, (unsigned char *)&kdns_net_device.hwaddr) != 0) {
+    rte_eth_macaddr_get(port_id, &port->hwaddr);
+    if (linux_set_if_mac(conf.name, (unsigned char *)&port->hwaddr) != 0) {
         char str_mac[ETHER_ADDR_FMT_SIZE];
-        ether_format_addr(str_mac, ETHER_ADDR_FMT_SIZE, &kdns_net_device.hwaddr);
+        ether_format_addr(str_mac, ETHER_ADDR_FMT_SIZE, &port->hwaddr);
         log_msg(LOG_ERR, "Fail to set mac %s for %s: %s\n", str_mac, conf.name, strerror(errno));
         exit(-1);
     }
@@ -402,46 +581,162 @@ static int kdns_kni_init(uint8_t port_id) {
 }
 
 int kdns_netdev_init(void) {
+    uint16_t i;
+    uint32_t port_mask = 0;
     uint8_t nb_sys_ports = rte_eth_dev_count();
     if (nb_sys_ports == 0) {
         log_msg(LOG_ERR, "No supported Ethernet device found\n");
         exit(-1);
     }
-    if (nb_sys_ports != 1) {
-        log_msg(LOG_ERR, "Now just one port supported\n");
+    if (nb_sys_ports > NETIF_MAX_PORTS) {
+        log_msg(LOG_ERR, "Too many ports(%u), max %u ports supported\n", nb_sys_ports, NETIF_MAX_PORTS);
         exit(-1);
     }
 
-    uint8_t port_id = 0;
-    kdns_port_init(port_id);
-    kdns_kni_init(port_id);
-    check_all_ports_link_status(nb_sys_ports, 1);
-    check_port_flow_type_rss_offloads(port_id);
+    if (g_dns_cfg->netdev.bond_mode != NETDEV_BOND_MODE_NONE) {
+        kdns_bond_port_create(nb_sys_ports);
+    } else {
+        for (i = 0; i < nb_sys_ports; i++) {
+            kdns_net_device.ports[i].port_id = (uint8_t)i;
+        }
+        kdns_net_device.nb_ports = nb_sys_ports;
+    }
+    netif_queue_conf_init();
+
+    for (i = 0; i < kdns_net_device.nb_ports; i++) {
+        kdns_port_init(i);
+        kdns_kni_init(i);
+        port_mask |= 1 << kdns_net_device.ports[i].port_id;
+    }
+    check_all_ports_link_status(rte_eth_dev_count(), port_mask);
+    for (i = 0; i < kdns_net_device.nb_ports; i++) {
+        check_port_flow_type_rss_offloads(kdns_net_device.ports[i].port_id);
+    }
+
+    return 0;
+}
+
+/* Must be called by the lcore itself, the events are added to the per thread epoll fd */
+int netif_rx_intr_register(struct netif_queue_conf *conf) {
+    int ret;
+    uint16_t i;
+
+    conf->rx_intr_en = 0;
+    for (i = 0; i < conf->nb_ports; i++) {
+        struct netif_port_queue *pq = &conf->port_queues[i];
+        struct netif_port *port = netif_port_get(pq->port_id);
+        if (port == NULL || !port->rx_intr) {
+            return -1;
+        }
 
+        ret = rte_eth_dev_rx_intr_ctl_q(pq->port_id, pq->rx_queue_id, RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL);
+        if (ret) {
+            log_msg(LOG_ERR, "Could not register rx interrupt of port(%u) queue(%u) ret(%d)\n", pq->port_id, pq->rx_queue_id, ret);
+            return ret;
+        }
+    }
+    conf->rx_intr_en = 1;
     return 0;
 }
 
+void netif_rx_intr_sleep(struct netif_queue_conf *conf, int timeout_ms) {
+    uint16_t i;
+    struct rte_epoll_event events[NETIF_MAX_PORTS];
+
+    for (i = 0; i < conf->nb_ports; i++) {
+        struct netif_port *port = netif_port_get(conf->port_queues[i].port_id);
+        rte_spinlock_lock(&port->intr_lock);
+        rte_eth_dev_rx_intr_enable(conf->port_queues[i].port_id, conf->port_queues[i].rx_queue_id);
+        rte_spinlock_unlock(&port->intr_lock);
+    }
+
+    rte_epoll_wait(RTE_EPOLL_PER_THREAD, events, NETIF_MAX_PORTS, timeout_ms);
+    conf->stats.rx_intr_sleeps++;
+
+    for (i = 0; i < conf->nb_ports; i++) {
+        struct netif_port *port = netif_port_get(conf->port_queues[i].port_id);
+        rte_spinlock_lock(&port->intr_lock);
+        rte_eth_dev_rx_intr_disable(conf->port_queues[i].port_id, conf->port_queues[i].rx_queue_id);
+        rte_spinlock_unlock(&port->intr_lock);
+    }
+}
+
 void kni_egress(struct rte_mbuf **mbufs, uint16_t nb_mbufs) {
-    uint16_t nb_tx = rte_kni_tx_burst(kdns_kni, mbufs, nb_mbufs);
+    uint16_t nb_tx = 0;
+
+    /* mbufs from one slave rx burst are all from the same port */
+    struct netif_port *port = netif_port_get(mbufs[0]->port);
+    if (likely(port != NULL)) {
+        nb_tx = rte_kni_tx_burst(port->kni, mbufs, nb_mbufs);
+    }
     if (unlikely(nb_tx < nb_mbufs)) {
-        log_msg(LOG_ERR, "Failed to send %u pkt to kni\n", nb_mbufs - nb_tx);
+        log_msg_ratelimit(LOG_ERR, "Failed to send %u pkt to kni\n", nb_mbufs - nb_tx);
         do {
             rte_pktmbuf_free(mbufs[nb_tx]);
         } while (++nb_tx < nb_mbufs);
     }
 }
 
-int kni_ingress(struct rte_mbuf **mbufs, uint16_t nb_mbufs) {
-    rte_kni_handle_request(kdns_kni);
+int kni_ingress(struct rte_mbuf **mbufs, uint16_t nb_mbufs, uint16_t port_idx) {
+    uint16_t i, nb_rx;
+    struct netif_port *port = &kdns_net_device.ports[port_idx];
+
+    rte_kni_handle_request(port->kni);
 
-    return rte_kni_rx_burst(kdns_kni, mbufs, nb_mbufs);
+    nb_rx = rte_kni_rx_burst(port->kni, mbufs, nb_mbufs);
+    for (i = 0; i < nb_rx; i++) {
+        mbufs[i]->port = port->port_id;
+    }
+    return nb_rx;
+}
+
+/*
+ * Counters of the lcores at the last reset. The live counters are only
+ * written by their lcore, a reset takes a snapshot and the readers report
+ * the counts since it. The web server runs a thread per connection, the
+ * lock keeps a read from subtracting a snapshot taken after it.
+ */
+static struct netif_queue_stats netif_stats_base[RTE_MAX_LCORE];
+static pthread_mutex_t netif_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void netif_statsdata_sub(struct netif_queue_stats *sta, struct netif_queue_stats *base) {
+    sta->pkts_rcv -= base->pkts_rcv;
+    sta->pkts_2kni -= base->pkts_2kni;
+    sta->pkts_icmp -= base->pkts_icmp;
+    sta->dns_pkts_rcv -= base->dns_pkts_rcv;
+    sta->dns_pkts_snd -= base->dns_pkts_snd;
+    sta->dns_lens_rcv -= base->dns_lens_rcv;
+    sta->dns_lens_snd -= base->dns_lens_snd;
+    sta->pkt_dropped -= base->pkt_dropped;
+    sta->pkt_len_err -= base->pkt_len_err;
+    sta->drop_rate_limit -= base->drop_rate_limit;
+    sta->drop_rrl -= base->drop_rrl;
+    sta->drop_tx_full -= base->drop_tx_full;
+    sta->drop_ring_full -= base->drop_ring_full;
+    sta->drop_answer_err -= base->drop_answer_err;
+    sta->cycles_busy -= base->cycles_busy;
+    sta->cycles_idle -= base->cycles_idle;
+    sta->rx_intr_sleeps -= base->rx_intr_sleeps;
+}
+
+static void netif_statsdata_lcore_read(unsigned lcore_id, struct netif_queue_stats *sta) {
+    *sta = kdns_net_device.l_netif_queue_conf[lcore_id]->stats;
+    netif_statsdata_sub(sta, &netif_stats_base[lcore_id]);
+}
+
+void netif_statsdata_lcore_get(unsigned lcore_id, struct netif_queue_stats *sta) {
+    pthread_mutex_lock(&netif_stats_lock);
+    netif_statsdata_lcore_read(lcore_id, sta);
+    pthread_mutex_unlock(&netif_stats_lock);
 }
 
 void netif_statsdata_get(struct netif_queue_stats *sta) {
     unsigned lcore_id;
-    struct netif_queue_stats *sta_lcore;
+    struct netif_queue_stats lcore_sta;
+    struct netif_queue_stats *sta_lcore = &lcore_sta;
+    pthread_mutex_lock(&netif_stats_lock);
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
-        sta_lcore = &kdns_net_device.l_netif_queue_conf[lcore_id].stats;
+        netif_statsdata_lcore_read(lcore_id, sta_lcore);
         sta->pkts_rcv += sta_lcore->pkts_rcv;
         sta->pkts_2kni += sta_lcore->pkts_2kni;
         sta->pkts_icmp += sta_lcore->pkts_icmp;
@@ -451,6 +746,11 @@ void netif_statsdata_get(struct netif_queue_stats *sta) {
         sta->dns_lens_snd += sta_lcore->dns_lens_snd;
         sta->pkt_dropped += sta_lcore->pkt_dropped;
         sta->pkt_len_err += sta_lcore->pkt_len_err;
+        sta->drop_rate_limit += sta_lcore->drop_rate_limit;
+        sta->drop_rrl += sta_lcore->drop_rrl;
+        sta->drop_tx_full += sta_lcore->drop_tx_full;
+        sta->drop_ring_full += sta_lcore->drop_ring_full;
+        sta->drop_answer_err += sta_lcore->drop_answer_err;
 
 #ifdef ENABLE_KDNS_METRICS
         sta->metrics.timeSum +=  sta_lcore->metrics.timeSum;
@@ -466,24 +766,17 @@ void netif_statsdata_get(struct netif_queue_stats *sta) {
         }
 #endif
     }
+    pthread_mutex_unlock(&netif_stats_lock);
     return;
 }
 
 void netif_statsdata_reset(void) {
     unsigned lcore_id;
-    struct netif_queue_stats *sta_lcore;
+    pthread_mutex_lock(&netif_stats_lock);
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
-        sta_lcore = &kdns_net_device.l_netif_queue_conf[lcore_id].stats;
-        sta_lcore->pkts_rcv = 0;
-        sta_lcore->pkts_2kni = 0;
-        sta_lcore->pkts_icmp = 0;
-        sta_lcore->dns_pkts_rcv = 0;
-        sta_lcore->dns_pkts_snd = 0;
-        sta_lcore->dns_lens_rcv = 0;
-        sta_lcore->dns_lens_snd = 0;
-        sta_lcore->pkt_dropped = 0;
-        sta_lcore->pkt_len_err = 0;
+        netif_stats_base[lcore_id] = kdns_net_device.l_netif_queue_conf[lcore_id]->stats;
     }
+    pthread_mutex_unlock(&netif_stats_lock);
     return;
 }
 
@@ -491,7 +784,7 @@ void netif_statsdata_metrics_reset(void) {
     unsigned lcore_id;
     struct netif_queue_stats *sta_lcore;
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
-        sta_lcore = &kdns_net_device.l_netif_queue_conf[lcore_id].stats;
+        sta_lcore = &kdns_net_device.l_netif_queue_conf[lcore_id]->stats;
         memset(&sta_lcore->metrics, 0, sizeof(metrics_metrics_st));
         sta_lcore->metrics.minTime = 0xffff;
     }
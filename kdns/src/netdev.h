@@ -6,9 +6,16 @@
 #include <rte_mempool.h>
 #include <rte_udp.h>
 #include <rte_ip.h>
+#include <rte_spinlock.h>
+#include <rte_ethdev.h>
 #include "metrics.h"
 
 #define NETIF_MAX_PKT_BURST     (32)
+#define NETIF_MAX_PORTS         (8)
+#define NETIF_TX_BUFFER_SIZE    (NETIF_MAX_PKT_BURST)
+#define NETIF_TX_DRAIN_US       (20)    /* flush the answers buffered longer than this */
+#define NETIF_TX_RETRY_MAX      (4)     /* tx bursts retried before dropping on a full tx queue */
+#define NETIF_TX_RETRY_DELAY_US (1)
 
 struct netif_queue_stats {
     uint64_t pkts_rcv;          /* Total number of receive packets */
@@ -19,6 +26,11 @@ struct netif_queue_stats {
     uint64_t dns_pkts_snd;      /* Total number of successfully transmitted packets. */
     uint64_t pkt_dropped;       /* Total number of dropped packets by software. */
     uint64_t pkt_len_err;       /* pkt len err. */
+    uint64_t drop_rate_limit;   /* Dropped by rate limit. */
+    uint64_t drop_rrl;          /* Dropped by response rate limit. */
+    uint64_t drop_tx_full;      /* Dropped as the tx queue stays full after retries. */
+    uint64_t drop_ring_full;    /* Dropped as the msg ring to master is full. */
+    uint64_t drop_answer_err;   /* Dropped as the answer can not be built. */
 
     uint64_t dns_lens_rcv;      /* Total lens of  received packets. */
     uint64_t dns_lens_snd;      /* Total lens of  transmitted packets. */
@@ -33,42 +45,99 @@ struct netif_queue_stats {
     uint64_t dns_pkts_rcv_tcp;
     uint64_t dns_pkts_snd_tcp;
 
+    uint64_t cycles_busy;       /* TSC cycles of the polls which got packets or ctrl msgs */
+    uint64_t cycles_idle;       /* TSC cycles of empty polls, backoff and sleeping */
+    uint64_t rx_intr_sleeps;    /* Times of sleeping until rx interrupt */
+
     metrics_metrics_st metrics;
 } __rte_cache_aligned;
 
-/* RX/TX queue conf for lcore */
-struct netif_queue_conf {
-    uint16_t port_id;
+/* RX/TX queue of one port polled by lcore */
+struct netif_port_queue {
+    uint8_t port_id;
     uint16_t rx_queue_id;
     uint16_t tx_queue_id;
+
+    uint64_t tx_flush_tsc;                  /* last time tx_buffer flushed */
+    struct rte_eth_dev_tx_buffer *tx_buffer;
+    struct netif_queue_stats *stats;        /* stats of the lcore */
+};
+
+/* RX/TX queue conf for lcore */
+struct netif_queue_conf {
+    uint16_t nb_ports;
+    struct netif_port_queue port_queues[NETIF_MAX_PORTS];
+    uint8_t rx_intr_en;                     /* rx interrupts registered for all the queues */
     struct netif_queue_stats stats;
-    uint16_t tx_len;
-    struct rte_mbuf *tx_mbufs[NETIF_MAX_PKT_BURST];
 
     uint16_t kni_len;
     struct rte_mbuf *kni_mbufs[NETIF_MAX_PKT_BURST];
 } __rte_cache_aligned;
 
+/* port polled by the slave lcores, a physical port or a bonded port */
+struct netif_port {
+    uint8_t port_id;
+    struct ether_addr hwaddr;
+    struct rte_kni *kni;
+    uint8_t rx_intr;                        /* configured with rx interrupts */
+    rte_spinlock_t intr_lock;
+
+    uint8_t nb_slaves;                      /* slave ports if it is a bonded port */
+    uint8_t slaves[NETIF_MAX_PORTS];
+};
+
 struct net_device {
     uint16_t max_rx_queues;
     uint16_t max_tx_queues;
     uint16_t max_rx_desc;
     uint16_t max_tx_desc;
-    struct ether_addr hwaddr;
 
-    struct netif_queue_conf l_netif_queue_conf[RTE_MAX_LCORE];
+    uint16_t nb_ports;
+    struct netif_port ports[NETIF_MAX_PORTS];
+
+    /* pkt mbuf pool per socket, rx queues use the pool of the polling lcore's socket */
+    struct rte_mempool *pktmbuf_pools[RTE_MAX_NUMA_NODES];
+
+    /* allocated on the socket of the lcore */
+    struct netif_queue_conf *l_netif_queue_conf[RTE_MAX_LCORE];
 };
 
+extern struct net_device kdns_net_device;
+
 struct netif_queue_conf *netif_queue_conf_get(uint16_t lcore_id);
 
+struct netif_port_queue *netif_port_queue_get(struct netif_queue_conf *conf, uint8_t port_id);
+
 int kdns_netdev_init(void);
 
+uint16_t netif_tx_burst_retry(struct netif_port_queue *pq, struct rte_mbuf **mbufs, uint16_t nb_mbufs);
+
+/* Buffer the answer, the buffer is sent when it is full or flushed */
+static inline void netif_tx_buffer(struct netif_port_queue *pq, struct rte_mbuf *pkt) {
+    pq->stats->dns_pkts_snd += rte_eth_tx_buffer(pq->port_id, pq->tx_queue_id, pq->tx_buffer, pkt);
+}
+
+static inline void netif_tx_flush(struct netif_port_queue *pq, uint64_t now_tsc) {
+    pq->tx_flush_tsc = now_tsc;
+    if (pq->tx_buffer->length) {
+        pq->stats->dns_pkts_snd += rte_eth_tx_buffer_flush(pq->port_id, pq->tx_queue_id, pq->tx_buffer);
+    }
+}
+
+int netif_rx_intr_register(struct netif_queue_conf *conf);
+
+void netif_rx_intr_sleep(struct netif_queue_conf *conf, int timeout_ms);
+
 void kni_egress(struct rte_mbuf **mbufs, uint16_t nb_mbufs);
 
-int kni_ingress(struct rte_mbuf **mbufs, uint16_t nb_mbufs);
+int kni_ingress(struct rte_mbuf **mbufs, uint16_t nb_mbufs, uint16_t port_idx);
 
+/* Counts since the last reset, summed over the slave lcores or of one lcore */
 void netif_statsdata_get(struct netif_queue_stats *sta);
 
+void netif_statsdata_lcore_get(unsigned lcore_id, struct netif_queue_stats *sta);
+
+/* Snapshot the counters, the live ones keep counting up */
 void netif_statsdata_reset(void);
 
 void netif_statsdata_metrics_reset(void);
@@ -27,23 +27,38 @@
 #include "view_update.h"
 #include "dns-conf.h"
 #include "rate_limit.h"
+#include "rrl.h"
+#include "querylog.h"
 #include "ctrl_msg.h"
+#include "latency_stats.h"
+#include "topk.h"
 
 #define PREFETCH_OFFSET     (3)
+#define IDLE_PAUSE_MAX      (256u)      // max rte_pause per empty poll when backing off
+#define RX_INTR_SLEEP_MS    (1)         // wake up to deal the ctrl msgs even if no packets
 #define UDP_PORT_53         (0x3500)    // port 53
 
 extern struct dns_config *g_dns_cfg;
 
 void tx_msg_slave_process(ctrl_msg *msg, unsigned slave_lcore) {
+    uint16_t i, start, end;
     ctrl_mbufs_msg *mmsg = (ctrl_mbufs_msg *)msg;
-
     struct netif_queue_conf *conf = netif_queue_conf_get(slave_lcore);
-    uint16_t cnts = rte_eth_tx_burst(conf->port_id, conf->tx_queue_id, mmsg->mbufs, mmsg->mbufs_cnts);
-    if (unlikely(cnts < mmsg->mbufs_cnts)) {
-        log_msg(LOG_ERR, "Failed to send %u pkt to tx_queue %u on slave_lcore %u\n", mmsg->mbufs_cnts - cnts, conf->tx_queue_id, slave_lcore);
-        do {
-            rte_pktmbuf_free(mmsg->mbufs[cnts]);
-        } while (++cnts < mmsg->mbufs_cnts);
+
+    /* fwd responses may belong to different ports, send them port by port */
+    for (start = 0; start < mmsg->mbufs_cnts; start = end) {
+        uint8_t port_id = mmsg->mbufs[start]->port;
+        for (end = start + 1; end < mmsg->mbufs_cnts && mmsg->mbufs[end]->port == port_id; ++end);
+
+        struct netif_port_queue *pq = netif_port_queue_get(conf, port_id);
+        if (unlikely(pq == NULL)) {
+            log_msg_ratelimit(LOG_ERR, "Failed to send %u pkt to unknown port %u on slave_lcore %u\n", end - start, port_id, slave_lcore);
+            for (i = start; i < end; i++) {
+                rte_pktmbuf_free(mmsg->mbufs[i]);
+            }
+            continue;
+        }
+        netif_tx_burst_retry(pq, &mmsg->mbufs[start], end - start);
     }
     free(mmsg);
 }
@@ -63,7 +78,7 @@ static void tx_msg_slave_ingress(struct rte_mbuf **mbufs, uint16_t rx_len) {
     kni_slave_lcore = rte_get_next_lcore(kni_slave_lcore, 1, 1);
     int s_cnt = ctrl_msg_slave_ingress((void **)&msg, 1, kni_slave_lcore);
     if (s_cnt != 1) {
-        log_msg(LOG_ERR, "Failed to send %u pkt to tx msg to slave_lcore %u\n", rx_len, kni_slave_lcore);
+        log_msg_ratelimit(LOG_ERR, "Failed to send %u pkt to tx msg to slave_lcore %u\n", rx_len, kni_slave_lcore);
         for (i = 0; i < rx_len; i++) {
             rte_pktmbuf_free(mbufs[i]);
         }
@@ -91,8 +106,9 @@ static void kni_msg_master_ingress(struct rte_mbuf **mbufs, uint16_t rx_len, str
 
     int s_cnt = ctrl_msg_master_ingress((void **)&msg, 1);
     if (s_cnt != 1) {
-        log_msg(LOG_ERR, "Failed to send %u pkt to kni msg\n", rx_len);
+        log_msg_ratelimit(LOG_ERR, "Failed to send %u pkt to kni msg\n", rx_len);
         conf->stats.pkt_dropped += (uint64_t)rx_len;
+        conf->stats.drop_ring_full += (uint64_t)rx_len;
         for (i = 0; i < rx_len; i++) {
             rte_pktmbuf_free(mbufs[i]);
         }
@@ -102,7 +118,16 @@ static void kni_msg_master_ingress(struct rte_mbuf **mbufs, uint16_t rx_len, str
     }
 }
 
-static int packet_process(struct rte_mbuf *pkt, struct netif_queue_conf *conf, unsigned lcore_id) {
+/* the dns packets of one rx burst, between the stages */
+struct dns_pkt_burst {
+    uint16_t len;
+    struct rte_mbuf *mbufs[NETIF_MAX_PKT_BURST];
+    kdns_query_st *queries[NETIF_MAX_PKT_BURST];
+    uint16_t old_flags[NETIF_MAX_PKT_BURST];
+};
+
+/* stage 1: check the headers, hand non-dns packets to kni and prepare the dns queries */
+static void packet_classify(struct rte_mbuf *pkt, struct dns_pkt_burst *burst, struct netif_queue_conf *conf, unsigned lcore_id) {
     uint16_t ether_hdr_offset = sizeof(struct ether_hdr);
     uint16_t ip_hdr_offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr);
     uint16_t udp_hdr_offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr);
@@ -111,32 +136,29 @@ static int packet_process(struct rte_mbuf *pkt, struct netif_queue_conf *conf, u
     struct ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, ether_hdr_offset);
     struct udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *, ip_hdr_offset);
 
-#ifdef ENABLE_KDNS_METRICS
-    uint64_t start_time = time_now_usec();
-#endif
-
     conf->stats.pkts_rcv++;
     if (unlikely(eth_hdr->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4))) {
         conf->kni_mbufs[conf->kni_len++] = pkt;
-        return 0;
+        return;
     }
     if (unlikely(rate_limit(ipv4_hdr->src_addr, RATE_LIMIT_TYPE_ALL, lcore_id) != 0)) {
         conf->stats.pkt_dropped++;
+        conf->stats.drop_rate_limit++;
         rte_pktmbuf_free(pkt);
-        return 0;
+        return;
     }
     uint16_t ip_hdr_len = (ipv4_hdr->version_ihl & IPV4_HDR_IHL_MASK) * IPV4_IHL_MULTIPLIER;
     uint16_t ip_total_length = rte_be_to_cpu_16(ipv4_hdr->total_length);
     if (unlikely(ip_hdr_len != sizeof(struct ipv4_hdr) || ip_total_length < ip_hdr_len || pkt->pkt_len < (sizeof(struct ether_hdr) + ip_total_length))) {
-        log_msg(LOG_ERR, "illegal pkt: pkt_len(%d), ip_hdr_len(%d), ip_total_length(%d)\n", pkt->pkt_len, ip_hdr_len, ip_total_length);
+        log_msg_ratelimit(LOG_ERR, "illegal pkt: pkt_len(%d), ip_hdr_len(%d), ip_total_length(%d)\n", pkt->pkt_len, ip_hdr_len, ip_total_length);
         conf->stats.pkt_len_err++;
         conf->stats.pkt_dropped++;
         rte_pktmbuf_free(pkt);
-        return 0;
+        return;
     }
     if (unlikely(ipv4_hdr->next_proto_id != IPPROTO_UDP || udp_hdr->dst_port != UDP_PORT_53)) {
         conf->kni_mbufs[conf->kni_len++] = pkt;
-        return 0;
+        return;
     }
 
     conf->stats.dns_pkts_rcv++;
@@ -145,31 +167,56 @@ static int packet_process(struct rte_mbuf *pkt, struct netif_queue_conf *conf, u
     uint16_t udp_dgram_len = rte_be_to_cpu_16(udp_hdr->dgram_len);
     int query_len = udp_dgram_len - sizeof(struct udp_hdr);
     if (unlikely((ip_total_length != (sizeof(struct ipv4_hdr) + udp_dgram_len) || query_len < DNS_HEAD_SIZE))) {
-        log_msg(LOG_ERR, "illegal pkt: ip_total_length(%d), udp_dgram_len(%d), query_len(%d)\n", ip_total_length, udp_dgram_len, query_len);
+        log_msg_ratelimit(LOG_ERR, "illegal pkt: ip_total_length(%d), udp_dgram_len(%d), query_len(%d)\n", ip_total_length, udp_dgram_len, query_len);
         conf->stats.pkt_len_err++;
         conf->stats.pkt_dropped++;
         rte_pktmbuf_free(pkt);
-        return 0;
+        return;
     }
 
     uint8_t *query_data = rte_pktmbuf_mtod_offset(pkt, uint8_t *, udp_hdr_offset);
-    uint16_t old_flag = *(((uint16_t *)query_data) + 1);
+    burst->old_flags[burst->len] = *(((uint16_t *)query_data) + 1);
+    burst->queries[burst->len] = dns_packet_prepare(ipv4_hdr->src_addr, query_data, query_len, burst->len, lcore_id);
+    burst->mbufs[burst->len++] = pkt;
+}
+
+/* stage 3: forward the refused queries, build the answer packets and buffer them for tx */
+static void packet_answer(struct rte_mbuf *pkt, kdns_query_st *query, uint16_t old_flag, struct netif_port_queue *pq, struct netif_queue_conf *conf,
+                          uint64_t rx_tsc, unsigned lcore_id) {
+    uint16_t ether_hdr_offset = sizeof(struct ether_hdr);
+    uint16_t ip_hdr_offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr);
+    uint16_t udp_hdr_offset = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr);
+
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    struct ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, ether_hdr_offset);
+    struct udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(pkt, struct udp_hdr *, ip_hdr_offset);
 
-    kdns_query_st *query = dns_packet_proess(ipv4_hdr->src_addr, query_data, query_len, lcore_id);
     if (unlikely(GET_RCODE(query->packet) == RCODE_REFUSE)) {
         if (unlikely(rate_limit(ipv4_hdr->src_addr, RATE_LIMIT_TYPE_FWD, lcore_id) != 0)) {
             conf->stats.pkt_dropped++;
+            conf->stats.drop_rate_limit++;
             rte_pktmbuf_free(pkt);
-            return 0;
+            return;
         }
 
+        querylog_response(query, ipv4_hdr->src_addr, QUERYLOG_FLAG_FORWARDED, 0, rx_tsc, lcore_id);
+        uint8_t *query_data = rte_pktmbuf_mtod_offset(pkt, uint8_t *, udp_hdr_offset);
         *(((uint16_t *)query_data) + 1) = old_flag;
         fwd_query_enqueue(pkt, ipv4_hdr->src_addr, GET_ID(query->packet), query->qtype, (char *)domain_name_to_string(query->qname, NULL));
-        return 0;
+        return;
+    }
+
+    if (unlikely(rrl_process(query, ipv4_hdr->src_addr, lcore_id) == RRL_DROP)) {
+        querylog_response(query, ipv4_hdr->src_addr, QUERYLOG_FLAG_DROPPED, 0, rx_tsc, lcore_id);
+        conf->stats.pkt_dropped++;
+        conf->stats.drop_rrl++;
+        rte_pktmbuf_free(pkt);
+        return;
     }
 
     int ret_len = buffer_remaining(query->packet);
     if (likely(ret_len > 0)) {
+        querylog_response(query, ipv4_hdr->src_addr, GET_FLAG_TC(query->packet) ? QUERYLOG_FLAG_TRUNCATED : 0, ret_len, rx_tsc, lcore_id);
         init_dns_packet_header(eth_hdr, ipv4_hdr, udp_hdr, ret_len);
         pkt->pkt_len = ret_len + udp_hdr_offset;
         pkt->data_len = pkt->pkt_len;
@@ -177,86 +224,153 @@ static int packet_process(struct rte_mbuf *pkt, struct netif_queue_conf *conf, u
         pkt->vlan_tci = ETHER_TYPE_IPv4;
         pkt->l3_len = sizeof(struct ipv4_hdr);
 
-        conf->tx_mbufs[conf->tx_len++] = pkt;
         conf->stats.dns_lens_snd += pkt->pkt_len;
+        netif_tx_buffer(pq, pkt);
     } else {
-        log_msg(LOG_ERR, "failed deal dns packet, ret %d\n", ret_len);
+        log_msg_ratelimit(LOG_ERR, "failed deal dns packet, ret %d\n", ret_len);
         conf->stats.pkt_dropped++;
+        conf->stats.drop_answer_err++;
         rte_pktmbuf_free(pkt);
+    }
+}
+
+static uint16_t port_queue_process(struct netif_port_queue *pq, struct netif_queue_conf *conf, unsigned lcore_id) {
+    int i;
+    uint16_t rx_count;
+    struct rte_mbuf *mbufs[NETIF_MAX_PKT_BURST];
+    struct dns_pkt_burst burst;
+    struct latency_stats *latency = g_latency_stats[lcore_id];
+
+    rx_count = rte_eth_rx_burst(pq->port_id, pq->rx_queue_id, mbufs, NETIF_MAX_PKT_BURST);
+    if (unlikely(rx_count == 0)) {
         return 0;
     }
+    uint64_t rx_tsc = rte_rdtsc();
+    latency_burst_begin(latency);
+
+    conf->kni_len = 0;
+    burst.len = 0;
 
+    /* Prefetch PREFETCH_OFFSET packets */
+    for (i = 0; i < PREFETCH_OFFSET && i < rx_count; i++) {
+        rte_prefetch0(rte_pktmbuf_mtod(mbufs[i], void *));
+    }
+
+    /* Prefetch and classify already prefetched packets. */
+    for (i = 0; i < (rx_count - PREFETCH_OFFSET); i++) {
+        rte_prefetch0(rte_pktmbuf_mtod(mbufs[i + PREFETCH_OFFSET], void *));
+        /* the bonded port keeps the slave port id, answers must go back by the polled port */
+        mbufs[i]->port = pq->port_id;
+        packet_classify(mbufs[i], &burst, conf, lcore_id);
+    }
+
+    /* Classify remaining prefetched packets */
+    for (; i < rx_count; i++) {
+        mbufs[i]->port = pq->port_id;
+        packet_classify(mbufs[i], &burst, conf, lcore_id);
+    }
+    latency_stage_mark(latency, LATENCY_STAGE_PARSE);
+
+    /* stage 2: parse, lookup and encode the whole burst of queries */
+    if (likely(burst.len > 0)) {
+        dns_packet_burst_process(burst.len, lcore_id);
+    }
+
+    for (i = 0; i < burst.len; i++) {
+        packet_answer(burst.mbufs[i], burst.queries[i], burst.old_flags[i], pq, conf, rx_tsc, lcore_id);
+    }
 #ifdef ENABLE_KDNS_METRICS
-    metrics_data_update(&conf->stats.metrics, time_now_usec() - start_time);
+    /* every burst, independent of the latency sampling: each query is counted with its share of the burst time */
+    if (likely(burst.len > 0)) {
+        uint64_t query_us = (rte_rdtsc() - rx_tsc) * 1000000 / rte_get_tsc_hz() / burst.len;
+        for (i = 0; i < burst.len; i++) {
+            metrics_data_update(&conf->stats.metrics, query_us);
+        }
+    }
 #endif
-    return 0;
+
+    // send the pkts, keep buffering while the rx queue still has a full burst
+    if (rx_count < NETIF_MAX_PKT_BURST) {
+        netif_tx_flush(pq, rte_rdtsc());
+    }
+    latency_stage_mark(latency, LATENCY_STAGE_TX);
+
+    latency_burst_end(latency);
+    // snd to master
+    if (unlikely(conf->kni_len > 0)) {
+        kni_msg_master_ingress(conf->kni_mbufs, conf->kni_len, conf);
+    }
+    return rx_count;
 }
 
 int process_slave(__attribute__((unused)) void *arg) {
-    int i;
-    uint16_t rx_count, cp_count = 0;
-    uint64_t now_tsc, prev_tsc, intvl_tsc;
-    struct rte_mbuf *mbufs[NETIF_MAX_PKT_BURST];
+    uint16_t p, rx_count, cp_count = 0;
+    uint32_t i, idle_polls = 0;
+    uint64_t now_tsc, prev_tsc, intvl_tsc, end_tsc, idle_start_tsc = 0;
     unsigned lcore_id = rte_lcore_id();
 
     now_tsc = rte_rdtsc();
     prev_tsc = now_tsc;
     intvl_tsc = rte_get_timer_hz() / 1000;  //1ms
+    uint64_t idle_intvl_tsc = rte_get_timer_hz() / 1000000 * g_dns_cfg->netdev.poll_idle_us;
+    uint64_t drain_tsc = rte_get_timer_hz() / 1000000 * NETIF_TX_DRAIN_US;
 
+    /* build the domain store and the per-lcore state on this lcore, so the memory is local to its numa node */
     kdns_init(lcore_id);
     rate_limit_init(lcore_id);
+    rrl_init(lcore_id);
+    topk_init(lcore_id);
+    latency_stats_init(lcore_id, g_dns_cfg->comm.latency_sample);
 
+    struct topk_ctrl *topk = g_topk_ctrls[lcore_id];
     struct netif_queue_conf *conf = netif_queue_conf_get(lcore_id);
-    log_msg(LOG_INFO, "Starting slave on core %u: rx %u, tx %u\n", lcore_id, conf->rx_queue_id, conf->tx_queue_id);
+    for (p = 0; p < conf->nb_ports; p++) {
+        log_msg(LOG_INFO, "Starting slave on core %u: port %u, rx %u, tx %u\n", lcore_id,
+                conf->port_queues[p].port_id, conf->port_queues[p].rx_queue_id, conf->port_queues[p].tx_queue_id);
+    }
+    if (idle_intvl_tsc && netif_rx_intr_register(conf) != 0) {
+        log_msg(LOG_ERR, "rx interrupts unavailable on core %u, backing off with pause only\n", lcore_id);
+    }
+
     while (1) {
         now_tsc = rte_rdtsc();
         if (cp_count || now_tsc - prev_tsc > intvl_tsc) {
             prev_tsc = now_tsc;
             config_reload_pre_core(lcore_id);
             cp_count = ctrl_msg_slave_process(lcore_id);
+            topk_window_check(topk, now_tsc);
         }
 
-        rx_count = rte_eth_rx_burst(conf->port_id, conf->rx_queue_id, mbufs, NETIF_MAX_PKT_BURST);
-        if (unlikely(rx_count == 0)) {
-            continue;
-        }
-
-        conf->tx_len = 0;
-        conf->kni_len = 0;
-
-        /* Prefetch PREFETCH_OFFSET packets */
-        for (i = 0; i < PREFETCH_OFFSET && i < rx_count; i++) {
-            rte_prefetch0(rte_pktmbuf_mtod(mbufs[i], void *));
-        }
-
-        /* Prefetch and Deal already prefetched packets. */
-        for (i = 0; i < (rx_count - PREFETCH_OFFSET); i++) {
-            rte_prefetch0(rte_pktmbuf_mtod(mbufs[i + PREFETCH_OFFSET], void *));
-            packet_process(mbufs[i], conf, lcore_id);
+        rx_count = 0;
+        for (p = 0; p < conf->nb_ports; p++) {
+            struct netif_port_queue *pq = &conf->port_queues[p];
+            rx_count += port_queue_process(pq, conf, lcore_id);
+            if (unlikely(now_tsc - pq->tx_flush_tsc > drain_tsc)) {
+                netif_tx_flush(pq, now_tsc);
+            }
         }
 
-        /* Deal remaining prefetched packets */
-        for (; i < rx_count; i++) {
-            packet_process(mbufs[i], conf, lcore_id);
+        if (likely(rx_count || cp_count)) {
+            idle_polls = 0;
+            conf->stats.cycles_busy += rte_rdtsc() - now_tsc;
+            continue;
         }
 
-        // send the pkts
-        if (likely(conf->tx_len > 0)) {
-            int ntx = rte_eth_tx_burst(conf->port_id, conf->tx_queue_id, conf->tx_mbufs, conf->tx_len);
-            conf->stats.dns_pkts_snd += ntx;
-            if (unlikely(ntx != conf->tx_len)) {
-                log_msg(LOG_ERR, "rx=%d, tx=%d, failed tx=%d, on slave=%u\n", rx_count, conf->tx_len, conf->tx_len - ntx, lcore_id);
-                int i = 0;
-                for (i = ntx; i < conf->tx_len; i++) {
-                    rte_pktmbuf_free(conf->tx_mbufs[i]);
+        /* adaptive polling: spin, back off with pause, then sleep until rx interrupt */
+        if (idle_intvl_tsc) {
+            if (idle_polls++ == 0) {
+                idle_start_tsc = now_tsc;
+            }
+            if (conf->rx_intr_en && now_tsc - idle_start_tsc > idle_intvl_tsc) {
+                netif_rx_intr_sleep(conf, RX_INTR_SLEEP_MS);
+            } else {
+                for (i = 0; i < RTE_MIN(idle_polls, IDLE_PAUSE_MAX); i++) {
+                    rte_pause();
                 }
-                conf->stats.pkt_dropped += ntx;
             }
         }
-        // snd to master
-        if (unlikely(conf->kni_len > 0)) {
-            kni_msg_master_ingress(conf->kni_mbufs, conf->kni_len, conf);
-        }
+        end_tsc = rte_rdtsc();
+        conf->stats.cycles_idle += end_tsc - now_tsc;
     }
     return 0;
 }
@@ -289,7 +403,7 @@ static int reset_master_affinity(void) {
 }
 
 int process_master(__attribute__((unused)) void *arg) {
-    uint16_t nb_ctrl = 0, nb_kni = 0, nb_fwd = 0;
+    uint16_t p, nb_ctrl = 0, nb_kni = 0, nb_fwd = 0;
     struct rte_mbuf *mbufs[NETIF_MAX_PKT_BURST];
     unsigned lcore_id = rte_lcore_id();
 
@@ -304,9 +418,13 @@ int process_master(__attribute__((unused)) void *arg) {
         config_reload_pre_core(lcore_id);
         nb_ctrl = ctrl_msg_master_process();
 
-        nb_kni = kni_ingress(mbufs, NETIF_MAX_PKT_BURST);
-        if (nb_kni > 0) {
-            tx_msg_slave_ingress(mbufs, nb_kni);
+        nb_kni = 0;
+        for (p = 0; p < kdns_net_device.nb_ports; p++) {
+            uint16_t nb_rx = kni_ingress(mbufs, NETIF_MAX_PKT_BURST, p);
+            if (nb_rx > 0) {
+                tx_msg_slave_ingress(mbufs, nb_rx);
+                nb_kni += nb_rx;
+            }
         }
 
         nb_fwd = fwd_response_dequeue(mbufs, NETIF_MAX_PKT_BURST);
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+
+#include "util.h"
+#include "netdev.h"
+#include "tcp_process.h"
+#include "forward.h"
+#include "query_stats.h"
+#include "latency_stats.h"
+#include "rrl.h"
+#include "querylog.h"
+#include "prometheus.h"
+
+#define PROM_BUF_INIT_SIZE          (64 * 1024)
+#define PROM_LATENCY_LE_MIN_BITS    (6)     /* histogram bounds of 2^n cycles, exact bucket bounds of the latency stats */
+#define PROM_LATENCY_LE_MAX_BITS    (32)
+#define PROM_PORTS_MAX              (NETIF_MAX_PORTS * (NETIF_MAX_PORTS + 1))
+
+/* per lcore counters of struct netif_queue_stats */
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} prom_lcore_counters[] = {
+    {"kdns_packets_received_total", "Packets received from the nic.", offsetof(struct netif_queue_stats, pkts_rcv)},
+    {"kdns_kni_packets_total", "Packets passed to the kernel.", offsetof(struct netif_queue_stats, pkts_2kni)},
+    {"kdns_icmp_packets_total", "Icmp packets received.", offsetof(struct netif_queue_stats, pkts_icmp)},
+    {"kdns_queries_received_total", "Dns queries received over udp.", offsetof(struct netif_queue_stats, dns_pkts_rcv)},
+    {"kdns_responses_sent_total", "Dns responses sent over udp.", offsetof(struct netif_queue_stats, dns_pkts_snd)},
+    {"kdns_received_bytes_total", "Bytes of the dns queries received over udp.", offsetof(struct netif_queue_stats, dns_lens_rcv)},
+    {"kdns_sent_bytes_total", "Bytes of the dns responses sent over udp.", offsetof(struct netif_queue_stats, dns_lens_snd)},
+    {"kdns_packets_dropped_total", "Packets dropped by software.", offsetof(struct netif_queue_stats, pkt_dropped)},
+    {"kdns_rx_intr_sleeps_total", "Times the lcore slept until a rx interrupt.", offsetof(struct netif_queue_stats, rx_intr_sleeps)},
+};
+
+static const struct {
+    const char *reason;
+    size_t offset;
+} prom_lcore_drops[] = {
+    {"len_err", offsetof(struct netif_queue_stats, pkt_len_err)},
+    {"rate_limit", offsetof(struct netif_queue_stats, drop_rate_limit)},
+    {"rrl", offsetof(struct netif_queue_stats, drop_rrl)},
+    {"tx_full", offsetof(struct netif_queue_stats, drop_tx_full)},
+    {"ring_full", offsetof(struct netif_queue_stats, drop_ring_full)},
+    {"answer_err", offsetof(struct netif_queue_stats, drop_answer_err)},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} prom_port_counters[] = {
+    {"kdns_port_rx_packets_total", "Packets received by the port.", offsetof(struct rte_eth_stats, ipackets)},
+    {"kdns_port_tx_packets_total", "Packets sent by the port.", offsetof(struct rte_eth_stats, opackets)},
+    {"kdns_port_rx_bytes_total", "Bytes received by the port.", offsetof(struct rte_eth_stats, ibytes)},
+    {"kdns_port_tx_bytes_total", "Bytes sent by the port.", offsetof(struct rte_eth_stats, obytes)},
+    {"kdns_port_rx_missed_total", "Packets dropped by the port as the rx queues were full.", offsetof(struct rte_eth_stats, imissed)},
+    {"kdns_port_rx_errors_total", "Erroneous packets received by the port.", offsetof(struct rte_eth_stats, ierrors)},
+    {"kdns_port_tx_errors_total", "Packets the port failed to send.", offsetof(struct rte_eth_stats, oerrors)},
+    {"kdns_port_rx_nombuf_total", "Rx mbuf allocation failures of the port.", offsetof(struct rte_eth_stats, rx_nombuf)},
+};
+
+/*
+ * The text is rendered into one buffer kept across the scrapes, under the
+ * lock as the web server runs a thread per connection. The snapshots of
+ * the counters are kept with it so nothing large lives on the stack.
+ */
+static struct {
+    pthread_mutex_t lock;
+    char *data;
+    size_t len;
+    size_t cap;
+    int err;
+
+    struct netif_queue_stats lcores[RTE_MAX_LCORE];
+    struct query_stats query;
+    struct latency_hist hists[LATENCY_STAGE_MAX];
+    uint8_t port_ids[PROM_PORTS_MAX];
+    struct rte_eth_stats ports[PROM_PORTS_MAX];
+} prom_st = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void prom_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void prom_printf(const char *fmt, ...) {
+    int n;
+    size_t cap;
+    char *data;
+    va_list ap;
+
+    if (prom_st.err) {
+        return;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(prom_st.data + prom_st.len, prom_st.cap - prom_st.len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        prom_st.err = 1;
+        return;
+    }
+    if ((size_t)n >= prom_st.cap - prom_st.len) {
+        cap = RTE_MAX(prom_st.cap * 2, prom_st.len + n + 1);
+        data = realloc(prom_st.data, cap);
+        if (data == NULL) {
+            prom_st.err = 1;
+            return;
+        }
+        prom_st.data = data;
+        prom_st.cap = cap;
+        va_start(ap, fmt);
+        vsnprintf(prom_st.data + prom_st.len, prom_st.cap - prom_st.len, fmt, ap);
+        va_end(ap);
+    }
+    prom_st.len += n;
+}
+
+static void prom_family(const char *name, const char *type, const char *help) {
+    prom_printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* label values escape the backslash, the double quote and the line feed */
+static const char *prom_label_escape(const char *src, char *dst, size_t size) {
+    size_t i = 0;
+
+    for (; *src && i + 2 < size; src++) {
+        if (*src == '\\' || *src == '"') {
+            dst[i++] = '\\';
+            dst[i++] = *src;
+        } else if (*src == '\n') {
+            dst[i++] = '\\';
+            dst[i++] = 'n';
+        } else {
+            dst[i++] = *src;
+        }
+    }
+    dst[i] = '\0';
+    return dst;
+}
+
+static inline uint64_t prom_counter(const void *stats, size_t offset) {
+    return *(const uint64_t *)((const char *)stats + offset);
+}
+
+static void prom_lcores_render(void) {
+    unsigned lcore_id, i;
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        prom_st.lcores[lcore_id] = netif_queue_conf_get(lcore_id)->stats;
+    }
+
+    for (i = 0; i < RTE_DIM(prom_lcore_counters); i++) {
+        prom_family(prom_lcore_counters[i].name, "counter", prom_lcore_counters[i].help);
+        RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+            prom_printf("%s{lcore=\"%u\"} %" PRIu64 "\n", prom_lcore_counters[i].name, lcore_id,
+                        prom_counter(&prom_st.lcores[lcore_id], prom_lcore_counters[i].offset));
+        }
+    }
+
+    prom_family("kdns_drops_total", "counter", "Packets dropped by software, by reason.");
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        for (i = 0; i < RTE_DIM(prom_lcore_drops); i++) {
+            prom_printf("kdns_drops_total{lcore=\"%u\",reason=\"%s\"} %" PRIu64 "\n", lcore_id, prom_lcore_drops[i].reason,
+                        prom_counter(&prom_st.lcores[lcore_id], prom_lcore_drops[i].offset));
+        }
+    }
+
+    prom_family("kdns_lcore_cycles_total", "counter", "TSC cycles of the polls that got work (busy) or not (idle).");
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        prom_printf("kdns_lcore_cycles_total{lcore=\"%u\",state=\"busy\"} %" PRIu64 "\n", lcore_id, prom_st.lcores[lcore_id].cycles_busy);
+        prom_printf("kdns_lcore_cycles_total{lcore=\"%u\",state=\"idle\"} %" PRIu64 "\n", lcore_id, prom_st.lcores[lcore_id].cycles_idle);
+    }
+}
+
+static void prom_threads_render(void) {
+    struct netif_queue_stats sta;
+
+    memset(&sta, 0, sizeof(sta));
+    tcp_statsdata_total_get(&sta);
+    fwd_statsdata_total_get(&sta);
+
+    prom_family("kdns_tcp_queries_received_total", "counter", "Dns queries received over tcp.");
+    prom_printf("kdns_tcp_queries_received_total %" PRIu64 "\n", sta.dns_pkts_rcv_tcp);
+    prom_family("kdns_tcp_responses_sent_total", "counter", "Dns responses sent over tcp.");
+    prom_printf("kdns_tcp_responses_sent_total %" PRIu64 "\n", sta.dns_pkts_snd_tcp);
+
+    prom_family("kdns_forward_queries_total", "counter", "Queries forwarded upstream.");
+    prom_printf("kdns_forward_queries_total{proto=\"udp\"} %" PRIu64 "\n", sta.dns_fwd_rcv_udp);
+    prom_printf("kdns_forward_queries_total{proto=\"tcp\"} %" PRIu64 "\n", sta.dns_fwd_rcv_tcp);
+    prom_family("kdns_forward_responses_total", "counter", "Forwarded queries answered.");
+    prom_printf("kdns_forward_responses_total{proto=\"udp\"} %" PRIu64 "\n", sta.dns_fwd_snd_udp);
+    prom_printf("kdns_forward_responses_total{proto=\"tcp\"} %" PRIu64 "\n", sta.dns_fwd_snd_tcp);
+    prom_family("kdns_forward_lost_total", "counter", "Forwarded queries without an answer.");
+    prom_printf("kdns_forward_lost_total{proto=\"udp\"} %" PRIu64 "\n", sta.dns_fwd_lost_udp);
+    prom_printf("kdns_forward_lost_total{proto=\"tcp\"} %" PRIu64 "\n", sta.dns_fwd_lost_tcp);
+}
+
+/* the series which never counted are left out, they show up on their first count */
+static void prom_queries_render(void) {
+    unsigned i, j, zone_count;
+    char zone[2 * MAXDOMAINLEN + 1];
+    rrtype_descriptor_st *descriptor;
+
+    memset(&prom_st.query, 0, sizeof(prom_st.query));
+    query_stats_total_get(&prom_st.query);
+    zone_count = zone_stats_id_count();
+
+    prom_family("kdns_answers_total", "counter", "Answered queries by zone and rcode.");
+    for (i = 0; i < zone_count; i++) {
+        prom_label_escape(zone_stats_name_get(i), zone, sizeof(zone));
+        for (j = 0; j < QUERY_STATS_RCODE_MAX; j++) {
+            if (prom_st.query.zones[i].rcodes[j]) {
+                prom_printf("kdns_answers_total{zone=\"%s\",rcode=\"%s\"} %" PRIu64 "\n", zone, query_stats_rcode_name(j),
+                            prom_st.query.zones[i].rcodes[j]);
+            }
+        }
+    }
+
+    prom_family("kdns_answers_qtype_total", "counter", "Answered queries by qtype.");
+    for (i = 0; i < QUERY_STATS_QTYPE_MAX; i++) {
+        if (prom_st.query.qtypes[i] == 0) {
+            continue;
+        }
+        descriptor = rrtype_descriptor_by_type(i);
+        if (descriptor) {
+            prom_printf("kdns_answers_qtype_total{qtype=\"%s\"} %" PRIu64 "\n", descriptor->name, prom_st.query.qtypes[i]);
+        } else {
+            prom_printf("kdns_answers_qtype_total{qtype=\"TYPE%u\"} %" PRIu64 "\n", i, prom_st.query.qtypes[i]);
+        }
+    }
+}
+
+/* the cumulative buckets are summed from the same reads, so +Inf and _count agree with them */
+static void prom_latency_render(void) {
+    unsigned i, n, idx, bound;
+    uint64_t cum;
+    double hz = rte_get_tsc_hz();
+
+    memset(prom_st.hists, 0, sizeof(prom_st.hists));
+    latency_stats_total_get(prom_st.hists);
+
+    prom_family("kdns_latency_seconds", "histogram", "Stage latency of the sampled rx bursts.");
+    for (i = 0; i < LATENCY_STAGE_MAX; i++) {
+        struct latency_hist *hist = &prom_st.hists[i];
+        const char *stage = latency_stage_name(i);
+
+        for (n = PROM_LATENCY_LE_MIN_BITS, idx = 0, cum = 0; n <= PROM_LATENCY_LE_MAX_BITS; n++) {
+            bound = latency_hist_index(1ULL << n);
+            for (; idx < bound; idx++) {
+                cum += hist->buckets[idx];
+            }
+            prom_printf("kdns_latency_seconds_bucket{stage=\"%s\",le=\"%.6g\"} %" PRIu64 "\n", stage, (1ULL << n) / hz, cum);
+        }
+        for (; idx < LATENCY_HIST_BUCKETS; idx++) {
+            cum += hist->buckets[idx];
+        }
+        prom_printf("kdns_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", stage, cum);
+        prom_printf("kdns_latency_seconds_sum{stage=\"%s\"} %.9g\n", stage, hist->sum / hz);
+        prom_printf("kdns_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n", stage, cum);
+    }
+}
+
+static void prom_features_render(void) {
+    int i;
+    uint64_t log_dropped, log_suppressed;
+    struct rrl_stats rrl;
+    struct querylog_stats qlog;
+
+    memset(&rrl, 0, sizeof(rrl));
+    rrl_stats_get(&rrl);
+    prom_family("kdns_rrl_responses_total", "counter", "Responses accounted by the response rate limit, by class.");
+    for (i = 0; i < RRL_CLASS_MAX; i++) {
+        prom_printf("kdns_rrl_responses_total{class=\"%s\"} %" PRIu64 "\n", rrl_class_name(i), rrl.responses[i]);
+    }
+    prom_family("kdns_rrl_dropped_total", "counter", "Responses dropped by the response rate limit, by class.");
+    for (i = 0; i < RRL_CLASS_MAX; i++) {
+        prom_printf("kdns_rrl_dropped_total{class=\"%s\"} %" PRIu64 "\n", rrl_class_name(i), rrl.dropped[i]);
+    }
+    prom_family("kdns_rrl_slipped_total", "counter", "Responses truncated by the response rate limit, by class.");
+    for (i = 0; i < RRL_CLASS_MAX; i++) {
+        prom_printf("kdns_rrl_slipped_total{class=\"%s\"} %" PRIu64 "\n", rrl_class_name(i), rrl.slipped[i]);
+    }
+
+    querylog_stats_get(&qlog);
+    prom_family("kdns_querylog_records_total", "counter", "Responses sampled to the query log.");
+    prom_printf("kdns_querylog_records_total %" PRIu64 "\n", qlog.records);
+    prom_family("kdns_querylog_dropped_total", "counter", "Query log records dropped on a full ring.");
+    prom_printf("kdns_querylog_dropped_total %" PRIu64 "\n", qlog.dropped);
+    prom_family("kdns_querylog_written_bytes_total", "counter", "Bytes written to the query log.");
+    prom_printf("kdns_querylog_written_bytes_total %" PRIu64 "\n", qlog.bytes);
+    prom_family("kdns_querylog_write_errors_total", "counter", "Failed writes of the query log.");
+    prom_printf("kdns_querylog_write_errors_total %" PRIu64 "\n", qlog.write_errors);
+
+    log_stats_get(&log_dropped, &log_suppressed);
+    prom_family("kdns_log_dropped_total", "counter", "Log messages dropped on a full ring.");
+    prom_printf("kdns_log_dropped_total %" PRIu64 "\n", log_dropped);
+    prom_family("kdns_log_suppressed_total", "counter", "Log messages suppressed by the rate limit.");
+    prom_printf("kdns_log_suppressed_total %" PRIu64 "\n", log_suppressed);
+}
+
+/* the bonded ports and their slave ports */
+static void prom_ports_render(void) {
+    unsigned i, j, n = 0;
+
+    for (i = 0; i < kdns_net_device.nb_ports; i++) {
+        struct netif_port *port = &kdns_net_device.ports[i];
+        for (j = 0; j < port->nb_slaves && n < PROM_PORTS_MAX; j++) {
+            if (rte_eth_stats_get(port->slaves[j], &prom_st.ports[n]) == 0) {
+                prom_st.port_ids[n++] = port->slaves[j];
+            }
+        }
+        if (n < PROM_PORTS_MAX && rte_eth_stats_get(port->port_id, &prom_st.ports[n]) == 0) {
+            prom_st.port_ids[n++] = port->port_id;
+        }
+    }
+
+    for (i = 0; i < RTE_DIM(prom_port_counters); i++) {
+        prom_family(prom_port_counters[i].name, "counter", prom_port_counters[i].help);
+        for (j = 0; j < n; j++) {
+            prom_printf("%s{port=\"%u\"} %" PRIu64 "\n", prom_port_counters[i].name, prom_st.port_ids[j],
+                        prom_counter(&prom_st.ports[j], prom_port_counters[i].offset));
+        }
+    }
+}
+
+char *prometheus_metrics_get(int domain_num, int *len) {
+    char *text = NULL;
+
+    pthread_mutex_lock(&prom_st.lock);
+    if (prom_st.data == NULL) {
+        prom_st.data = malloc(PROM_BUF_INIT_SIZE);
+        prom_st.cap = prom_st.data ? PROM_BUF_INIT_SIZE : 0;
+    }
+    prom_st.len = 0;
+    prom_st.err = prom_st.data == NULL;
+
+    prom_family("kdns_domains", "gauge", "Domains loaded.");
+    prom_printf("kdns_domains %d\n", domain_num);
+    prom_lcores_render();
+    prom_threads_render();
+    prom_queries_render();
+    prom_latency_render();
+    prom_features_render();
+    prom_ports_render();
+
+    if (!prom_st.err) {
+        text = malloc(prom_st.len + 1);
+        if (text) {
+            memcpy(text, prom_st.data, prom_st.len + 1);
+            *len = prom_st.len;
+        }
+    }
+    pthread_mutex_unlock(&prom_st.lock);
+    return text;
+}
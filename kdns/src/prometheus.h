@@ -0,0 +1,16 @@
+#ifndef _PROMETHEUS_H_
+#define _PROMETHEUS_H_
+
+#include <stdint.h>
+
+#define PROMETHEUS_CONTENT_TYPE     "text/plain; version=0.0.4; charset=utf-8"
+
+/*
+ * Render the counters of the lcores and threads in the prometheus text
+ * format. The counters are the live ones, monotonic since the start, the
+ * statistics reset api does not touch them. Returns a malloc'ed copy of
+ * the text for the web server, NULL on failure.
+ */
+char *prometheus_metrics_get(int domain_num, int *len);
+
+#endif  /* _PROMETHEUS_H_ */
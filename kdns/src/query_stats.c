@@ -0,0 +1,94 @@
+#include <string.h>
+#include <pthread.h>
+#include <rte_malloc.h>
+
+#include "util.h"
+#include "query_stats.h"
+
+struct query_stats *g_query_stats[QUERY_STATS_SLOT_MAX];
+
+/*
+ * Sums at the last reset, the counters of the lcores and threads keep
+ * counting up. The lock orders the resets and the reads of the web threads.
+ */
+static struct query_stats query_stats_base;
+static pthread_mutex_t query_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const uint8_t query_stats_rcodes[RCODE_MASK + 1] = {
+    [RCODE_OK] = QUERY_STATS_NOERROR,
+    [RCODE_FORMAT] = QUERY_STATS_FORMERR,
+    [RCODE_SERVFAIL] = QUERY_STATS_SERVFAIL,
+    [RCODE_NXDOMAIN] = QUERY_STATS_NXDOMAIN,
+    [RCODE_IMPL] = QUERY_STATS_OTHER,
+    [RCODE_REFUSE] = QUERY_STATS_REFUSED,
+    [RCODE_YXDOMAIN ... RCODE_MASK] = QUERY_STATS_OTHER,
+};
+
+static const char *query_stats_rcode_names[QUERY_STATS_RCODE_MAX] = {
+    [QUERY_STATS_NOERROR] = "NOERROR",
+    [QUERY_STATS_FORMERR] = "FORMERR",
+    [QUERY_STATS_SERVFAIL] = "SERVFAIL",
+    [QUERY_STATS_NXDOMAIN] = "NXDOMAIN",
+    [QUERY_STATS_REFUSED] = "REFUSED",
+    [QUERY_STATS_OTHER] = "OTHER",
+};
+
+int query_stats_init(unsigned slot, int socket_id) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "query_stats_%u", slot);
+    g_query_stats[slot] = rte_zmalloc_socket(name, sizeof(struct query_stats), RTE_CACHE_LINE_SIZE, socket_id);
+    if (g_query_stats[slot] == NULL) {
+        log_msg(LOG_ERR, "unable to alloc the query stats of slot %u\n", slot);
+        exit(-1);
+    }
+    return 0;
+}
+
+void query_stats_total_get(struct query_stats *stats) {
+    unsigned slot, i, j;
+    unsigned zone_count = zone_stats_id_count();
+
+    for (slot = 0; slot < QUERY_STATS_SLOT_MAX; slot++) {
+        struct query_stats *slot_stats = g_query_stats[slot];
+        if (slot_stats == NULL) {
+            continue;
+        }
+        for (i = 0; i < zone_count; i++) {
+            for (j = 0; j < QUERY_STATS_RCODE_MAX; j++) {
+                stats->zones[i].rcodes[j] += slot_stats->zones[i].rcodes[j];
+            }
+        }
+        for (i = 0; i < QUERY_STATS_QTYPE_MAX; i++) {
+            stats->qtypes[i] += slot_stats->qtypes[i];
+        }
+    }
+}
+
+void query_stats_get(struct query_stats *stats) {
+    unsigned i, j;
+    unsigned zone_count = zone_stats_id_count();
+
+    pthread_mutex_lock(&query_stats_lock);
+    query_stats_total_get(stats);
+    for (i = 0; i < zone_count; i++) {
+        for (j = 0; j < QUERY_STATS_RCODE_MAX; j++) {
+            stats->zones[i].rcodes[j] -= query_stats_base.zones[i].rcodes[j];
+        }
+    }
+    for (i = 0; i < QUERY_STATS_QTYPE_MAX; i++) {
+        stats->qtypes[i] -= query_stats_base.qtypes[i];
+    }
+    pthread_mutex_unlock(&query_stats_lock);
+}
+
+void query_stats_reset(void) {
+    pthread_mutex_lock(&query_stats_lock);
+    memset(&query_stats_base, 0, sizeof(query_stats_base));
+    query_stats_total_get(&query_stats_base);
+    pthread_mutex_unlock(&query_stats_lock);
+}
+
+const char *query_stats_rcode_name(query_stats_rcode rcode) {
+    return query_stats_rcode_names[rcode];
+}
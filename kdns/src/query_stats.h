@@ -0,0 +1,67 @@
+#ifndef _QUERY_STATS_H_
+#define _QUERY_STATS_H_
+
+#include <rte_lcore.h>
+#include <rte_memory.h>
+#include "query.h"
+#include "packet.h"
+#include "zone.h"
+#include "tcp_process.h"
+#include "local_udp_process.h"
+
+#define QUERY_STATS_QTYPE_MAX       (256)   /* larger qtypes are counted as 0 */
+
+/* counters of the slave lcores are indexed by lcore id, then the threads */
+#define QUERY_STATS_SLOT_TCP        (RTE_MAX_LCORE)     /* the first tcp worker */
+#define QUERY_STATS_SLOT_LOCAL_UDP  (QUERY_STATS_SLOT_TCP + TCP_WORKER_MAX)    /* the first local udp worker */
+#define QUERY_STATS_SLOT_MAX        (QUERY_STATS_SLOT_LOCAL_UDP + LOCAL_UDP_WORKER_MAX)
+
+typedef enum {
+    QUERY_STATS_NOERROR,
+    QUERY_STATS_FORMERR,
+    QUERY_STATS_SERVFAIL,
+    QUERY_STATS_NXDOMAIN,
+    QUERY_STATS_REFUSED,
+    QUERY_STATS_OTHER,
+    QUERY_STATS_RCODE_MAX,
+} query_stats_rcode;
+
+/* one cache line of rcode counters per zone */
+struct query_zone_stats {
+    uint64_t rcodes[QUERY_STATS_RCODE_MAX];
+} __rte_cache_aligned;
+
+/*
+ * Answered queries of one lcore or thread, only written by their owner so
+ * no atomics are needed, and summed up by the readers.
+ */
+struct query_stats {
+    struct query_zone_stats zones[ZONE_STATS_MAX];
+    uint64_t qtypes[QUERY_STATS_QTYPE_MAX];
+} __rte_cache_aligned;
+
+extern struct query_stats *g_query_stats[QUERY_STATS_SLOT_MAX];
+extern const uint8_t query_stats_rcodes[RCODE_MASK + 1];
+
+int query_stats_init(unsigned slot, int socket_id);
+
+/* Count an answered query, the queries out of any zone are counted in zone 0 */
+static inline void query_stats_update(struct query_stats *stats, struct query *q) {
+    unsigned zone_id = q->zone ? q->zone->zonestatid : 0;
+
+    stats->zones[zone_id].rcodes[query_stats_rcodes[GET_RCODE(q->packet)]]++;
+    stats->qtypes[q->qtype < QUERY_STATS_QTYPE_MAX ? q->qtype : 0]++;
+}
+
+/* Sum up the counters of all the lcores and threads into stats, since the last reset */
+void query_stats_get(struct query_stats *stats);
+
+/* The same since the start */
+void query_stats_total_get(struct query_stats *stats);
+
+/* Snapshot the sums, the live counters are never cleared */
+void query_stats_reset(void);
+
+const char *query_stats_rcode_name(query_stats_rcode rcode);
+
+#endif  /* _QUERY_STATS_H_ */
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <rte_malloc.h>
+#include <rte_cycles.h>
+#include <rte_atomic.h>
+
+#include "util.h"
+#include "dns-conf.h"
+#include "querylog.h"
+
+#define QUERYLOG_RECORD_MAX         (2 + 24 + 1 + MAX_VIEW_NAME_LEN + 1 + MAXDOMAINLEN)
+#define QUERYLOG_BATCH_SIZE         (64 * 1024)
+#define QUERYLOG_WRITER_IDLE_US     (1000)
+
+struct querylog_ring *g_querylog_rings[RTE_MAX_LCORE];
+
+/* state of the writer thread */
+static struct {
+    int fd;
+    int is_socket;
+    uint64_t base_tsc;              /* tsc at base_tv, to turn the record tsc into time */
+    struct timeval base_tv;
+    uint64_t written;
+    uint64_t bytes;
+    uint64_t write_errors;
+    size_t len;
+    uint8_t buf[QUERYLOG_BATCH_SIZE];
+} querylog_writer_st = {.fd = -1};
+
+void querylog_push(struct querylog_ring *ring, struct query *q, uint32_t sip, uint8_t flags, uint16_t answer_len, uint64_t rx_tsc) {
+    struct querylog_entry *entry;
+    uint32_t head = ring->head;
+
+    if (unlikely(head - ring->tail >= ring->size)) {
+        ring->dropped++;
+        return;
+    }
+    entry = &ring->entries[head & (ring->size - 1)];
+    entry->tsc = rte_rdtsc();
+    entry->latency_cycles = rx_tsc ? entry->tsc - rx_tsc : 0;
+    entry->client = sip;
+    entry->qtype = q->qtype;
+    entry->answer_len = answer_len;
+    entry->rcode = GET_RCODE(q->packet);
+    entry->flags = flags;
+    entry->view_len = strnlen(q->view_name, MAX_VIEW_NAME_LEN);
+    memcpy(entry->view, q->view_name, entry->view_len);
+    entry->qname_len = q->qname->name_size;
+    memcpy(entry->qname, domain_name_get(q->qname), entry->qname_len);
+
+    rte_smp_wmb();
+    ring->head = head + 1;
+    ring->records++;
+}
+
+static int querylog_open(const char *dest) {
+    int fd;
+    struct sockaddr_un addr;
+
+    if (strncmp(dest, QUERYLOG_UNIX_PREFIX, strlen(QUERYLOG_UNIX_PREFIX)) != 0) {
+        fd = open(dest, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0) {
+            log_msg(LOG_ERR, "Cannot open query log %s: %s\n", dest, strerror(errno));
+            return -1;
+        }
+        querylog_writer_st.is_socket = 0;
+        return fd;
+    }
+
+    dest += strlen(QUERYLOG_UNIX_PREFIX);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, dest, sizeof(addr.sun_path));
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_msg(LOG_ERR, "Cannot create query log socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_msg_ratelimit(LOG_ERR, "Cannot connect query log socket %s: %s\n", dest, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    log_msg(LOG_INFO, "query log connected to %s\n", dest);
+    querylog_writer_st.is_socket = 1;
+    return fd;
+}
+
+static void querylog_flush(void) {
+    size_t off = 0;
+    ssize_t n;
+
+    if (querylog_writer_st.fd < 0) {
+        querylog_writer_st.len = 0;
+        return;
+    }
+    while (off < querylog_writer_st.len) {
+        if (querylog_writer_st.is_socket) {
+            n = send(querylog_writer_st.fd, querylog_writer_st.buf + off, querylog_writer_st.len - off, MSG_NOSIGNAL);
+        } else {
+            n = write(querylog_writer_st.fd, querylog_writer_st.buf + off, querylog_writer_st.len - off);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg_ratelimit(LOG_ERR, "query log write failed: %s\n", strerror(errno));
+            querylog_writer_st.write_errors++;
+            if (querylog_writer_st.is_socket) {
+                close(querylog_writer_st.fd);
+                querylog_writer_st.fd = -1;
+            }
+            break;
+        }
+        off += n;
+    }
+    querylog_writer_st.bytes += off;
+    querylog_writer_st.len = 0;
+}
+
+static void querylog_encode(struct querylog_entry *entry, unsigned lcore_id) {
+    uint8_t *p = querylog_writer_st.buf + querylog_writer_st.len;
+    uint64_t hz = rte_get_tsc_hz();
+    int64_t delta = (int64_t)(entry->tsc - querylog_writer_st.base_tsc);
+    int64_t usec = querylog_writer_st.base_tv.tv_usec + delta * 1000000 / (int64_t)hz;
+    uint32_t sec = querylog_writer_st.base_tv.tv_sec + usec / 1000000;
+    uint32_t latency_ns = RTE_MIN(entry->latency_cycles * 1000000000 / hz, (uint64_t)UINT32_MAX);
+    uint16_t len = 24 + 1 + entry->view_len + 1 + entry->qname_len;
+
+    usec %= 1000000;
+    if (usec < 0) {
+        usec += 1000000;
+        sec--;
+    }
+
+    *(uint16_t *)p = htons(len);
+    p[2] = QUERYLOG_VERSION;
+    p[3] = entry->flags;
+    *(uint32_t *)(p + 4) = htonl(sec);
+    *(uint32_t *)(p + 8) = htonl((uint32_t)usec);
+    *(uint32_t *)(p + 12) = entry->client;
+    *(uint16_t *)(p + 16) = htons(entry->qtype);
+    p[18] = entry->rcode;
+    p[19] = (uint8_t)lcore_id;
+    *(uint16_t *)(p + 20) = htons(entry->answer_len);
+    *(uint32_t *)(p + 22) = htonl(latency_ns);
+    p += 26;
+    *p++ = entry->view_len;
+    memcpy(p, entry->view, entry->view_len);
+    p += entry->view_len;
+    *p++ = entry->qname_len;
+    memcpy(p, entry->qname, entry->qname_len);
+
+    querylog_writer_st.len += 2 + len;
+    querylog_writer_st.written++;
+}
+
+static uint32_t querylog_drain(void) {
+    unsigned lcore_id;
+    uint32_t head, tail, n = 0;
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        struct querylog_ring *ring = g_querylog_rings[lcore_id];
+        if (ring == NULL) {
+            continue;
+        }
+        tail = ring->tail;
+        head = ring->head;
+        rte_smp_rmb();
+        for (; tail != head; tail++, n++) {
+            if (querylog_writer_st.len + QUERYLOG_RECORD_MAX > QUERYLOG_BATCH_SIZE) {
+                querylog_flush();
+            }
+            querylog_encode(&ring->entries[tail & (ring->size - 1)], lcore_id);
+        }
+        rte_smp_mb();
+        ring->tail = tail;
+    }
+    if (querylog_writer_st.len) {
+        querylog_flush();
+    }
+    return n;
+}
+
+static void *querylog_writer(void *arg) {
+    const char *dest = arg;
+    uint64_t hz = rte_get_tsc_hz(), now;
+
+    while (1) {
+        if (querylog_writer_st.fd < 0) {
+            querylog_writer_st.fd = querylog_open(dest);
+            if (querylog_writer_st.fd < 0) {
+                sleep(1);   //the rings fill up and drop meanwhile
+                continue;
+            }
+        }
+
+        /* keep the tsc to time base fresh, the tsc and the wall clock drift apart */
+        now = rte_rdtsc();
+        if (now - querylog_writer_st.base_tsc >= hz) {
+            gettimeofday(&querylog_writer_st.base_tv, NULL);
+            querylog_writer_st.base_tsc = rte_rdtsc();
+        }
+
+        if (querylog_drain() == 0) {
+            usleep(QUERYLOG_WRITER_IDLE_US);
+        }
+    }
+    return NULL;
+}
+
+int querylog_init(void) {
+    char name[32];
+    unsigned lcore_id;
+    pthread_t thread;
+    uint32_t size;
+    struct querylog_ring *ring;
+
+    if (g_dns_cfg->comm.query_log == NULL) {
+        log_msg(LOG_INFO, "query log is disabled!\n");
+        return 0;
+    }
+
+    size = rte_align32pow2(g_dns_cfg->comm.query_log_ring_size);
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        snprintf(name, sizeof(name), "querylog_ring_%u", lcore_id);
+        ring = rte_zmalloc_socket(name, sizeof(struct querylog_ring), RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+        if (ring == NULL) {
+            log_msg(LOG_ERR, "Failed to malloc query log ring: %s!\n", name);
+            exit(-1);
+        }
+        ring->entries = rte_zmalloc_socket(name, size * sizeof(struct querylog_entry), RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+        if (ring->entries == NULL) {
+            log_msg(LOG_ERR, "Failed to malloc query log entries: %s!\n", name);
+            exit(-1);
+        }
+        ring->size = size;
+        ring->sample_rate = g_dns_cfg->comm.query_log_sample;
+        ring->sample_countdown = ring->sample_rate;
+        g_querylog_rings[lcore_id] = ring;
+    }
+
+    querylog_writer_st.base_tsc = rte_rdtsc();
+    gettimeofday(&querylog_writer_st.base_tv, NULL);
+    if (pthread_create(&thread, NULL, querylog_writer, (void *)g_dns_cfg->comm.query_log) != 0) {
+        log_msg(LOG_ERR, "Cannot create the query log writer thread: %s\n", strerror(errno));
+        exit(-1);
+    }
+    pthread_setname_np(thread, "kdns_qlog");
+    log_msg(LOG_INFO, "query log to %s, sample 1 of %u responses, ring size %u\n", g_dns_cfg->comm.query_log,
+            g_dns_cfg->comm.query_log_sample, size);
+    return 0;
+}
+
+int querylog_reload(unsigned lcore_id) {
+    struct querylog_ring *ring = g_querylog_rings[lcore_id];
+
+    if (ring) {
+        ring->sample_rate = g_dns_cfg->comm.query_log_sample;
+        ring->sample_countdown = ring->sample_rate;
+    }
+    return 0;
+}
+
+void querylog_stats_get(struct querylog_stats *stats) {
+    unsigned lcore_id;
+
+    memset(stats, 0, sizeof(struct querylog_stats));
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        struct querylog_ring *ring = g_querylog_rings[lcore_id];
+        if (ring) {
+            stats->records += ring->records;
+            stats->dropped += ring->dropped;
+        }
+    }
+    stats->written = querylog_writer_st.written;
+    stats->bytes = querylog_writer_st.bytes;
+    stats->write_errors = querylog_writer_st.write_errors;
+    stats->connected = querylog_writer_st.fd >= 0;
+}
@@ -0,0 +1,97 @@
+#ifndef _QUERYLOG_H_
+#define _QUERYLOG_H_
+
+#include <stdint.h>
+#include <rte_lcore.h>
+#include <rte_memory.h>
+#include "query.h"
+
+/*
+ * Sampled query log. The slave lcores copy 1 of every query-log-sample
+ * responses into their own ring, a writer thread batches the rings to a
+ * file or to a unix stream socket ("unix:/path"). A full ring drops the
+ * record, the data plane never waits for the writer.
+ *
+ * The stream is a sequence of records, all integers in network order:
+ *
+ *     u16 len          length of the record after this field
+ *     u8  version      QUERYLOG_VERSION
+ *     u8  flags        QUERYLOG_FLAG_*
+ *     u32 sec, usec    time of the response
+ *     u32 client       ipv4 source address
+ *     u16 qtype
+ *     u8  rcode
+ *     u8  lcore
+ *     u16 answer_len   udp payload of the response, 0 if none was sent
+ *     u32 latency_ns   from the rx burst to the response
+ *     u8  view_len, view_len bytes of view name
+ *     u8  qname_len, qname_len bytes of wire format qname
+ */
+#define QUERYLOG_VERSION            (1)
+
+#define QUERYLOG_FLAG_FORWARDED     (0x1)   /* refused here, sent to the forwarder */
+#define QUERYLOG_FLAG_TRUNCATED     (0x2)
+#define QUERYLOG_FLAG_DROPPED       (0x4)   /* dropped by the response rate limit */
+
+#define QUERYLOG_UNIX_PREFIX        "unix:"
+
+struct querylog_entry {
+    uint64_t tsc;
+    uint64_t latency_cycles;
+    uint32_t client;
+    uint16_t qtype;
+    uint16_t answer_len;
+    uint8_t rcode;
+    uint8_t flags;
+    uint8_t view_len;
+    uint8_t qname_len;
+    char view[MAX_VIEW_NAME_LEN];
+    uint8_t qname[MAXDOMAINLEN];
+};
+
+/* ring of one slave lcore, the lcore only moves head, the writer only moves tail */
+struct querylog_ring {
+    volatile uint32_t head;
+    uint32_t sample_rate;           /* log 1 of every sample_rate responses, 0 for none */
+    uint32_t sample_countdown;
+    uint64_t records;
+    uint64_t dropped;
+
+    volatile uint32_t tail __rte_cache_aligned;
+
+    uint32_t size __rte_cache_aligned;
+    struct querylog_entry *entries;
+};
+
+extern struct querylog_ring *g_querylog_rings[RTE_MAX_LCORE];
+
+struct querylog_stats {
+    uint64_t records;
+    uint64_t dropped;
+    uint64_t written;
+    uint64_t bytes;
+    uint64_t write_errors;
+    int connected;
+};
+
+/* Allocate the rings of the slave lcores and start the writer, nothing if no query-log is set */
+int querylog_init(void);
+
+int querylog_reload(unsigned lcore_id);
+
+void querylog_push(struct querylog_ring *ring, struct query *q, uint32_t sip, uint8_t flags, uint16_t answer_len, uint64_t rx_tsc);
+
+/* Log the response if it is the sampled one */
+static inline void querylog_response(struct query *q, uint32_t sip, uint8_t flags, uint16_t answer_len, uint64_t rx_tsc, unsigned lcore_id) {
+    struct querylog_ring *ring = g_querylog_rings[lcore_id];
+
+    if (likely(ring == NULL || ring->sample_rate == 0 || --ring->sample_countdown)) {
+        return;
+    }
+    ring->sample_countdown = ring->sample_rate;
+    querylog_push(ring, q, sip, flags, answer_len, rx_tsc);
+}
+
+void querylog_stats_get(struct querylog_stats *stats);
+
+#endif  /* _QUERYLOG_H_ */
@@ -4,11 +4,8 @@
 
 #include <rte_common.h>
 #include <rte_eal.h>
+#include <rte_lcore.h>
 #include <rte_malloc.h>
-#include <rte_mempool.h>
-#include <rte_hash.h>
-#include <rte_mbuf.h>
-#include <rte_meter.h>
 #include <rte_cycles.h>
 #include <arpa/inet.h>
 
@@ -32,19 +29,60 @@
 
 #define EXCEEDED_LOG_PER_SECOND     (1)
 
+#define RATE_LIMIT_BUCKET_ENTRIES   (4)
+
+/* heavy hitter slots published per lcore and limited type */
+#define RATE_LIMIT_HH_SLOTS         (4096)
+#define RATE_LIMIT_HH_TYPES         (RATE_LIMIT_TYPE_EXCEEDED_LOG)
+/* a count is published every 1/4 of the fair share of an lcore */
+#define RATE_LIMIT_HH_STEP_DIV      (4)
+#define RATE_LIMIT_HH_CNT_MAX       (0xffffffu)
+
 typedef struct {
     uint32_t client_num;
+    uint32_t prefix_len;
+    uint32_t mask;          /* client prefix mask, network order */
+    uint32_t bucket_mask;
+    uint64_t tsc_hz;
     uint32_t rl_ps[RATE_LIMIT_TYPE_MAX];
+    uint32_t fair_ps[RATE_LIMIT_TYPE_MAX];  /* share of one rx lcore */
+    uint32_t hh_step[RATE_LIMIT_TYPE_MAX];
+    uint16_t peer_num;
+    uint16_t peers[MAX_CORES];              /* the other rx lcores */
 } rate_limit_ctrl;
 
+/*
+ * Counts of one client prefix in the current second. The table is set
+ * associative: a new client takes a free entry of its bucket, or evicts
+ * the one seen least recently, the one with the fewest queries among
+ * those seen in the same second. Busy clients stay, a flood of new
+ * sources only recycles the entries of the idle ones.
+ */
+typedef struct {
+    uint32_t key;
+    uint32_t sec;           /* second of the counts, 0 if the entry is free */
+    uint32_t cnt[RATE_LIMIT_TYPE_MAX];  /* admitted queries, exceeded logs */
+    uint32_t exceeded_cnt;  /* dropped since the last exceeded log */
+    uint32_t remote[RATE_LIMIT_HH_TYPES];   /* admitted by the other lcores */
+} rate_limit_entry;
+
 typedef struct {
-    uint32_t exceeded_cnt;
-    struct rte_meter_srtcm rl_meter[RATE_LIMIT_TYPE_MAX];
-} rate_limit_hnode;
+    rate_limit_entry entries[RATE_LIMIT_BUCKET_ENTRIES];
+} __rte_cache_aligned rate_limit_bucket;
 
 static rate_limit_ctrl rl_ctrl[MAX_CORES];
-static struct rte_hash *rl_hmap[MAX_CORES];
-static rate_limit_hnode *rl_harray[MAX_CORES];
+static rate_limit_bucket *rl_buckets[MAX_CORES];
+
+/*
+ * Heavy hitters of each lcore: the admitted count of a client in the
+ * current second, packed as key << 32 | (sec & 0xff) << 24 | count in a
+ * slot chosen by the client hash. Only the owner lcore writes its table,
+ * the others read it without locks to add up the count of a client over
+ * all rx queues. A slot shared by two clients holds the last one written,
+ * the other is then limited per lcore only. The tables are kept across
+ * reloads, as other lcores may be reading them.
+ */
+static volatile uint64_t *rl_hh[MAX_CORES];
 
 static const char *rl_type_str_array[RATE_LIMIT_TYPE_MAX] = {
     "all",
@@ -52,7 +90,7 @@ static const char *rl_type_str_array[RATE_LIMIT_TYPE_MAX] = {
     "exceeded log"
 };
 
-static inline const char *rate_limit_type_str(rate_limit_type type) {
+const char *rate_limit_type_str(rate_limit_type type) {
     if (unlikely(type < 0 || type >= RATE_LIMIT_TYPE_MAX)) {
         return "illegal type";
     }
@@ -60,119 +98,243 @@ static inline const char *rate_limit_type_str(rate_limit_type type) {
     return rl_type_str_array[type];
 }
 
+static inline uint32_t rate_limit_sec(uint64_t tsc_hz) {
+    return (uint32_t)(rte_rdtsc() / tsc_hz) + 1;
+}
+
+static inline uint32_t rate_limit_hh_slot(rate_limit_type type, uint32_t hash) {
+    return type * RATE_LIMIT_HH_SLOTS + ((hash >> 16) & (RATE_LIMIT_HH_SLOTS - 1));
+}
+
+static inline uint64_t rate_limit_hh_pack(uint32_t key, uint32_t sec, uint32_t cnt) {
+    return (uint64_t)key << 32 | (uint64_t)(sec & 0xff) << 24 | RTE_MIN(cnt, RATE_LIMIT_HH_CNT_MAX);
+}
+
+static inline int rate_limit_hh_match(uint64_t hh, uint32_t key, uint32_t sec) {
+    return (uint32_t)(hh >> 32) == key && ((hh >> 24) & 0xff) == (sec & 0xff);
+}
+
+/* queries of the client admitted by the other rx lcores in this second */
+static inline uint32_t rate_limit_hh_remote(const rate_limit_ctrl *ctrl, uint32_t slot, uint32_t key, uint32_t sec) {
+    uint16_t i;
+    uint32_t sum = 0;
+
+    for (i = 0; i < ctrl->peer_num; ++i) {
+        const volatile uint64_t *hh = rl_hh[ctrl->peers[i]];
+        uint64_t val;
+        if (hh == NULL) {
+            continue;
+        }
+        val = hh[slot];
+        if (rate_limit_hh_match(val, key, sec)) {
+            sum += val & RATE_LIMIT_HH_CNT_MAX;
+        }
+    }
+    return sum;
+}
+
+static inline int rate_limit_entry_older(const rate_limit_entry *a, const rate_limit_entry *b) {
+    if (a->sec != b->sec) {
+        return a->sec < b->sec;
+    }
+    return a->cnt[RATE_LIMIT_TYPE_ALL] + a->cnt[RATE_LIMIT_TYPE_FWD] < b->cnt[RATE_LIMIT_TYPE_ALL] + b->cnt[RATE_LIMIT_TYPE_FWD];
+}
+
+static inline rate_limit_entry *rate_limit_entry_get(rate_limit_bucket *bucket, uint32_t key, uint32_t sec) {
+    int i;
+    rate_limit_entry *entry, *victim = &bucket->entries[0];
+
+    for (i = 0; i < RATE_LIMIT_BUCKET_ENTRIES; ++i) {
+        entry = &bucket->entries[i];
+        if (entry->key == key && entry->sec != 0) {
+            if (entry->sec != sec) {
+                entry->sec = sec;
+                memset(entry->cnt, 0, sizeof(entry->cnt));
+                memset(entry->remote, 0, sizeof(entry->remote));
+            }
+            return entry;
+        }
+        if (rate_limit_entry_older(entry, victim)) {
+            victim = entry;
+        }
+    }
+
+    victim->key = key;
+    victim->sec = sec;
+    memset(victim->cnt, 0, sizeof(victim->cnt));
+    memset(victim->remote, 0, sizeof(victim->remote));
+    victim->exceeded_cnt = 0;
+    return victim;
+}
+
 int rate_limit(uint32_t sip, rate_limit_type type, unsigned lcore_id) {
-    int ret;
-    uint64_t now;
-    rate_limit_hnode *hnode;
+    uint32_t key, hash, sec, slot, admitted;
+    rate_limit_entry *entry;
+    rate_limit_ctrl *ctrl = &rl_ctrl[lcore_id];
 
-    if (unlikely(type < 0 || type >= RATE_LIMIT_TYPE_MAX)) {
-        log_msg(LOG_ERR, "rate limit illegal type %d\n", type);
+    if (unlikely(type < 0 || type >= RATE_LIMIT_HH_TYPES)) {
+        log_msg_ratelimit(LOG_ERR, "rate limit illegal type %d\n", type);
         return 0;
     }
-    if (rl_ctrl[lcore_id].rl_ps[type] == 0 || rl_ctrl[lcore_id].client_num == 0) {
+    if (ctrl->rl_ps[type] == 0 || ctrl->client_num == 0) {
         return 0;
     }
 
-    ret = rte_hash_lookup(rl_hmap[lcore_id], (const void *)&sip);
-    if (ret < 0) {
-        ret = rte_hash_add_key(rl_hmap[lcore_id], (const void *)&sip);
-        if (ret < 0) {
-            log_msg(LOG_ERR, "Failed to insert sip %s to hash table %d, ret %d!", inet_ntoa(*(struct in_addr *)&sip), lcore_id, ret);
-            return 0;
-        }
-    }
+    key = sip & ctrl->mask;
+    hash = DEFAULT_HASH_FUNC(&key, sizeof(key), 0);
+    sec = rate_limit_sec(ctrl->tsc_hz);
+    slot = rate_limit_hh_slot(type, hash);
+    entry = rate_limit_entry_get(&rl_buckets[lcore_id][hash & ctrl->bucket_mask], key, sec);
 
-    now = rte_rdtsc();
-    hnode = &rl_harray[lcore_id][ret];
-    if (rte_meter_srtcm_color_blind_check(&hnode->rl_meter[type], now, 1) == e_RTE_METER_RED) {
-        ++hnode->exceeded_cnt;
-        if (rte_meter_srtcm_color_blind_check(&hnode->rl_meter[RATE_LIMIT_TYPE_EXCEEDED_LOG], now, 1) != e_RTE_METER_RED) {
-            log_msg(LOG_ERR, "query from %s, %s rate limit exceeded %d, drop\n", inet_ntoa(*(struct in_addr *)&sip), rate_limit_type_str(type), hnode->exceeded_cnt);
-            hnode->exceeded_cnt = 0;
+    /*
+     * The count of the other lcores is read again every publish step, and
+     * on every query once this lcore is over its share of the limit.
+     */
+    if (entry->cnt[type] % ctrl->hh_step[type] == 0 || entry->cnt[type] >= ctrl->fair_ps[type]) {
+        entry->remote[type] = rate_limit_hh_remote(ctrl, slot, key, sec);
+    }
+    admitted = entry->cnt[type] + entry->remote[type];
+    if (admitted >= ctrl->rl_ps[type]) {
+        ++entry->exceeded_cnt;
+        if (entry->cnt[RATE_LIMIT_TYPE_EXCEEDED_LOG] < ctrl->rl_ps[RATE_LIMIT_TYPE_EXCEEDED_LOG]) {
+            ++entry->cnt[RATE_LIMIT_TYPE_EXCEEDED_LOG];
+            log_msg_ratelimit(LOG_ERR, "query from %s/%u, %s rate limit exceeded %d, drop\n", inet_ntoa(*(struct in_addr *)&key),
+                    ctrl->prefix_len, rate_limit_type_str(type), entry->exceeded_cnt);
+            entry->exceeded_cnt = 0;
         }
         return -1;
     }
 
+    if (++entry->cnt[type] % ctrl->hh_step[type] == 0) {
+        rl_hh[lcore_id][slot] = rate_limit_hh_pack(key, sec, entry->cnt[type]);
+    }
     return 0;
 }
 
 int rate_limit_init(unsigned lcore_id) {
-    int ret;
-    uint32_t i;
-    char name[RTE_HASH_NAMESIZE];
-    struct rte_hash_parameters hash_params;
-    struct rte_meter_srtcm_params meter_params[RATE_LIMIT_TYPE_MAX];
-    rate_limit_hnode tmp;
-
-    rl_ctrl[lcore_id].client_num = g_dns_cfg->comm.client_num;
-    rl_ctrl[lcore_id].rl_ps[RATE_LIMIT_TYPE_ALL] = g_dns_cfg->comm.all_per_second;
-    rl_ctrl[lcore_id].rl_ps[RATE_LIMIT_TYPE_FWD] = g_dns_cfg->comm.fwd_per_second;
-    rl_ctrl[lcore_id].rl_ps[RATE_LIMIT_TYPE_EXCEEDED_LOG] = EXCEEDED_LOG_PER_SECOND;
-    if (rl_ctrl[lcore_id].client_num == 0 || (rl_ctrl[lcore_id].rl_ps[RATE_LIMIT_TYPE_ALL] == 0 && rl_ctrl[lcore_id].rl_ps[RATE_LIMIT_TYPE_FWD] == 0)) {
+    uint32_t i, buckets;
+    unsigned peer;
+    char name[32];
+    rate_limit_ctrl *ctrl = &rl_ctrl[lcore_id];
+
+    ctrl->client_num = g_dns_cfg->comm.client_num;
+    ctrl->prefix_len = g_dns_cfg->comm.client_prefix_len;
+    ctrl->mask = htonl(ctrl->prefix_len ? ~0u << (32 - ctrl->prefix_len) : 0);
+    ctrl->tsc_hz = rte_get_tsc_hz();
+    ctrl->rl_ps[RATE_LIMIT_TYPE_ALL] = g_dns_cfg->comm.all_per_second;
+    ctrl->rl_ps[RATE_LIMIT_TYPE_FWD] = g_dns_cfg->comm.fwd_per_second;
+    ctrl->rl_ps[RATE_LIMIT_TYPE_EXCEEDED_LOG] = EXCEEDED_LOG_PER_SECOND;
+
+    ctrl->peer_num = 0;
+    RTE_LCORE_FOREACH_SLAVE(peer) {
+        if (peer != lcore_id) {
+            ctrl->peers[ctrl->peer_num++] = peer;
+        }
+    }
+    for (i = 0; i < RATE_LIMIT_HH_TYPES; ++i) {
+        ctrl->fair_ps[i] = ctrl->rl_ps[i] / (ctrl->peer_num + 1);
+        ctrl->hh_step[i] = RTE_MAX(ctrl->fair_ps[i] / RATE_LIMIT_HH_STEP_DIV, 1u);
+    }
+
+    if (ctrl->client_num == 0 || (ctrl->rl_ps[RATE_LIMIT_TYPE_ALL] == 0 && ctrl->rl_ps[RATE_LIMIT_TYPE_FWD] == 0)) {
         log_msg(LOG_INFO, "rate limit is disabled!\n");
         return 0;
     }
 
-    if (rl_hmap[lcore_id] == NULL) {
-        hash_params.name = name,
-        hash_params.entries = rl_ctrl[lcore_id].client_num,
-        hash_params.key_len = sizeof(uint32_t),
-        hash_params.hash_func = DEFAULT_HASH_FUNC,
-        hash_params.hash_func_init_val = 0,
-        hash_params.socket_id = rte_socket_id(),
-        snprintf(name, sizeof(name), "rl_hmap_%u", lcore_id);
-        rl_hmap[lcore_id] = rte_hash_create(&hash_params);
-        if (rl_hmap[lcore_id] == NULL) {
-            log_msg(LOG_ERR, "Failed to create hash table: %s!\n", name);
+    if (rl_buckets[lcore_id] == NULL) {
+        buckets = rte_align32pow2(RTE_MAX(ctrl->client_num / RATE_LIMIT_BUCKET_ENTRIES, 1u));
+        ctrl->bucket_mask = buckets - 1;
+        snprintf(name, sizeof(name), "rl_buckets_%u", lcore_id);
+        rl_buckets[lcore_id] = rte_zmalloc_socket(name, buckets * sizeof(rate_limit_bucket), RTE_CACHE_LINE_SIZE, rte_socket_id());
+        if (rl_buckets[lcore_id] == NULL) {
+            log_msg(LOG_ERR, "Failed to malloc rate limit table: %s!\n", name);
             exit(-1);
         }
     }
 
-    if (rl_harray[lcore_id] == NULL) {
-        snprintf(name, sizeof(name), "rl_harray_%u", lcore_id);
-        rl_harray[lcore_id] = rte_calloc(name, rl_ctrl[lcore_id].client_num, sizeof(rate_limit_hnode), 0);
-        if (rl_harray[lcore_id] == NULL) {
-            log_msg(LOG_ERR, "Failed to malloc hash array: %s!\n", name);
+    if (rl_hh[lcore_id] == NULL) {
+        snprintf(name, sizeof(name), "rl_hh_%u", lcore_id);
+        rl_hh[lcore_id] = rte_zmalloc_socket(name, RATE_LIMIT_HH_TYPES * RATE_LIMIT_HH_SLOTS * sizeof(uint64_t),
+                                             RTE_CACHE_LINE_SIZE, rte_socket_id());
+        if (rl_hh[lcore_id] == NULL) {
+            log_msg(LOG_ERR, "Failed to malloc heavy hitters table: %s!\n", name);
             exit(-1);
         }
     }
-
-    memset(&tmp, 0, sizeof(tmp));
-    for (i = 0; i < RATE_LIMIT_TYPE_MAX; ++i) {
-        if (rl_ctrl[lcore_id].rl_ps[i]) {
-            meter_params[i].cir = rl_ctrl[lcore_id].rl_ps[i];
-            meter_params[i].cbs = rl_ctrl[lcore_id].rl_ps[i];
-            meter_params[i].ebs = rl_ctrl[lcore_id].rl_ps[i] / 2;
-
-            ret = rte_meter_srtcm_config(&tmp.rl_meter[i], &meter_params[i]);
-            if (ret) {
-                log_msg(LOG_ERR, "Failed to init %s meter srtcm config!\n", rate_limit_type_str(i));
-                exit(-1);
-            }
-        }
-    }
-    for (i = 0; i < rl_ctrl[lcore_id].client_num; ++i) {
-        memcpy(&rl_harray[lcore_id][i], &tmp, sizeof(rate_limit_hnode));
-    }
     return 0;
 }
 
 void rate_limit_uninit(unsigned lcore_id) {
-    if (rl_harray[lcore_id]) {
-        rte_free(rl_harray[lcore_id]);
-        rl_harray[lcore_id] = NULL;
-    }
-    if (rl_hmap[lcore_id]) {
-        rte_hash_free(rl_hmap[lcore_id]);
-        rl_hmap[lcore_id] = NULL;
+    if (rl_buckets[lcore_id]) {
+        rte_free(rl_buckets[lcore_id]);
+        rl_buckets[lcore_id] = NULL;
     }
 }
 
 int rate_limit_reload(unsigned lcore_id) {
-    if (rl_ctrl[lcore_id].client_num != g_dns_cfg->comm.client_num) {
+    if (rl_ctrl[lcore_id].client_num != g_dns_cfg->comm.client_num ||
+        rl_ctrl[lcore_id].prefix_len != g_dns_cfg->comm.client_prefix_len) {
         rate_limit_uninit(lcore_id);
     }
 
     rate_limit_init(lcore_id);
     return 0;
-}
\ No newline at end of file
+}
+
+static int rate_limit_hitter_cmp(const void *a, const void *b) {
+    const rate_limit_hitter *ha = a, *hb = b;
+    return ha->queries < hb->queries ? 1 : ha->queries > hb->queries ? -1 : 0;
+}
+
+int rate_limit_heavy_hitters_get(rate_limit_hitter *hitters, int max) {
+    int type, num = 0, cap = 0, j;
+    uint32_t slot, sec, key;
+    unsigned lcore_id;
+    rate_limit_hitter *all = NULL, *tmp;
+
+    sec = rate_limit_sec(rte_get_tsc_hz());
+    for (type = 0; type < RATE_LIMIT_HH_TYPES; ++type) {
+        for (slot = type * RATE_LIMIT_HH_SLOTS; slot < (uint32_t)(type + 1) * RATE_LIMIT_HH_SLOTS; ++slot) {
+            /* a client is in the same slot on every lcore */
+            int first = num;
+            RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+                uint64_t val;
+                if (rl_hh[lcore_id] == NULL) {
+                    continue;
+                }
+                val = rl_hh[lcore_id][slot];
+                if (!rate_limit_hh_match(val, (uint32_t)(val >> 32), sec) || (val & RATE_LIMIT_HH_CNT_MAX) == 0) {
+                    continue;
+                }
+                key = (uint32_t)(val >> 32);
+                for (j = first; j < num && all[j].client != key; ++j)
+                    ;
+                if (j == num) {
+                    if (num == cap) {
+                        cap = cap ? cap * 2 : 256;
+                        tmp = realloc(all, cap * sizeof(rate_limit_hitter));
+                        if (tmp == NULL) {
+                            free(all);
+                            return -1;
+                        }
+                        all = tmp;
+                    }
+                    all[num].client = key;
+                    all[num].prefix_len = g_dns_cfg->comm.client_prefix_len;
+                    all[num].type = type;
+                    all[num].queries = 0;
+                    ++num;
+                }
+                all[j].queries += val & RATE_LIMIT_HH_CNT_MAX;
+            }
+        }
+    }
+
+    if (num > 0) {
+        qsort(all, num, sizeof(rate_limit_hitter), rate_limit_hitter_cmp);
+        num = RTE_MIN(num, max);
+        memcpy(hitters, all, num * sizeof(rate_limit_hitter));
+    }
+    free(all);
+    return num;
+}
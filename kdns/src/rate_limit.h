@@ -8,6 +8,13 @@ typedef enum {
     RATE_LIMIT_TYPE_MAX,
 } rate_limit_type;
 
+typedef struct {
+    uint32_t client;        /* client prefix, network order */
+    uint32_t prefix_len;
+    rate_limit_type type;
+    uint32_t queries;       /* admitted in the current second by all lcores */
+} rate_limit_hitter;
+
 int rate_limit(uint32_t sip, rate_limit_type type, unsigned lcore_id);
 
 int rate_limit_init(unsigned lcore_id);
@@ -16,5 +23,14 @@ void rate_limit_uninit(unsigned lcore_id);
 
 int rate_limit_reload(unsigned lcore_id);
 
+const char *rate_limit_type_str(rate_limit_type type);
+
+/*
+ * Fill hitters with up to max of the busiest clients of the current
+ * second, read from the heavy hitters the lcores publish. Returns the
+ * number filled, -1 if out of memory.
+ */
+int rate_limit_heavy_hitters_get(rate_limit_hitter *hitters, int max);
+
 #endif  /* _RATE_LIMIT_H_ */
 
@@ -0,0 +1,220 @@
+/*
+ * rrl.c -- response rate limiting, in the style of the BIND and NSD rrl.
+ */
+
+#include <rte_common.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_cycles.h>
+#include <rte_jhash.h>
+#include <arpa/inet.h>
+
+#include "kdns.h"
+#include "dns-conf.h"
+#include "packet.h"
+#include "rrl.h"
+
+/*
+ * Token bucket of one (client prefix, name, class). The table is direct
+ * mapped like the nsd one: a colliding key takes the bucket over with a
+ * full bucket of tokens.
+ */
+typedef struct {
+    uint64_t key;
+    uint32_t stamp;         /* second of the last refill, 0 if unused */
+    int32_t tokens;
+} rrl_bucket;
+
+typedef struct {
+    uint32_t rates[RRL_CLASS_MAX];
+    uint32_t slip;
+    uint32_t slip_cnt;
+    uint32_t prefix_len;
+    uint32_t mask;          /* client prefix mask, network order */
+    uint32_t table_size;
+    uint64_t tsc_hz;
+    int enabled;
+    rrl_bucket *table;
+    struct rrl_stats stats;
+} __rte_cache_aligned rrl_ctrl;
+
+static rrl_ctrl rrl_ctrls[MAX_CORES];
+
+static const char *rrl_class_names[RRL_CLASS_MAX] = {
+    "answer",
+    "nodata",
+    "nxdomain",
+    "error",
+};
+
+const char *rrl_class_name(rrl_class cls) {
+    if (unlikely(cls < 0 || cls >= RRL_CLASS_MAX)) {
+        return "illegal class";
+    }
+    return rrl_class_names[cls];
+}
+
+static inline uint32_t rrl_sec(uint64_t tsc_hz) {
+    return (uint32_t)(rte_rdtsc() / tsc_hz) + 1;
+}
+
+static inline rrl_class rrl_classify(struct query *q) {
+    switch (GET_RCODE(q->packet)) {
+    case RCODE_OK:
+        return GET_AN_COUNT(q->packet) ? RRL_CLASS_ANSWER : RRL_CLASS_NODATA;
+    case RCODE_NXDOMAIN:
+        return RRL_CLASS_NXDOMAIN;
+    default:
+        return RRL_CLASS_ERROR;
+    }
+}
+
+/* answers are limited per name, the negative ones per zone so random names share a bucket */
+static inline uint64_t rrl_key_hash(struct query *q, rrl_class cls, uint32_t prefix) {
+    uint32_t name = 0, type = (uint32_t)cls << 16;
+
+    if (cls == RRL_CLASS_ANSWER) {
+        name = q->qhash;
+        type |= q->qtype;
+    } else if (cls != RRL_CLASS_ERROR) {
+        name = q->zone ? q->zone->zonestatid : 0;
+    }
+    return (uint64_t)rte_jhash_3words(prefix, name, type, 0) << 32 | rte_jhash_3words(prefix, name, type, 0x9e3779b9);
+}
+
+/* keep the header and the question, with TC set */
+static void rrl_slip(struct query *q) {
+    size_t len = DNS_HEAD_SIZE;
+
+    if (GET_QD_COUNT(q->packet)) {
+        len += q->qname->name_size + 2 * sizeof(uint16_t);
+    }
+    SET_FLAG_TC(q->packet);
+    SET_AN_COUNT(q->packet, 0);
+    SET_NS_COUNT(q->packet, 0);
+    SET_AR_COUNT(q->packet, 0);
+    buffer_setlimit(q->packet, len);
+}
+
+rrl_action rrl_process(struct query *q, uint32_t sip, unsigned lcore_id) {
+    rrl_ctrl *ctrl = &rrl_ctrls[lcore_id];
+    rrl_bucket *b;
+    rrl_class cls;
+    uint32_t rate, now;
+    uint64_t key;
+
+    if (!ctrl->enabled) {
+        return RRL_SEND;
+    }
+
+    cls = rrl_classify(q);
+    ctrl->stats.responses[cls]++;
+    rate = ctrl->rates[cls];
+    if (rate == 0) {
+        return RRL_SEND;
+    }
+
+    key = rrl_key_hash(q, cls, sip & ctrl->mask);
+    b = &ctrl->table[key & (ctrl->table_size - 1)];
+    now = rrl_sec(ctrl->tsc_hz);
+    if (b->stamp == 0 || b->key != key) {
+        b->key = key;
+        b->stamp = now;
+        b->tokens = rate;
+    } else if (b->stamp != now) {
+        b->tokens = (int32_t)RTE_MIN((uint64_t)rate, (uint64_t)b->tokens + (uint64_t)(now - b->stamp) * rate);
+        b->stamp = now;
+    }
+
+    if (likely(b->tokens > 0)) {
+        b->tokens--;
+        return RRL_SEND;
+    }
+
+    if (ctrl->slip && ++ctrl->slip_cnt >= ctrl->slip) {
+        ctrl->slip_cnt = 0;
+        ctrl->stats.slipped[cls]++;
+        rrl_slip(q);
+        return RRL_SLIP;
+    }
+    ctrl->stats.dropped[cls]++;
+    return RRL_DROP;
+}
+
+int rrl_init(unsigned lcore_id) {
+    char name[32];
+    rrl_ctrl *ctrl = &rrl_ctrls[lcore_id];
+
+    ctrl->rates[RRL_CLASS_ANSWER] = g_dns_cfg->comm.rrl_responses_per_second;
+    ctrl->rates[RRL_CLASS_NODATA] = g_dns_cfg->comm.rrl_responses_per_second;
+    ctrl->rates[RRL_CLASS_NXDOMAIN] = g_dns_cfg->comm.rrl_nxdomains_per_second;
+    ctrl->rates[RRL_CLASS_ERROR] = g_dns_cfg->comm.rrl_errors_per_second;
+    ctrl->slip = g_dns_cfg->comm.rrl_slip;
+    ctrl->slip_cnt = 0;
+    ctrl->tsc_hz = rte_get_tsc_hz();
+    ctrl->enabled = ctrl->rates[RRL_CLASS_ANSWER] || ctrl->rates[RRL_CLASS_NXDOMAIN] || ctrl->rates[RRL_CLASS_ERROR];
+    if (!ctrl->enabled) {
+        log_msg(LOG_INFO, "rrl is disabled on lcore %u!\n", lcore_id);
+        return 0;
+    }
+
+    /* the table is read by the api, so it is kept once allocated */
+    if (ctrl->table == NULL) {
+        ctrl->table_size = rte_align32pow2(RTE_MAX(g_dns_cfg->comm.rrl_table_size, 1u));
+        snprintf(name, sizeof(name), "rrl_table_%u", lcore_id);
+        ctrl->table = rte_zmalloc_socket(name, ctrl->table_size * sizeof(rrl_bucket), RTE_CACHE_LINE_SIZE, rte_socket_id());
+        if (ctrl->table == NULL) {
+            log_msg(LOG_ERR, "Failed to malloc rrl table: %s!\n", name);
+            exit(-1);
+        }
+    } else if (ctrl->table_size != rte_align32pow2(RTE_MAX(g_dns_cfg->comm.rrl_table_size, 1u))) {
+        log_msg(LOG_ERR, "rrl table size of lcore %u stays %u until restart\n", lcore_id, ctrl->table_size);
+    }
+
+    if (ctrl->prefix_len != g_dns_cfg->comm.rrl_prefix_len) {
+        ctrl->prefix_len = g_dns_cfg->comm.rrl_prefix_len;
+        ctrl->mask = htonl(ctrl->prefix_len ? ~0u << (32 - ctrl->prefix_len) : 0);
+        memset(ctrl->table, 0, ctrl->table_size * sizeof(rrl_bucket));
+    }
+    return 0;
+}
+
+int rrl_reload(unsigned lcore_id) {
+    return rrl_init(lcore_id);
+}
+
+uint32_t rrl_lcore_stats_get(unsigned lcore_id, struct rrl_stats *stats, uint32_t *limited) {
+    uint32_t i, now, size;
+    rrl_ctrl *ctrl = &rrl_ctrls[lcore_id];
+    rrl_bucket *table = ctrl->table;
+
+    memcpy(stats, &ctrl->stats, sizeof(struct rrl_stats));
+    *limited = 0;
+    if (table == NULL || !ctrl->enabled) {
+        return 0;
+    }
+
+    /* read while the lcore updates it, a few buckets may be miscounted */
+    size = ctrl->table_size;
+    now = rrl_sec(rte_get_tsc_hz());
+    for (i = 0; i < size; i++) {
+        if (table[i].stamp == now && table[i].tokens <= 0) {
+            ++*limited;
+        }
+    }
+    return size;
+}
+
+void rrl_stats_get(struct rrl_stats *stats) {
+    int i;
+    unsigned lcore_id;
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        rrl_ctrl *ctrl = &rrl_ctrls[lcore_id];
+        for (i = 0; i < RRL_CLASS_MAX; i++) {
+            stats->responses[i] += ctrl->stats.responses[i];
+            stats->dropped[i] += ctrl->stats.dropped[i];
+            stats->slipped[i] += ctrl->stats.slipped[i];
+        }
+    }
+}
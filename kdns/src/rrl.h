@@ -0,0 +1,53 @@
+#ifndef _RRL_H_
+#define _RRL_H_
+
+#include <stdint.h>
+#include "query.h"
+
+/* response classes, each limited at its own rate */
+typedef enum {
+    RRL_CLASS_ANSWER,       /* NOERROR with answers, per qname and qtype */
+    RRL_CLASS_NODATA,       /* NOERROR without answers, per zone */
+    RRL_CLASS_NXDOMAIN,     /* per zone */
+    RRL_CLASS_ERROR,        /* other rcodes, per client prefix only */
+    RRL_CLASS_MAX,
+} rrl_class;
+
+typedef enum {
+    RRL_SEND,
+    RRL_SLIP,               /* the response was cut down to a truncated one */
+    RRL_DROP,
+} rrl_action;
+
+/* counters of one slave lcore, only written by it */
+struct rrl_stats {
+    uint64_t responses[RRL_CLASS_MAX];
+    uint64_t dropped[RRL_CLASS_MAX];
+    uint64_t slipped[RRL_CLASS_MAX];
+};
+
+int rrl_init(unsigned lcore_id);
+
+int rrl_reload(unsigned lcore_id);
+
+/*
+ * Account the response of an answered query to its (client prefix,
+ * name, class) bucket. When the bucket is out of tokens the response is
+ * dropped, or every rrl-slip'th time replaced by a truncated one so a
+ * real client can retry over tcp.
+ */
+rrl_action rrl_process(struct query *q, uint32_t sip, unsigned lcore_id);
+
+const char *rrl_class_name(rrl_class cls);
+
+/*
+ * Copy the counters of a slave lcore and count the buckets of its table
+ * that are out of tokens in the current second. Returns the table size,
+ * 0 if rrl is disabled on the lcore.
+ */
+uint32_t rrl_lcore_stats_get(unsigned lcore_id, struct rrl_stats *stats, uint32_t *limited);
+
+/* Sum the counters of the slave lcores into stats, without walking the tables */
+void rrl_stats_get(struct rrl_stats *stats);
+
+#endif  /* _RRL_H_ */
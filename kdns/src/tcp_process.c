@@ -1,5 +1,5 @@
 /*
- * tcp+process.c 
+ * tcp+process.c
  */
 
 #define _GNU_SOURCE
@@ -9,12 +9,15 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <rte_common.h>
 
 #include "netdev.h"
 #include "util.h"
@@ -25,274 +28,1067 @@
 #include "db_update.h"
 #include "query.h"
 #include "kdns-adap.h"
+#include "query_stats.h"
 #include "tcp_process.h"
 
+#define TCP_LISTEN_BACKLOG      (1024)
+#define TCP_EPOLL_EVENTS        (64)
+#define TCP_EPOLL_WAIT_MS       (100)       /* timeouts are checked at least this often */
+#define TCP_BUF_INIT_SIZE       (512)
+#define TCP_MSG_SIZE            (2 + TCP_MAX_MESSAGE_LEN)
+#define TCP_WBUF_HIGH           (TCP_MSG_SIZE)  /* stop reading queries while more answers are unsent */
+
+#define TCP_UPSTREAM_POOL_SIZE      (4)     /* connections of a worker to one upstream server */
+#define TCP_UPSTREAM_INFLIGHT_MAX   (256)   /* queries pipelined on one upstream connection */
+#define TCP_UPSTREAM_BACKOFF_MIN_MS (100)   /* doubled on each failed connect to a server */
+#define TCP_UPSTREAM_BACKOFF_MAX_MS (10000)
+
+/*
+ * Minimum query size is:
+ *
+ *     Size of the header (12)
+ *   + Root domain name   (1)
+ *   + Query class        (2)
+ *   + Query type         (2)
+ */
+#define TCP_QUERY_LEN_MIN       (DNS_HEAD_SIZE + 1 + sizeof(uint16_t) + sizeof(uint16_t))
+
 extern domain_fwd_addrs_ctrl g_fwd_addrs_ctrl;
 
-rte_rwlock_t tcp_lock;
-struct kdns tcp_kdns;
-static struct query *tcp_query;
-struct netif_queue_stats tcp_stats;
+/* the epoll events carry a pointer to one of these, told apart by their first member */
+typedef enum {
+    TCP_EV_LISTEN,
+    TCP_EV_CLIENT,
+    TCP_EV_UPSTREAM,
+} tcp_ev_type;
+
+typedef struct {
+    uint8_t *data;
+    uint32_t off;               /* consumed bytes */
+    uint32_t len;               /* filled bytes */
+    uint32_t size;
+} tcp_buf;
+
+struct tcp_conn;
+struct tcp_upstream;
+
+/* a refused query forwarded to the upstream servers for a client connection */
+typedef struct tcp_fwd {
+    struct tcp_conn *conn;
+    struct tcp_upstream *up;    /* the upstream connection it is in flight on */
+    struct tcp_fwd *prev;       /* in the in flight list of up */
+    struct tcp_fwd *next;
+    struct tcp_fwd *next_dead;
+
+    int server_idx;
+    int servers_len;
+    dns_addr_t servers[FWD_MAX_ADDRS];
+    uint64_t deadline_ms;
+
+    uint16_t id;                /* query id on the upstream connection */
+    uint16_t qtype;
+    char domain[FWD_MAX_DOMAIN_NAME_LEN];
+    tcp_buf query;              /* the query with its length prefix, as received */
+} tcp_fwd;
+
+/* the persistent connections of a worker to one upstream server */
+typedef struct tcp_pool {
+    dns_addr_t addr;
+    struct tcp_upstream *conns[TCP_UPSTREAM_POOL_SIZE];
+    uint32_t fails;             /* connects failed in a row */
+    uint64_t retry_ms;          /* no new connection before, while backing off */
+    struct tcp_pool *next;
+} tcp_pool;
+
+/* a pooled upstream connection, the forwarded queries of any client are pipelined on it */
+typedef struct tcp_upstream {
+    tcp_ev_type ev_type;
+    int fd;
+    uint8_t connected;
+    uint32_t events;            /* epoll events registered */
+    tcp_pool *pool;
+    unsigned slot;              /* slot in the pool conns */
+    struct tcp_upstream *next_dead;
+
+    uint16_t next_id;
+    uint32_t inflight_num;
+    uint64_t answered;
+    tcp_fwd *inflight;          /* sent queries, matched to the responses by the rewritten id */
+    tcp_buf wbuf;               /* queries not yet sent */
+    tcp_buf rbuf;               /* received bytes of the responses */
+} tcp_upstream;
+
+/* a client connection, its queries are answered in order */
+typedef struct tcp_conn {
+    tcp_ev_type ev_type;
+    int fd;
+    uint32_t idx;               /* slot in the worker conns */
+    uint32_t events;            /* epoll events registered */
+    uint8_t closing;            /* the client closed its side, close once all is answered */
+    struct tcp_conn *next_dead;
+
+    struct sockaddr_in addr;
+    uint64_t active_ms;
+
+    tcp_buf rbuf;               /* received bytes not yet answered */
+    tcp_buf wbuf;               /* answers not yet sent */
+    tcp_fwd *fwd;               /* forwarding query, the later queries wait for it */
+} tcp_conn;
+
+/*
+ * One tcp server thread. Every worker listens on its own SO_REUSEPORT
+ * socket and owns its store, so the workers only share the master view
+ * tree and the forward addresses.
+ */
+typedef struct tcp_worker {
+    tcp_ev_type ev_type;
+    unsigned id;
+    int lfd;
+    int efd;
+    pthread_t thread;
+
+    rte_rwlock_t lock;          /* held for write by the updates from the master */
+    struct kdns kdns;
+    struct query *query;
+    uint8_t msg_buf[TCP_MAX_MESSAGE_LEN];   /* backs query->packet, answers are built in place */
+    struct netif_queue_stats stats;
+
+    uint32_t conn_num;
+    uint32_t conn_max;
+    tcp_conn **conns;
+    uint64_t idle_timeout_ms;
+
+    tcp_pool *pools;            /* by upstream server */
+
+    /* freed after the epoll events being handled, which may still point to them */
+    tcp_conn *dead_conns;
+    tcp_fwd *dead_fwds;
+    tcp_upstream *dead_ups;
+} tcp_worker;
+
+static tcp_worker *tcp_workers[TCP_WORKER_MAX];
+static unsigned tcp_worker_num;
+
+static void tcp_conn_process(tcp_worker *worker, tcp_conn *conn);
+
+void tcp_statsdata_total_get(struct netif_queue_stats *sta) {
+    unsigned i;
+
+    for (i = 0; i < tcp_worker_num; i++) {
+        struct netif_queue_stats *stats = &tcp_workers[i]->stats;
+        sta->dns_fwd_rcv_tcp += stats->dns_fwd_rcv_tcp;
+        sta->dns_fwd_snd_tcp += stats->dns_fwd_snd_tcp;
+        sta->dns_fwd_lost_tcp += stats->dns_fwd_lost_tcp;
+        sta->dns_pkts_rcv_tcp += stats->dns_pkts_rcv_tcp;
+        sta->dns_pkts_snd_tcp += stats->dns_pkts_snd_tcp;
+    }
+}
+
+/*
+ * Counters of all the workers at the last reset, the workers keep counting
+ * up. The lock orders the resets and the reads of the web threads.
+ */
+static struct netif_queue_stats tcp_stats_base;
+static pthread_mutex_t tcp_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void tcp_statsdata_get(struct netif_queue_stats *sta) {
-    sta->dns_fwd_rcv_tcp = tcp_stats.dns_fwd_rcv_tcp;
-    sta->dns_fwd_snd_tcp = tcp_stats.dns_fwd_snd_tcp;
-    sta->dns_fwd_lost_tcp = tcp_stats.dns_fwd_lost_tcp;
-    sta->dns_pkts_rcv_tcp = tcp_stats.dns_pkts_rcv_tcp;
-    sta->dns_pkts_snd_tcp = tcp_stats.dns_pkts_snd_tcp;
+    struct netif_queue_stats total = {0};
+
+    pthread_mutex_lock(&tcp_stats_lock);
+    tcp_statsdata_total_get(&total);
+    sta->dns_fwd_rcv_tcp += total.dns_fwd_rcv_tcp - tcp_stats_base.dns_fwd_rcv_tcp;
+    sta->dns_fwd_snd_tcp += total.dns_fwd_snd_tcp - tcp_stats_base.dns_fwd_snd_tcp;
+    sta->dns_fwd_lost_tcp += total.dns_fwd_lost_tcp - tcp_stats_base.dns_fwd_lost_tcp;
+    sta->dns_pkts_rcv_tcp += total.dns_pkts_rcv_tcp - tcp_stats_base.dns_pkts_rcv_tcp;
+    sta->dns_pkts_snd_tcp += total.dns_pkts_snd_tcp - tcp_stats_base.dns_pkts_snd_tcp;
+    pthread_mutex_unlock(&tcp_stats_lock);
 }
 
 void tcp_statsdata_reset(void) {
-    memset(&tcp_stats, 0, sizeof(tcp_stats));
+    pthread_mutex_lock(&tcp_stats_lock);
+    memset(&tcp_stats_base, 0, sizeof(tcp_stats_base));
+    tcp_statsdata_total_get(&tcp_stats_base);
+    pthread_mutex_unlock(&tcp_stats_lock);
 }
 
 int tcp_domian_databd_update(struct domin_info_update *update) {
-    rte_rwlock_write_lock(&tcp_lock);
-    int ret = domaindata_update(tcp_kdns.db, update);
-    rte_rwlock_write_unlock(&tcp_lock);
+    unsigned i;
+    int ret = 0;
+
+    for (i = 0; i < tcp_worker_num; i++) {
+        rte_rwlock_write_lock(&tcp_workers[i]->lock);
+        ret |= domaindata_update(tcp_workers[i]->kdns.db, update);
+        rte_rwlock_write_unlock(&tcp_workers[i]->lock);
+    }
     return ret;
 }
 
-static int tcp_process_query(char *snd_buf, ssize_t snd_len, char *rvc_buf, ssize_t rcv_len, dns_addr_t *id_addr, int timeout) {
-    int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock_fd == -1) {
-        log_msg(LOG_ERR, "tcp_process_query sock errno=%d, errinfo=%s\n", errno, strerror(errno));
-        return -1;
+void tcp_kdns_update(int (*update)(struct kdns *kdns)) {
+    unsigned i;
+
+    for (i = 0; i < tcp_worker_num; i++) {
+        rte_rwlock_write_lock(&tcp_workers[i]->lock);
+        update(&tcp_workers[i]->kdns);
+        rte_rwlock_write_unlock(&tcp_workers[i]->lock);
     }
+}
 
-    struct timeval tv = {timeout, 0};
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        log_msg(LOG_ERR, "tcp_process_query socket option SO_RCVTIMEO errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
+static uint64_t tcp_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int tcp_buf_reserve(tcp_buf *buf, uint32_t count) {
+    if (buf->off && buf->off == buf->len) {
+        buf->off = buf->len = 0;
     }
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-        log_msg(LOG_ERR, "tcp_process_query socket option SO_SNDTIMEO errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
+    if (buf->len + count <= buf->size) {
+        return 0;
+    }
+    /* move the unconsumed bytes to the front before growing */
+    if (buf->off) {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
+        if (buf->len + count <= buf->size) {
+            return 0;
+        }
     }
 
-    int ret = connect(sock_fd, &id_addr->addr, id_addr->addrlen);
-    if (-1 == ret) {
-        log_msg(LOG_ERR, "tcp_process_query connect errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
+    uint32_t size = buf->size ? buf->size : TCP_BUF_INIT_SIZE;
+    while (size < buf->len + count) {
+        size *= 2;
+    }
+    uint8_t *data = realloc(buf->data, size);
+    if (data == NULL) {
+        log_msg(LOG_ERR, "unable to grow tcp buffer to %u\n", size);
         return -1;
     }
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+static void tcp_buf_free(tcp_buf *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(tcp_buf));
+}
+
+static inline uint32_t tcp_buf_pending(tcp_buf *buf) {
+    return buf->len - buf->off;
+}
+
+static void tcp_conn_events_update(tcp_worker *worker, tcp_conn *conn) {
+    uint32_t events = 0;
+    struct epoll_event ev;
+
+    if (!conn->closing && conn->fwd == NULL && tcp_buf_pending(&conn->wbuf) < TCP_WBUF_HIGH) {
+        events |= EPOLLIN;
+    }
+    if (tcp_buf_pending(&conn->wbuf)) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return;
+    }
 
-    ret = send(sock_fd, snd_buf, snd_len, 0);
-    if (ret <= 0) {
-        log_msg(LOG_ERR, "tcp_process_query send errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
-        return -1;
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(worker->efd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        log_msg(LOG_ERR, "tcp worker %u epoll mod fd %d errno=%d, errinfo=%s\n", worker->id, conn->fd, errno, strerror(errno));
+        return;
+    }
+    conn->events = events;
+}
+
+/* Take the forward off the upstream connection, a late response to it is dropped */
+static void tcp_fwd_detach(tcp_fwd *fwd) {
+    tcp_upstream *up = fwd->up;
+
+    if (up == NULL) {
+        return;
+    }
+    if (fwd->prev) {
+        fwd->prev->next = fwd->next;
+    } else {
+        up->inflight = fwd->next;
+    }
+    if (fwd->next) {
+        fwd->next->prev = fwd->prev;
+    }
+    up->inflight_num--;
+    fwd->up = NULL;
+    fwd->prev = fwd->next = NULL;
+}
+
+static void tcp_fwd_release(tcp_worker *worker, tcp_fwd *fwd) {
+    tcp_fwd_detach(fwd);
+    fwd->conn->fwd = NULL;
+    fwd->next_dead = worker->dead_fwds;
+    worker->dead_fwds = fwd;
+}
+
+static void tcp_conn_close(tcp_worker *worker, tcp_conn *conn) {
+    if (conn->fwd) {
+        tcp_fwd_release(worker, conn->fwd);
+    }
+    close(conn->fd);
+    conn->fd = -1;
+
+    worker->conns[conn->idx] = worker->conns[--worker->conn_num];
+    worker->conns[conn->idx]->idx = conn->idx;
+
+    conn->next_dead = worker->dead_conns;
+    worker->dead_conns = conn;
+}
+
+static void tcp_dead_free(tcp_worker *worker) {
+    while (worker->dead_conns) {
+        tcp_conn *conn = worker->dead_conns;
+        worker->dead_conns = conn->next_dead;
+        tcp_buf_free(&conn->rbuf);
+        tcp_buf_free(&conn->wbuf);
+        free(conn);
+    }
+    while (worker->dead_fwds) {
+        tcp_fwd *fwd = worker->dead_fwds;
+        worker->dead_fwds = fwd->next_dead;
+        tcp_buf_free(&fwd->query);
+        free(fwd);
+    }
+    while (worker->dead_ups) {
+        tcp_upstream *up = worker->dead_ups;
+        worker->dead_ups = up->next_dead;
+        tcp_buf_free(&up->wbuf);
+        tcp_buf_free(&up->rbuf);
+        free(up);
+    }
+}
+
+/* Send what the connection has buffered, returns -1 if the connection is broken */
+static int tcp_conn_flush(tcp_conn *conn) {
+    while (tcp_buf_pending(&conn->wbuf)) {
+        ssize_t n = send(conn->fd, conn->wbuf.data + conn->wbuf.off, tcp_buf_pending(&conn->wbuf), MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "response to %s, send error, errno=%d, errinfo=%s\n",
+                    inet_ntoa(conn->addr.sin_addr), errno, strerror(errno));
+            return -1;
+        }
+        conn->wbuf.off += n;
+        conn->active_ms = tcp_now_ms();
     }
+    if (tcp_buf_pending(&conn->wbuf) == 0) {
+        conn->wbuf.off = conn->wbuf.len = 0;
+    }
+    return 0;
+}
+
+static int tcp_conn_answer_append(tcp_conn *conn, uint8_t *data, uint16_t len) {
+    uint16_t nlen = htons(len);
 
-    ret = recv(sock_fd, rvc_buf, rcv_len, 0);
-    if (ret <= 0) {
-        log_msg(LOG_ERR, "tcp_process_query recv errno=%d, errinfo=%s\n", errno, strerror(errno));
-        close(sock_fd);
+    if (tcp_buf_reserve(&conn->wbuf, len + 2) != 0) {
         return -1;
     }
-    close(sock_fd);
-    return ret;
+    memcpy(conn->wbuf.data + conn->wbuf.len, &nlen, 2);
+    memcpy(conn->wbuf.data + conn->wbuf.len + 2, data, len);
+    conn->wbuf.len += len + 2;
+    return 0;
 }
 
-static int tcp_process_forward(int sfd, char *buf, int buf_len, struct sockaddr_in *caddr, uint16_t id, uint16_t qtype, char *domain) {
-    (void)id;
-    int i = 0;
-    int rlen = 0;
-    int fwd_mode;
-    int fwd_timeout;
-    int servers_len;
-    dns_addr_t server_addrs[FWD_MAX_ADDRS];
-    char recv_buf[TCP_MAX_MESSAGE_LEN];
+static void tcp_fwd_lost(tcp_worker *worker, tcp_fwd *fwd) {
+    char ip_dst_str[INET_ADDRSTRLEN] = {0};
 
-    pthread_rwlock_rdlock(&__fwd_lock);
-    fwd_mode = g_fwd_addrs_ctrl.mode;
-    fwd_timeout = g_fwd_addrs_ctrl.timeout;
-    domain_fwd_addrs *fwd_addrs = fwd_addrs_find(domain, &g_fwd_addrs_ctrl);
-    servers_len = fwd_addrs->servers_len;
-    memcpy(&server_addrs, &fwd_addrs->server_addrs, sizeof(fwd_addrs->server_addrs));
-    pthread_rwlock_unlock(&__fwd_lock);
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&fwd->servers[fwd->server_idx].addr)->sin_addr, ip_dst_str, sizeof(ip_dst_str));
+    log_msg(LOG_ERR, "Failed to send tcp request: %s, type %d, to %s, from: %s, trycnt: %d\n",
+            fwd->domain, fwd->qtype, ip_dst_str, inet_ntoa(fwd->conn->addr.sin_addr), fwd->server_idx);
+    worker->stats.dns_fwd_lost_tcp++;
+}
 
-    tcp_stats.dns_fwd_rcv_tcp++;
-    if (fwd_mode == FWD_MODE_DISABLE) {
-        tcp_stats.dns_fwd_lost_tcp++;
+/* The current server of the forward is backed off, the query goes on to the next one */
+static void tcp_fwd_skip(tcp_worker *worker, tcp_fwd *fwd) {
+    char ip_dst_str[INET_ADDRSTRLEN] = {0};
+
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&fwd->servers[fwd->server_idx].addr)->sin_addr, ip_dst_str, sizeof(ip_dst_str));
+    log_msg_ratelimit(LOG_ERR, "tcp upstream %s is backed off, skip it for %s, type %d\n", ip_dst_str, fwd->domain, fwd->qtype);
+    if (fwd->server_idx + 1 >= fwd->servers_len) {
+        worker->stats.dns_fwd_lost_tcp++;
+    }
+}
+
+static tcp_pool *tcp_pool_get(tcp_worker *worker, dns_addr_t *addr) {
+    tcp_pool *pool;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addr->addr;
+
+    for (pool = worker->pools; pool; pool = pool->next) {
+        struct sockaddr_in *pin = (struct sockaddr_in *)&pool->addr.addr;
+        if (pin->sin_addr.s_addr == sin->sin_addr.s_addr && pin->sin_port == sin->sin_port) {
+            return pool;
+        }
+    }
+    pool = xalloc_zero(sizeof(tcp_pool));
+    pool->addr = *addr;
+    pool->next = worker->pools;
+    worker->pools = pool;
+    return pool;
+}
+
+/* The server is being backed off and the pool has no connection left to queue on */
+static int tcp_pool_backed_off(tcp_pool *pool) {
+    unsigned slot;
+
+    if (tcp_now_ms() >= pool->retry_ms) {
         return 0;
     }
+    for (slot = 0; slot < TCP_UPSTREAM_POOL_SIZE; slot++) {
+        if (pool->conns[slot]) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    for (; i < servers_len; i++) {
-        rlen = tcp_process_query(buf, buf_len, recv_buf, sizeof(recv_buf), &server_addrs[i], fwd_timeout);
-        if (rlen > 0) {
-            break;
+static void tcp_pool_backoff(tcp_pool *pool) {
+    uint64_t backoff_ms = (uint64_t)TCP_UPSTREAM_BACKOFF_MIN_MS << RTE_MIN(pool->fails, 10u);
+
+    pool->fails++;
+    pool->retry_ms = tcp_now_ms() + RTE_MIN(backoff_ms, (uint64_t)TCP_UPSTREAM_BACKOFF_MAX_MS);
+}
+
+static void tcp_upstream_events_update(tcp_worker *worker, tcp_upstream *up) {
+    uint32_t events = EPOLLOUT;
+    struct epoll_event ev;
+
+    if (up->connected) {
+        events = EPOLLIN;
+        if (tcp_buf_pending(&up->wbuf)) {
+            events |= EPOLLOUT;
         }
+    }
+    if (events == up->events) {
+        return;
+    }
 
-        char ip_src_str[INET_ADDRSTRLEN] = {0};
-        char ip_dst_str[INET_ADDRSTRLEN] = {0};
-        inet_ntop(AF_INET, &caddr->sin_addr, ip_src_str, sizeof(ip_src_str));
-        inet_ntop(AF_INET, &((struct sockaddr_in *)&server_addrs[i].addr)->sin_addr, ip_dst_str, sizeof(ip_dst_str));
-        log_msg(LOG_ERR, "Failed to send tcp request: %s, type %d, to %s, from: %s, trycnt: %d\n",
-                domain, qtype, ip_dst_str, ip_src_str, i);
-        tcp_stats.dns_fwd_lost_tcp++;
+    ev.events = events;
+    ev.data.ptr = up;
+    if (epoll_ctl(worker->efd, EPOLL_CTL_MOD, up->fd, &ev) == -1) {
+        log_msg(LOG_ERR, "tcp worker %u epoll mod upstream fd %d errno=%d, errinfo=%s\n", worker->id, up->fd, errno, strerror(errno));
+        return;
     }
+    up->events = events;
+}
 
-    if (rlen > 0) {
-        if (send(sfd, recv_buf, rlen, 0) == -1) {
-            tcp_stats.dns_fwd_lost_tcp++;
-            log_msg(LOG_ERR, "Failed to send tcp response: %s, type %d, to %s\n", domain, qtype, inet_ntoa(caddr->sin_addr));
-            return -1;
+/* Open the connection of a pool slot, without blocking */
+static tcp_upstream *tcp_upstream_open(tcp_worker *worker, tcp_pool *pool, unsigned slot) {
+    struct epoll_event ev;
+    int one = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == -1) {
+        log_msg(LOG_ERR, "tcp fwd sock errno=%d, errinfo=%s\n", errno, strerror(errno));
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, &pool->addr.addr, pool->addr.addrlen) == -1 && errno != EINPROGRESS) {
+        log_msg(LOG_ERR, "tcp fwd connect errno=%d, errinfo=%s\n", errno, strerror(errno));
+        close(fd);
+        tcp_pool_backoff(pool);
+        return NULL;
+    }
+
+    tcp_upstream *up = xalloc_zero(sizeof(tcp_upstream));
+    up->ev_type = TCP_EV_UPSTREAM;
+    up->fd = fd;
+    up->pool = pool;
+    up->slot = slot;
+    up->events = EPOLLOUT;
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = up;
+    if (epoll_ctl(worker->efd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_msg(LOG_ERR, "tcp worker %u epoll add fwd fd errno=%d, errinfo=%s\n", worker->id, errno, strerror(errno));
+        close(fd);
+        free(up);
+        return NULL;
+    }
+    pool->conns[slot] = up;
+    return up;
+}
+
+static tcp_fwd *tcp_upstream_fwd_find(tcp_upstream *up, uint16_t id) {
+    tcp_fwd *fwd;
+
+    for (fwd = up->inflight; fwd; fwd = fwd->next) {
+        if (fwd->id == id) {
+            return fwd;
         }
-        tcp_stats.dns_fwd_snd_tcp++;
     }
+    return NULL;
+}
+
+/*
+ * Queue the query on the upstream connection. The queries of different
+ * clients may share an id, so the one sent upstream is rewritten to be
+ * unique on the connection, the client's one stays in fwd->query.
+ */
+static int tcp_upstream_queue(tcp_worker *worker, tcp_upstream *up, tcp_fwd *fwd) {
+    uint16_t id;
+
+    if (tcp_buf_reserve(&up->wbuf, fwd->query.len) != 0) {
+        return -1;
+    }
+    do {
+        id = up->next_id++;
+    } while (tcp_upstream_fwd_find(up, id));
+
+    uint8_t *msg = up->wbuf.data + up->wbuf.len;
+    memcpy(msg, fwd->query.data, fwd->query.len);
+    msg[2] = id >> 8;
+    msg[3] = id & 0xff;
+    up->wbuf.len += fwd->query.len;
+
+    fwd->id = id;
+    fwd->up = up;
+    fwd->prev = NULL;
+    fwd->next = up->inflight;
+    if (up->inflight) {
+        up->inflight->prev = fwd;
+    }
+    up->inflight = fwd;
+    up->inflight_num++;
+
+    tcp_upstream_events_update(worker, up);
     return 0;
 }
 
-static int tcp_recv(int fd, char *buf, int len) {
-    int bytes_transmitted = 0;
-    while (bytes_transmitted < len) {
-        int recv_len = recv(fd, buf + bytes_transmitted, len - bytes_transmitted, 0);
-        if (recv_len == -1) {
-            log_msg(LOG_ERR, "call recv len %d error, ret=%d, errno=%d, errinfo=%s\n", len, recv_len, errno, strerror(errno));
-            return -1;
-        } else if (recv_len == 0) {
-            /* EOF */
-            return 0;
+/*
+ * Pick a connection of the pool for the query: the open one with the least
+ * queries in flight, or a new one if they are all busy and the server is
+ * not being backed off.
+ */
+static int tcp_pool_enqueue(tcp_worker *worker, tcp_pool *pool, tcp_fwd *fwd) {
+    unsigned slot;
+    int free_slot = -1;
+    tcp_upstream *best = NULL;
+
+    for (slot = 0; slot < TCP_UPSTREAM_POOL_SIZE; slot++) {
+        tcp_upstream *up = pool->conns[slot];
+        if (up == NULL) {
+            if (free_slot < 0) {
+                free_slot = slot;
+            }
+        } else if (best == NULL || up->inflight_num < best->inflight_num) {
+            best = up;
         }
+    }
+    if ((best == NULL || best->inflight_num > 0) && free_slot >= 0 && tcp_now_ms() >= pool->retry_ms) {
+        tcp_upstream *up = tcp_upstream_open(worker, pool, free_slot);
+        if (up) {
+            best = up;
+        }
+    }
+    if (best == NULL || best->inflight_num >= TCP_UPSTREAM_INFLIGHT_MAX) {
+        return -1;
+    }
+    return tcp_upstream_queue(worker, best, fwd);
+}
 
-        bytes_transmitted += recv_len;
+/*
+ * Queue the forward to its current upstream server, or the next ones if it
+ * can't take it. A server being backed off is skipped without counting the
+ * query lost, unless it is the last one.
+ */
+static int tcp_fwd_send(tcp_worker *worker, tcp_fwd *fwd) {
+    while (fwd->server_idx < fwd->servers_len) {
+        tcp_pool *pool = tcp_pool_get(worker, &fwd->servers[fwd->server_idx]);
+        if (tcp_pool_enqueue(worker, pool, fwd) == 0) {
+            return 0;
+        }
+        if (tcp_pool_backed_off(pool)) {
+            tcp_fwd_skip(worker, fwd);
+        } else {
+            tcp_fwd_lost(worker, fwd);
+        }
+        fwd->server_idx++;
+        fwd->deadline_ms = tcp_now_ms() + g_fwd_addrs_ctrl.timeout * 1000;
     }
-    return bytes_transmitted;
+    return -1;
 }
 
-static void *thread_tcp_process(void *arg) {
-    char *ip = (char *)arg;
-    int sfd, cfd, slen;
-    socklen_t addr_len;
-    uint16_t flags_old;
-    struct sockaddr_in saddr, caddr;
-    char buf[TCP_MAX_MESSAGE_LEN];
+/* Send the forward again, to the same server if next is 0, giving it up and going on with the later queries if no server is left */
+static void tcp_fwd_resend(tcp_worker *worker, tcp_fwd *fwd, int next) {
+    tcp_conn *conn = fwd->conn;
 
-    sleep(30);
+    tcp_fwd_detach(fwd);
+    if (next) {
+        tcp_fwd_lost(worker, fwd);
+        fwd->server_idx++;
+        fwd->deadline_ms = tcp_now_ms() + g_fwd_addrs_ctrl.timeout * 1000;
+    }
+    if (tcp_fwd_send(worker, fwd) != 0) {
+        tcp_fwd_release(worker, fwd);
+        tcp_conn_process(worker, conn);
+    }
+}
 
-    sfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sfd < 0) {
-        log_msg(LOG_ERR, "Failed to create tcp socket, errno=%d, errinfo=%s\n", errno, strerror(errno));
-        exit(1);
+/*
+ * Close the upstream connection. Its queries in flight are sent again: to
+ * the same server if it was a working connection the server closed, else
+ * to the next servers. A connect that failed backs the server off.
+ */
+static void tcp_upstream_close(tcp_worker *worker, tcp_upstream *up, int failed) {
+    tcp_fwd *fwd = up->inflight;
+    tcp_fwd *next;
+    int same_server = !failed && up->answered > 0;
+
+    if (failed && !up->connected) {
+        tcp_pool_backoff(up->pool);
     }
+    close(up->fd);
+    up->fd = -1;
+    up->pool->conns[up->slot] = NULL;
+    up->next_dead = worker->dead_ups;
+    worker->dead_ups = up;
 
-    bzero(&saddr, sizeof(saddr));
-    saddr.sin_family = AF_INET;
-    saddr.sin_addr.s_addr = inet_addr(ip);
-    saddr.sin_port = htons(53);
-    if (bind(sfd, (struct sockaddr *)&saddr, sizeof(saddr)) == -1) {
-        log_msg(LOG_ERR, "Failed to bind tcp, ip %s, errno=%d, errinfo=%s\n", ip, errno, strerror(errno));
-        exit(1);
+    up->inflight = NULL;
+    up->inflight_num = 0;
+    for (; fwd; fwd = next) {
+        next = fwd->next;
+        fwd->up = NULL;
+        fwd->prev = fwd->next = NULL;
+        tcp_fwd_resend(worker, fwd, !same_server);
     }
+}
 
-    if (listen(sfd, 100) == -1) {
-        log_msg(LOG_ERR, "Failed to listen, ip %s, errno=%d, errinfo=%s\n", ip, errno, strerror(errno));
-        exit(1);
+static void tcp_fwd_done(tcp_worker *worker, tcp_fwd *fwd, uint8_t *msg, uint32_t msg_len) {
+    tcp_conn *conn = fwd->conn;
+
+    /* back to the client's id */
+    msg[2] = fwd->query.data[2];
+    msg[3] = fwd->query.data[3];
+    if (tcp_buf_reserve(&conn->wbuf, msg_len) == 0) {
+        memcpy(conn->wbuf.data + conn->wbuf.len, msg, msg_len);
+        conn->wbuf.len += msg_len;
+        worker->stats.dns_fwd_snd_tcp++;
+    } else {
+        worker->stats.dns_fwd_lost_tcp++;
     }
+    tcp_fwd_release(worker, fwd);
+    tcp_conn_process(worker, conn);
+}
 
-    log_msg(LOG_INFO, "Accepting tcp querys, form %s...\n", ip);
-    while (1) {
-        addr_len = sizeof(struct sockaddr);
-        cfd = accept(sfd, (struct sockaddr *)&caddr, &addr_len);
-        if (cfd == -1) {
-            log_msg(LOG_ERR, "Failed to accept, ip %s, errno=%d, errinfo=%s\n", ip, errno, strerror(errno));
-            continue;
+/* Hand the complete responses received to the clients waiting for them */
+static void tcp_upstream_responses(tcp_worker *worker, tcp_upstream *up) {
+    while (tcp_buf_pending(&up->rbuf) >= 2) {
+        uint8_t *msg = up->rbuf.data + up->rbuf.off;
+        uint32_t msg_len = 2 + ((msg[0] << 8) | msg[1]);
+        if (tcp_buf_pending(&up->rbuf) < msg_len) {
+            break;
         }
-        struct timeval tv = {2, 0};
-        if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-            log_msg(LOG_ERR, "set socket option SO_RCVTIMEO errno=%d, errinfo=%s\n", errno, strerror(errno));
-            close(cfd);
+        up->rbuf.off += msg_len;
+        if (msg_len < 2 + DNS_HEAD_SIZE) {
             continue;
         }
-        if (setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-            log_msg(LOG_ERR, "set socket option SO_SNDTIMEO errno=%d, errinfo=%s\n", errno, strerror(errno));
-            close(cfd);
-            continue;
+
+        /* no match if it timed out or its client is gone */
+        tcp_fwd *fwd = tcp_upstream_fwd_find(up, (msg[2] << 8) | msg[3]);
+        if (fwd) {
+            up->answered++;
+            tcp_fwd_done(worker, fwd, msg, msg_len);
         }
-        while (1) {
-            int bytes_transmitted = 0;
-            bytes_transmitted = tcp_recv(cfd, buf, 2);  //recv query len first
-            if (bytes_transmitted != 2) {
-                if (bytes_transmitted < 0) {
-                    log_msg(LOG_ERR, "failed recv len %d from %s\n", 2, inet_ntoa(caddr.sin_addr));
-                }
-                close(cfd);
-                break;
-            }
+    }
+}
+
+static void tcp_upstream_event(tcp_worker *worker, tcp_upstream *up, uint32_t events) {
+    ssize_t n;
+
+    if (!up->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if ((events & (EPOLLERR | EPOLLHUP)) || getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+            tcp_upstream_close(worker, up, 1);
+            return;
+        }
+        up->connected = 1;
+        up->pool->fails = 0;
+    } else if (events & EPOLLERR) {
+        tcp_upstream_close(worker, up, 1);
+        return;
+    }
 
-            /*
-             * Minimum query size is:
-             *
-             *     Size of the header (12)
-             *   + Root domain name   (1)
-             *   + Query class        (2)
-             *   + Query type         (2)
-             */
-            uint16_t tcp_query_len = 0;
-            memcpy(&tcp_query_len, buf, 2);
-            tcp_query_len = ntohs(tcp_query_len);
-            if (tcp_query_len < DNS_HEAD_SIZE + 1 + sizeof(uint16_t) + sizeof(uint16_t)) {
-                log_msg(LOG_ERR, "tcp query from %s packet size %d illegal, drop\n", inet_ntoa(caddr.sin_addr), tcp_query_len);
-                close(cfd);
+    while (tcp_buf_pending(&up->wbuf)) {
+        n = send(up->fd, up->wbuf.data + up->wbuf.off, tcp_buf_pending(&up->wbuf), MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
             }
+            if (errno == EINTR) {
+                continue;
+            }
+            tcp_upstream_close(worker, up, 1);
+            return;
+        }
+        up->wbuf.off += n;
+    }
 
-            bytes_transmitted = tcp_recv(cfd, buf + 2, tcp_query_len);
-            if (bytes_transmitted != tcp_query_len) {
-                if (bytes_transmitted < 0) {
-                    log_msg(LOG_ERR, "failed recv len %d from %s\n", tcp_query_len, inet_ntoa(caddr.sin_addr));
-                }
-                close(cfd);
+    while (events & (EPOLLIN | EPOLLHUP)) {
+        if (tcp_buf_reserve(&up->rbuf, TCP_BUF_INIT_SIZE) != 0) {
+            tcp_upstream_close(worker, up, 1);
+            return;
+        }
+        n = recv(up->fd, up->rbuf.data + up->rbuf.len, up->rbuf.size - up->rbuf.len, 0);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
             }
+            if (errno == EINTR) {
+                continue;
+            }
+            tcp_upstream_close(worker, up, 1);
+            return;
+        }
+        if (n == 0) {
+            tcp_upstream_close(worker, up, 0);
+            return;
+        }
+        up->rbuf.len += n;
+        tcp_upstream_responses(worker, up);
+    }
+    tcp_upstream_events_update(worker, up);
+}
+
+/* Forward the refused query, msg is the query as received with its length prefix */
+static void tcp_fwd_start(tcp_worker *worker, tcp_conn *conn, uint8_t *msg, uint32_t msg_len, struct query *query) {
+    int fwd_mode;
+    domain_fwd_addrs *fwd_addrs;
+    const char *domain = domain_name_to_string(query->qname, NULL);
+
+    worker->stats.dns_fwd_rcv_tcp++;
 
-            query_reset(tcp_query);
-            tcp_query->sip = *(uint32_t *)&caddr.sin_addr;
-            tcp_query->maxMsgLen = sizeof(buf);
-            tcp_query->packet->data = (uint8_t *)(buf + 2);  //skip len
-            tcp_query->packet->position += 2 + tcp_query_len;
-            buffer_flip(tcp_query->packet);
+    tcp_fwd *fwd = xalloc_zero(sizeof(tcp_fwd));
+    fwd->conn = conn;
+    fwd->qtype = query->qtype;
+    snprintf(fwd->domain, sizeof(fwd->domain), "%s", domain);
 
-            memcpy(&flags_old, tcp_query->packet->data + 2, 2);
+    pthread_rwlock_rdlock(&__fwd_lock);
+    fwd_mode = g_fwd_addrs_ctrl.mode;
+    fwd_addrs = fwd_addrs_find(fwd->domain, &g_fwd_addrs_ctrl);
+    fwd->servers_len = fwd_addrs->servers_len;
+    memcpy(&fwd->servers, &fwd_addrs->server_addrs, sizeof(fwd_addrs->server_addrs));
+    pthread_rwlock_unlock(&__fwd_lock);
+
+    conn->fwd = fwd;
+    if (fwd_mode == FWD_MODE_DISABLE || fwd->servers_len == 0 || tcp_buf_reserve(&fwd->query, msg_len) != 0) {
+        worker->stats.dns_fwd_lost_tcp++;
+        tcp_fwd_release(worker, fwd);
+        return;
+    }
+    memcpy(fwd->query.data, msg, msg_len);
+    fwd->query.len = msg_len;
 
-            view_query_master_process(tcp_query);
-            rte_rwlock_read_lock(&tcp_lock);
-            if (query_process(tcp_query, &tcp_kdns) != QUERY_FAIL) {
-                buffer_flip(tcp_query->packet);
+    fwd->server_idx = 0;
+    fwd->deadline_ms = tcp_now_ms() + g_fwd_addrs_ctrl.timeout * 1000;
+    if (tcp_fwd_send(worker, fwd) != 0) {
+        tcp_fwd_release(worker, fwd);
+    }
+}
+
+/*
+ * Answer the complete queries received on the connection, in order. A
+ * forwarded query holds the later ones until its response is buffered.
+ */
+static void tcp_conn_process(tcp_worker *worker, tcp_conn *conn) {
+    struct query *query = worker->query;
+
+    while (conn->fwd == NULL && tcp_buf_pending(&conn->wbuf) < TCP_WBUF_HIGH) {
+        uint32_t pending = tcp_buf_pending(&conn->rbuf);
+        uint8_t *msg = conn->rbuf.data + conn->rbuf.off;
+        if (pending < 2) {
+            break;
+        }
+        uint16_t query_len = (msg[0] << 8) | msg[1];
+        if (query_len < TCP_QUERY_LEN_MIN) {
+            log_msg(LOG_ERR, "tcp query from %s packet size %d illegal, drop\n", inet_ntoa(conn->addr.sin_addr), query_len);
+            tcp_conn_close(worker, conn);
+            return;
+        }
+        if (pending < (uint32_t)query_len + 2) {
+            break;
+        }
+        conn->rbuf.off += query_len + 2;
+
+        query_reset(query);
+        query->sip = conn->addr.sin_addr.s_addr;
+        query->maxMsgLen = TCP_MAX_MESSAGE_LEN;
+        query->packet->data = worker->msg_buf;
+        memcpy(worker->msg_buf, msg + 2, query_len);
+        query->packet->position = query_len;
+        buffer_flip(query->packet);
+
+        view_query_master_process(query);
+        rte_rwlock_read_lock(&worker->lock);
+        query_state_type state = query_process(query, &worker->kdns);
+        if (state != QUERY_FAIL) {
+            query_stats_update(g_query_stats[QUERY_STATS_SLOT_TCP + worker->id], query);
+            buffer_flip(query->packet);
+        }
+        rte_rwlock_read_unlock(&worker->lock);
+
+        if (state == QUERY_FAIL) {
+            worker->stats.dns_pkts_rcv_tcp++;
+            continue;
+        }
+        if (GET_RCODE(query->packet) == RCODE_REFUSE) {
+            tcp_fwd_start(worker, conn, msg, query_len + 2, query);
+            continue;
+        }
+
+        worker->stats.dns_pkts_rcv_tcp++;
+        uint16_t slen = buffer_remaining(query->packet);
+        if (slen > 0) {
+            if (tcp_conn_answer_append(conn, buffer_begin(query->packet), slen) != 0) {
+                tcp_conn_close(worker, conn);
+                return;
             }
-            rte_rwlock_read_unlock(&tcp_lock);
+            worker->stats.dns_pkts_snd_tcp++;
+        }
+    }
+
+    if (tcp_conn_flush(conn) != 0) {
+        tcp_conn_close(worker, conn);
+        return;
+    }
+    if (conn->closing && conn->fwd == NULL && tcp_buf_pending(&conn->wbuf) == 0) {
+        tcp_conn_close(worker, conn);
+        return;
+    }
+    tcp_conn_events_update(worker, conn);
+}
 
-            if (GET_RCODE(tcp_query->packet) == RCODE_REFUSE) {
-                memcpy((buf + 2) + 2, &flags_old, 2);
-                tcp_process_forward(cfd, buf, tcp_query_len + 2, &caddr, GET_ID(tcp_query->packet), tcp_query->qtype,
-                                    (char *)domain_name_to_string(tcp_query->qname, NULL));
+static void tcp_conn_read(tcp_worker *worker, tcp_conn *conn) {
+    while (tcp_buf_pending(&conn->rbuf) < TCP_MSG_SIZE) {
+        if (tcp_buf_reserve(&conn->rbuf, TCP_BUF_INIT_SIZE) != 0) {
+            tcp_conn_close(worker, conn);
+            return;
+        }
+        ssize_t n = recv(conn->fd, conn->rbuf.data + conn->rbuf.len, conn->rbuf.size - conn->rbuf.len, 0);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
                 continue;
             }
+            log_msg(LOG_ERR, "failed recv from %s, errno=%d, errinfo=%s\n", inet_ntoa(conn->addr.sin_addr), errno, strerror(errno));
+            tcp_conn_close(worker, conn);
+            return;
+        }
+        if (n == 0) {
+            conn->closing = 1;
+            break;
+        }
+        conn->rbuf.len += n;
+        conn->active_ms = tcp_now_ms();
+    }
+    tcp_conn_process(worker, conn);
+}
+
+static void tcp_conn_accept(tcp_worker *worker) {
+    struct epoll_event ev;
+    struct sockaddr_in caddr;
+    int one = 1;
+
+    while (1) {
+        socklen_t addr_len = sizeof(caddr);
+        int cfd = accept4(worker->lfd, (struct sockaddr *)&caddr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_msg(LOG_ERR, "Failed to accept on tcp worker %u, errno=%d, errinfo=%s\n", worker->id, errno, strerror(errno));
+            }
+            return;
+        }
+        if (worker->conn_num >= worker->conn_max) {
+            log_msg(LOG_ERR, "tcp worker %u has %u connections, close the one from %s\n",
+                    worker->id, worker->conn_num, inet_ntoa(caddr.sin_addr));
+            close(cfd);
+            continue;
+        }
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        tcp_conn *conn = xalloc_zero(sizeof(tcp_conn));
+        conn->ev_type = TCP_EV_CLIENT;
+        conn->fd = cfd;
+        conn->addr = caddr;
+        conn->active_ms = tcp_now_ms();
+        conn->events = EPOLLIN;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->efd, EPOLL_CTL_ADD, cfd, &ev) == -1) {
+            log_msg(LOG_ERR, "tcp worker %u epoll add fd %d errno=%d, errinfo=%s\n", worker->id, cfd, errno, strerror(errno));
+            close(cfd);
+            free(conn);
+            continue;
+        }
+        conn->idx = worker->conn_num;
+        worker->conns[worker->conn_num++] = conn;
+    }
+}
+
+/* Move the forwards past their timeout on to the next servers, close the connections idle for too long */
+static void tcp_timeouts_check(tcp_worker *worker, uint64_t now_ms) {
+    uint32_t i = 0;
+
+    while (i < worker->conn_num) {
+        tcp_conn *conn = worker->conns[i];
+        if (conn->fwd) {
+            tcp_fwd *fwd = conn->fwd;
+            if (now_ms >= fwd->deadline_ms) {
+                /* a connect hanging is the server failing, for all the queries waiting on it */
+                if (fwd->up && !fwd->up->connected) {
+                    tcp_upstream_close(worker, fwd->up, 1);
+                } else {
+                    tcp_fwd_resend(worker, fwd, 1);
+                }
+            }
+        } else if (now_ms - conn->active_ms >= worker->idle_timeout_ms) {
+            tcp_conn_close(worker, conn);
+            continue;
+        }
+        /* the connection may have been closed and replaced by the last one */
+        if (i < worker->conn_num && worker->conns[i] == conn) {
+            i++;
+        }
+    }
+}
+
+static void *thread_tcp_process(void *arg) {
+    int i, nfds;
+    tcp_worker *worker = (tcp_worker *)arg;
+    struct epoll_event events[TCP_EPOLL_EVENTS];
+    uint64_t now_ms, check_ms = tcp_now_ms();
+
+    log_msg(LOG_INFO, "tcp worker %u accepting tcp querys\n", worker->id);
+    while (1) {
+        nfds = epoll_wait(worker->efd, events, TCP_EPOLL_EVENTS, TCP_EPOLL_WAIT_MS);
+        if (nfds == -1 && errno != EINTR) {
+            log_msg(LOG_ERR, "tcp worker %u epoll wait errno=%d, errinfo=%s\n", worker->id, errno, strerror(errno));
+        }
 
-            tcp_stats.dns_pkts_rcv_tcp++;
-            slen = buffer_remaining(tcp_query->packet);
-            if (slen > 0) {
-                uint16_t len = htons(slen);
-                memcpy(buf, &len, 2);
-                if (send(cfd, buf, slen + 2, 0) == -1) {
-                    log_msg(LOG_ERR, "response query %s to %s, send error, errno=%d, errinfo=%s\n",
-                            (char *)domain_name_to_string(tcp_query->qname, NULL), inet_ntoa(caddr.sin_addr), errno, strerror(errno));
+        for (i = 0; i < nfds; i++) {
+            tcp_ev_type type = *(tcp_ev_type *)events[i].data.ptr;
+            if (type == TCP_EV_LISTEN) {
+                tcp_conn_accept(worker);
+            } else if (type == TCP_EV_CLIENT) {
+                tcp_conn *conn = events[i].data.ptr;
+                if (conn->fd < 0) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    tcp_conn_close(worker, conn);
+                } else if (events[i].events & EPOLLIN) {
+                    tcp_conn_read(worker, conn);
+                } else if (events[i].events & EPOLLOUT) {
+                    tcp_conn_process(worker, conn);
+                }
+            } else {
+                tcp_upstream *up = events[i].data.ptr;
+                if (up->fd < 0) {
+                    continue;
                 }
-                tcp_stats.dns_pkts_snd_tcp++;
+                tcp_upstream_event(worker, up, events[i].events);
             }
         }
+
+        now_ms = tcp_now_ms();
+        if (now_ms - check_ms >= TCP_EPOLL_WAIT_MS) {
+            check_ms = now_ms;
+            tcp_timeouts_check(worker, now_ms);
+        }
+        tcp_dead_free(worker);
     }
+    return NULL;
+}
+
+static int tcp_listen_socket(char *ip) {
+    int one = 1;
+    struct sockaddr_in saddr;
+
+    int sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sfd < 0) {
+        log_msg(LOG_ERR, "Failed to create tcp socket, errno=%d, errinfo=%s\n", errno, strerror(errno));
+        exit(1);
+    }
+    /* the workers share the port, and the vip may not be up on the kni yet */
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+        setsockopt(sfd, IPPROTO_IP, IP_FREEBIND, &one, sizeof(one)) == -1) {
+        log_msg(LOG_ERR, "Failed to set tcp socket options, errno=%d, errinfo=%s\n", errno, strerror(errno));
+        exit(1);
+    }
+
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = inet_addr(ip);
+    saddr.sin_port = htons(53);
+    if (bind(sfd, (struct sockaddr *)&saddr, sizeof(saddr)) == -1) {
+        log_msg(LOG_ERR, "Failed to bind tcp, ip %s, errno=%d, errinfo=%s\n", ip, errno, strerror(errno));
+        exit(1);
+    }
+
+    if (listen(sfd, TCP_LISTEN_BACKLOG) == -1) {
+        log_msg(LOG_ERR, "Failed to listen, ip %s, errno=%d, errinfo=%s\n", ip, errno, strerror(errno));
+        exit(1);
+    }
+    return sfd;
 }
 
 int tcp_process_init(char *ip) {
-    rte_rwlock_init(&tcp_lock);
-    kdns_prepare_init(&tcp_kdns, &tcp_query);
+    unsigned i;
+    char name[16];
+    struct epoll_event ev;
+    unsigned workers = RTE_MIN(RTE_MAX(g_dns_cfg->comm.tcp_threads, 1), TCP_WORKER_MAX);
+
+    for (i = 0; i < workers; i++) {
+        tcp_worker *worker = xalloc_zero(sizeof(tcp_worker));
+        worker->ev_type = TCP_EV_LISTEN;
+        worker->id = i;
+        worker->conn_max = RTE_MAX(g_dns_cfg->comm.tcp_max_conns / workers, 1u);
+        worker->conns = xalloc_zero(worker->conn_max * sizeof(tcp_conn *));
+        worker->idle_timeout_ms = g_dns_cfg->comm.tcp_idle_timeout * 1000;
 
-    pthread_t *thread_id = (pthread_t *)xalloc(sizeof(pthread_t));
-    pthread_create(thread_id, NULL, thread_tcp_process, (void *)ip);
-    pthread_setname_np(*thread_id, "kdns_tcp_proc");
+        rte_rwlock_init(&worker->lock);
+        kdns_prepare_init(&worker->kdns, &worker->query);
+        worker->query->ednsMaxLen = g_dns_cfg->comm.edns_udp_size;
+        query_stats_init(QUERY_STATS_SLOT_TCP + i, SOCKET_ID_ANY);
+
+        worker->lfd = tcp_listen_socket(ip);
+        worker->efd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->efd == -1) {
+            log_msg(LOG_ERR, "Failed to create epoll, errno=%d, errinfo=%s\n", errno, strerror(errno));
+            exit(1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = worker;
+        if (epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->lfd, &ev) == -1) {
+            log_msg(LOG_ERR, "Failed to add tcp listen socket to epoll, errno=%d, errinfo=%s\n", errno, strerror(errno));
+            exit(1);
+        }
+        tcp_workers[i] = worker;
+        tcp_worker_num = i + 1;
+    }
+
+    for (i = 0; i < tcp_worker_num; i++) {
+        pthread_create(&tcp_workers[i]->thread, NULL, thread_tcp_process, (void *)tcp_workers[i]);
+        snprintf(name, sizeof(name), "kdns_tcp_%u", i);
+        pthread_setname_np(tcp_workers[i]->thread, name);
+    }
+    log_msg(LOG_INFO, "Accepting tcp querys, form %s on %u workers...\n", ip, tcp_worker_num);
     return 0;
 }
@@ -4,13 +4,22 @@
 #include <arpa/inet.h>
 #include "db_update.h"
 
+#define TCP_WORKER_MAX          (16)
+
+/* Add the counts of the workers since the last reset to sta */
 void tcp_statsdata_get(struct netif_queue_stats *sta);
 
+/* Add the counts of the workers since the start to sta */
+void tcp_statsdata_total_get(struct netif_queue_stats *sta);
+
 void tcp_statsdata_reset(void);
 
 int tcp_process_init(char *ip);
 
 int tcp_domian_databd_update(struct domin_info_update *update);
 
+/* Run update on the store of every tcp worker, with the worker's lock held */
+void tcp_kdns_update(int (*update)(struct kdns *kdns));
+
 #endif  /*_TCP_PROCESS_H_*/
 
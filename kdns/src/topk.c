@@ -0,0 +1,369 @@
+#include <string.h>
+#include <time.h>
+#include <rte_malloc.h>
+#include <rte_cycles.h>
+#include <rte_atomic.h>
+#include <rte_jhash.h>
+
+#include "util.h"
+#include "dns-conf.h"
+#include "topk.h"
+
+struct topk_ctrl *g_topk_ctrls[RTE_MAX_LCORE];
+
+static const char *topk_type_names[TOPK_TYPE_MAX] = {
+    [TOPK_QNAME] = "qnames",
+    [TOPK_CLIENT] = "clients",
+    [TOPK_CLIENT_QNAME] = "client_qnames",
+};
+
+const char *topk_type_name(topk_type type) {
+    return topk_type_names[type];
+}
+
+static inline int topk_key_equal(struct topk_entry *entry, uint32_t hash, uint32_t client, const uint8_t *qname, uint8_t qname_len) {
+    return entry->hash == hash && entry->client == client && entry->qname_len == qname_len &&
+           memcmp(entry->qname, qname, qname_len) == 0;
+}
+
+/*
+ * Estimate of the key, after counting it once more if add is set. The rows
+ * are indexed by double hashing, hash2 comes from another hash function so
+ * keys colliding on the 32 bit crc qhash still part in the other rows.
+ */
+static inline uint32_t topk_sketch_count(struct topk_tracker *t, uint32_t hash, uint32_t hash2, int add) {
+    uint32_t d, idx, c, est = UINT32_MAX;
+
+    hash2 |= 1;
+    for (d = 0; d < TOPK_SKETCH_DEPTH; d++) {
+        idx = (hash + d * hash2) & (TOPK_SKETCH_WIDTH - 1);
+        c = add ? ++t->sketch[d][idx] : t->sketch[d][idx];
+        est = RTE_MIN(est, c);
+    }
+    return est;
+}
+
+static inline void topk_heap_set(struct topk_tracker *t, uint32_t pos, struct topk_node node) {
+    t->heap[pos] = node;
+    t->entries[node.ref].pos = pos;
+}
+
+static void topk_sift_down(struct topk_tracker *t, uint32_t pos) {
+    uint32_t child;
+    struct topk_node node = t->heap[pos];
+
+    while ((child = 2 * pos + 1) < t->size) {
+        if (child + 1 < t->size && t->heap[child + 1].count < t->heap[child].count) {
+            child++;
+        }
+        if (node.count <= t->heap[child].count) {
+            break;
+        }
+        topk_heap_set(t, pos, t->heap[child]);
+        pos = child;
+    }
+    topk_heap_set(t, pos, node);
+}
+
+static void topk_sift_up(struct topk_tracker *t, uint32_t pos) {
+    uint32_t parent;
+    struct topk_node node = t->heap[pos];
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (t->heap[parent].count <= node.count) {
+            break;
+        }
+        topk_heap_set(t, pos, t->heap[parent]);
+        pos = parent;
+    }
+    topk_heap_set(t, pos, node);
+}
+
+/* remove an index slot of the linear probing table, shifting the following run back */
+static void topk_index_delete(struct topk_tracker *t, uint32_t slot) {
+    uint32_t next, home;
+
+    t->index[slot] = 0;
+    for (next = (slot + 1) & t->index_mask; t->index[next]; next = (next + 1) & t->index_mask) {
+        struct topk_entry *entry = &t->entries[t->index[next] - 1];
+        home = entry->hash & t->index_mask;
+        /* move it back unless its home lies cyclically in (slot, next] */
+        if (((next - home) & t->index_mask) >= ((next - slot) & t->index_mask)) {
+            t->index[slot] = t->index[next];
+            t->index[next] = 0;
+            entry->slot = slot;
+            slot = next;
+        }
+    }
+}
+
+static void topk_track(struct topk_tracker *t, uint32_t k, uint32_t hash, uint32_t hash2, uint32_t client,
+                       const uint8_t *qname, uint8_t qname_len) {
+    uint32_t est, slot, ref, pos;
+    struct topk_entry *entry;
+
+    est = topk_sketch_count(t, hash, hash2, 1);
+    if (likely(t->size == k && est <= t->heap[0].count)) {
+        return;
+    }
+
+    for (slot = hash & t->index_mask; t->index[slot]; slot = (slot + 1) & t->index_mask) {
+        entry = &t->entries[t->index[slot] - 1];
+        if (topk_key_equal(entry, hash, client, qname, qname_len)) {
+            t->heap[entry->pos].count = est;
+            topk_sift_down(t, entry->pos);
+            return;
+        }
+    }
+
+    if (t->size < k) {
+        pos = t->size++;
+        ref = pos;
+    } else {
+        /* the new key takes the place of the minimum */
+        pos = 0;
+        ref = t->heap[0].ref;
+        topk_index_delete(t, t->entries[ref].slot);
+        for (slot = hash & t->index_mask; t->index[slot]; slot = (slot + 1) & t->index_mask) {
+            ;
+        }
+    }
+    entry = &t->entries[ref];
+    entry->hash = hash;
+    entry->hash2 = hash2;
+    entry->client = client;
+    entry->slot = slot;
+    entry->qname_len = qname_len;
+    memcpy(entry->qname, qname, qname_len);
+    t->index[slot] = ref + 1;
+    topk_heap_set(t, pos, (struct topk_node){.count = est, .ref = ref});
+    if (pos == 0) {
+        topk_sift_down(t, 0);
+    } else {
+        topk_sift_up(t, pos);
+    }
+}
+
+void topk_update(struct topk_ctrl *ctrl, struct query *q) {
+    struct topk_window *w = ctrl->windows[ctrl->cur];
+    const uint8_t *qname = domain_name_get(q->qname);
+    uint8_t qname_len = q->qname->name_size;
+    uint32_t qhash = q->qhash, qhash2 = rte_jhash(qname, qname_len, 0), sip = q->sip;
+
+    w->queries++;
+    topk_track(&w->trackers[TOPK_QNAME], ctrl->k, qhash, qhash2, 0, qname, qname_len);
+    topk_track(&w->trackers[TOPK_CLIENT], ctrl->k, rte_jhash_1word(sip, 0), rte_jhash_1word(sip, 0x5bd1e995), sip, qname, 0);
+    topk_track(&w->trackers[TOPK_CLIENT_QNAME], ctrl->k, rte_jhash_2words(sip, qhash, 0), rte_jhash_2words(sip, qhash2, 0),
+               sip, qname, qname_len);
+}
+
+static void topk_window_clear(struct topk_window *w) {
+    int i;
+
+    w->queries = 0;
+    for (i = 0; i < TOPK_TYPE_MAX; i++) {
+        struct topk_tracker *t = &w->trackers[i];
+        memset(t->sketch, 0, sizeof(t->sketch));
+        memset(t->index, 0, (t->index_mask + 1) * sizeof(uint16_t));
+        t->size = 0;
+    }
+    w->start_sec = time(NULL);
+}
+
+void topk_window_switch(struct topk_ctrl *ctrl, uint64_t now_tsc) {
+    ctrl->epoch++;
+    rte_smp_wmb();
+    ctrl->cur ^= 1;
+    topk_window_clear(ctrl->windows[ctrl->cur]);
+    rte_smp_wmb();
+    ctrl->epoch++;
+    ctrl->window_end_tsc = now_tsc + rte_get_tsc_hz() * ctrl->window_sec;
+}
+
+static struct topk_window *topk_window_alloc(const char *name, uint32_t k, int socket_id) {
+    int i;
+    uint32_t index_size = rte_align32pow2(k * 4);
+    struct topk_window *w;
+
+    w = rte_zmalloc_socket(name, sizeof(struct topk_window), RTE_CACHE_LINE_SIZE, socket_id);
+    if (w == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < TOPK_TYPE_MAX; i++) {
+        struct topk_tracker *t = &w->trackers[i];
+        t->index_mask = index_size - 1;
+        t->index = rte_zmalloc_socket(name, index_size * sizeof(uint16_t), RTE_CACHE_LINE_SIZE, socket_id);
+        t->heap = rte_zmalloc_socket(name, k * sizeof(struct topk_node), RTE_CACHE_LINE_SIZE, socket_id);
+        t->entries = rte_zmalloc_socket(name, k * sizeof(struct topk_entry), RTE_CACHE_LINE_SIZE, socket_id);
+        if (t->index == NULL || t->heap == NULL || t->entries == NULL) {
+            return NULL;
+        }
+    }
+    w->start_sec = time(NULL);
+    return w;
+}
+
+int topk_init(unsigned lcore_id) {
+    char name[32];
+    int i, socket_id = rte_lcore_to_socket_id(lcore_id);
+    struct topk_ctrl *ctrl;
+    uint32_t k = g_dns_cfg->comm.topk_k;
+
+    if (k == 0) {
+        log_msg(LOG_INFO, "topk is disabled on lcore %u!\n", lcore_id);
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "topk_%u", lcore_id);
+    ctrl = rte_zmalloc_socket(name, sizeof(struct topk_ctrl), RTE_CACHE_LINE_SIZE, socket_id);
+    if (ctrl == NULL) {
+        log_msg(LOG_ERR, "Failed to malloc topk: %s!\n", name);
+        exit(-1);
+    }
+    for (i = 0; i < 2; i++) {
+        snprintf(name, sizeof(name), "topk_%u_%d", lcore_id, i);
+        ctrl->windows[i] = topk_window_alloc(name, k, socket_id);
+        if (ctrl->windows[i] == NULL) {
+            log_msg(LOG_ERR, "Failed to malloc topk window: %s!\n", name);
+            exit(-1);
+        }
+    }
+    ctrl->k = k;
+    ctrl->window_sec = g_dns_cfg->comm.topk_window;
+    ctrl->window_end_tsc = rte_rdtsc() + rte_get_tsc_hz() * ctrl->window_sec;
+    g_topk_ctrls[lcore_id] = ctrl;
+    return 0;
+}
+
+int topk_reload(unsigned lcore_id) {
+    struct topk_ctrl *ctrl = g_topk_ctrls[lcore_id];
+
+    if (ctrl) {
+        /* takes effect from the next window */
+        ctrl->window_sec = g_dns_cfg->comm.topk_window;
+    }
+    return 0;
+}
+
+static int topk_hitter_cmp_key(const void *a, const void *b) {
+    const topk_hitter *x = a, *y = b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    if (x->client != y->client) {
+        return x->client < y->client ? -1 : 1;
+    }
+    if (x->qname_len != y->qname_len) {
+        return x->qname_len < y->qname_len ? -1 : 1;
+    }
+    return memcmp(x->qname, y->qname, x->qname_len);
+}
+
+static int topk_hitter_cmp_count(const void *a, const void *b) {
+    const topk_hitter *x = a, *y = b;
+
+    return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+int topk_get(topk_type type, topk_hitter *hitters, int max, uint64_t *window_start, int *partial) {
+    unsigned lcore_id;
+    uint32_t i, n, m, epochs[RTE_MAX_LCORE];
+    uint8_t stale[RTE_MAX_LCORE];
+    uint64_t now_tsc;
+    int retry, changed;
+    topk_hitter *cands = NULL;
+    struct topk_ctrl *ctrl;
+
+    for (retry = 0; retry < 3; retry++) {
+        n = 0;
+        *partial = 0;
+        *window_start = 0;
+
+        /* candidates: the heaps of the last windows */
+        now_tsc = rte_rdtsc();
+        RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+            ctrl = g_topk_ctrls[lcore_id];
+            if (ctrl == NULL) {
+                continue;
+            }
+            while ((epochs[lcore_id] = ctrl->epoch) & 1) {
+                rte_pause();
+            }
+            rte_smp_rmb();
+            /* the lcore has not switched windows for a window, its last one is out of date */
+            stale[lcore_id] = now_tsc > ctrl->window_end_tsc + rte_get_tsc_hz() * ctrl->window_sec;
+            n += ctrl->k;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (cands == NULL) {
+            cands = calloc(n, sizeof(topk_hitter));
+            if (cands == NULL) {
+                return -1;
+            }
+        }
+
+        m = 0;
+        RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+            ctrl = g_topk_ctrls[lcore_id];
+            if (ctrl == NULL || stale[lcore_id]) {
+                continue;
+            }
+            struct topk_window *w = ctrl->windows[epochs[lcore_id] ? ctrl->cur ^ 1 : ctrl->cur];
+            struct topk_tracker *t = &w->trackers[type];
+            uint32_t size = RTE_MIN(t->size, ctrl->k);
+            if (epochs[lcore_id] == 0) {
+                *partial = 1;
+            }
+            *window_start = RTE_MAX(*window_start, w->start_sec);
+            for (i = 0; i < size && m < n; i++, m++) {
+                cands[m].hash = t->entries[i].hash;
+                cands[m].hash2 = t->entries[i].hash2;
+                cands[m].client = t->entries[i].client;
+                cands[m].qname_len = RTE_MIN(t->entries[i].qname_len, MAXDOMAINLEN);
+                memcpy(cands[m].qname, t->entries[i].qname, cands[m].qname_len);
+            }
+        }
+
+        /* dedup, then sum the sketch estimates of every lcore */
+        qsort(cands, m, sizeof(topk_hitter), topk_hitter_cmp_key);
+        for (i = 0, n = 0; i < m; i++) {
+            if (n > 0 && topk_hitter_cmp_key(&cands[n - 1], &cands[i]) == 0) {
+                continue;
+            }
+            cands[n++] = cands[i];
+        }
+        for (i = 0; i < n; i++) {
+            cands[i].count = 0;
+            RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+                ctrl = g_topk_ctrls[lcore_id];
+                if (ctrl == NULL || stale[lcore_id]) {
+                    continue;
+                }
+                struct topk_window *w = ctrl->windows[epochs[lcore_id] ? ctrl->cur ^ 1 : ctrl->cur];
+                cands[i].count += topk_sketch_count(&w->trackers[type], cands[i].hash, cands[i].hash2, 0);
+            }
+        }
+
+        rte_smp_rmb();
+        changed = 0;
+        RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+            ctrl = g_topk_ctrls[lcore_id];
+            if (ctrl && ctrl->epoch != epochs[lcore_id]) {
+                changed = 1;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+    }
+
+    qsort(cands, n, sizeof(topk_hitter), topk_hitter_cmp_count);
+    n = RTE_MIN(n, (uint32_t)max);
+    memcpy(hitters, cands, n * sizeof(topk_hitter));
+    free(cands);
+    return n;
+}
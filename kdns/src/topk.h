@@ -0,0 +1,117 @@
+#ifndef _TOPK_H_
+#define _TOPK_H_
+
+#include <stdint.h>
+#include <rte_lcore.h>
+#include <rte_memory.h>
+#include <rte_cycles.h>
+#include "query.h"
+
+/*
+ * Heavy hitters of the slave lcores. Each lcore counts every answered
+ * query in a count-min sketch per key type and keeps the topk-k keys
+ * with the largest estimates in a min-heap, Space-Saving style: a key
+ * whose estimate passes the heap minimum takes the place of the
+ * minimum. Nothing is allocated on the packet path.
+ *
+ * The counts are per topk-window seconds. The lcore keeps the current
+ * and the last complete window, the readers merge the last windows of
+ * all the lcores by summing their sketch estimates. An lcore whose
+ * last window ended more than a window ago is left out.
+ */
+#define TOPK_SKETCH_DEPTH       (4)
+#define TOPK_SKETCH_WIDTH       (16384)     /* power of 2 */
+#define TOPK_K_MAX              (1024)
+
+typedef enum {
+    TOPK_QNAME,
+    TOPK_CLIENT,
+    TOPK_CLIENT_QNAME,
+    TOPK_TYPE_MAX,
+} topk_type;
+
+/* a tracked key, the entries stay in place while their heap nodes move */
+struct topk_entry {
+    uint32_t hash;
+    uint32_t hash2;                 /* independent of hash, steps the sketch rows */
+    uint32_t client;
+    uint16_t slot;                  /* index slot pointing at the entry */
+    uint16_t pos;                   /* heap position */
+    uint8_t qname_len;
+    uint8_t qname[MAXDOMAINLEN];
+};
+
+struct topk_node {
+    uint32_t count;
+    uint32_t ref;                   /* the entry */
+};
+
+struct topk_tracker {
+    uint32_t sketch[TOPK_SKETCH_DEPTH][TOPK_SKETCH_WIDTH];
+    uint32_t size;
+    uint32_t index_mask;
+    uint16_t *index;                /* open addressed on the hash, entry + 1, 0 if empty */
+    struct topk_node *heap;         /* min-heap on the count */
+    struct topk_entry *entries;
+};
+
+struct topk_window {
+    uint64_t start_sec;             /* wall clock second the window started */
+    uint64_t queries;
+    struct topk_tracker trackers[TOPK_TYPE_MAX];
+};
+
+struct topk_ctrl {
+    uint32_t k;
+    uint32_t window_sec;
+    uint32_t cur;
+    volatile uint32_t epoch;        /* windows switched, odd while a window is being cleared */
+    uint64_t window_end_tsc;
+    struct topk_window *windows[2];
+} __rte_cache_aligned;
+
+extern struct topk_ctrl *g_topk_ctrls[RTE_MAX_LCORE];
+
+/* one merged heavy hitter */
+typedef struct {
+    uint32_t hash;
+    uint32_t hash2;
+    uint32_t count;
+    uint32_t client;
+    uint8_t qname_len;
+    uint8_t qname[MAXDOMAINLEN];
+} topk_hitter;
+
+int topk_init(unsigned lcore_id);
+
+int topk_reload(unsigned lcore_id);
+
+void topk_window_switch(struct topk_ctrl *ctrl, uint64_t now_tsc);
+
+/*
+ * Switch to a new window when the current one is over. Called from the
+ * poll loop of the lcore with the ctrl msgs, so idle lcores rotate too.
+ */
+static inline void topk_window_check(struct topk_ctrl *ctrl, uint64_t now_tsc) {
+    if (ctrl == NULL) {
+        return;
+    }
+    if (unlikely(now_tsc >= ctrl->window_end_tsc)) {
+        topk_window_switch(ctrl, now_tsc);
+    }
+}
+
+/* Count an answered query of the lcore, from q->sip */
+void topk_update(struct topk_ctrl *ctrl, struct query *q);
+
+/*
+ * Merge the heavy hitters of type over the slave lcores into hitters,
+ * largest first. Returns their number, at most max, or -1 if topk is
+ * disabled. *window_start is the start of the merged window, *partial
+ * is set if no window has completed yet and the current one was used.
+ */
+int topk_get(topk_type type, topk_hitter *hitters, int max, uint64_t *window_start, int *partial);
+
+const char *topk_type_name(topk_type type);
+
+#endif  /* _TOPK_H_ */
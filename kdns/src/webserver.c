@@ -43,6 +43,12 @@ not thread safe
 */
 int web_endpoint_add(const char *  method, const char * url, struct web_instance * ins, 
           void* (* callback_function)(struct connection_info_struct *con_info, char *url,int * len_response)) {
+    return web_endpoint_add_typed(method, url, ins, NULL, callback_function);
+}
+
+
+int web_endpoint_add_typed(const char *  method, const char * url, struct web_instance * ins, const char * content_type,
+          void* (* callback_function)(struct connection_info_struct *con_info, char *url,int * len_response)) {
 
     struct web_endpoint *ep = web_endpoint_match((const char *)method,(const char *)url, ins);
     if (ep != NULL){
@@ -53,6 +59,7 @@ int web_endpoint_add(const char *  method, const char * url, struct web_instance
     ep = xalloc_zero(sizeof(struct web_endpoint));
     ep->method = strdup(method);
     ep->url    = strdup(url);
+    ep->content_type = content_type ? strdup(content_type) : NULL;
     ep->callback_function = callback_function;
     ep->next = ins->endpoint_list;
     ins->endpoint_list = ep;
@@ -105,7 +112,7 @@ static int send_bad_response( struct MHD_Connection *connection)
 
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 static int
-send_page (struct MHD_Connection *connection,  void *data, int len)
+send_page (struct MHD_Connection *connection,  void *data, int len, const char *content_type)
 {
 	int ret;
 	struct MHD_Response *response;
@@ -114,7 +121,7 @@ send_page (struct MHD_Connection *connection,  void *data, int len)
 		free(data);
         if (!response)
 		    return MHD_NO;
-        MHD_add_response_header(response, "Content-Type", CONTENT_TYPE_JSON);
+        MHD_add_response_header(response, "Content-Type", content_type ? content_type : CONTENT_TYPE_JSON);
 		ret = MHD_queue_response(connection,MHD_HTTP_OK,response);
 		MHD_destroy_response(response);
         return ret;
@@ -194,7 +201,7 @@ static int webservice_dispatcher(void *cls, struct MHD_Connection *connection,
     if (ep != NULL){
         response_buf = ep->callback_function(con_info, (char *)url,&response_len);      
     }
-    return send_page(connection,response_buf,response_len);
+    return send_page(connection,response_buf,response_len,ep ? ep->content_type : NULL);
 }
 
 
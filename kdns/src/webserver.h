@@ -18,6 +18,7 @@ struct connection_info_struct
 typedef struct web_endpoint {
   char * method;
   char * url;
+  char * content_type;   // NULL for json
   struct web_endpoint *next;
   void* (* callback_function)(struct connection_info_struct *con_info , char* url, int * len_response);
 }web_endpoint_st;
@@ -31,6 +32,10 @@ struct web_instance {
 int web_endpoint_add(const char * method, const char * url, struct web_instance * ins, 
           void* (* callback_function)(struct connection_info_struct *con_info,char* url, int * len_response)) ;
 
+/* the same with the content type of the responses, they are json otherwise */
+int web_endpoint_add_typed(const char * method, const char * url, struct web_instance * ins, const char * content_type,
+          void* (* callback_function)(struct connection_info_struct *con_info,char* url, int * len_response)) ;
+
 struct web_instance * webserver_new(unsigned int port);
 int webserver_run(struct web_instance * instance);
 void webserver_stop(struct web_instance * instance);
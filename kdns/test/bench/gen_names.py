@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+"""
+Write the name dataset of radtree_bench, one name per line:
+
+    ./gen_names.py [count] [seed] > names.txt
+
+The names are hosts of 3 to 5 labels spread over 50000 zones under a few
+tlds, like the records of a large zone set. The same count and seed give
+the same file.
+"""
+
+import random
+import sys
+
+TLDS = ['com', 'net', 'org', 'cn', 'io', 'local', 'arpa']
+ZONES = 50000
+CHARS = 'abcdefghijklmnopqrstuvwxyz0123456789'
+
+
+def label(rnd, lo, hi):
+    return ''.join(rnd.choice(CHARS) for _ in range(rnd.randint(lo, hi)))
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 5000000
+    rnd = random.Random(int(sys.argv[2]) if len(sys.argv) > 2 else 1)
+    zones = ['%s%d.%s' % (label(rnd, 3, 10), z, rnd.choice(TLDS)) for z in range(ZONES)]
+    out = sys.stdout
+    for i in range(count):
+        zone = zones[rnd.randrange(ZONES)]
+        depth = rnd.choice((1, 1, 1, 2, 3))
+        labels = ['h%d' % i] + [label(rnd, 2, 8) for _ in range(depth - 1)]
+        out.write('%s.%s\n' % ('.'.join(labels), zone))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,154 @@
+/*
+ * qname_bench.c
+ *
+ * Compare the one pass query name parse, domain_name_make_query, with
+ * the chain it replaced:
+ *   packet_read_query_section  copy the name out of the packet
+ *   domain_name_make_no_malloc label offsets, lowercase
+ *   radomain_name_d2r          radname key for the name tree
+ * Both must give the same name, label offsets and key for every test
+ * name, the times are per name.
+ *
+ * Copyright (c) 2018 The TIGLabs Authors.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dns.h"
+#include "packet.h"
+#include "radtree.h"
+#include "buffer.h"
+
+#define NAME_NUM	4096
+#define ROUNDS		500
+#define PKT_SIZE	512
+#define NAME_BUF_SIZE	1024
+
+static uint8_t pkts[NAME_NUM][PKT_SIZE];
+static size_t pkt_lens[NAME_NUM];
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Random query packets of 1 to 6 labels in mixed case, with a few bytes
+ * outside of the hostname characters.
+ */
+static void
+make_queries(void)
+{
+	static const char chars[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_@[";
+	int n, l, k, labels, label_len;
+	uint8_t *p;
+	size_t pos;
+
+	srand(1);
+	for (n = 0; n < NAME_NUM; n++) {
+		p = pkts[n] + DNS_HEAD_SIZE;
+		pos = 0;
+		labels = 1 + rand() % 6;
+		for (l = 0; l < labels; l++) {
+			label_len = 1 + rand() % (l == 0 ? 40 : 12);
+			p[pos++] = label_len;
+			for (k = 0; k < label_len; k++) {
+				if (rand() % 50 == 0)
+					p[pos++] = (rand() & 0x7f) | (rand() % 2 ? 0x80 : 0);
+				else
+					p[pos++] = chars[rand() % (sizeof(chars) - 1)];
+			}
+		}
+		p[pos++] = 0;
+		/* qtype A, qclass IN */
+		p[pos++] = 0; p[pos++] = 1; p[pos++] = 0; p[pos++] = 1;
+		pkt_lens[n] = DNS_HEAD_SIZE + pos;
+	}
+}
+
+static void
+packet_init(buffer_st *packet, int n)
+{
+	packet->data = pkts[n];
+	packet->capacity = packet->limit = pkt_lens[n];
+	packet->position = DNS_HEAD_SIZE;
+}
+
+int
+main(void)
+{
+	uint8_t *buf_old = calloc(1, NAME_BUF_SIZE);
+	uint8_t *buf_new = calloc(1, NAME_BUF_SIZE);
+	domain_name_st *name_old = (domain_name_st *)buf_old;
+	domain_name_st *name_new = (domain_name_st *)buf_new;
+	uint8_t qname[MAXDOMAINLEN], key_old[MAXDOMAINLEN], key_new[MAXDOMAINLEN];
+	uint16_t key_old_len, key_new_len, qtype, qclass;
+	volatile unsigned sink = 0;
+	buffer_st packet;
+	double t0, t1, t2;
+	int n, r;
+
+	if (buf_old == NULL || buf_new == NULL)
+		return 1;
+	make_queries();
+
+	for (n = 0; n < NAME_NUM; n++) {
+		packet_init(&packet, n);
+		if (!packet_read_query_section(&packet, qname, &qtype, &qclass)) {
+			printf("old chain failed on name %d\n", n);
+			return 1;
+		}
+		domain_name_make_no_malloc(qname, 1, name_old);
+		key_old_len = sizeof(key_old);
+		radomain_name_d2r(key_old, &key_old_len, domain_name_get(name_old),
+			name_old->name_size);
+
+		if (!domain_name_make_query(pkts[n] + DNS_HEAD_SIZE, pkt_lens[n] - DNS_HEAD_SIZE,
+			name_new, key_new, &key_new_len)
+		    || name_old->name_size != name_new->name_size
+		    || name_old->label_count != name_new->label_count
+		    || memcmp(buf_old, buf_new, sizeof(domain_name_st) + name_old->label_count + name_old->name_size)
+		    || key_old_len != key_new_len || memcmp(key_old, key_new, key_old_len)) {
+			printf("mismatch on name %d\n", n);
+			return 1;
+		}
+	}
+	printf("all %d names match\n", NAME_NUM);
+
+	t0 = now_sec();
+	for (r = 0; r < ROUNDS; r++) {
+		for (n = 0; n < NAME_NUM; n++) {
+			packet_init(&packet, n);
+			packet_read_query_section(&packet, qname, &qtype, &qclass);
+			domain_name_make_no_malloc(qname, 1, name_old);
+			key_old_len = sizeof(key_old);
+			radomain_name_d2r(key_old, &key_old_len, domain_name_get(name_old),
+				name_old->name_size);
+			sink += key_old_len;
+		}
+	}
+	t1 = now_sec();
+	for (r = 0; r < ROUNDS; r++) {
+		for (n = 0; n < NAME_NUM; n++) {
+			domain_name_make_query(pkts[n] + DNS_HEAD_SIZE, pkt_lens[n] - DNS_HEAD_SIZE,
+				name_new, key_new, &key_new_len);
+			sink += key_new_len;
+		}
+	}
+	t2 = now_sec();
+
+	printf("old chain   %.1f ns/name\n", (t1 - t0) * 1e9 / ((double)ROUNDS * NAME_NUM));
+	printf("single pass %.1f ns/name\n", (t2 - t1) * 1e9 / ((double)ROUNDS * NAME_NUM));
+	free(buf_old);
+	free(buf_new);
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * radtree_bench.c
+ *
+ * Memory and lookup latency of the name tree on a large name set, see
+ * gen_names.py for the dataset:
+ *   ./radtree_bench names.txt
+ * All the names are inserted, then as many lookups are done in random
+ * order, half of them for names that are not in the tree (an extra
+ * label in front), as the burst path does with radix_find_less_equal.
+ * The lookups are repeated after a third of the names is deleted. The
+ * checksums only depend on the dataset, so they must not change between
+ * two versions of the tree.
+ *
+ * Copyright (c) 2018 The TIGLabs Authors.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dns.h"
+#include "radtree.h"
+
+struct bench_names {
+	uint8_t *wire;		/* all the names in wire format, back to back */
+	size_t *offsets;
+	size_t count;
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long
+rss_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long pages = 0, rss = 0;
+
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+		rss = 0;
+	fclose(f);
+	return rss * 4096;
+}
+
+static size_t
+wire_len(const uint8_t *d)
+{
+	const uint8_t *p = d;
+
+	while (*p)
+		p += *p + 1;
+	return p - d + 1;
+}
+
+static int
+names_load(const char *path, struct bench_names *names)
+{
+	char line[MAXDOMAINLEN + 2];
+	uint8_t dname[MAXDOMAINLEN];
+	size_t cap = 1 << 20, size = 0, len, ocap = 1 << 16;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL)
+		return -1;
+	names->wire = malloc(cap);
+	names->offsets = malloc(ocap * sizeof(size_t));
+	names->count = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0 || !domain_name_parse_wire(dname, line))
+			continue;
+		len = wire_len(dname);
+		if (size + len > cap) {
+			cap *= 2;
+			names->wire = realloc(names->wire, cap);
+		}
+		if (names->count == ocap) {
+			ocap *= 2;
+			names->offsets = realloc(names->offsets, ocap * sizeof(size_t));
+		}
+		if (names->wire == NULL || names->offsets == NULL) {
+			fclose(f);
+			return -1;
+		}
+		memcpy(names->wire + size, dname, len);
+		names->offsets[names->count++] = size;
+		size += len;
+	}
+	fclose(f);
+	return 0;
+}
+
+static inline uint8_t *
+names_get(struct bench_names *names, size_t i)
+{
+	return names->wire + names->offsets[i];
+}
+
+struct bench_keys {
+	uint8_t *data;		/* radname keys back to back */
+	size_t *offsets;
+	uint16_t *lens;
+	size_t count;
+};
+
+/* the lookup keys in random order, every other one a name that is not in the tree */
+static int
+keys_make(struct bench_names *names, struct bench_keys *keys)
+{
+	uint8_t dname[MAXDOMAINLEN + 2];
+	size_t i, id, len, size = 0, cap = 1 << 20;
+
+	keys->data = malloc(cap);
+	keys->offsets = malloc(names->count * sizeof(size_t));
+	keys->lens = malloc(names->count * sizeof(uint16_t));
+	keys->count = names->count;
+	if (keys->data == NULL || keys->offsets == NULL || keys->lens == NULL)
+		return -1;
+	srand(7);
+	for (i = 0; i < names->count; i++) {
+		id = ((size_t)rand() * 7919u) % names->count;
+		len = wire_len(names_get(names, id));
+		if (i & 1 && len + 2 <= MAXDOMAINLEN) {
+			dname[0] = 1;
+			dname[1] = 'x';
+			memcpy(dname + 2, names_get(names, id), len);
+			len += 2;
+		} else {
+			memcpy(dname, names_get(names, id), len);
+		}
+		if (size + MAXDOMAINLEN > cap) {
+			cap *= 2;
+			keys->data = realloc(keys->data, cap);
+			if (keys->data == NULL)
+				return -1;
+		}
+		keys->lens[i] = MAXDOMAINLEN;
+		radomain_name_d2r(keys->data + size, &keys->lens[i], dname, len);
+		keys->offsets[i] = size;
+		size += keys->lens[i];
+	}
+	return 0;
+}
+
+static void
+lookups_run(const char *tag, struct radtree *rt, struct bench_keys *keys)
+{
+	struct radnode *node;
+	uint64_t sum = 0;
+	size_t i, exact = 0;
+	double t0, t1;
+
+	t0 = now_sec();
+	for (i = 0; i < keys->count; i++) {
+		exact += radix_find_less_equal(rt, keys->data + keys->offsets[i], keys->lens[i], &node);
+		sum += node ? (uintptr_t)node->elem : 0;
+	}
+	t1 = now_sec();
+	printf("%s: %.1f ns/lookup, exact %zu, checksum %llu\n", tag,
+		(t1 - t0) * 1e9 / keys->count, exact, (unsigned long long)sum);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_names names;
+	struct bench_keys keys;
+	struct radtree *rt;
+	uint8_t *d;
+	long rss0, rss1;
+	double t0, t1;
+	size_t i;
+
+	if (argc < 2) {
+		printf("usage: %s names.txt\n", argv[0]);
+		return 1;
+	}
+	if (names_load(argv[1], &names) != 0 || names.count == 0) {
+		printf("cannot load the names of %s\n", argv[1]);
+		return 1;
+	}
+	if (keys_make(&names, &keys) != 0) {
+		printf("out of memory\n");
+		return 1;
+	}
+
+	rt = radix_tree_create();
+	rss0 = rss_bytes();
+	t0 = now_sec();
+	for (i = 0; i < names.count; i++) {
+		d = names_get(&names, i);
+		radomain_name_insert(rt, d, wire_len(d), (void *)(uintptr_t)(i + 1));
+	}
+	t1 = now_sec();
+	rss1 = rss_bytes();
+	printf("insert %zu names: %.2f s, %zu in tree\n", names.count, t1 - t0, rt->count);
+	printf("memory: rss %.1f bytes/name\n", (double)(rss1 - rss0) / names.count);
+
+	lookups_run("lookup", rt, &keys);
+
+	for (i = 0; i < names.count; i += 3) {
+		d = names_get(&names, i);
+		radomain_name_delete(rt, d, wire_len(d));
+	}
+	lookups_run("after deleting a third", rt, &keys);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Count the truncated udp answers of the large rrsets in large_rrsets.jsonl
+for a range of client EDNS payload sizes, against a running kdns.
+
+    ./edns_truncation.py --load                  # add the records once
+    ./edns_truncation.py --server 10.0.0.1       # query them
+
+Every answer that comes back with TC set is a tcp fallback for the
+client. Without EDNS the answers are limited to 512 bytes; with EDNS
+they may grow to the smaller of the client size and the COMMON
+edns-udp-size of the server. The script also checks that no answer is
+larger than the size the client asked for.
+"""
+
+import argparse
+import json
+import os
+import random
+import socket
+import struct
+import sys
+import urllib.request
+
+FIXTURES = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'large_rrsets.jsonl')
+QTYPES = {'A': 1, 'AAAA': 28, 'SRV': 33}
+EDNS_SIZES = [None, 512, 1232, 1400, 4096]
+
+
+def load_fixtures():
+    with open(FIXTURES) as f:
+        return [json.loads(line) for line in f if line.strip()]
+
+
+def add_records(api, records):
+    for rec in records:
+        req = urllib.request.Request(api + '/kdns/domain', data=json.dumps(rec).encode(),
+                                     headers={'Content-Type': 'application/json;charset=UTF-8'},
+                                     method='POST')
+        urllib.request.urlopen(req).read()
+    print('added %d records' % len(records))
+
+
+def build_query(qid, name, qtype, edns_size):
+    arcount = 1 if edns_size else 0
+    msg = struct.pack('!HHHHHH', qid, 0x0100, 1, 0, 0, arcount)
+    for label in name.rstrip('.').split('.'):
+        msg += struct.pack('B', len(label)) + label.encode()
+    msg += b'\x00' + struct.pack('!HH', qtype, 1)
+    if edns_size:
+        # root owner, OPT, payload size, ext rcode, version, flags, rdlen
+        msg += b'\x00' + struct.pack('!HHBBHH', 41, edns_size, 0, 0, 0, 0)
+    return msg
+
+
+def query(sock, addr, name, qtype, edns_size):
+    qid = random.randint(0, 0xffff)
+    sock.sendto(build_query(qid, name, qtype, edns_size), addr)
+    while True:
+        data, _ = sock.recvfrom(65535)
+        if len(data) >= 12 and struct.unpack('!H', data[:2])[0] == qid:
+            return data
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--server', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=53)
+    parser.add_argument('--api', default='http://127.0.0.1:5500')
+    parser.add_argument('--load', action='store_true', help='add the fixture records through the api first')
+    args = parser.parse_args()
+
+    records = load_fixtures()
+    if args.load:
+        add_records(args.api, records)
+
+    questions = []
+    for rec in records:
+        q = (rec['domainName'], QTYPES[rec['type']])
+        if q not in questions:
+            questions.append(q)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(2)
+    addr = (args.server, args.port)
+
+    print('%d questions per run' % len(questions))
+    print('%-8s %10s %10s %10s' % ('edns', 'truncated', 'max size', 'oversize'))
+    failed = 0
+    for edns_size in EDNS_SIZES:
+        limit = max(512, edns_size or 512)
+        truncated = oversize = max_len = 0
+        for name, qtype in questions:
+            resp = query(sock, addr, name, qtype, edns_size)
+            flags, = struct.unpack('!H', resp[2:4])
+            if flags & 0x0200:
+                truncated += 1
+            if len(resp) > limit:
+                oversize += 1
+            max_len = max(max_len, len(resp))
+        failed += oversize
+        print('%-8s %10d %10d %10d' % (edns_size or 'none', truncated, max_len, oversize))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())